@@ -38,6 +38,12 @@
 #include "../regex_r.h"
 // get_aliasclient_list()
 #include "../database/aliasclients.h"
+// get_rate_limit_tokens()
+#include "../ratelimit.h"
+// struct metricsData
+#include "../metrics.h"
+// get_upstream_score()
+#include "../upstreams.h"
 // get_edestr()
 #include "api_helper.h"
 // RTF_UP, RTF_GATEWAY
@@ -515,6 +521,7 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 		float percentage = 0.0f;
 		const char *ip, *name;
 		in_port_t upstream_port = 0;
+		const upstreamsData* upstream = NULL;
 
 		if(i == -3)
 		{
@@ -553,7 +560,7 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 			const int count = temparray[i][1];
 
 			// Get upstream pointer
-			const upstreamsData* upstream = getUpstream(upstreamID, true);
+			upstream = getUpstream(upstreamID, true);
 			if(upstream == NULL)
 				continue;
 
@@ -576,9 +583,13 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 		if(percentage > 0.0f || i < 0)
 		{
 			if(istelnet)
-				if(upstream_port != 0)
-					ssend(sock, "%i %.2f %s#%u %s#%u\n", i, percentage,
-					      ip, upstream_port, name, upstream_port);
+				if(upstream != NULL)
+					// Upstream servers are followed by their
+					// average round-trip time [ms], failure rate
+					// [%] and score (see upstreams.c)
+					ssend(sock, "%i %.2f %s#%u %s#%u %.1f %.1f %.1f\n", i, percentage,
+					      ip, upstream_port, name, upstream_port, upstream->ewma.rtt,
+					      1e2f*upstream->ewma.failures, get_upstream_score(upstream));
 				else
 					ssend(sock, "%i %.2f %s %s\n", i, percentage, ip, name);
 			else
@@ -1356,6 +1367,135 @@ void getClientNames(const int sock, const bool istelnet)
 		clearSetupVarsArray();
 }
 
+void getRateLimits(const int sock, const bool istelnet)
+{
+	// Exit before processing any data if requested via config setting
+	get_privacy_level(NULL);
+	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+		return;
+
+	// Token buckets are refilled lazily, we show their current state
+	const time_t now = time(NULL);
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		// Get client pointer
+		const clientsData* client = getClient(clientID, true);
+		// Skip invalid and alias clients as well as clients which
+		// did not query (since enabling rate-limiting)
+		if(client == NULL || client->flags.aliasclient || client->rate_limit.refilled == 0)
+			continue;
+
+		const char *client_ip = getstr(client->ippos);
+		const char *client_name = getstr(client->namepos);
+		const float tokens = get_rate_limit_tokens(client, now);
+
+		if(istelnet)
+			ssend(sock, "%s %s %.2f %u %i %u %lli\n", client_ip, client_name, tokens,
+			      config.rate_limit.count, client->flags.rate_limited ? 1 : 0,
+			      client->rate_limit.refused, (long long)client->rate_limit.since);
+		else {
+			pack_str32(sock, client_ip);
+			pack_str32(sock, client_name);
+			pack_float(sock, tokens);
+			pack_int32(sock, config.rate_limit.count);
+			pack_bool(sock, client->flags.rate_limited);
+			pack_int32(sock, client->rate_limit.refused);
+			pack_int64(sock, client->rate_limit.since);
+		}
+	}
+}
+
+// Send one latency histogram (all values in microseconds)
+static void send_latency_histogram(const int sock, const bool istelnet, const char *type,
+                                   const char *name, const latencyHistogram *hist)
+{
+	const float avg = hist->count > 0 ? 1e-3f*hist->sum/hist->count : 0.0f;
+	const float p50 = 1e-3f*get_latency_percentile(hist, 0.5);
+	const float p90 = 1e-3f*get_latency_percentile(hist, 0.9);
+	const float p99 = 1e-3f*get_latency_percentile(hist, 0.99);
+	const float p999 = 1e-3f*get_latency_percentile(hist, 0.999);
+	const float max = 1e-3f*hist->max;
+
+	if(istelnet)
+		ssend(sock, "%s %s %llu %.1f %.1f %.1f %.1f %.1f %.1f\n", type, name,
+		      (unsigned long long)hist->count, avg, p50, p90, p99, p999, max);
+	else {
+		pack_str32(sock, type);
+		pack_str32(sock, name);
+		pack_uint64(sock, hist->count);
+		pack_float(sock, avg);
+		pack_float(sock, p50);
+		pack_float(sock, p90);
+		pack_float(sock, p99);
+		pack_float(sock, p999);
+		pack_float(sock, max);
+	}
+}
+
+void getLatencyMetrics(const int sock, const bool istelnet)
+{
+	if(!metrics_available())
+		return;
+
+	// Query processing stages, SHM lock and upstream round-trip times
+	for(unsigned int i = 0; i < LATENCY_STAGES; i++)
+		send_latency_histogram(sock, istelnet, "stage", get_latency_stage_name(i), &metrics->stages[i]);
+
+	// Individual upstream servers
+	for(unsigned int i = 0; i < MAX_UPSTREAM_METRICS; i++)
+	{
+		const upstreamMetrics *upstream = &metrics->upstreams[i];
+		if(upstream->name[0] != '\0')
+			send_latency_histogram(sock, istelnet, "upstream", upstream->name, &upstream->rtt);
+	}
+
+	// SHM lock wait and hold times per call site
+	for(unsigned int i = 0; i < MAX_LOCK_SITES; i++)
+	{
+		const lockSite *site = &metrics->sites[i];
+		if(site->key == 0 || site->count == 0)
+			continue;
+
+		const float wait_avg = 1e-3f*site->wait_sum/site->count;
+		const float hold_avg = 1e-3f*site->hold_sum/site->count;
+		if(istelnet)
+			ssend(sock, "lock %s %s:%d %llu %.1f %.1f %.1f %.1f\n", site->func, site->file, site->line,
+			      (unsigned long long)site->count, wait_avg, 1e-3f*site->wait_max,
+			      hold_avg, 1e-3f*site->hold_max);
+		else {
+			pack_str32(sock, "lock");
+			pack_str32(sock, site->func);
+			pack_str32(sock, site->file);
+			pack_int32(sock, site->line);
+			pack_uint64(sock, site->count);
+			pack_float(sock, wait_avg);
+			pack_float(sock, 1e-3f*site->wait_max);
+			pack_float(sock, hold_avg);
+			pack_float(sock, 1e-3f*site->hold_max);
+		}
+	}
+
+	// TCP worker pool utilization and worker lifetimes
+	const tcpPoolMetrics *tcp = &metrics->tcp;
+	const float saturated = 1e-9f*get_tcp_saturated_ns();
+	if(istelnet)
+		ssend(sock, "tcp %u %u %u %llu %llu %llu %.3f %llu\n", tcp->slots, tcp->busy, tcp->peak,
+		      (unsigned long long)tcp->workers, (unsigned long long)tcp->gravity_opened,
+		      (unsigned long long)tcp->saturated, saturated, (unsigned long long)tcp->pooled);
+	else {
+		pack_str32(sock, "tcp");
+		pack_int32(sock, (int32_t)tcp->slots);
+		pack_int32(sock, (int32_t)tcp->busy);
+		pack_int32(sock, (int32_t)tcp->peak);
+		pack_uint64(sock, tcp->workers);
+		pack_uint64(sock, tcp->gravity_opened);
+		pack_uint64(sock, tcp->saturated);
+		pack_float(sock, saturated);
+		pack_uint64(sock, tcp->pooled);
+	}
+	send_latency_histogram(sock, istelnet, "tcp", "worker_lifetime", &tcp->lifetime);
+}
+
 void getUnknownQueries(const int sock, const bool istelnet)
 {
 	// Exit before processing any data if requested via config setting
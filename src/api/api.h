@@ -21,6 +21,8 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 void getRecentBlocked(const char *client_message, const int sock, const bool istelnet);
 void getClientsOverTime(const int sock, const bool istelnet);
 void getClientNames(const int sock, const bool istelnet);
+void getRateLimits(const int sock, const bool istelnet);
+void getLatencyMetrics(const int sock, const bool istelnet);
 
 // FTL methods
 void getClientID(const int sock, const bool istelnet);
@@ -130,6 +130,20 @@ bool process_request(const char *client_message, const int sock, const bool iste
 		getClientNames(sock, istelnet);
 		unlock_shm();
 	}
+	else if(command(client_message, ">rate-limit"))
+	{
+		processed = true;
+		lock_shm();
+		getRateLimits(sock, istelnet);
+		unlock_shm();
+	}
+	else if(command(client_message, ">latency"))
+	{
+		processed = true;
+		lock_shm();
+		getLatencyMetrics(sock, istelnet);
+		unlock_shm();
+	}
 	else if(command(client_message, ">unknown"))
 	{
 		processed = true;
@@ -154,11 +168,9 @@ bool process_request(const char *client_message, const int sock, const bool iste
 	{
 		processed = true;
 		logg("Received API request to recompile regex");
-		lock_shm();
-		// Reread regex.list
-		// Read and compile possible regex filters
-		read_regex_from_database();
-		unlock_shm();
+		// Regex filters are compiled by the database thread next to the
+		// running ones and swapped in once they are ready
+		set_event(RELOAD_GRAVITY);
 	}
 	else if(command(client_message, ">delete-lease"))
 	{
@@ -0,0 +1,92 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Scratch arena routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "arena.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+
+// Temporary memory needed while processing a query (lower-cased copies of
+// domains, IP strings, etc.) is taken from a bump allocator instead of the
+// heap. Nothing allocated here may outlive the current hook: the arena is
+// reset whenever dnsmasq calls into FTL for the next event. The arena is
+// thread-local so forked TCP workers inherit their own private copy.
+
+// Heap blocks used when the arena is exhausted
+struct arena_block {
+	struct arena_block *next;
+	unsigned char data[];
+};
+
+static __thread struct {
+	size_t used;
+	struct arena_block *overflow;
+	unsigned long alloc_mark;
+	bool checked;
+	unsigned char buf[ARENA_SIZE] __attribute__ ((aligned(16)));
+} arena = { 0 };
+
+void *arena_alloc(const size_t size)
+{
+	// Keep all allocations 16-byte aligned
+	const size_t len = (size + 15u) & ~(size_t)15u;
+	if(len <= ARENA_SIZE - arena.used)
+	{
+		void *ptr = arena.buf + arena.used;
+		arena.used += len;
+		memset(ptr, 0, size);
+		return ptr;
+	}
+
+	// Arena is exhausted, fall back to the heap. The block is released on
+	// the next reset like everything else
+	struct arena_block *block = calloc(1, sizeof(struct arena_block) + size);
+	if(block == NULL)
+		return NULL;
+
+	block->next = arena.overflow;
+	arena.overflow = block;
+	return block->data;
+}
+
+char *arena_strdup(const char *src)
+{
+	const size_t len = strlen(src);
+	char *dest = arena_alloc(len + 1);
+	if(dest == NULL)
+		return NULL;
+
+	memcpy(dest, src, len + 1);
+	return dest;
+}
+
+void arena_reset(void)
+{
+	while(arena.overflow != NULL)
+	{
+		struct arena_block *next = arena.overflow->next;
+		free(arena.overflow);
+		arena.overflow = next;
+	}
+	arena.used = 0;
+
+	// The query path is expected to be allocation-free in steady state.
+	// Report every heap allocation done by this thread since the last
+	// reset (this includes arena overflows). Allocations done before the
+	// very first reset belong to the initialization and are not reported
+	if(config.debug & DEBUG_EXTRA && arena.checked &&
+	   FTLalloc_calls != arena.alloc_mark)
+		logg("WARN: %lu heap allocation(s) on the query path",
+		     FTLalloc_calls - arena.alloc_mark);
+	arena.alloc_mark = FTLalloc_calls;
+	arena.checked = true;
+}
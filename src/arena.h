@@ -0,0 +1,23 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Scratch arena prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Size of the per-thread scratch arena. Requests exceeding what is left
+// spill over into heap blocks which are released on the next reset
+#define ARENA_SIZE 16384
+
+void *arena_alloc(const size_t size) __attribute__ ((malloc)) __attribute__ ((alloc_size(1)));
+char *arena_strdup(const char *src) __attribute__ ((malloc));
+void arena_reset(void);
+
+#endif //ARENA_H
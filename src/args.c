@@ -38,6 +38,10 @@
 #include "tools/dhcp-discover.h"
 // run_arp_scan()
 #include "tools/arp-scan.h"
+// run_bench()
+#include "tools/bench.h"
+// run_replay()
+#include "tools/replay.h"
 // defined in dnsmasq.c
 extern void print_dnsmasq_version(const char *yellow, const char *green, const char *bold, const char *normal);
 
@@ -208,6 +212,29 @@ void parse_args(int argc, char* argv[])
 		exit(run_arp_scan(scan_all, extreme_mode));
 	}
 
+	// Benchmark mode
+	if(argc > 2 && strcmp(argv[1], "bench") == 0)
+	{
+		// Enable stdout printing
+		cli_mode = true;
+		const unsigned int queries = argc > 3 ? (unsigned int)atoi(argv[3]) : 100000u;
+		const unsigned int clients = argc > 4 ? (unsigned int)atoi(argv[4]) : 16u;
+		if(queries < 1 || clients < 1)
+		{
+			printf("Incorrect usage of pihole-FTL bench subcommand\n");
+			exit(EXIT_FAILURE);
+		}
+		exit(run_bench(argv[2], queries, clients, argc > 5 ? argv[5] : NULL));
+	}
+
+	// Query replay mode
+	if(argc > 1 && strcmp(argv[1], "replay") == 0)
+	{
+		// Enable stdout printing
+		cli_mode = true;
+		exit(run_replay(argc, argv));
+	}
+
 	// start from 1, as argv[0] is the executable name
 	for(int i = 1; i < argc; i++)
 	{
@@ -449,7 +476,9 @@ void parse_args(int argc, char* argv[])
 		{
 			// Enable stdout printing
 			cli_mode = true;
-			if(argc == i + 2)
+			if(argc > i + 2 && strcmp(argv[i + 1], "-f") == 0)
+				exit(regex_test_batch(dnsmasq_debug, argv[i + 2], argc > i + 3 ? (unsigned int)atoi(argv[i + 3]) : 0u));
+			else if(argc == i + 2)
 				exit(regex_test(dnsmasq_debug, quiet, argv[i + 1], NULL));
 			else if(argc == i + 3)
 				exit(regex_test(dnsmasq_debug, quiet, argv[i + 1], argv[i + 2]));
@@ -489,7 +518,13 @@ void parse_args(int argc, char* argv[])
 			printf("\t%sregex-test %sstr%s      Test %sstr%s against all regular\n", green, blue, normal, blue, normal);
 			printf("\t                    expressions in the database\n");
 			printf("\t%sregex-test %sstr %srgx%s  Test %sstr%s against regular expression\n", green, blue, cyan, normal, blue, normal);
-			printf("\t                    given by regular expression %srgx%s\n\n", cyan, normal);
+			printf("\t                    given by regular expression %srgx%s\n", cyan, normal);
+			printf("\t%sregex-test -f %sfile%s Test all domains in %sfile%s against all\n", green, blue, normal, blue, normal);
+			printf("\t                    regular expressions in the database\n");
+			printf("\t                    and report hits and time per regex\n");
+			printf("\t                    %sfile%s is either a list of domains\n", blue, normal);
+			printf("\t                    or a long-term database, append\n");
+			printf("\t                    %s[threads]%s to limit the CPU cores\n\n", cyan, normal);
 
 			printf("    Example: %spihole-FTL regex-test %ssomebad.domain %sbad%s\n", green, blue, cyan, normal);
 			printf("    to test %ssomebad.domain%s against %sbad%s\n\n", blue, normal, cyan, normal);
@@ -545,6 +580,14 @@ void parse_args(int argc, char* argv[])
 			printf("\t                    interfaces\n");
 			printf("\t                    Append %s-x%s to force scan on all\n", cyan, normal);
 			printf("\t                    interfaces and scan 10x more often\n");
+			printf("\t%sbench %sdb%s            Benchmark the query pipeline using\n", green, blue, normal);
+			printf("\t                    gravity database %sdb%s, append\n", blue, normal);
+			printf("\t                    %s[queries [clients [file]]]%s to set\n", cyan, normal);
+			printf("\t                    the number of queries and clients\n");
+			printf("\t                    or replay queries from %sfile%s\n", cyan, normal);
+			printf("\t%sreplay %sfile%s         Replay queries from a long-term\n", green, blue, normal);
+			printf("\t                    database or pcap %sfile%s as DNS\n", blue, normal);
+			printf("\t                    traffic, see %sreplay%s for options\n", green, normal);
 			printf("\t%s-h%s, %shelp%s            Display this help and exit\n\n", green, normal, green, normal);
 			exit(EXIT_SUCCESS);
 		}
@@ -208,6 +208,47 @@ void read_FTLconf(void)
 	else
 		logg("   DBINTERVAL: saving to DB file every %lli seconds", (long long)config.DBinterval);
 
+	// DBPARTITIONS
+	// Store queries in one table per day or week so old queries can be
+	// removed by dropping entire tables
+	// defaults to: NONE
+	buffer = parse_FTLconf(fp, "DBPARTITIONS");
+
+	if(buffer != NULL && strcasecmp(buffer, "DAY") == 0)
+	{
+		config.DBpartitioning = DB_PARTITION_DAY;
+		logg("   DBPARTITIONS: Storing queries in daily partitions");
+	}
+	else if(buffer != NULL && strcasecmp(buffer, "WEEK") == 0)
+	{
+		config.DBpartitioning = DB_PARTITION_WEEK;
+		logg("   DBPARTITIONS: Storing queries in weekly partitions");
+	}
+	else
+	{
+		config.DBpartitioning = DB_PARTITION_NONE;
+		logg("   DBPARTITIONS: Storing queries in a single table");
+	}
+
+	// ROLLUP_RETENTION
+	// How many days are hourly and daily query statistics kept in the
+	// database? A value of zero disables the corresponding rollup
+	// defaults to: 31 days hourly / 730 days daily
+	config.rollup_retention.hourly = 31;
+	config.rollup_retention.daily = 730;
+	buffer = parse_FTLconf(fp, "ROLLUP_RETENTION");
+
+	unsigned int hourly = 0, daily = 0;
+	if(buffer != NULL && sscanf(buffer, "%u/%u", &hourly, &daily) == 2)
+	{
+		// Prevent possible overflow
+		config.rollup_retention.hourly = hourly < (unsigned int)maxdbdays_max ? hourly : (unsigned int)maxdbdays_max;
+		config.rollup_retention.daily = daily < (unsigned int)maxdbdays_max ? daily : (unsigned int)maxdbdays_max;
+	}
+
+	logg("   ROLLUP_RETENTION: Keeping hourly statistics for %u and daily statistics for %u days",
+	     config.rollup_retention.hourly, config.rollup_retention.daily);
+
 	// DBFILE
 	// defaults to: "/etc/pihole/pihole-FTL.db"
 	buffer = parse_FTLconf(fp, "DBFILE");
@@ -706,6 +747,47 @@ void read_FTLconf(void)
 		logg("   REPLY_WHEN_BUSY: Drop queries when the database is busy");
 	}
 
+	// UPSTREAM_SELECTION
+	// How should upstream servers be chosen for forwarded queries?
+	// DNSMASQ: dnsmasq's default (last server to reply first)
+	// LATENCY: best score of measured round-trip time and failure rate
+	// defaults to: DNSMASQ
+	buffer = parse_FTLconf(fp, "UPSTREAM_SELECTION");
+
+	if(buffer != NULL && strcasecmp(buffer, "LATENCY") == 0)
+	{
+		config.upstream_selection = UPSTREAM_SELECT_LATENCY;
+		logg("   UPSTREAM_SELECTION: Prefer upstream servers with the best measured latency");
+	}
+	else
+	{
+		config.upstream_selection = UPSTREAM_SELECT_DNSMASQ;
+		logg("   UPSTREAM_SELECTION: Use dnsmasq's server selection");
+	}
+
+	// PREFETCH
+	// Refresh cached A/AAAA records of popular domains from upstream when
+	// they are queried within the last <percent> of their TTL. Format is
+	// <percent>/<min. queries>/<max. refreshes per minute>
+	// defaults to: 0/0/0 (disabled)
+	config.prefetch.percent = 0;
+	config.prefetch.min_queries = 0;
+	config.prefetch.budget = 0;
+	buffer = parse_FTLconf(fp, "PREFETCH");
+
+	unsigned int percent = 0, min_queries = 0, budget = 0;
+	if(buffer != NULL && sscanf(buffer, "%u/%u/%u", &percent, &min_queries, &budget) == 3 &&
+	   percent > 0 && percent < 100 && budget > 0)
+	{
+		config.prefetch.percent = percent;
+		config.prefetch.min_queries = min_queries;
+		config.prefetch.budget = budget;
+		logg("   PREFETCH: Refreshing domains with at least %u queries in the last %u%% of their TTL (max. %u/min)",
+		     min_queries, percent, budget);
+	}
+	else
+		logg("   PREFETCH: Disabled");
+
 	// BLOCK_TTL
 	// defaults to: 2 seconds
 	config.block_ttl = 2;
@@ -65,6 +65,8 @@ typedef struct {
 	enum refresh_hostnames refresh_hostnames;
 	enum busy_reply reply_when_busy;
 	enum ptr_type pihole_ptr;
+	enum db_partitioning DBpartitioning;
+	enum upstream_selection upstream_selection;
 	int maxDBdays;
 	int port;
 	int maxlogage;
@@ -76,6 +78,15 @@ typedef struct {
 		unsigned int count;
 		unsigned int interval;
 	} rate_limit;
+	struct {
+		unsigned int hourly;
+		unsigned int daily;
+	} rollup_retention;
+	struct {
+		unsigned int percent;
+		unsigned int min_queries;
+		unsigned int budget;
+	} prefetch;
 	enum debug_flags debug;
 	time_t DBinterval;
 	struct {
@@ -40,56 +40,68 @@ bool create_aliasclients_table(sqlite3 *db)
 	return true;
 }
 
-// Recompute the alias-client's values
-// We shouldn't do this too often as it iterates over all existing clients
-static void recompute_aliasclient(const int aliasclientID)
+// Add (sign = +1) or subtract (sign = -1) the counts of a client to/from an
+// alias-client. Later changes are propagated by change_clientcount() so the
+// alias-client only needs to be updated when its membership changes
+static void apply_client_counts(clientsData *aliasclient, const clientsData *client, const int sign)
+{
+	aliasclient->count += sign*client->count;
+	aliasclient->blockedcount += sign*client->blockedcount;
+	for(int idx = 0; idx < OVERTIME_SLOTS; idx++)
+		aliasclient->overTime[idx] += sign*client->overTime[idx];
+}
+
+// Add client to the list of members of this alias-client
+static void add_aliasclient_member(const int aliasclientID, clientsData *client)
 {
 	clientsData *aliasclient = getClient(aliasclientID, true);
+	if(aliasclient == NULL)
+		return;
 
 	if(config.debug & DEBUG_ALIASCLIENTS)
 	{
-		logg("Recomputing alias-client \"%s\" (%s)...",
+		logg("Client \"%s\" (%s) IS  managed by alias-client \"%s\" (%s), adding counts",
+		     getstr(client->namepos), getstr(client->ippos),
 		     getstr(aliasclient->namepos), getstr(aliasclient->ippos));
 	}
 
-	// Reset this alias-client
-	aliasclient->count = 0;
-	aliasclient->blockedcount = 0;
-	memset(aliasclient->overTime, 0, sizeof(aliasclient->overTime));
+	// Prepend client to the list of members
+	client->members.next = aliasclient->members.first;
+	aliasclient->members.first = client->id;
+	client->aliasclient_id = aliasclientID;
 
-	// Loop over all existing clients to find which clients are associated to this one
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get pointer to client candidate
-		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and alias-clients
-		if(client == NULL || client->flags.aliasclient)
-			continue;
+	apply_client_counts(aliasclient, client, +1);
+}
 
-		// Skip clients that are not managed by this aliasclient
-		if(client->aliasclient_id != aliasclientID)
-		{
-			if(config.debug & DEBUG_ALIASCLIENTS)
-			{
-				logg("Client \"%s\" (%s) NOT managed by this alias-client, skipping",
-				     getstr(client->namepos), getstr(client->ippos));
-			}
-			continue;
-		}
+// Remove client from the list of members of its alias-client
+static void remove_aliasclient_member(clientsData *client)
+{
+	clientsData *aliasclient = getClient(client->aliasclient_id, true);
+	client->aliasclient_id = -1;
+	if(aliasclient == NULL)
+		return;
 
-		// Debug logging
-		if(config.debug & DEBUG_ALIASCLIENTS)
-		{
-			logg("Client \"%s\" (%s) IS  managed by this alias-client, adding counts",
-					getstr(client->namepos), getstr(client->ippos));
-		}
+	if(config.debug & DEBUG_ALIASCLIENTS)
+	{
+		logg("Client \"%s\" (%s) NOT managed by alias-client \"%s\" (%s) anymore, removing counts",
+		     getstr(client->namepos), getstr(client->ippos),
+		     getstr(aliasclient->namepos), getstr(aliasclient->ippos));
+	}
 
-		// Add counts of this client to the alias-client
-		aliasclient->count += client->count;
-		aliasclient->blockedcount += client->blockedcount;
-		for(int idx = 0; idx < OVERTIME_SLOTS; idx++)
-			aliasclient->overTime[idx] += client->overTime[idx];
+	// Unlink client from the list of members
+	int *link = &aliasclient->members.first;
+	while(*link > -1 && *link != (int)client->id)
+	{
+		clientsData *member = getClient(*link, true);
+		if(member == NULL)
+			break;
+		link = &member->members.next;
 	}
+	if(*link == (int)client->id)
+		*link = client->members.next;
+	client->members.next = -1;
+
+	apply_client_counts(aliasclient, client, -1);
 }
 
 // Store hostname of device identified by dbID
@@ -147,9 +159,6 @@ bool import_aliasclients(sqlite3 *db)
 		// Set client flags
 		client->flags.new = false;
 
-		// Reset counter
-		client->count = 0;
-
 		// Store intended name
 		const char *name = (char*)sqlite3_column_text(stmt, 1);
 		client->namepos = addstr(name);
@@ -254,61 +263,64 @@ void reset_aliasclient(sqlite3 *db, clientsData *client)
 
 	// Skip alias-clients themselves
 	if(client->flags.aliasclient)
+	{
+		if(db_opened) dbclose(&db);
 		return;
+	}
 
 	// Find corresponding alias-client (if any)
-	client->aliasclient_id = get_aliasclient_ID(db, client);
+	const int aliasclientID = get_aliasclient_ID(db, client);
 
 	// Close the database if we opened it here
 	if(db_opened) dbclose(&db);
 
-	// Skip if there is no responsible alias-client
-	if(client->aliasclient_id == -1)
+	// Nothing to be done if the membership did not change
+	if(aliasclientID == client->aliasclient_id)
 		return;
 
-	// Recompute all values for this alias-client
-	recompute_aliasclient(client->aliasclient_id);
+	// Move the counts of this client from the previous to the new
+	// alias-client (if any)
+	if(client->aliasclient_id > -1)
+		remove_aliasclient_member(client);
+	if(aliasclientID > -1)
+		add_aliasclient_member(aliasclientID, client);
 }
 
 // Return a list of clients linked to the current alias-client
 // The first element contains the number of following IDs
 int *get_aliasclient_list(const int aliasclientID)
 {
+	const clientsData *aliasclient = getClient(aliasclientID, true);
+	const int first = aliasclient != NULL ? aliasclient->members.first : -1;
+
+	// Walk the list of members to count them
 	int count = 0;
-	// Loop over all existing clients to count associated clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	for(int clientID = first; clientID > -1; count++)
 	{
-		// Get pointer to client candidate
 		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and those that are not managed by this aliasclient
-		if(client == NULL || client->aliasclient_id != aliasclientID)
-			continue;
-
-		count++;
+		clientID = client != NULL ? client->members.next : -1;
 	}
 
 	int *list = calloc(count + 1, sizeof(int));
 	list[0] = count;
 
-	// Loop over all existing clients to fill list of clients
+	// Walk the list of members again to fill list of clients
 	count = 0;
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	for(int clientID = first; clientID > -1;)
 	{
-		// Get pointer to client candidate
 		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and those that are not managed by this aliasclient
-		if(client == NULL || client->aliasclient_id != aliasclientID)
-			continue;
+		if(client == NULL)
+			break;
 
 		list[++count] = clientID;
+		clientID = client->members.next;
 	}
 
 	return list;
 }
 
 // Reimport alias-clients from database
-// Note that this will always only change or add new clients. Alias-clients are
-// removed by nulling them before importing new clients
+// Note that this will always only change or add new clients
 void reimport_aliasclients(sqlite3 *db)
 {
 	// Return early if database is known to be broken
@@ -329,25 +341,11 @@ void reimport_aliasclients(sqlite3 *db)
 		db_opened = true;
 	}
 
-	// Loop over all existing alias-clients and set their counters to zero
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get pointer to client candidate
-		clientsData *client = getClient(clientID, true);
-		// Skip invalid and non-alias-clients
-		if(client == NULL || !client->flags.aliasclient)
-			continue;
-
-		// Reset this alias-client
-		client->count = 0;
-		client->blockedcount = 0;
-		memset(client->overTime, 0, sizeof(client->overTime));
-	}
-
 	// Import aliasclients from database table
 	import_aliasclients(db);
 
-	// Recompute all alias-clients
+	// Update memberships of all clients, alias-clients are only updated
+	// for clients that changed their membership
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		// Get pointer to client candidate
@@ -0,0 +1,580 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory client table classifier
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "client-classifier.h"
+// struct config
+#include "../config.h"
+// logg()
+#include "../log.h"
+// inet_pton()
+#include <arpa/inet.h>
+
+// The client table is compiled into process-private lookup structures
+// whenever the gravity database is (re-)opened. This avoids running a
+// subnet_match() full table scan (plus a few more queries for hardware
+// addresses, host names and interfaces) for every new client and on every
+// group recheck. The structures are read-only after compilation so they can
+// safely be inherited by forks.
+
+// Prefix of interface names in the client table
+#define INTERFACE_SEP ':'
+
+typedef struct {
+	int id;
+	int bits;
+	int next;
+	char *text;
+} cidrEntry;
+
+typedef struct {
+	int child[2];
+	int entries;
+} trieNode;
+
+typedef struct {
+	trieNode *nodes;
+	unsigned int count;
+	unsigned int size;
+} prefixTrie;
+
+typedef struct {
+	char *key;
+	int id;
+} keyEntry;
+
+typedef struct {
+	keyEntry *slots;
+	unsigned int count;
+	unsigned int size;
+} keyMap;
+
+typedef struct {
+	int id;
+	char *groups;
+} clientGroups;
+
+typedef struct {
+	bool ready;
+	prefixTrie ipv4;
+	prefixTrie ipv6;
+	struct {
+		cidrEntry *list;
+		unsigned int count;
+		unsigned int size;
+	} entries;
+	keyMap hwaddrs;
+	keyMap hostnames;
+	keyMap interfaces;
+	struct {
+		clientGroups *list;
+		unsigned int count;
+		unsigned int size;
+	} groups;
+} clientClassifier;
+
+// The active classifier is used for lookups, the staged one is compiled by the
+// database thread from a new gravity database connection (see
+// gravityDB_stage()) and replaces the active one when the connection is
+// swapped in
+static clientClassifier classifier = { 0 };
+static clientClassifier staged_classifier = { 0 };
+
+// Counting number of occurrences of a specific char in a string
+static size_t __attribute__ ((pure)) count_char(const char *haystack, const char needle)
+{
+	size_t count = 0u;
+	while(*haystack)
+		if (*haystack++ == needle)
+			++count;
+	return count;
+}
+
+// Identify MAC addresses using the same criteria as subnet_match()
+static bool __attribute__ ((pure)) isMAC(const char *input)
+{
+	return input != NULL &&
+	       strlen(input) == 17u &&
+	       count_char(input, ':') == 5u &&
+	       strstr(input, "::") == NULL;
+}
+
+// Case-insensitive FNV-1a hash, this mirrors the ASCII-only folding of
+// SQLite3's NOCASE collation
+static uint32_t __attribute__ ((pure)) hash_nocase(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for(; *key != '\0'; key++)
+	{
+		hash ^= (uint32_t)tolower((unsigned char)*key);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool keymap_grow(keyMap *map)
+{
+	const unsigned int newsize = map->size > 0 ? 2*map->size : 16u;
+	keyEntry *slots = calloc(newsize, sizeof(keyEntry));
+	if(slots == NULL)
+		return false;
+
+	// Rehash existing entries into the new slots
+	for(unsigned int i = 0; i < map->size; i++)
+	{
+		if(map->slots[i].key == NULL)
+			continue;
+		unsigned int pos = hash_nocase(map->slots[i].key) & (newsize - 1);
+		while(slots[pos].key != NULL)
+			pos = (pos + 1) & (newsize - 1);
+		slots[pos] = map->slots[i];
+	}
+
+	if(map->slots != NULL)
+		free(map->slots);
+	map->slots = slots;
+	map->size = newsize;
+	return true;
+}
+
+static bool keymap_insert(keyMap *map, const char *key, const int id)
+{
+	// Keep the load factor below 50%
+	if(2*(map->count + 1) > map->size && !keymap_grow(map))
+		return false;
+
+	unsigned int pos = hash_nocase(key) & (map->size - 1);
+	while(map->slots[pos].key != NULL)
+	{
+		// The client table's UNIQUE constraint is case-sensitive so there
+		// may be several rows matching the same key. The first (lowest ID)
+		// one is kept as this is what the table scan used to return.
+		if(strcasecmp(map->slots[pos].key, key) == 0)
+			return true;
+		pos = (pos + 1) & (map->size - 1);
+	}
+
+	if((map->slots[pos].key = strdup(key)) == NULL)
+		return false;
+	map->slots[pos].id = id;
+	map->count++;
+	return true;
+}
+
+static int __attribute__ ((pure)) keymap_lookup(const keyMap *map, const char *key)
+{
+	if(map->count == 0 || key == NULL)
+		return -1;
+
+	unsigned int pos = hash_nocase(key) & (map->size - 1);
+	while(map->slots[pos].key != NULL)
+	{
+		if(strcasecmp(map->slots[pos].key, key) == 0)
+			return map->slots[pos].id;
+		pos = (pos + 1) & (map->size - 1);
+	}
+
+	return -1;
+}
+
+static void keymap_free(keyMap *map)
+{
+	for(unsigned int i = 0; i < map->size; i++)
+		if(map->slots[i].key != NULL)
+			free(map->slots[i].key);
+	if(map->slots != NULL)
+		free(map->slots);
+	memset(map, 0, sizeof(*map));
+}
+
+static int trie_new_node(prefixTrie *trie)
+{
+	if(trie->count >= trie->size)
+	{
+		const unsigned int newsize = trie->size > 0 ? 2*trie->size : 64u;
+		trieNode *nodes = realloc(trie->nodes, newsize*sizeof(trieNode));
+		if(nodes == NULL)
+			return -1;
+		trie->nodes = nodes;
+		trie->size = newsize;
+	}
+
+	trieNode *node = &trie->nodes[trie->count];
+	node->child[0] = node->child[1] = -1;
+	node->entries = -1;
+	return (int)trie->count++;
+}
+
+// Get bit number <bit> (counting from the most significant one) of an address
+static inline int addr_bit(const struct in6_addr *addr, const int bit)
+{
+	return (addr->s6_addr[bit/8] >> (7 - (bit % 8))) & 1;
+}
+
+static bool trie_insert(prefixTrie *trie, cidrEntry *list, const struct in6_addr *addr, const int bits, const int entry)
+{
+	if(trie->count == 0 && trie_new_node(trie) < 0)
+		return false;
+
+	int node = 0;
+	for(int bit = 0; bit < bits; bit++)
+	{
+		const int b = addr_bit(addr, bit);
+		int next = trie->nodes[node].child[b];
+		if(next < 0)
+		{
+			// trie_new_node() may move the nodes array
+			if((next = trie_new_node(trie)) < 0)
+				return false;
+			trie->nodes[node].child[b] = next;
+		}
+		node = next;
+	}
+
+	// Append entry to the end of this node's list so entries stay sorted
+	// by their (ascending) client ID
+	int *tail = &trie->nodes[node].entries;
+	while(*tail >= 0)
+		tail = &list[*tail].next;
+	*tail = entry;
+	return true;
+}
+
+// Walk the trie along the address and return the deepest node having
+// entries attached, i.e., the longest matching prefix
+static int __attribute__ ((pure)) trie_lookup(const prefixTrie *trie, const struct in6_addr *addr, const int maxbits)
+{
+	if(trie->count == 0)
+		return -1;
+
+	int node = 0, best = -1;
+	for(int bit = 0; ; bit++)
+	{
+		if(trie->nodes[node].entries >= 0)
+			best = trie->nodes[node].entries;
+		if(bit >= maxbits)
+			break;
+		node = trie->nodes[node].child[addr_bit(addr, bit)];
+		if(node < 0)
+			break;
+	}
+
+	return best;
+}
+
+static bool add_cidr_entry(clientClassifier *c, const int id, const char *text)
+{
+	// Extract possible CIDR from the database string, sscanf() will not
+	// overwrite the pre-defined CIDR if none is specified
+	const bool isIPv6 = strchr(text, ':') != NULL;
+	const int maxbits = isIPv6 ? 128 : 32;
+	int cidr = maxbits;
+	char *addr = NULL;
+	const int rt = sscanf(text, "%m[^/]/%i", &addr, &cidr);
+	if(rt < 1 || addr == NULL)
+		return true;
+
+	// Not an IP address (host names, MAC addresses, etc.)
+	struct in6_addr saddr = {{{ 0 }}};
+	const int valid = inet_pton(isIPv6 ? AF_INET6 : AF_INET, addr, &saddr);
+	free(addr);
+	if(valid != 1)
+		return true;
+
+	// subnet_match() never matched subnets with a non-positive number of bits
+	if(cidr < 1)
+		return true;
+	if(cidr > maxbits)
+		cidr = maxbits;
+
+	if(c->entries.count >= c->entries.size)
+	{
+		const unsigned int newsize = c->entries.size > 0 ? 2*c->entries.size : 16u;
+		cidrEntry *list = realloc(c->entries.list, newsize*sizeof(cidrEntry));
+		if(list == NULL)
+			return false;
+		c->entries.list = list;
+		c->entries.size = newsize;
+	}
+
+	const int entry = (int)c->entries.count;
+	cidrEntry *e = &c->entries.list[entry];
+	if((e->text = strdup(text)) == NULL)
+		return false;
+	e->id = id;
+	e->bits = cidr;
+	e->next = -1;
+	c->entries.count++;
+
+	return trie_insert(isIPv6 ? &c->ipv6 : &c->ipv4, c->entries.list, &saddr, cidr, entry);
+}
+
+static bool add_client(clientClassifier *c, const int id, const char *text)
+{
+	// Interfaces are stored with a leading colon, e.g., ":eth0"
+	if(text[0] == INTERFACE_SEP)
+		return keymap_insert(&c->interfaces, text + 1, id);
+
+	// MAC addresses cannot be anything else
+	if(isMAC(text))
+		return keymap_insert(&c->hwaddrs, text, id);
+
+	// Everything else may be an IP address/subnet. We still add it to the
+	// host name map as the lookup by host name has always been a plain
+	// string comparison against all rows of the client table
+	return add_cidr_entry(c, id, text) &&
+	       keymap_insert(&c->hostnames, text, id);
+}
+
+static bool add_groups(clientClassifier *c, const int id, const char *groups)
+{
+	if(c->groups.count >= c->groups.size)
+	{
+		const unsigned int newsize = c->groups.size > 0 ? 2*c->groups.size : 16u;
+		clientGroups *list = realloc(c->groups.list, newsize*sizeof(clientGroups));
+		if(list == NULL)
+			return false;
+		c->groups.list = list;
+		c->groups.size = newsize;
+	}
+
+	clientGroups *g = &c->groups.list[c->groups.count];
+	if((g->groups = strdup(groups)) == NULL)
+		return false;
+	g->id = id;
+	c->groups.count++;
+	return true;
+}
+
+static bool load_table(clientClassifier *c, sqlite3 *db, const char *querystr,
+                       bool (*add)(clientClassifier*, const int, const char*))
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("classifier_compile(\"%s\") - SQL error prepare: %s",
+		     querystr, sqlite3_errstr(rc));
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *text = (const char*)sqlite3_column_text(stmt, 1);
+		if(text == NULL)
+			continue;
+
+		if(!add(c, sqlite3_column_int(stmt, 0), text))
+		{
+			logg("classifier_compile(): Memory allocation failed");
+			sqlite3_finalize(stmt);
+			return false;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_DONE)
+	{
+		logg("classifier_compile(\"%s\") - SQL error step: %s",
+		     querystr, sqlite3_errstr(rc));
+		return false;
+	}
+
+	return true;
+}
+
+static void free_classifier(clientClassifier *c)
+{
+	for(unsigned int i = 0; i < c->entries.count; i++)
+		free(c->entries.list[i].text);
+	if(c->entries.list != NULL)
+		free(c->entries.list);
+
+	for(unsigned int i = 0; i < c->groups.count; i++)
+		free(c->groups.list[i].groups);
+	if(c->groups.list != NULL)
+		free(c->groups.list);
+
+	if(c->ipv4.nodes != NULL)
+		free(c->ipv4.nodes);
+	if(c->ipv6.nodes != NULL)
+		free(c->ipv6.nodes);
+
+	keymap_free(&c->hwaddrs);
+	keymap_free(&c->hostnames);
+	keymap_free(&c->interfaces);
+
+	memset(c, 0, sizeof(*c));
+}
+
+// Compile the client table of a gravity database connection into a classifier
+static bool compile_classifier(clientClassifier *c, sqlite3 *db)
+{
+	free_classifier(c);
+
+	// Rows are processed in order of their IDs, this is required for getting
+	// both the maximum ID of multiple equally good subnet matches and the
+	// lowest ID of multiple rows matching the same key
+	if(!load_table(c, db, "SELECT id, ip FROM client ORDER BY id;", add_client) ||
+	   !load_table(c, db, "SELECT client_id, GROUP_CONCAT(group_id) FROM client_by_group "
+	                      "GROUP BY client_id ORDER BY client_id;", add_groups))
+	{
+		free_classifier(c);
+		return false;
+	}
+
+	c->ready = true;
+
+	if(config.debug & DEBUG_CLIENTS)
+	{
+		logg("Compiled client table: %u subnets (%u/%u trie nodes), %u hardware addresses, "
+		     "%u host names, %u interfaces, %u clients with groups",
+		     c->entries.count, c->ipv4.count, c->ipv6.count,
+		     c->hwaddrs.count, c->hostnames.count,
+		     c->interfaces.count, c->groups.count);
+	}
+
+	return true;
+}
+
+// Compile the client table of the gravity database into the active classifier
+bool classifier_compile(sqlite3 *db)
+{
+	return compile_classifier(&classifier, db);
+}
+
+void classifier_free(void)
+{
+	free_classifier(&classifier);
+}
+
+// Compile the client table of the staged gravity database connection without
+// touching the active classifier
+bool classifier_stage(sqlite3 *db)
+{
+	return compile_classifier(&staged_classifier, db);
+}
+
+// Free a staged classifier which is not going to be used
+void classifier_discard_staged(void)
+{
+	free_classifier(&staged_classifier);
+}
+
+// Replace the active classifier by the staged one. Returns false if there is
+// no (successfully compiled) staged classifier
+bool classifier_swap(void)
+{
+	free_classifier(&classifier);
+	classifier = staged_classifier;
+	memset(&staged_classifier, 0, sizeof(staged_classifier));
+	return classifier.ready;
+}
+
+bool classifier_ready(void)
+{
+	return classifier.ready;
+}
+
+// Find the longest matching subnet for this IP address. Several client table
+// rows may match with the same number of bits, they are all reported so the
+// caller can warn about this ambiguity
+bool classifier_match_ip(const char *ip, classifierMatch *match)
+{
+	memset(match, 0, sizeof(*match));
+	match->chosen_match_id = -1;
+
+	const bool isIPv6 = strchr(ip, ':') != NULL;
+	struct in6_addr saddr = {{{ 0 }}};
+	if(inet_pton(isIPv6 ? AF_INET6 : AF_INET, ip, &saddr) != 1)
+	{
+		logg("Malformed FTL IP address: %s", ip);
+		return false;
+	}
+
+	const int first = isIPv6 ? trie_lookup(&classifier.ipv6, &saddr, 128) :
+	                           trie_lookup(&classifier.ipv4, &saddr, 32);
+	if(first < 0)
+		return false;
+
+	// Count the matches and collect their IDs. The list is sorted so the
+	// last entry has the highest ID, this is the one we choose
+	size_t len = 0u;
+	for(int e = first; e >= 0; e = classifier.entries.list[e].next)
+	{
+		match->matching_count++;
+		len += 12u;
+	}
+
+	match->matching_ids = calloc(len + 1u, sizeof(char));
+	if(match->matching_ids == NULL)
+		return false;
+
+	size_t pos = 0u;
+	for(int e = first; e >= 0; e = classifier.entries.list[e].next)
+	{
+		const cidrEntry *entry = &classifier.entries.list[e];
+		pos += snprintf(match->matching_ids + pos, len + 1u - pos, "%s%d", pos > 0 ? "," : "", entry->id);
+		match->chosen_match_id = entry->id;
+		match->chosen_match_text = entry->text;
+		match->matching_bits = entry->bits;
+	}
+
+	return true;
+}
+
+int classifier_match_hwaddr(const char *hwaddr)
+{
+	return keymap_lookup(&classifier.hwaddrs, hwaddr);
+}
+
+int classifier_match_hostname(const char *hostname)
+{
+	return keymap_lookup(&classifier.hostnames, hostname);
+}
+
+int classifier_match_interface(const char *iface)
+{
+	return keymap_lookup(&classifier.interfaces, iface);
+}
+
+bool classifier_has_hwaddrs(void)
+{
+	return classifier.hwaddrs.count > 0;
+}
+
+bool classifier_has_hostnames(void)
+{
+	return classifier.hostnames.count > 0;
+}
+
+bool classifier_has_interfaces(void)
+{
+	return classifier.interfaces.count > 0;
+}
+
+// Get the comma-separated list of groups of this client table row
+const char *classifier_get_groups(const int client_id)
+{
+	unsigned int lo = 0u, hi = classifier.groups.count;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		const int id = classifier.groups.list[mid].id;
+		if(id == client_id)
+			return classifier.groups.list[mid].groups;
+		else if(id < client_id)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
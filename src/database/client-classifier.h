@@ -0,0 +1,40 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory client table classifier prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef CLIENT_CLASSIFIER_H
+#define CLIENT_CLASSIFIER_H
+
+#include "sqlite3.h"
+
+// Result of a longest-prefix match of an IP address against all
+// IPv4/IPv6 addresses and subnets configured in the client table
+typedef struct {
+	int matching_count;
+	int chosen_match_id;
+	int matching_bits;
+	const char *chosen_match_text;
+	char *matching_ids;
+} classifierMatch;
+
+bool classifier_compile(sqlite3 *db);
+void classifier_free(void);
+bool classifier_stage(sqlite3 *db);
+void classifier_discard_staged(void);
+bool classifier_swap(void);
+bool classifier_ready(void) __attribute__ ((pure));
+bool classifier_match_ip(const char *ip, classifierMatch *match);
+int classifier_match_hwaddr(const char *hwaddr) __attribute__ ((pure));
+int classifier_match_hostname(const char *hostname) __attribute__ ((pure));
+int classifier_match_interface(const char *iface) __attribute__ ((pure));
+bool classifier_has_hwaddrs(void) __attribute__ ((pure));
+bool classifier_has_hostnames(void) __attribute__ ((pure));
+bool classifier_has_interfaces(void) __attribute__ ((pure));
+const char *classifier_get_groups(const int client_id) __attribute__ ((pure));
+
+#endif //CLIENT_CLASSIFIER_H
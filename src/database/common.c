@@ -25,6 +25,10 @@
 #include "aliasclients.h"
 // add_additional_info_column()
 #include "query-table.h"
+// create_query_partitions_table()
+#include "query-partitions.h"
+// create_rollup_tables()
+#include "rollup-table.h"
 
 bool DBdeleteoldqueries = false;
 static bool DBerror = false;
@@ -465,6 +469,36 @@ void db_init(void)
 		dbversion = db_get_int(db, DB_VERSION);
 	}
 
+	// Update to version 13 if lower
+	if(dbversion < 13)
+	{
+		// Update to version 13: Add table for time-partitioned query storage
+		logg("Updating long-term database to version 13");
+		if(!create_query_partitions_table(db))
+		{
+			logg("Query partitions table not initialized, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
+	// Update to version 14 if lower
+	if(dbversion < 14)
+	{
+		// Update to version 14: Add hourly and daily query rollup tables
+		logg("Updating long-term database to version 14");
+		if(!create_rollup_tables(db))
+		{
+			logg("Rollup tables not initialized, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
 	lock_shm();
 	import_aliasclients(db);
 	unlock_shm();
@@ -539,7 +573,8 @@ bool db_update_counters(sqlite3 *db, const int total, const int blocked)
 	return true;
 }
 
-int db_query_int(sqlite3 *db, const char* querystr)
+// Run a query returning a single integer, <func> is used for logging
+static int64_t db_query_integer(sqlite3 *db, const char* querystr, const char *func)
 {
 	// Return early if the database is known to be broken
 	if(FTLDBerror())
@@ -555,19 +590,19 @@ int db_query_int(sqlite3 *db, const char* querystr)
 	if( rc != SQLITE_OK )
 	{
 		if( rc != SQLITE_BUSY )
-			logg("Encountered prepare error in db_query_int(\"%s\"): %s", querystr, sqlite3_errstr(rc));
+			logg("Encountered prepare error in %s(\"%s\"): %s", func, querystr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
 		return DB_FAILED;
 	}
 
 	rc = sqlite3_step(stmt);
-	int result;
+	int64_t result;
 
 	if( rc == SQLITE_ROW )
 	{
-		result = sqlite3_column_int(stmt, 0);
+		result = sqlite3_column_int64(stmt, 0);
 		if(config.debug & DEBUG_DATABASE)
-			logg("         ---> Result %i (int)", result);
+			logg("         ---> Result %lld (int)", (long long)result);
 	}
 	else if( rc == SQLITE_DONE )
 	{
@@ -578,7 +613,7 @@ int db_query_int(sqlite3 *db, const char* querystr)
 	}
 	else
 	{
-		logg("Encountered step error in db_query_int(\"%s\"): %s", querystr, sqlite3_errstr(rc));
+		logg("Encountered step error in %s(\"%s\"): %s", func, querystr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
 		return DB_FAILED;
 	}
@@ -587,13 +622,26 @@ int db_query_int(sqlite3 *db, const char* querystr)
 	return result;
 }
 
+int db_query_int(sqlite3 *db, const char* querystr)
+{
+	return (int)db_query_integer(db, querystr, __FUNCTION__);
+}
+
+int64_t db_query_int64(sqlite3 *db, const char* querystr)
+{
+	return db_query_integer(db, querystr, __FUNCTION__);
+}
+
 long int get_max_query_ID(sqlite3 *db)
 {
 	// Return early if the database is known to be broken
 	if(FTLDBerror())
 		return DB_FAILED;
 
-	const char *sql = "SELECT MAX(ID) FROM queries";
+	// The queries VIEW may span many partitions, we use the sequence of the
+	// query_storage table as global ID counter instead (it is updated by
+	// AUTOINCREMENT and when storing queries in partitions)
+	const char *sql = "SELECT seq FROM sqlite_sequence WHERE name = 'query_storage'";
 	if(config.debug & DEBUG_DATABASE)
 		logg("dbquery: \"%s\"", sql);
 
@@ -612,14 +660,15 @@ long int get_max_query_ID(sqlite3 *db)
 	}
 
 	rc = sqlite3_step(stmt);
-	if( rc != SQLITE_ROW )
+	if( rc != SQLITE_ROW && rc != SQLITE_DONE )
 	{
 		logg("Encountered step error in get_max_query_ID(): %s", sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
 		return DB_FAILED;
 	}
 
-	sqlite3_int64 result = sqlite3_column_int64(stmt, 0);
+	// No queries have been stored so far if there is no sequence yet
+	sqlite3_int64 result = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
 	if(config.debug & DEBUG_DATABASE)
 	{
 		logg("         ---> Result %lli (long long int)", (long long int)result);
@@ -39,6 +39,7 @@ sqlite3 *_dbopen(bool create, const char *func, const int line, const char *file
 void _dbclose(sqlite3 **db, const char *func, const int line, const char *file);
 
 int db_query_int(sqlite3 *db, const char *querystr);
+int64_t db_query_int64(sqlite3 *db, const char *querystr);
 void SQLite3LogCallback(void *pArg, int iErrCode, const char *zMsg);
 long int get_max_query_ID(sqlite3 *db);
 bool db_update_counters(sqlite3 *db, const int total, const int blocked);
@@ -17,6 +17,8 @@
 #include "network-table.h"
 // DB_save_queries()
 #include "query-table.h"
+// delete_old_rollups_in_DB()
+#include "rollup-table.h"
 #include "../config.h"
 #include "../log.h"
 #include "../timers.h"
@@ -64,10 +66,14 @@ void *DB_thread(void *val)
 				unlock_shm();
 
 				// Check if GC should be done on the database
-				if(DBdeleteoldqueries && config.maxDBdays != -1)
+				if(DBdeleteoldqueries)
 				{
 					// No thread locks needed
-					delete_old_queries_in_DB(db);
+					if(config.maxDBdays != -1)
+						delete_old_queries_in_DB(db);
+
+					// Rollups have their own retention
+					delete_old_rollups_in_DB(db);
 					DBdeleteoldqueries = false;
 				}
 
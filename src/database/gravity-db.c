@@ -17,8 +17,6 @@
 #include "../log.h"
 // getstr()
 #include "../shmem.h"
-// SQLite3 prepared statement vectors
-#include "../vector.h"
 // log_subnet_warning()
 // logg_inaccessible_adlist
 #include "message-table.h"
@@ -28,6 +26,12 @@
 #include "../datastructure.h"
 // reset_aliasclient()
 #include "aliasclients.h"
+// classifier_compile()
+#include "client-classifier.h"
+// gravity_diff_stage()
+#include "gravity-diff.h"
+// record_tcp_worker_gravity()
+#include "../metrics.h"
 
 // Definition of struct regexData
 #include "../regex_r.h"
@@ -35,20 +39,54 @@
 // Prefix of interface names in the client table
 #define INTERFACE_SEP ":"
 
+// Domains shorter than this are matched against ABP-style entries without
+// allocating memory
+#define ABP_STACK_LEN 256
+
 // Process-private prepared statements are used to support multiple forks (might
 // be TCP workers) to use the database simultaneously without corrupting the
 // gravity database
-sqlite3_stmt_vec *whitelist_stmt = NULL;
-sqlite3_stmt_vec *gravity_stmt = NULL;
-sqlite3_stmt_vec *blacklist_stmt = NULL;
+//
+// Statements are shared by all clients with the same (canonical) group set,
+// hence, memory and preparation time scale with the number of distinct group
+// sets rather than with the number of clients. Group sets are reference
+// counted and their statements are finalized when the last client using them
+// is gone. The number of distinct group sets is typically small so we use a
+// simple array here
+typedef struct {
+	char *groups;
+	unsigned int refs;
+	sqlite3_stmt *whitelist;
+	sqlite3_stmt *blacklist;
+	sqlite3_stmt *gravity;
+} groupStatements;
+static groupStatements *groupsets = NULL;
+static unsigned int num_groupsets = 0;
+
+// Process-private mapping client ID -> index into groupsets (-1 = none)
+static int *client_groupset = NULL;
+static unsigned int client_groupset_size = 0;
 
 // Private variables
 static sqlite3 *gravity_db = NULL;
 static sqlite3_stmt* table_stmt = NULL;
 static sqlite3_stmt* auditlist_stmt = NULL;
 bool gravityDB_opened = false;
+// Set in TCP workers which have not opened the database so far
+static bool gravity_lazy_open = false;
 static bool gravity_abp_format = false;
 
+// Connection to the gravity database (and statements prepared on it) built by
+// the database thread while the active connection keeps serving queries. It
+// replaces the active connection in gravityDB_swap()
+static sqlite3 *staged_db = NULL;
+static groupStatements *staged_groupsets = NULL;
+static unsigned int num_staged_groupsets = 0;
+static bool staged_abp_format = false;
+
+// Process-private copy of the generation of the gravity database we are using
+static unsigned int gravity_generation = 0;
+
 // Table names corresponding to the enum defined in gravity-db.h
 static const char* tablename[] = { "vw_gravity", "vw_blacklist", "vw_whitelist", "vw_regex_blacklist", "vw_regex_whitelist" , "" };
 
@@ -88,29 +126,36 @@ void gravityDB_forked(void)
 	gravity_db = NULL;
 
 	// Also pretend we have not yet prepared the list statements
-	whitelist_stmt = NULL;
-	blacklist_stmt = NULL;
-	gravity_stmt = NULL;
-
-	// Open the database
-	gravityDB_open();
+	groupsets = NULL;
+	num_groupsets = 0;
+	client_groupset = NULL;
+	client_groupset_size = 0;
+
+	// A reload may have been staged by the database thread of the parent
+	staged_db = NULL;
+	staged_groupsets = NULL;
+	num_staged_groupsets = 0;
+
+	// The database is opened once it is actually needed (see
+	// gravityDB_current())
+	gravity_lazy_open = true;
 }
 
-static void gravity_check_ABP_format(void)
+// Check if we have a valid ABP format
+static bool gravity_check_ABP_format(sqlite3 *db)
 {
-	// Check if we have a valid ABP format
 	// We do this by checking the "abp_domains" property in the "info" table
 
 	// Prepare statement
 	sqlite3_stmt *stmt = NULL;
-	int rc = sqlite3_prepare_v2(gravity_db,
+	int rc = sqlite3_prepare_v2(db,
 	                            "SELECT value FROM info WHERE property = 'abp_domains';",
 	                            -1, &stmt, NULL);
 
 	if( rc != SQLITE_OK )
 	{
 		logg("gravity_check_ABP_format() - SQL error prepare: %s", sqlite3_errstr(rc));
-		return;
+		return false;
 	}
 
 	// Execute statement
@@ -118,63 +163,77 @@ static void gravity_check_ABP_format(void)
 	if( rc != SQLITE_ROW )
 	{
 		// No result
-		gravity_abp_format = false;
 		sqlite3_finalize(stmt);
-		return;
+		return false;
 	}
 
 	// Get result (SQLite3 stores 1 for TRUE, 0 for FALSE)
-	gravity_abp_format = sqlite3_column_int(stmt, 0) != 0;
+	const bool abp_format = sqlite3_column_int(stmt, 0) != 0;
 
 	// Finalize statement
 	sqlite3_finalize(stmt);
+
+	return abp_format;
 }
 
-// Open gravity database
-bool gravityDB_open(void)
+// Open a new read-only connection to the gravity database. Returns NULL on error
+static sqlite3 *gravityDB_connect(void)
 {
 	struct stat st;
 	if(stat(FTLfiles.gravity_db, &st) != 0)
 	{
 		// File does not exist
 		logg("gravityDB_open(): %s does not exist", FTLfiles.gravity_db);
-		return false;
-	}
-
-	if(gravityDB_opened && gravity_db != NULL)
-	{
-		if(config.debug & DEBUG_DATABASE)
-			logg("gravityDB_open(): Database already connected");
-		return true;
+		return NULL;
 	}
 
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Trying to open %s in read-only mode", FTLfiles.gravity_db);
-	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &gravity_db, SQLITE_OPEN_READONLY, NULL);
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
 	if( rc != SQLITE_OK )
 	{
 		logg("gravityDB_open() - SQL error: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		sqlite3_close(db);
+		return NULL;
 	}
 
-	// Database connection is now open
-	gravityDB_opened = true;
-
 	// Tell SQLite3 to store temporary tables in memory. This speeds up read operations on
 	// temporary tables, indices, and views.
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Setting location for temporary object to MEMORY");
 	char *zErrMsg = NULL;
-	rc = sqlite3_exec(gravity_db, "PRAGMA temp_store = MEMORY", NULL, NULL, &zErrMsg);
+	rc = sqlite3_exec(db, "PRAGMA temp_store = MEMORY", NULL, NULL, &zErrMsg);
 	if( rc != SQLITE_OK )
 	{
 		logg("gravityDB_open(PRAGMA temp_store) - SQL error (%i): %s", rc, zErrMsg);
 		sqlite3_free(zErrMsg);
-		gravityDB_close();
-		return false;
+		sqlite3_close(db);
+		return NULL;
 	}
 
+	// Set SQLite3 busy timeout to a user-defined value (defaults to 1 second)
+	// to avoid immediate failures when the gravity database is still busy
+	// writing the changes to disk
+	if(config.debug & DEBUG_DATABASE)
+		logg("gravityDB_open(): Setting busy timeout to %d", DATABASE_BUSY_TIMEOUT);
+	sqlite3_busy_timeout(db, DATABASE_BUSY_TIMEOUT);
+
+	// Explicitly set busy handler to zero milliseconds
+	if(config.debug & DEBUG_DATABASE)
+		logg("gravityDB_open(): Setting busy timeout to zero");
+	rc = sqlite3_busy_timeout(db, 0);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravityDB_open() - Cannot set busy handler: %s", sqlite3_errstr(rc));
+	}
+
+	return db;
+}
+
+// Prepare everything we need on the (new) active gravity database connection
+static bool gravityDB_init_connection(void)
+{
 	// Prepare audit statement
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Preparing audit query");
@@ -189,7 +248,7 @@ bool gravityDB_open(void)
 	//            matches 'google.de' and all of its subdomains but
 	//            also other domains ending in google.de, like
 	//            abcgoogle.de
-	rc = sqlite3_prepare_v3(gravity_db,
+	int rc = sqlite3_prepare_v3(gravity_db,
 	        "SELECT domain, "
 	          "CASE WHEN substr(domain, 1, 1) = '*' " // Does the database string start in '*' ?
 	            "THEN '*' || substr(:input, - length(domain) + 1) " // If so: Crop the input domain and prepend '*'
@@ -205,36 +264,40 @@ bool gravityDB_open(void)
 		return false;
 	}
 
-	// Set SQLite3 busy timeout to a user-defined value (defaults to 1 second)
-	// to avoid immediate failures when the gravity database is still busy
-	// writing the changes to disk
 	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Setting busy timeout to %d", DATABASE_BUSY_TIMEOUT);
-	sqlite3_busy_timeout(gravity_db, DATABASE_BUSY_TIMEOUT);
-
-	// Prepare private vector of statements for this process (might be a TCP fork!)
-	if(whitelist_stmt == NULL)
-		whitelist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(blacklist_stmt == NULL)
-		blacklist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(gravity_stmt == NULL)
-		gravity_stmt = new_sqlite3_stmt_vec(counters->clients);
+		logg("gravityDB_open(): Successfully opened gravity.db");
+	return true;
+}
 
-	// Explicitly set busy handler to zero milliseconds
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Setting busy timeout to zero");
-	rc = sqlite3_busy_timeout(gravity_db, 0);
-	if(rc != SQLITE_OK)
+// Open gravity database
+bool gravityDB_open(void)
+{
+	if(gravityDB_opened && gravity_db != NULL)
 	{
-		logg("gravityDB_open() - Cannot set busy handler: %s", sqlite3_errstr(rc));
+		if(config.debug & DEBUG_DATABASE)
+			logg("gravityDB_open(): Database already connected");
+		return true;
 	}
 
+	if((gravity_db = gravityDB_connect()) == NULL)
+		return false;
+
+	// Database connection is now open
+	gravityDB_opened = true;
+
+	if(!gravityDB_init_connection())
+		return false;
+
 	// Check (and remember in global variable) if there are any ABP-style
 	// entries in the database
-	gravity_check_ABP_format();
+	gravity_abp_format = gravity_check_ABP_format(gravity_db);
+
+	// Compile the client table for fast client -> group lookups. We keep an
+	// existing (inherited) classifier in forks, it is read-only and only
+	// replaced when the database is reloaded
+	if(!classifier_ready())
+		classifier_compile(gravity_db);
 
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Successfully opened gravity.db");
 	return true;
 }
 
@@ -247,6 +310,32 @@ bool gravityDB_reopen(void)
 	return gravityDB_open();
 }
 
+// Forks keep using their own connection to the gravity database (see
+// gravityDB_forked()). Once the main process swapped in a new generation of
+// the database, we replace our connection, finally releasing the old one
+static bool gravityDB_current(void)
+{
+	if(gravity_generation != counters->gravity_generation)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Gravity database generation changed (%u -> %u), reopening",
+			     gravity_generation, counters->gravity_generation);
+		gravity_generation = counters->gravity_generation;
+		gravityDB_reopen();
+	}
+	else if(gravity_lazy_open && !gravityDB_opened)
+	{
+		// First lookup in this TCP worker
+		if(config.debug & DEBUG_DATABASE)
+			logg("Opening gravity database in TCP worker");
+		gravity_lazy_open = false;
+		record_tcp_worker_gravity();
+		gravityDB_open();
+	}
+
+	return gravityDB_opened;
+}
+
 static char* get_client_querystr(const char *table, const char *column, const char *groups)
 {
 	// Build query string with group filtering
@@ -297,75 +386,35 @@ static bool get_client_groupids(clientsData* client)
 		return false;
 	}
 
-	if(config.debug & DEBUG_CLIENTS)
-		logg("Querying gravity database for client with IP %s...", ip);
-
-	// Check if client is configured through the client table
-	// This will return nothing if the client is unknown/unconfigured
-	const char *querystr = "SELECT count(id) matching_count, "
-	                       "max(id) chosen_match_id, "
-	                       "ip chosen_match_text, "
-	                       "group_concat(id) matching_ids, "
-	                       "subnet_match(ip,?) matching_bits FROM client "
-	                       "WHERE matching_bits > 0 "
-	                       "GROUP BY matching_bits "
-	                       "ORDER BY matching_bits DESC LIMIT 1;";
-
-	// Prepare query
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-	if(rc != SQLITE_OK)
+	// The client table is compiled when opening the database, try again if
+	// this failed before
+	if(!classifier_ready() && !classifier_compile(gravity_db))
 	{
-		logg("get_client_groupids(\"%s\") - SQL error prepare: %s",
-		     ip, sqlite3_errstr(rc));
+		logg("get_client_groupids(): Client table not available");
 		return false;
 	}
 
-	// Bind ipaddr to prepared statement
-	if((rc = sqlite3_bind_text(table_stmt, 1, ip, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\"): Failed to bind ip: %s",
-		     ip, sqlite3_errstr(rc));
-		sqlite3_reset(table_stmt);
-		sqlite3_finalize(table_stmt);
-		return NULL;
-	}
+	if(config.debug & DEBUG_CLIENTS)
+		logg("Querying gravity database for client with IP %s...", ip);
 
-	// Perform query
-	rc = sqlite3_step(table_stmt);
-	int matching_count = 0, chosen_match_id = -1, matching_bits = 0;
-	char *matching_ids = NULL, *chosen_match_text = NULL;
-	if(rc == SQLITE_ROW)
+	// Check if client is configured through the client table using its IP
+	// address (or a subnet containing it). The longest matching subnet wins
+	classifierMatch match;
+	int chosen_match_id = -1;
+	if(classifier_match_ip(ip, &match))
 	{
-		// There is a record for this client in the database,
-		// extract the result (there can be at most one line)
-		matching_count = sqlite3_column_int(table_stmt, 0);
-		chosen_match_id = sqlite3_column_int(table_stmt, 1);
-		chosen_match_text = strdup((const char*)sqlite3_column_text(table_stmt, 2));
-		matching_ids = strdup((const char*)sqlite3_column_text(table_stmt, 3));
-		matching_bits = sqlite3_column_int(table_stmt, 4);
+		chosen_match_id = match.chosen_match_id;
 
-		if(config.debug & DEBUG_CLIENTS && matching_count == 1)
+		if(config.debug & DEBUG_CLIENTS && match.matching_count == 1)
 			// Case matching_count > 1 handled below using logg_subnet_warning()
 			logg("--> Found record for %s in the client table (group ID %d)", ip, chosen_match_id);
 	}
-	else if(rc == SQLITE_DONE)
+	else if(config.debug & DEBUG_CLIENTS)
 	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("--> No record for %s in the client table", ip);
-	}
-	else
-	{
-		// Error
-		logg("get_client_groupids(\"%s\") - SQL error step: %s",
-		     ip, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		return false;
+		logg("--> No record for %s in the client table", ip);
 	}
 
-	// Finalize statement
-	gravityDB_finalizeTable();
-
-	if(matching_count > 1)
+	if(match.matching_count > 1)
 	{
 		// There is more than one configured subnet that matches to current device
 		// with the same number of subnet mask bits. This is likely unintended by
@@ -373,20 +422,16 @@ static bool get_client_groupids(clientsData* client)
 		// Example:
 		//   Device 10.8.0.22
 		//   Client 1: 10.8.0.0/24
-		//   Client 2: 10.8.1.0/24
-		logg_subnet_warning(ip, matching_count, matching_ids, matching_bits, chosen_match_text, chosen_match_id);
+		//   Client 2: 10.8.0.0/255.255.255.0
+		logg_subnet_warning(ip, match.matching_count, match.matching_ids, match.matching_bits,
+		                    match.chosen_match_text, match.chosen_match_id);
 	}
 
 	// Free memory if applicable
-	if(matching_ids != NULL)
-	{
-		free(matching_ids);
-		matching_ids = NULL;
-	}
-	if(chosen_match_text != NULL)
+	if(match.matching_ids != NULL)
 	{
-		free(chosen_match_text);
-		chosen_match_text = NULL;
+		free(match.matching_ids);
+		match.matching_ids = NULL;
 	}
 
 	// If we didn't find an IP address match above, try with MAC address matches
@@ -394,8 +439,10 @@ static bool get_client_groupids(clientsData* client)
 	//   1.1. Look up IP address in network_addresses table
 	//   1.2. Get MAC address from this network_id
 	// 2. If found -> Get groups by looking up MAC address in client table
+	// The network table lookup is skipped when there are no hardware
+	// addresses in the client table and we already know the MAC address
 	char *hwaddr = NULL;
-	if(chosen_match_id < 0)
+	if(chosen_match_id < 0 && (classifier_has_hwaddrs() || client->hwlen != 6))
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for MAC address of %s...", ip);
@@ -431,19 +478,19 @@ static bool get_client_groupids(clientsData* client)
 				client->hwlen = sizeof(data);
 			}
 		}
+	}
 
-		// MAC address fallback: Try to synthesize MAC address from internal buffer
-		if(hwaddr == NULL && client->hwlen == 6)
-		{
-			const size_t strlen = sizeof("AA:BB:CC:DD:EE:FF");
-			hwaddr = calloc(18, strlen);
-			snprintf(hwaddr, strlen, "%02X:%02X:%02X:%02X:%02X:%02X",
-			         client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
-			         client->hwaddr[3], client->hwaddr[4], client->hwaddr[5]);
+	// MAC address fallback: Try to synthesize MAC address from internal buffer
+	if(chosen_match_id < 0 && hwaddr == NULL && client->hwlen == 6)
+	{
+		const size_t strlen = sizeof("AA:BB:CC:DD:EE:FF");
+		hwaddr = calloc(18, strlen);
+		snprintf(hwaddr, strlen, "%02X:%02X:%02X:%02X:%02X:%02X",
+		         client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
+		         client->hwaddr[3], client->hwaddr[4], client->hwaddr[5]);
 
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Obtained %s from internal ARP cache", hwaddr);
-		}
+		if(config.debug & DEBUG_CLIENTS)
+			logg("--> Obtained %s from internal ARP cache", hwaddr);
 	}
 
 	// Check if we received a valid MAC address
@@ -454,59 +501,16 @@ static bool get_client_groupids(clientsData* client)
 			logg("--> Querying client table for %s", hwaddr);
 
 		// Check if client is configured through the client table
-		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
+		// The comparison is done case-insensitive
+		chosen_match_id = classifier_match_hwaddr(hwaddr);
 
-		// Bind hwaddr to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hwaddr, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hwaddr: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for %s in the client table (group ID %d)", hwaddr, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
+		if(config.debug & DEBUG_CLIENTS)
 		{
-			if(config.debug & DEBUG_CLIENTS)
+			if(chosen_match_id < 0)
 				logg("--> There is no record for %s in the client table", hwaddr);
+			else
+				logg("--> Found record for %s in the client table (group ID %d)", hwaddr, chosen_match_id);
 		}
-		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// If we did neither find an IP nor a MAC address match above, we try to look
@@ -514,7 +518,7 @@ static bool get_client_groupids(clientsData* client)
 	// 1. Look up host name address of this client
 	// 2. If found -> Get groups by looking up host name in client table
 	char *hostname = NULL;
-	if(chosen_match_id < 0)
+	if(chosen_match_id < 0 && classifier_has_hostnames())
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for host name of %s...", ip);
@@ -534,70 +538,23 @@ static bool get_client_groupids(clientsData* client)
 		}
 	}
 
-	// Check if we received a valid MAC address
-	// This ensures we skip mock hardware addresses such as "ip-127.0.0.1"
+	// Check if we received a valid host name
 	if(hostname != NULL)
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("--> Querying client table for %s", hostname);
 
 		// Check if client is configured through the client table
-		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
+		// The comparison is done case-insensitive
+		chosen_match_id = classifier_match_hostname(hostname);
 
-		// Bind hostname to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hostname, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hostname: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for %s in the client table (group ID %d)", hostname, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
+		if(config.debug & DEBUG_CLIENTS)
 		{
-			if(config.debug & DEBUG_CLIENTS)
+			if(chosen_match_id < 0)
 				logg("--> There is no record for %s in the client table", hostname);
+			else
+				logg("--> Found record for %s in the client table (group ID %d)", hostname, chosen_match_id);
 		}
-		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// If we did neither find an IP nor a MAC address and also no host name
@@ -606,7 +563,7 @@ static bool get_client_groupids(clientsData* client)
 	//    when creating the client from history data!)
 	// 2. If found -> Get groups by looking up interface in client table
 	char *interface = NULL;
-	if(chosen_match_id < 0)
+	if(chosen_match_id < 0 && classifier_has_interfaces())
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for interface of %s...", ip);
@@ -633,66 +590,16 @@ static bool get_client_groupids(clientsData* client)
 			logg("Querying client table for interface "INTERFACE_SEP"%s", interface);
 
 		// Check if client is configured through the client table using its interface
-		// This will return nothing if the client is unknown/unconfigured
-		// We use the SQLite concatenate operator || to prepace the queried interface by ":"
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = '"INTERFACE_SEP"' || ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
+		// The comparison is done case-insensitive
+		chosen_match_id = classifier_match_interface(interface);
 
-		// Bind interface to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, interface, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind interface: %s",
-				ip, interface, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for interface "INTERFACE_SEP"%s in the client table (group ID %d)", interface, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
+		if(config.debug & DEBUG_CLIENTS)
 		{
-			if(config.debug & DEBUG_CLIENTS)
+			if(chosen_match_id < 0)
 				logg("--> There is no record for interface "INTERFACE_SEP"%s in the client table", interface);
+			else
+				logg("--> Found record for interface "INTERFACE_SEP"%s in the client table (group ID %d)", interface, chosen_match_id);
 		}
-		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, interface, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// We use the default group and return early here
@@ -706,99 +613,27 @@ static bool get_client_groupids(clientsData* client)
 
 		client->groupspos = addstr("0");
 		client->flags.found_group = true;
-
-		if(hwaddr != NULL)
-		{
-			free(hwaddr);
-			hwaddr = NULL;
-		}
-
-		if(hostname != NULL)
-		{
-			free(hostname);
-			hostname = NULL;
-		}
-
-		if(interface != NULL)
-		{
-			free(interface);
-			interface = NULL;
-		}
-
-		return true;
-	}
-
-	// Build query string to get possible group associations for this particular client
-	// The SQL GROUP_CONCAT() function returns a string which is the concatenation of all
-	// non-NULL values of group_id separated by ','. The order of the concatenated elements
-	// is arbitrary, however, is of no relevance for your use case.
-	// We check using a possibly defined subnet and use the first result
-	querystr = "SELECT GROUP_CONCAT(group_id) FROM client_by_group "
-	           "WHERE client_id = ?;";
-
-	if(config.debug & DEBUG_CLIENTS)
-		logg("Querying gravity database for client %s (getting groups)", ip);
-
-	// Prepare query
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error prepare: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Bind hwaddr to prepared statement
-	if((rc = sqlite3_bind_int(table_stmt, 1, chosen_match_id)) != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d): Failed to bind chosen_match_id: %s",
-			ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_reset(table_stmt);
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Perform query
-	rc = sqlite3_step(table_stmt);
-	if(rc == SQLITE_ROW)
-	{
-		// There is a record for this client in the database
-		const char* result = (const char*)sqlite3_column_text(table_stmt, 0);
-		if(result != NULL)
-		{
-			client->groupspos = addstr(result);
-			client->flags.found_group = true;
-		}
-	}
-	else if(rc == SQLITE_DONE)
-	{
-		// Found no record for this client in the database
-		// -> No associated groups
-		client->groupspos = addstr("");
-		client->flags.found_group = true;
 	}
 	else
 	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error step: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		return false;
-	}
-	// Finalize statement
-	gravityDB_finalizeTable();
+		// Get possible group associations for this particular client. A
+		// client without any associated groups gets an empty list
+		const char *groups = classifier_get_groups(chosen_match_id);
+		client->groupspos = addstr(groups != NULL ? groups : "");
+		client->flags.found_group = true;
 
-	if(config.debug & DEBUG_CLIENTS)
-	{
-		if(interface != NULL)
-		{
-			logg("Gravity database: Client %s found (identified by interface %s). Using groups (%s)\n",
-			     show_client_string(hwaddr, hostname, ip), interface, getstr(client->groupspos));
-		}
-		else
+		if(config.debug & DEBUG_CLIENTS)
 		{
-			logg("Gravity database: Client %s found. Using groups (%s)\n",
-			     show_client_string(hwaddr, hostname, ip), getstr(client->groupspos));
+			if(interface != NULL)
+			{
+				logg("Gravity database: Client %s found (identified by interface %s). Using groups (%s)\n",
+				     show_client_string(hwaddr, hostname, ip), interface, getstr(client->groupspos));
+			}
+			else
+			{
+				logg("Gravity database: Client %s found. Using groups (%s)\n",
+				     show_client_string(hwaddr, hostname, ip), getstr(client->groupspos));
+			}
 		}
 	}
 
@@ -837,23 +672,25 @@ char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
 	if(config.debug & DEBUG_DATABASE)
 		logg("Querying group names for IDs (%s)", group_ids);
 
-	// Prepare query
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	// Prepare query. We do not use table_stmt here as this is called while
+	// the database thread may be reading a table from a staged connection
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
 	if(rc != SQLITE_OK){
 		logg("get_client_groupids(%s) - SQL error prepare: %s",
 		     querystr, sqlite3_errstr(rc));
-		sqlite3_finalize(table_stmt);
+		sqlite3_finalize(stmt);
 		free(querystr);
 		return strdup("N/A");
 	}
 
 	// Perform query
 	char *result = NULL;
-	rc = sqlite3_step(table_stmt);
+	rc = sqlite3_step(stmt);
 	if(rc == SQLITE_ROW)
 	{
 		// There is a record for this client in the database
-		result = strdup((const char*)sqlite3_column_text(table_stmt, 0));
+		result = strdup((const char*)sqlite3_column_text(stmt, 0));
 		if(result == NULL)
 			result = strdup("N/A");
 	}
@@ -867,16 +704,172 @@ char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
 	{
 		logg("group_names(%s) - SQL error step: %s",
 		     querystr, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
+		sqlite3_finalize(stmt);
 		free(querystr);
 		return strdup("N/A");
 	}
 	// Finalize statement
-	gravityDB_finalizeTable();
+	sqlite3_finalize(stmt);
 	free(querystr);
 	return result;
 }
 
+// Comparison function for qsort() sorting group IDs
+static int __attribute__ ((pure)) cmp_groupid(const void *a, const void *b)
+{
+	const int ia = *(const int*)a, ib = *(const int*)b;
+	return (ia > ib) - (ia < ib);
+}
+
+// Get canonical form of a comma-separated list of group IDs (sorted, without
+// duplicates). The returned string has to be free'd by the caller
+static char *canonical_groups(const char *groups)
+{
+	// Parse group IDs
+	unsigned int num = 1;
+	for(const char *p = groups; *p != '\0'; p++)
+		if(*p == ',')
+			num++;
+	int *ids = calloc(num, sizeof(int));
+	if(ids == NULL)
+		return NULL;
+
+	unsigned int n = 0;
+	for(const char *p = groups; *p != '\0' && n < num; )
+	{
+		char *end = NULL;
+		const long id = strtol(p, &end, 10);
+		if(end == p)
+		{
+			// Skip anything that is not a number
+			p++;
+			continue;
+		}
+		ids[n++] = (int)id;
+		p = end;
+	}
+	qsort(ids, n, sizeof(int), cmp_groupid);
+
+	// Each ID takes at most 11 characters plus the separator
+	char *result = calloc(12u*n + 1u, sizeof(char));
+	if(result == NULL)
+	{
+		free(ids);
+		return NULL;
+	}
+
+	char *out = result;
+	for(unsigned int i = 0; i < n; i++)
+	{
+		// Skip duplicates
+		if(i > 0 && ids[i] == ids[i-1])
+			continue;
+		out += sprintf(out, "%s%d", out == result ? "" : ",", ids[i]);
+	}
+	free(ids);
+
+	return result;
+}
+
+// Prepare a list statement for one group set
+static sqlite3_stmt *prepare_groupset_statement(sqlite3 *db, const char *table, const char *column, const char *groups)
+{
+	char *querystr = get_client_querystr(table, column, groups);
+	if(querystr == NULL)
+		return NULL;
+
+	sqlite3_stmt* stmt = NULL;
+	int rc = sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+	free(querystr);
+	if( rc != SQLITE_OK )
+	{
+		logg("gravityDB_open(\"SELECT(... %s ...)\") - SQL error prepare: %s", table, sqlite3_errstr(rc));
+		return NULL;
+	}
+
+	return stmt;
+}
+
+static void finalize_groupset(groupStatements *set)
+{
+	if(config.debug & DEBUG_DATABASE)
+		logg("Finalizing gravity statements for group set (%s)", set->groups);
+
+	sqlite3_finalize(set->whitelist);
+	sqlite3_finalize(set->blacklist);
+	sqlite3_finalize(set->gravity);
+	if(set->groups != NULL)
+		free(set->groups);
+	memset(set, 0, sizeof(*set));
+}
+
+// Get index of the statements for this group set, they are prepared if there
+// is no other client using the same group set. Returns -1 on error
+static int get_groupset(const char *groups)
+{
+	int free_slot = -1;
+	for(unsigned int i = 0; i < num_groupsets; i++)
+	{
+		if(groupsets[i].groups == NULL)
+		{
+			if(free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+		if(strcmp(groupsets[i].groups, groups) == 0)
+			return i;
+	}
+
+	// Add new group set
+	if(free_slot < 0)
+	{
+		groupStatements *new_sets = realloc(groupsets, (num_groupsets + 1)*sizeof(groupStatements));
+		if(new_sets == NULL)
+			return -1;
+		groupsets = new_sets;
+		free_slot = num_groupsets++;
+		memset(&groupsets[free_slot], 0, sizeof(groupStatements));
+	}
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("Preparing gravity statements for group set (%s)", groups);
+
+	groupStatements *set = &groupsets[free_slot];
+	set->groups = strdup(groups);
+	set->whitelist = prepare_groupset_statement(gravity_db, "vw_whitelist", "id", groups);
+	set->gravity = prepare_groupset_statement(gravity_db, "vw_gravity", "domain", groups);
+	set->blacklist = prepare_groupset_statement(gravity_db, "vw_blacklist", "id", groups);
+	if(set->groups == NULL || set->whitelist == NULL || set->gravity == NULL || set->blacklist == NULL)
+	{
+		finalize_groupset(set);
+		return -1;
+	}
+
+	return free_slot;
+}
+
+// Get statements used for this client, NULL if not yet prepared
+static groupStatements * __attribute__ ((pure)) get_client_groupset(const clientsData *client)
+{
+	if(client->id >= client_groupset_size ||
+	   client_groupset[client->id] < 0)
+		return NULL;
+
+	return &groupsets[client_groupset[client->id]];
+}
+
+// Release the group set used by this client
+static void release_client_groupset(const clientsData *client)
+{
+	groupStatements *set = get_client_groupset(client);
+	if(set == NULL)
+		return;
+
+	if(--set->refs == 0)
+		finalize_groupset(set);
+	client_groupset[client->id] = -1;
+}
+
 // Prepare statements for scanning white- and blacklist as well as gravit for one client
 bool gravityDB_prepare_client_statements(clientsData *client)
 {
@@ -890,80 +883,57 @@ bool gravityDB_prepare_client_statements(clientsData *client)
 		logg("Initializing gravity statements for %s", clientip);
 
 	// Get associated groups for this client (if defined)
-	char *querystr = NULL;
 	if(!client->flags.found_group && !get_client_groupids(client))
 		return false;
 
-	// Prepare whitelist statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_whitelist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_whitelist", "id", getstr(client->groupspos));
-	sqlite3_stmt* stmt = NULL;
-	int rc = sqlite3_prepare_v3(gravity_db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	// Make room for this client in the mapping
+	if((unsigned int)client->id >= client_groupset_size)
 	{
-		logg("gravityDB_open(\"SELECT(... vw_whitelist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		const unsigned int size = client->id + 64u;
+		int *new_map = realloc(client_groupset, size*sizeof(int));
+		if(new_map == NULL)
+			return false;
+		for(unsigned int i = client_groupset_size; i < size; i++)
+			new_map[i] = -1;
+		client_groupset = new_map;
+		client_groupset_size = size;
 	}
-	whitelist_stmt->set(whitelist_stmt, client->id, stmt);
-	free(querystr);
 
-	// Prepare gravity statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_gravity statement for client %s", clientip);
-	querystr = get_client_querystr("vw_gravity", "domain", getstr(client->groupspos));
-	rc = sqlite3_prepare_v3(gravity_db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	// Get (possibly shared) statements for this group set
+	char *groups = canonical_groups(getstr(client->groupspos));
+	if(groups == NULL)
+		return false;
+	const int set = get_groupset(groups);
+	free(groups);
+	if(set < 0)
 	{
-		logg("gravityDB_open(\"SELECT(... vw_gravity ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
 		gravityDB_close();
 		return false;
 	}
-	gravity_stmt->set(gravity_stmt, client->id, stmt);
-	free(querystr);
 
-	// Prepare blacklist statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_blacklist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_blacklist", "id", getstr(client->groupspos));
-	rc = sqlite3_prepare_v3(gravity_db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	// Switch to the new group set (if it changed at all)
+	if(client_groupset[client->id] != set)
 	{
-		logg("gravityDB_open(\"SELECT(... vw_blacklist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		groupsets[set].refs++;
+		release_client_groupset(client);
+		client_groupset[client->id] = set;
 	}
-	blacklist_stmt->set(blacklist_stmt, client->id, stmt);
-	free(querystr);
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("Client %s uses group set (%s) with %u client%s", clientip, groupsets[set].groups,
+		     groupsets[set].refs, groupsets[set].refs == 1 ? "" : "s");
 
 	return true;
 }
 
-// Finalize non-NULL prepared statements and set them to NULL for a given client
+// Release prepared statements for a given client, they are finalized if no
+// other client uses the same group set
 static inline void gravityDB_finalize_client_statements(clientsData *client)
 {
 	if(config.debug & DEBUG_DATABASE)
 		logg("Finalizing gravity statements for %s", getstr(client->ippos));
 
-	if(whitelist_stmt != NULL &&
-	   whitelist_stmt->get(whitelist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(whitelist_stmt->get(whitelist_stmt, client->id));
-		whitelist_stmt->set(whitelist_stmt, client->id, NULL);
-	}
-	if(blacklist_stmt != NULL &&
-	   blacklist_stmt->get(blacklist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(blacklist_stmt->get(blacklist_stmt, client->id));
-		blacklist_stmt->set(blacklist_stmt, client->id, NULL);
-	}
-	if(gravity_stmt != NULL &&
-	   gravity_stmt->get(gravity_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(gravity_stmt->get(gravity_stmt, client->id));
-		gravity_stmt->set(gravity_stmt, client->id, NULL);
-	}
+	release_client_groupset(client);
 
 	// Unset group found property to trigger a check next time the
 	// client sends a query
@@ -980,34 +950,190 @@ void gravityDB_close(void)
 	if(!gravityDB_opened)
 		return;
 
-	// Finalize prepared list statements for all clients
+	// Unset group found property of all clients to trigger a check next
+	// time they send a query
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		clientsData *client = getClient(clientID, true);
 		if(client != NULL)
-			gravityDB_finalize_client_statements(client);
+			client->flags.found_group = false;
 	}
 
-	// Free allocated memory for vectors of prepared client statements
-	free_sqlite3_stmt_vec(&whitelist_stmt);
-	free_sqlite3_stmt_vec(&blacklist_stmt);
-	free_sqlite3_stmt_vec(&gravity_stmt);
+	// Finalize prepared list statements of all group sets
+	for(unsigned int i = 0; i < num_groupsets; i++)
+		if(groupsets[i].groups != NULL)
+			finalize_groupset(&groupsets[i]);
+
+	if(groupsets != NULL)
+		free(groupsets);
+	groupsets = NULL;
+	num_groupsets = 0;
+
+	if(client_groupset != NULL)
+		free(client_groupset);
+	client_groupset = NULL;
+	client_groupset_size = 0;
 
 	// Finalize audit list statement
 	sqlite3_finalize(auditlist_stmt);
 	auditlist_stmt = NULL;
 
+	// Free compiled client table
+	classifier_free();
+
 	// Close table
 	sqlite3_close(gravity_db);
 	gravity_db = NULL;
 	gravityDB_opened = false;
 }
 
+// Free everything prepared for a reload which is not going to happen
+static void gravityDB_discard_staged(void)
+{
+	for(unsigned int i = 0; i < num_staged_groupsets; i++)
+		if(staged_groupsets[i].groups != NULL)
+			finalize_groupset(&staged_groupsets[i]);
+
+	if(staged_groupsets != NULL)
+		free(staged_groupsets);
+	staged_groupsets = NULL;
+	num_staged_groupsets = 0;
+
+	classifier_discard_staged();
+
+	sqlite3_close(staged_db);
+	staged_db = NULL;
+}
+
+// Open a second connection to the (possibly replaced) gravity database and
+// prepare the list statements of all group sets currently in use as well as
+// the client classifier on it. This is done by the database thread without holding the SHM lock, queries are
+// still answered using the active connection in the meantime. Until the staged
+// connection is swapped in or discarded, gravityDB_getTable() and
+// gravityDB_count() read from it
+bool gravityDB_stage(void)
+{
+	gravityDB_discard_staged();
+
+	if((staged_db = gravityDB_connect()) == NULL)
+		return false;
+	staged_abp_format = gravity_check_ABP_format(staged_db);
+
+	// Get group sets in use right now
+	lock_shm();
+	if(num_groupsets > 0)
+		staged_groupsets = calloc(num_groupsets, sizeof(groupStatements));
+	if(staged_groupsets != NULL)
+	{
+		for(unsigned int i = 0; i < num_groupsets; i++)
+			if(groupsets[i].groups != NULL && groupsets[i].refs > 0)
+				staged_groupsets[num_staged_groupsets++].groups = strdup(groupsets[i].groups);
+	}
+	unlock_shm();
+
+	// Prepare their statements on the new connection. Group sets failing
+	// here are dropped, they will be prepared again on first use
+	for(unsigned int i = 0; i < num_staged_groupsets; i++)
+	{
+		groupStatements *set = &staged_groupsets[i];
+		if(set->groups == NULL)
+			continue;
+
+		if(config.debug & DEBUG_DATABASE)
+			logg("Staging gravity statements for group set (%s)", set->groups);
+
+		set->whitelist = prepare_groupset_statement(staged_db, "vw_whitelist", "id", set->groups);
+		set->gravity = prepare_groupset_statement(staged_db, "vw_gravity", "domain", set->groups);
+		set->blacklist = prepare_groupset_statement(staged_db, "vw_blacklist", "id", set->groups);
+		if(set->whitelist == NULL || set->gravity == NULL || set->blacklist == NULL)
+			finalize_groupset(set);
+	}
+
+	// Compile the client table of the new database. If this fails, the
+	// client table is compiled again after swapping in the connection
+	classifier_stage(staged_db);
+
+	// Find out what changed compared to the active database
+	gravity_diff_stage(staged_db);
+
+	return true;
+}
+
+// Replace the active gravity database connection by the staged one. Clients
+// determine their groups again on their next query and use the statements
+// prepared by gravityDB_stage() if their group set did not change (staged
+// group sets nobody uses any longer are finalized together with the
+// connection). Forks replace their own connection once they notice the new
+// generation. Has to be called with the SHM lock held
+bool gravityDB_swap(void)
+{
+	if(staged_db == NULL)
+		return false;
+
+	// Retire the active connection
+	gravityDB_close();
+
+	gravity_db = staged_db;
+	groupsets = staged_groupsets;
+	num_groupsets = num_staged_groupsets;
+	staged_db = NULL;
+	staged_groupsets = NULL;
+	num_staged_groupsets = 0;
+	gravityDB_opened = true;
+
+	gravity_generation = ++counters->gravity_generation;
+	if(config.debug & DEBUG_DATABASE)
+		logg("Swapped in gravity database generation %u", gravity_generation);
+
+	if(!gravityDB_init_connection())
+		return false;
+
+	// Take over what gravityDB_stage() found out about the new database
+	gravity_abp_format = staged_abp_format;
+	if(!classifier_swap())
+		classifier_compile(gravity_db);
+
+	return true;
+}
+
+// Check if there is a staged gravity database connection. It is gone if it
+// has been discarded after an error (see gravityDB_table_error())
+bool gravityDB_staged(void)
+{
+	return staged_db != NULL;
+}
+
+// Get the connection whole tables are read from
+static sqlite3 *gravityDB_table_connection(void)
+{
+	if(staged_db != NULL)
+		return staged_db;
+
+	if(!gravityDB_current() && !gravityDB_open())
+		return NULL;
+
+	return gravity_db;
+}
+
+// Errors on the staged connection are handled by discarding it, the active
+// connection is unaffected by them
+static void gravityDB_table_error(void)
+{
+	if(staged_db != NULL)
+	{
+		logg("Discarding new gravity database connection");
+		gravityDB_discard_staged();
+	}
+	else
+		gravityDB_close();
+}
+
 // Prepare a SQLite3 statement which can be used by gravityDB_getDomain() to get
 // blocking domains from a table which is specified when calling this function
 bool gravityDB_getTable(const unsigned char list)
 {
-	if(!gravityDB_opened && !gravityDB_open())
+	sqlite3 *db = gravityDB_table_connection();
+	if(db == NULL)
 	{
 		logg("gravityDB_getTable(%u): Gravity database not available", list);
 		return false;
@@ -1036,11 +1162,11 @@ bool gravityDB_getTable(const unsigned char list)
 		querystr = "SELECT domain, id FROM vw_regex_whitelist GROUP BY id";
 
 	// Prepare SQLite3 statement
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &table_stmt, NULL);
 	if(rc != SQLITE_OK)
 	{
 		logg("readGravity(%s) - SQL error prepare: %s", querystr, sqlite3_errstr(rc));
-		gravityDB_close();
+		gravityDB_table_error();
 		return false;
 	}
 
@@ -1090,7 +1216,7 @@ inline const char* gravityDB_getDomain(int *rowid)
 // Finalize statement of a gravity database transaction
 void gravityDB_finalizeTable(void)
 {
-	if(!gravityDB_opened)
+	if(!gravityDB_opened && staged_db == NULL)
 		return;
 
 	// Finalize statement
@@ -1102,7 +1228,8 @@ void gravityDB_finalizeTable(void)
 // the constant DB_FAILED and log to FTL.log if we encounter any error
 int gravityDB_count(const enum gravity_tables list)
 {
-	if(!gravityDB_opened && !gravityDB_open())
+	sqlite3 *db = gravityDB_table_connection();
+	if(db == NULL)
 	{
 		logg("gravityDB_count(%d): Gravity database not available", list);
 		return DB_FAILED;
@@ -1132,7 +1259,7 @@ int gravityDB_count(const enum gravity_tables list)
 			break;
 		case UNKNOWN_TABLE:
 			logg("Error: List type %u unknown!", list);
-			gravityDB_close();
+			gravityDB_table_error();
 			return DB_FAILED;
 	}
 
@@ -1141,11 +1268,11 @@ int gravityDB_count(const enum gravity_tables list)
 		     tablename[list], querystr);
 
 	// Prepare query
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &table_stmt, NULL);
 	if(rc != SQLITE_OK){
 		logg("gravityDB_count(%s) - SQL error prepare %s", querystr, sqlite3_errstr(rc));
 		gravityDB_finalizeTable();
-		gravityDB_close();
+		gravityDB_table_error();
 		return DB_FAILED;
 	}
 
@@ -1158,7 +1285,7 @@ int gravityDB_count(const enum gravity_tables list)
 			logg("Count of gravity domains not available. Please run pihole -g");
 		}
 		gravityDB_finalizeTable();
-		gravityDB_close();
+		gravityDB_table_error();
 		return DB_FAILED;
 	}
 
@@ -1277,26 +1404,27 @@ enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clients
 {
 	// If list statement is not ready and cannot be initialized (e.g. no
 	// access to the database), we return false to prevent an FTL crash
-	if(whitelist_stmt == NULL)
+	if(!gravityDB_current())
 		return LIST_NOT_AVAILABLE;
 
 	// Check if this client needs a rechecking of group membership
 	gravityDB_client_check_again(client);
 
-	// Get whitelist statement from vector of prepared statements if available
-	sqlite3_stmt *stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	// Get statements shared by all clients with the same group set
+	groupStatements *set = get_client_groupset(client);
 
 	// If client statement is not ready and cannot be initialized (e.g. no access to
 	// the database), we return false (not in whitelist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+	if(set == NULL && !gravityDB_prepare_client_statements(client))
 	{
 		logg("ERROR: Gravity database not available");
 		return LIST_NOT_AVAILABLE;
 	}
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	// Update statements if they have just been initialized
+	if(set == NULL)
+		set = get_client_groupset(client);
+	sqlite3_stmt *stmt = set->whitelist;
 
 	// We have to check both the exact whitelist (using a prepared database statement)
 	// as well the compiled regex whitelist filters to check if the current domain is
@@ -1304,31 +1432,10 @@ enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clients
 	return domain_in_list(domain, stmt, "whitelist", &dns_cache->domainlist_id);
 }
 
-enum db_result in_gravity(const char *domain, clientsData *client)
+// Check if domain is in gravity, either exactly or (if enabled) as ABP-style
+// entry matching the domain or any of its parent domains
+static enum db_result domain_in_gravity(const char *domain, sqlite3_stmt *stmt, const bool abp_format)
 {
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(gravity_stmt == NULL)
-		return LIST_NOT_AVAILABLE;
-
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = gravity_stmt->get(gravity_stmt, client->id);
-
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in gravity list) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
-	{
-		logg("ERROR: Gravity database not available");
-		return LIST_NOT_AVAILABLE;
-	}
-
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = gravity_stmt->get(gravity_stmt, client->id);
-
 	// Check if domain is exactly in gravity list
 	const enum db_result exact_match = domain_in_list(domain, stmt, "gravity", NULL);
 	if(config.debug & DEBUG_QUERIES)
@@ -1341,15 +1448,28 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 	// Return early if we are not supposed to check for ABP-style regex
 	// matches. This needs to be enabled in the config file as it is
 	// computationally expensive and not needed in most cases (HOSTS lists).
-	if(!gravity_abp_format)
+	if(!abp_format)
 		return NOT_FOUND;
 
-	// Make a copy of the domain we will slowly truncate
-	// while extracting the individual components below
-	char *domainBuf = strdup(domain);
+	// Make a copy of the domain we will slowly truncate while extracting
+	// the individual components below and a buffer to hold the constructed
+	// (sub)domain in ABP format. Both live on the stack as this is done for
+	// every query, only exceptionally long domains need heap memory
+	char domainStack[ABP_STACK_LEN], abpStack[ABP_STACK_LEN + 3];
+	const size_t domainlen = strlen(domain);
+	const bool onStack = domainlen < ABP_STACK_LEN;
+	char *domainBuf = onStack ? domainStack : calloc(domainlen + 1, sizeof(char));
+	char *abpDomain = onStack ? abpStack : calloc(domainlen + 4, sizeof(char));
+	if(domainBuf == NULL || abpDomain == NULL)
+	{
+		if(!onStack && domainBuf != NULL)
+			free(domainBuf);
+		if(!onStack && abpDomain != NULL)
+			free(abpDomain);
+		return NOT_FOUND;
+	}
+	memcpy(domainBuf, domain, domainlen + 1);
 
-	// Buffer to hold the constructed (sub)domain in ABP format
-	char *abpDomain = calloc(strlen(domain) + 4, sizeof(char));
 	// Prime abp matcher with minimal content
 	strcpy(abpDomain, "||^");
 
@@ -1400,8 +1520,11 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 		// Return for anything else than "not found" (e.g. "found" or "list not available")
 		if(abp_match != NOT_FOUND)
 		{
-			free(domainBuf);
-			free(abpDomain);
+			if(!onStack)
+			{
+				free(domainBuf);
+				free(abpDomain);
+			}
 			return abp_match;
 		}
 		// Truncate the domain buffer to the left of the
@@ -1420,37 +1543,94 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 		abpDomain[2] = '.';
 	}
 
-	free(domainBuf);
-	free(abpDomain);
+	if(!onStack)
+	{
+		free(domainBuf);
+		free(abpDomain);
+	}
 
 	// Domain not found in gravity list
 	return NOT_FOUND;
 }
 
+
+enum db_result in_gravity(const char *domain, clientsData *client)
+{
+	// If list statement is not ready and cannot be initialized (e.g. no
+	// access to the database), we return false to prevent an FTL crash
+	if(!gravityDB_current())
+		return LIST_NOT_AVAILABLE;
+
+	// Check if this client needs a rechecking of group membership
+	gravityDB_client_check_again(client);
+
+	// Get statements shared by all clients with the same group set
+	groupStatements *set = get_client_groupset(client);
+
+	// If client statement is not ready and cannot be initialized (e.g. no access to
+	// the database), we return false (not in gravity list) to prevent an FTL crash
+	if(set == NULL && !gravityDB_prepare_client_statements(client))
+	{
+		logg("ERROR: Gravity database not available");
+		return LIST_NOT_AVAILABLE;
+	}
+
+	// Update statements if they have just been initialized
+	if(set == NULL)
+		set = get_client_groupset(client);
+
+	return domain_in_gravity(domain, set->gravity, gravity_abp_format);
+}
+
+// Check if domain is in gravity for a given group set using the staged
+// connection (see gravityDB_stage()). Only the group sets in use at the time of
+// staging are available
+enum db_result gravityDB_staged_in_gravity(const char *domain, const char *groups)
+{
+	char *canonical = canonical_groups(groups);
+	if(canonical == NULL)
+		return LIST_NOT_AVAILABLE;
+
+	enum db_result result = LIST_NOT_AVAILABLE;
+	for(unsigned int i = 0; i < num_staged_groupsets; i++)
+	{
+		const groupStatements *set = &staged_groupsets[i];
+		if(set->groups != NULL && strcmp(set->groups, canonical) == 0)
+		{
+			result = domain_in_gravity(domain, set->gravity, staged_abp_format);
+			break;
+		}
+	}
+	free(canonical);
+
+	return result;
+}
+
 enum db_result in_blacklist(const char *domain, DNSCacheData *dns_cache, clientsData *client)
 {
 	// If list statement is not ready and cannot be initialized (e.g. no
 	// access to the database), we return false to prevent an FTL crash
-	if(blacklist_stmt == NULL)
+	if(!gravityDB_current())
 		return LIST_NOT_AVAILABLE;
 
 	// Check if this client needs a rechecking of group membership
 	gravityDB_client_check_again(client);
 
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+	// Get statements shared by all clients with the same group set
+	groupStatements *set = get_client_groupset(client);
 
 	// If client statement is not ready and cannot be initialized (e.g. no access to
 	// the database), we return false (not in blacklist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+	if(set == NULL && !gravityDB_prepare_client_statements(client))
 	{
 		logg("ERROR: Gravity database not available");
 		return LIST_NOT_AVAILABLE;
 	}
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+	// Update statements if they have just been initialized
+	if(set == NULL)
+		set = get_client_groupset(client);
+	sqlite3_stmt *stmt = set->blacklist;
 
 	return domain_in_list(domain, stmt, "blacklist", &dns_cache->domainlist_id);
 }
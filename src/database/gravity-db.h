@@ -20,6 +20,9 @@ enum gravity_tables { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABL
 
 bool gravityDB_open(void);
 bool gravityDB_reopen(void);
+bool gravityDB_stage(void);
+bool gravityDB_swap(void);
+bool gravityDB_staged(void) __attribute__ ((pure));
 void gravityDB_forked(void);
 void gravityDB_reload_groups(clientsData* client);
 bool gravityDB_prepare_client_statements(clientsData* client);
@@ -32,6 +35,7 @@ int gravityDB_count(const enum gravity_tables list);
 void check_inaccessible_adlists(void);
 
 enum db_result in_gravity(const char *domain, clientsData *client);
+enum db_result gravityDB_staged_in_gravity(const char *domain, const char *groups);
 enum db_result in_blacklist(const char *domain, DNSCacheData *dns_cache, clientsData *client);
 enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clientsData *client);
 bool in_auditlist(const char *domain);
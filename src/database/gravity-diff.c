@@ -0,0 +1,566 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Gravity database generation diff routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "gravity-diff.h"
+// INT_MAX
+#include <limits.h>
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+// lock_shm(), getstr()
+#include "../shmem.h"
+// getDNSCache(), FTL_reset_per_client_domain_data()
+#include "../datastructure.h"
+// gravityDB_staged_in_gravity()
+#include "gravity-db.h"
+// regcomp(), regexec()
+#include "../regex_r.h"
+
+// When the gravity database is reloaded, we compare the staged generation with
+// the active one to invalidate only those cached blocking decisions which may
+// be affected by the changes:
+//  - Domains added to or removed from the exact black- and whitelists
+//    invalidate all cache entries of exactly these domains
+//  - Added or removed regex filters invalidate all cached domains they match
+//  - A new gravity run or changed adlists/groups lead to checking all cached
+//    decisions which depend on gravity against the staged database
+//  - Changes of the client table invalidate everything
+// The domain lists are compared row by row, gravity itself is far too large
+// for this and is only compared by a fingerprint of its metadata
+
+static const char *const gravity_key_queries[] = {
+	"SELECT value FROM info WHERE property = 'updated'",
+	"SELECT id,enabled FROM adlist ORDER BY id",
+	"SELECT adlist_id,group_id FROM adlist_by_group ORDER BY adlist_id,group_id",
+	"SELECT id,enabled FROM \"group\" ORDER BY id",
+};
+
+static const char *const clients_key_queries[] = {
+	"SELECT id,ip FROM client ORDER BY id",
+	"SELECT client_id,group_id FROM client_by_group ORDER BY client_id,group_id",
+};
+
+// Rows have the form "<list>\t<group ID>\t<ID>\t<domain>"
+static const char *rows_query =
+	"SELECT 'w',group_id,id,domain FROM vw_whitelist UNION ALL "
+	"SELECT 'b',group_id,id,domain FROM vw_blacklist UNION ALL "
+	"SELECT 'W',group_id,id,domain FROM vw_regex_whitelist UNION ALL "
+	"SELECT 'B',group_id,id,domain FROM vw_regex_blacklist";
+
+typedef struct {
+	bool valid;
+	uint64_t gravity_key;
+	uint64_t clients_key;
+	unsigned int num_rows;
+	char **rows;
+} gravitySnapshot;
+
+static gravitySnapshot current_snapshot = { 0 };
+static gravitySnapshot staged_snapshot = { 0 };
+
+// Changes between the active and the staged generation. The strings point into
+// the rows of the snapshots
+static struct {
+	bool full;
+	bool gravity;
+	unsigned int num_domains;
+	const char **domains;
+	unsigned int num_regex;
+	const char **regex;
+} diff = { 0 };
+
+// Cache entries to be invalidated when the staged generation is swapped in.
+// Entries added after the cache has been inspected are always invalidated, as
+// are entries which were still undecided at that time and have been decided
+// since (based on the old generation)
+static struct {
+	bool ready;
+	int cache_size;
+	unsigned int num;
+	int *ids;
+	unsigned int num_unknown;
+	int *unknown;
+} invalidate = { 0 };
+
+// Comparison function for qsort() sorting rows
+static int __attribute__ ((pure)) cmp_string(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Comparison function for qsort() and bsearch() on domains
+static int __attribute__ ((pure)) cmp_domain(const void *a, const void *b)
+{
+	return strcasecmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Fingerprint all rows returned by the given queries (FNV-1a)
+static bool hash_queries(sqlite3 *db, const char *const *queries, const unsigned int num, uint64_t *hash)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for(unsigned int i = 0; i < num; i++)
+	{
+		sqlite3_stmt *stmt = NULL;
+		int rc = sqlite3_prepare_v2(db, queries[i], -1, &stmt, NULL);
+		if(rc != SQLITE_OK)
+		{
+			logg("gravity_diff_stage(%s) - SQL error prepare: %s", queries[i], sqlite3_errstr(rc));
+			return false;
+		}
+
+		while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		{
+			for(int col = 0; col < sqlite3_column_count(stmt); col++)
+			{
+				const unsigned char *text = sqlite3_column_text(stmt, col);
+				for(; text != NULL && *text != '\0'; text++)
+				{
+					h ^= *text;
+					h *= 1099511628211ULL;
+				}
+				// Separate columns
+				h ^= 0xFF;
+				h *= 1099511628211ULL;
+			}
+		}
+		sqlite3_finalize(stmt);
+
+		if(rc != SQLITE_DONE)
+		{
+			logg("gravity_diff_stage(%s) - SQL error step: %s", queries[i], sqlite3_errstr(rc));
+			return false;
+		}
+	}
+
+	*hash = h;
+	return true;
+}
+
+// Read all domain list rows sorted
+static bool read_rows(sqlite3 *db, gravitySnapshot *snapshot)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, rows_query, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravity_diff_stage() - SQL error prepare: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	unsigned int size = 0;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(snapshot->num_rows >= size)
+		{
+			size = size > 0 ? 2*size : 256;
+			char **rows = realloc(snapshot->rows, size*sizeof(char*));
+			if(rows == NULL)
+				break;
+			snapshot->rows = rows;
+		}
+
+		const char *group = (const char*)sqlite3_column_text(stmt, 1);
+		const char *domain = (const char*)sqlite3_column_text(stmt, 3);
+		char *row = NULL;
+		if(asprintf(&row, "%s\t%s\t%d\t%s", sqlite3_column_text(stmt, 0),
+		            group != NULL ? group : "", sqlite3_column_int(stmt, 2),
+		            domain != NULL ? domain : "") < 0)
+			break;
+		snapshot->rows[snapshot->num_rows++] = row;
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("gravity_diff_stage() - Failed to read domain lists: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	if(snapshot->num_rows > 0)
+		qsort(snapshot->rows, snapshot->num_rows, sizeof(char*), cmp_string);
+
+	return true;
+}
+
+static void free_snapshot(gravitySnapshot *snapshot)
+{
+	for(unsigned int i = 0; i < snapshot->num_rows; i++)
+		free(snapshot->rows[i]);
+	if(snapshot->rows != NULL)
+		free(snapshot->rows);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+
+static void free_diff(void)
+{
+	if(diff.domains != NULL)
+		free(diff.domains);
+	if(diff.regex != NULL)
+		free(diff.regex);
+	memset(&diff, 0, sizeof(diff));
+
+	if(invalidate.ids != NULL)
+		free(invalidate.ids);
+	if(invalidate.unknown != NULL)
+		free(invalidate.unknown);
+	memset(&invalidate, 0, sizeof(invalidate));
+}
+
+static bool append_string(const char ***array, unsigned int *num, const char *string)
+{
+	// Grow in steps of 64 entries
+	if(*num % 64 == 0)
+	{
+		const char **new_array = realloc(*array, (*num + 64)*sizeof(char*));
+		if(new_array == NULL)
+			return false;
+		*array = new_array;
+	}
+	(*array)[(*num)++] = string;
+	return true;
+}
+
+// Remember the domain or regex of a row only present in one of the generations
+static void add_changed_row(const char *row)
+{
+	// Skip list type, group ID and ID
+	const char *value = row;
+	for(unsigned int tabs = 0; tabs < 3 && value != NULL; tabs++)
+		if((value = strchr(value, '\t')) != NULL)
+			value++;
+	if(value == NULL)
+		return;
+
+	bool okay;
+	if(row[0] == 'w' || row[0] == 'b')
+		okay = append_string(&diff.domains, &diff.num_domains, value);
+	else
+		okay = append_string(&diff.regex, &diff.num_regex, value);
+
+	// Fall back to invalidating everything if we cannot track the changes
+	if(!okay)
+		diff.full = true;
+}
+
+// Sort and remove duplicates
+static void unique_strings(const char **array, unsigned int *num,
+                           int (*cmp)(const void *, const void *))
+{
+	if(*num < 2)
+		return;
+
+	qsort(array, *num, sizeof(char*), cmp);
+	unsigned int n = 1;
+	for(unsigned int i = 1; i < *num; i++)
+		if(cmp(&array[i], &array[n-1]) != 0)
+			array[n++] = array[i];
+	*num = n;
+}
+
+// Read the staged gravity database and compare it with the active one. This is
+// done by the database thread without holding the SHM lock
+void gravity_diff_stage(sqlite3 *db)
+{
+	free_snapshot(&staged_snapshot);
+	free_diff();
+
+	staged_snapshot.valid =
+		hash_queries(db, gravity_key_queries, sizeof(gravity_key_queries)/sizeof(*gravity_key_queries), &staged_snapshot.gravity_key) &&
+		hash_queries(db, clients_key_queries, sizeof(clients_key_queries)/sizeof(*clients_key_queries), &staged_snapshot.clients_key) &&
+		read_rows(db, &staged_snapshot);
+
+	// Without a complete picture of both generations, everything may have
+	// changed. This is also the case for the first time the database is read
+	if(!staged_snapshot.valid || !current_snapshot.valid ||
+	   staged_snapshot.clients_key != current_snapshot.clients_key)
+	{
+		diff.full = true;
+		if(config.debug & DEBUG_DATABASE)
+			logg("Gravity diff: Invalidating all cached blocking decisions");
+		return;
+	}
+
+	diff.gravity = staged_snapshot.gravity_key != current_snapshot.gravity_key;
+
+	// Merge both sorted row lists, rows only present in one of them changed
+	unsigned int i = 0, j = 0;
+	while(i < current_snapshot.num_rows || j < staged_snapshot.num_rows)
+	{
+		int cmp;
+		if(i >= current_snapshot.num_rows)
+			cmp = 1;
+		else if(j >= staged_snapshot.num_rows)
+			cmp = -1;
+		else
+			cmp = strcmp(current_snapshot.rows[i], staged_snapshot.rows[j]);
+
+		if(cmp < 0)
+			add_changed_row(current_snapshot.rows[i++]);
+		else if(cmp > 0)
+			add_changed_row(staged_snapshot.rows[j++]);
+		else
+		{
+			i++;
+			j++;
+		}
+	}
+
+	unique_strings(diff.domains, &diff.num_domains, cmp_domain);
+	unique_strings(diff.regex, &diff.num_regex, cmp_string);
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("Gravity diff: %u changed domains, %u changed regex, gravity %s",
+		     diff.num_domains, diff.num_regex, diff.gravity ? "changed" : "unchanged");
+}
+
+// Compile a changed regex for sweeping through the cached domains. Regex with
+// FTL-specific options are matched without them, this only makes us invalidate
+// more entries than necessary. Inverted regex may match anything, they are
+// reported as failure
+static bool compile_sweep_regex(const char *regexin, regex_t *regex)
+{
+	char *pattern = strdup(regexin);
+	if(pattern == NULL)
+		return false;
+
+	char *options = strchr(pattern, ';');
+	if(options != NULL)
+	{
+		*options++ = '\0';
+		if(strcasestr(options, "invert") != NULL)
+		{
+			free(pattern);
+			return false;
+		}
+	}
+
+	const int errcode = regcomp(regex, pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	free(pattern);
+
+	return errcode == 0;
+}
+
+typedef struct {
+	int id;
+	enum domain_client_status status;
+	char *domain;
+	char *groups;
+} cachedDecision;
+
+// Check if a cached decision may be affected by the changes
+static bool decision_affected(const cachedDecision *entry, const regex_t *regex, const unsigned int num_regex)
+{
+	// Group membership of this client has not been determined yet
+	if(entry->groups == NULL)
+		return true;
+
+	// Queries to _esni.<domain> may be blocked because of <domain>
+	const char *domains[2] = { entry->domain, NULL };
+	if(strncasecmp(entry->domain, "_esni.", 6u) == 0)
+		domains[1] = entry->domain + 6u;
+
+	for(unsigned int d = 0; d < 2 && domains[d] != NULL; d++)
+	{
+		// Exact domain list changes
+		if(diff.num_domains > 0 &&
+		   bsearch(&domains[d], diff.domains, diff.num_domains, sizeof(char*), cmp_domain) != NULL)
+			return true;
+
+		// Regex changes
+		for(unsigned int i = 0; i < num_regex; i++)
+			if(regexec(&regex[i], domains[d], 0, NULL, 0) == REG_OK)
+				return true;
+	}
+
+	// Gravity only matters for decisions not made by the white- or blacklist
+	if(!diff.gravity ||
+	   (entry->status != NOT_BLOCKED &&
+	    entry->status != GRAVITY_BLOCKED &&
+	    entry->status != REGEX_BLOCKED))
+		return false;
+
+	bool in_gravity = false;
+	for(unsigned int d = 0; d < 2 && domains[d] != NULL; d++)
+	{
+		const enum db_result result = gravityDB_staged_in_gravity(domains[d], entry->groups);
+		if(result == LIST_NOT_AVAILABLE)
+			return true;
+		if(result == FOUND)
+			in_gravity = true;
+	}
+
+	return in_gravity != (entry->status == GRAVITY_BLOCKED);
+}
+
+// Find the cache entries affected by the changes found in gravity_diff_stage().
+// This is done by the database thread, the SHM lock is only held while copying
+// the cached decisions
+void gravity_diff_prepare_cache(void)
+{
+	if(invalidate.ids != NULL)
+		free(invalidate.ids);
+	if(invalidate.unknown != NULL)
+		free(invalidate.unknown);
+	memset(&invalidate, 0, sizeof(invalidate));
+
+	// Everything will be invalidated anyway
+	if(diff.full)
+		return;
+
+	// Nothing changed that could affect any blocking decision, this also
+	// applies to decisions made while the reload was being prepared
+	if(!diff.gravity && diff.num_domains == 0 && diff.num_regex == 0)
+	{
+		invalidate.ready = true;
+		invalidate.cache_size = INT_MAX;
+		return;
+	}
+
+	// Compile changed regex
+	regex_t *regex = NULL;
+	unsigned int num_regex = 0;
+	if(diff.num_regex > 0 && (regex = calloc(diff.num_regex, sizeof(regex_t))) == NULL)
+		return;
+	for(unsigned int i = 0; i < diff.num_regex; i++)
+	{
+		if(!compile_sweep_regex(diff.regex[i], &regex[num_regex]))
+		{
+			if(config.debug & DEBUG_DATABASE)
+				logg("Gravity diff: Cannot sweep cache for regex \"%s\"", diff.regex[i]);
+			goto end_of_prepare_cache;
+		}
+		num_regex++;
+	}
+
+	// Copy cached decisions
+	lock_shm();
+	const int cache_size = counters->dns_cache_size;
+	cachedDecision *entries = calloc(cache_size > 0 ? cache_size : 1, sizeof(cachedDecision));
+	invalidate.unknown = calloc(cache_size > 0 ? cache_size : 1, sizeof(int));
+	unsigned int num_entries = 0;
+	for(int cacheID = 0; entries != NULL && invalidate.unknown != NULL && cacheID < cache_size; cacheID++)
+	{
+		const DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+		if(dns_cache == NULL ||
+		   dns_cache->blocking_status == SPECIAL_DOMAIN)
+			continue;
+
+		// Remember undecided entries, they may be decided before the
+		// staged generation is swapped in
+		if(dns_cache->blocking_status == UNKNOWN_BLOCKED)
+		{
+			invalidate.unknown[invalidate.num_unknown++] = cacheID;
+			continue;
+		}
+
+		const domainsData *domain = getDomain(dns_cache->domainID, true);
+		const clientsData *client = getClient(dns_cache->clientID, true);
+		if(domain == NULL)
+			continue;
+
+		cachedDecision *entry = &entries[num_entries++];
+		entry->id = cacheID;
+		entry->status = dns_cache->blocking_status;
+		entry->domain = strdup(getstr(domain->domainpos));
+		if(client != NULL && client->flags.found_group)
+			entry->groups = strdup(getstr(client->groupspos));
+	}
+	unlock_shm();
+
+	if(entries == NULL || invalidate.unknown == NULL)
+	{
+		if(entries != NULL)
+			free(entries);
+		goto end_of_prepare_cache;
+	}
+
+	// Check them against the changes
+	invalidate.ids = calloc(num_entries > 0 ? num_entries : 1, sizeof(int));
+	for(unsigned int i = 0; i < num_entries; i++)
+	{
+		cachedDecision *entry = &entries[i];
+		if(invalidate.ids != NULL && entry->domain != NULL &&
+		   decision_affected(entry, regex, num_regex))
+			invalidate.ids[invalidate.num++] = entry->id;
+
+		if(entry->domain != NULL)
+			free(entry->domain);
+		if(entry->groups != NULL)
+			free(entry->groups);
+	}
+	free(entries);
+
+	invalidate.ready = invalidate.ids != NULL;
+	invalidate.cache_size = cache_size;
+
+end_of_prepare_cache:
+	for(unsigned int i = 0; i < num_regex; i++)
+		regfree(&regex[i]);
+	if(regex != NULL)
+		free(regex);
+}
+
+// Invalidate the cache entries found by gravity_diff_prepare_cache() and make
+// the staged generation the active one. Has to be called with the SHM lock held
+// after the staged gravity database connection has been swapped in
+void gravity_diff_apply_cache(void)
+{
+	if(diff.full || !invalidate.ready)
+	{
+		// Reset FTL's internal DNS cache storing whether a specific
+		// domain has already been validated for a specific user
+		FTL_reset_per_client_domain_data();
+	}
+	else
+	{
+		unsigned int num = 0;
+		for(unsigned int i = 0; i < invalidate.num; i++)
+		{
+			DNSCacheData *dns_cache = getDNSCache(invalidate.ids[i], true);
+			if(dns_cache != NULL)
+			{
+				dns_cache->blocking_status = UNKNOWN_BLOCKED;
+				num++;
+			}
+		}
+
+		// Decisions made while the reload was being prepared are based
+		// on the old generation
+		for(unsigned int i = 0; i < invalidate.num_unknown; i++)
+		{
+			DNSCacheData *dns_cache = getDNSCache(invalidate.unknown[i], true);
+			if(dns_cache != NULL && dns_cache->blocking_status != UNKNOWN_BLOCKED)
+			{
+				dns_cache->blocking_status = UNKNOWN_BLOCKED;
+				num++;
+			}
+		}
+		for(int cacheID = invalidate.cache_size; cacheID < counters->dns_cache_size; cacheID++)
+		{
+			DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+			if(dns_cache != NULL && dns_cache->blocking_status != UNKNOWN_BLOCKED)
+			{
+				dns_cache->blocking_status = UNKNOWN_BLOCKED;
+				num++;
+			}
+		}
+
+		if(config.debug & DEBUG_DATABASE)
+			logg("Invalidated %u of %i DNS cache entries", num, counters->dns_cache_size);
+	}
+
+	// The staged generation is now the active one
+	free_diff();
+	free_snapshot(&current_snapshot);
+	current_snapshot = staged_snapshot;
+	memset(&staged_snapshot, 0, sizeof(staged_snapshot));
+}
@@ -0,0 +1,19 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Gravity database generation diff prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef GRAVITY_DIFF_H
+#define GRAVITY_DIFF_H
+
+#include "sqlite3.h"
+
+void gravity_diff_stage(sqlite3 *db);
+void gravity_diff_prepare_cache(void);
+void gravity_diff_apply_cache(void);
+
+#endif //GRAVITY_DIFF_H
@@ -23,8 +23,6 @@
 #include "../signals.h"
 // struct config
 #include "../config.h"
-// get_rate_limit_turnaround()
-#include "../gc.h"
 
 static const char *message_types[MAX_MESSAGE] =
 	{ "REGEX", "SUBNET", "HOSTNAME", "DNSMASQ_CONFIG", "RATE_LIMIT", "DNSMASQ_WARN", "LOAD", "SHMEM", "DISK", "ADLIST" };
@@ -356,10 +354,8 @@ void logg_fatal_dnsmasq_message(const char *message)
 	cleanup(EXIT_FAILURE);
 }
 
-void logg_rate_limit_message(const char *clientIP, const unsigned int rate_limit_count)
+void logg_rate_limit_message(const char *clientIP, const time_t turnaround)
 {
-	const time_t turnaround = get_rate_limit_turnaround(rate_limit_count);
-
 	// Log to FTL.log
 	logg("Rate-limiting %s for at least %ld second%s",
 	     clientIP, turnaround, turnaround == 1 ? "" : "s");
@@ -195,585 +195,632 @@ bool create_network_addresses_with_names_table(sqlite3 *db)
 	return true;
 }
 
-// Try to find device by recent usage of this IP address
-static int find_device_by_recent_ip(sqlite3 *db, const char *ipaddr)
+// In-memory copy of the network and network_addresses tables. It is loaded
+// once per neighbor cache run and all lookups are served from here. Changes
+// are collected in the cache and only rows which actually differ from their
+// database state are written back at the end of the run.
+typedef struct {
+	int id;
+	bool changed;
+	char *hwaddr;
+	char *iface;
+	time_t firstSeen;
+	time_t lastQuery;
+	unsigned int numQueries;
+} netDBdevice;
+
+typedef struct {
+	int network_id;
+	bool changed;
+	char *ip;
+	char *name;
+	time_t lastSeen;
+	time_t nameUpdated;
+} netDBaddress;
+
+typedef struct {
+	sqlite3 *db;
+	time_t now;
+	struct {
+		// Sorted by id (ascending), new devices are always appended as
+		// their rowid is larger than any existing one
+		netDBdevice **by_id;
+		// Sorted by hwaddr (case-insensitive)
+		netDBdevice **by_hwaddr;
+		unsigned int count;
+		unsigned int size;
+	} devices;
+	struct {
+		// Sorted by ip
+		netDBaddress **by_ip;
+		unsigned int count;
+		unsigned int size;
+	} addresses;
+	struct {
+		sqlite3_stmt *insert_device;
+		sqlite3_stmt *unmock_device;
+		sqlite3_stmt *update_device;
+		sqlite3_stmt *upsert_address;
+	} stmt;
+} netDBcache;
+
+// Allocation step for the arrays in the network cache
+#define NETDB_ALLOC_STEP 64
+
+// Find the position of hwaddr in the sorted device array. Returns true if an
+// exact match was found, *pos is the insertion point otherwise
+static bool netDB_search_hwaddr(const netDBcache *cache, const char *hwaddr, unsigned int *pos)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return -1;
-
-	char *querystr = NULL;
-	int ret = asprintf(&querystr,
-	                   "SELECT network_id FROM network_addresses "
-	                   "WHERE ip = \'%s\' AND "
-	                   "lastSeen > (cast(strftime('%%s', 'now') as int)-86400) "
-	                   "ORDER BY lastSeen DESC LIMIT 1;", ipaddr);
-	if(querystr == NULL || ret < 0)
+	unsigned int lo = 0u, hi = cache->devices.count;
+	while(lo < hi)
 	{
-		logg("Memory allocation failed in find_device_by_recent_ip(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
+		const unsigned int mid = lo + (hi - lo) / 2;
+		const int cmp = strcasecmp(cache->devices.by_hwaddr[mid]->hwaddr, hwaddr);
+		if(cmp == 0)
+		{
+			*pos = mid;
+			return true;
+		}
+		else if(cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	*pos = lo;
+	return false;
+}
 
-	// Perform SQL query
-	int network_id = db_query_int(db, querystr);
-	free(querystr);
-	querystr = NULL;
-
-	if(network_id == DB_FAILED)
-	{
-		// SQLite error
-		return -1;
-	}
-	else if(network_id == DB_NODATA)
+// Find the position of ip in the sorted address array. Returns true if an
+// exact match was found, *pos is the insertion point otherwise
+static bool netDB_search_ip(const netDBcache *cache, const char *ip, unsigned int *pos)
+{
+	unsigned int lo = 0u, hi = cache->addresses.count;
+	while(lo < hi)
 	{
-		// No result found
-		return -1;
+		const unsigned int mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(cache->addresses.by_ip[mid]->ip, ip);
+		if(cmp == 0)
+		{
+			*pos = mid;
+			return true;
+		}
+		else if(cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	if(config.debug & DEBUG_ARP)
-		logg("APR: Identified device %s using most recently used IP address", ipaddr);
-
-	// Found network_id
-	return network_id;
+	*pos = lo;
+	return false;
 }
 
-// Try to find device by mock hardware address (generated from IP address)
-static int find_device_by_mock_hwaddr(sqlite3 *db, const char *ipaddr)
+static netDBdevice * __attribute__ ((pure)) netDB_find_device_by_id(const netDBcache *cache, const int id)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return DB_FAILED;
-
-	char *querystr = NULL;
-	int ret = asprintf(&querystr, "SELECT id FROM network WHERE hwaddr = \'ip-%s\';", ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_mock_hwaddr(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
+	unsigned int lo = 0u, hi = cache->devices.count;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2;
+		netDBdevice *device = cache->devices.by_id[mid];
+		if(device->id == id)
+			return device;
+		else if(device->id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	// Perform SQL query
-	int network_id = db_query_int(db, querystr);
-	free(querystr);
-
-	return network_id;
+	return NULL;
 }
 
 // Try to find device by hardware address
-static int find_device_by_hwaddr(sqlite3 *db, const char hwaddr[])
+static netDBdevice * __attribute__ ((pure)) netDB_find_device_by_hwaddr(const netDBcache *cache, const char *hwaddr)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return DB_FAILED;
-
-	char *querystr = NULL;
-	int ret = asprintf(&querystr, "SELECT id FROM network WHERE hwaddr = \'%s\' COLLATE NOCASE;", hwaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_hwaddr(\"%s\"): %i",
-		     hwaddr, ret);
-		return -1;
-	}
-
-	// Perform SQL query
-	int network_id = db_query_int(db, querystr);
-	free(querystr);
-
-	return network_id;
+	unsigned int pos = 0u;
+	if(netDB_search_hwaddr(cache, hwaddr, &pos))
+		return cache->devices.by_hwaddr[pos];
+	return NULL;
 }
 
-// Try to find device by RECENT mock hardware address (generated from IP address)
-static int find_recent_device_by_mock_hwaddr(sqlite3 *db, const char *ipaddr)
+static netDBaddress * __attribute__ ((pure)) netDB_find_address(const netDBcache *cache, const char *ip)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return DB_FAILED;
+	unsigned int pos = 0u;
+	if(netDB_search_ip(cache, ip, &pos))
+		return cache->addresses.by_ip[pos];
+	return NULL;
+}
 
-	char *querystr = NULL;
-	int ret = asprintf(&querystr,
-	                   "SELECT id FROM network WHERE "
-	                   "hwaddr = \'ip-%s\' AND "
-	                   "firstSeen > (cast(strftime('%%s', 'now') as int)-3600);",
-	                   ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_recent_mock_hwaddr(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
-	}
+// Try to find device by recent usage of this IP address
+static netDBdevice *netDB_find_device_by_recent_ip(const netDBcache *cache, const char *ipaddr)
+{
+	const netDBaddress *address = netDB_find_address(cache, ipaddr);
+	if(address == NULL || address->lastSeen <= cache->now - 86400)
+		return NULL;
 
-	// Perform SQL query
-	int network_id = db_query_int(db, querystr);
-	free(querystr);
+	netDBdevice *device = netDB_find_device_by_id(cache, address->network_id);
+	if(device != NULL && config.debug & DEBUG_ARP)
+		logg("APR: Identified device %s using most recently used IP address", ipaddr);
 
-	return network_id;
+	return device;
 }
 
-// Store hostname of device identified by dbID
-static int update_netDB_name(sqlite3 *db, const char *ip, const char *name)
+// Try to find device by mock hardware address (generated from IP address)
+static netDBdevice *netDB_find_device_by_mock_hwaddr(const netDBcache *cache, const char *ipaddr)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
+	char hwaddr[128];
+	snprintf(hwaddr, sizeof(hwaddr), "ip-%s", ipaddr);
+	return netDB_find_device_by_hwaddr(cache, hwaddr);
+}
 
-	// Skip if hostname is NULL or an empty string (= no result)
-	if(name == NULL || strlen(name) < 1)
-		return SQLITE_OK;
+// Try to find device by RECENT mock hardware address (generated from IP address)
+static netDBdevice *netDB_find_recent_device_by_mock_hwaddr(const netDBcache *cache, const char *ipaddr)
+{
+	netDBdevice *device = netDB_find_device_by_mock_hwaddr(cache, ipaddr);
+	if(device == NULL || device->firstSeen <= cache->now - 3600)
+		return NULL;
+	return device;
+}
 
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "UPDATE network_addresses SET name = ?1, "
-	                               "nameUpdated = (cast(strftime('%s', 'now') as int)) "
-	                               "WHERE ip = ?2";
+// Insert a device into the hwaddr-sorted array
+static void netDB_index_hwaddr(netDBcache *cache, netDBdevice *device)
+{
+	unsigned int pos = 0u;
+	netDB_search_hwaddr(cache, device->hwaddr, &pos);
+	memmove(&cache->devices.by_hwaddr[pos+1], &cache->devices.by_hwaddr[pos],
+	        (cache->devices.count - pos)*sizeof(netDBdevice*));
+	cache->devices.by_hwaddr[pos] = device;
+}
 
-	int rc = sqlite3_prepare_v2(db, querystr, -1, &query_stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("update_netDB_name(%s, \"%s\") - SQL error prepare (%i): %s",
-		     ip, name, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		return rc;
-	}
+static int netDB_cmp_hwaddr(const void *a, const void *b)
+{
+	const netDBdevice *x = *(netDBdevice * const *)a;
+	const netDBdevice *y = *(netDBdevice * const *)b;
+	return strcasecmp(x->hwaddr, y->hwaddr);
+}
 
-	if(config.debug & DEBUG_DATABASE)
+// Add a device to the cache. The device has to have an id larger than all
+// devices already in the cache (as is guaranteed for rowids of new rows).
+// When loading the table, the hwaddr index is built once afterwards instead
+static netDBdevice *netDB_cache_device(netDBcache *cache, const int id, const char *hwaddr,
+                                       const char *iface, const time_t firstSeen,
+                                       const time_t lastQuery, const unsigned int numQueries,
+                                       const bool index)
+{
+	if(cache->devices.count >= cache->devices.size)
 	{
-		logg("dbquery: \"%s\" with arguments 1 = \"%s\" and 2 = \"%s\"",
-		     querystr, name, ip);
+		const unsigned int size = cache->devices.size > 0 ? 2*cache->devices.size : NETDB_ALLOC_STEP;
+		netDBdevice **by_id = realloc(cache->devices.by_id, size*sizeof(netDBdevice*));
+		if(by_id == NULL)
+			return NULL;
+		cache->devices.by_id = by_id;
+		netDBdevice **by_hwaddr = realloc(cache->devices.by_hwaddr, size*sizeof(netDBdevice*));
+		if(by_hwaddr == NULL)
+			return NULL;
+		cache->devices.by_hwaddr = by_hwaddr;
+		cache->devices.size = size;
 	}
 
-	// Bind name to prepared statement (1st argument)
-	// We can do this as name has dynamic scope that exceeds that of the binding.
-	if((rc = sqlite3_bind_text(query_stmt, 1, name, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("update_netDB_name(%s, \"%s\"): Failed to bind ip (error %d): %s",
-		     ip, name, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
-	// Bind ip (unique key) to prepared statement (2nd argument)
-	// We can do this as name has dynamic scope that exceeds that of the binding.
-	if((rc = sqlite3_bind_text(query_stmt, 2, ip, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("update_netDB_name(%s, \"%s\"): Failed to bind name (error %d): %s",
-		     ip, name, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
+	netDBdevice *device = calloc(1, sizeof(netDBdevice));
+	if(device == NULL)
+		return NULL;
 
-	// Perform step
-	if ((rc = sqlite3_step(query_stmt)) != SQLITE_DONE)
-	{
-		logg("update_netDB_name(%s, \"%s\"): Failed to step (error %d): %s",
-		     ip, name, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
+	device->id = id;
+	device->hwaddr = strdup(hwaddr);
+	device->iface = strdup(iface != NULL ? iface : "");
+	device->firstSeen = firstSeen;
+	device->lastQuery = lastQuery;
+	device->numQueries = numQueries;
 
-	// Finalize statement
-	if ((rc = sqlite3_finalize(query_stmt)) != SQLITE_OK)
-	{
-		logg("update_netDB_name(%s, \"%s\"): Failed to finalize (error %d): %s",
-		     ip, name, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
+	cache->devices.by_id[cache->devices.count] = device;
+	if(index)
+		netDB_index_hwaddr(cache, device);
+	cache->devices.count++;
 
-	return SQLITE_OK;
+	return device;
 }
 
-// Updates lastQuery. Only use new value if larger than zero.
-// client->lastQuery may be zero if this client is only known
-// from a database entry but has not been seen since then (skip in this case)
-static int update_netDB_lastQuery(sqlite3 *db, const int network_id, const time_t lastQuery)
+// Add an address to the cache (or return the existing one). Addresses sorting
+// after all others (as when loading the table ordered by ip) are appended
+// without searching
+static netDBaddress *netDB_cache_address(netDBcache *cache, const char *ip)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
+	unsigned int pos = cache->addresses.count;
+	if((pos == 0u || strcmp(cache->addresses.by_ip[pos-1]->ip, ip) >= 0) &&
+	   netDB_search_ip(cache, ip, &pos))
+		return cache->addresses.by_ip[pos];
+
+	if(cache->addresses.count >= cache->addresses.size)
+	{
+		const unsigned int size = cache->addresses.size > 0 ? 2*cache->addresses.size : NETDB_ALLOC_STEP;
+		netDBaddress **by_ip = realloc(cache->addresses.by_ip, size*sizeof(netDBaddress*));
+		if(by_ip == NULL)
+			return NULL;
+		cache->addresses.by_ip = by_ip;
+		cache->addresses.size = size;
+	}
 
-	// Return early if there is nothing to update
-	if(lastQuery < 1)
-		return SQLITE_OK;
+	netDBaddress *address = calloc(1, sizeof(netDBaddress));
+	if(address == NULL)
+		return NULL;
+	address->ip = strdup(ip);
 
-	const int ret = dbquery(db, "UPDATE network "\
-	                            "SET lastQuery = MAX(lastQuery, %ld) "\
-	                            "WHERE id = %i;",
-	                            lastQuery, network_id);
+	memmove(&cache->addresses.by_ip[pos+1], &cache->addresses.by_ip[pos],
+	        (cache->addresses.count - pos)*sizeof(netDBaddress*));
+	cache->addresses.by_ip[pos] = address;
+	cache->addresses.count++;
 
-	return ret;
+	return address;
 }
 
-
-// Update numQueries.
-// Add queries seen since last update and reset counter afterwards
-static int update_netDB_numQueries(sqlite3 *db, const int dbID, const int numQueries)
+// Prepare a statement which is reused for all rows written during this run
+static bool netDB_prepare(netDBcache *cache, sqlite3_stmt **stmt, const char *querystr)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
-
-	// Return early if there is nothing to update
-	if(numQueries < 1)
-		return SQLITE_OK;
-
-	const int ret = dbquery(db, "UPDATE network "
-	                            "SET numQueries = numQueries + %u "
-	                            "WHERE id = %i;",
-	                            numQueries, dbID);
-
-	return ret;
+	const int rc = sqlite3_prepare_v3(cache->db, querystr, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("netDB_prepare(\"%s\") - SQL error prepare (%i): %s",
+		     querystr, rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+	return true;
 }
 
-// Add IP address record if it does not exist (INSERT). If it already exists,
-// the UNIQUE(ip) trigger becomes active and the line is instead REPLACEd.
-// We preserve a possibly existing IP -> host name association here
-static int add_netDB_network_address(sqlite3 *db, const int network_id, const char *ip)
+// Step a fully bound statement and reset it for the next use
+static int netDB_step(sqlite3_stmt *stmt, int rc, const char *func)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
+	if(rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_DONE)
+		rc = SQLITE_OK;
 
-	// Return early if there is nothing to be done in here
-	if(ip == NULL || strlen(ip) == 0)
-		return SQLITE_OK;
-
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "INSERT OR REPLACE INTO network_addresses "
-	                        "(network_id,ip,lastSeen,name,nameUpdated) VALUES "
-	                        "(?1,?2,(cast(strftime('%s', 'now') as int)),"
-	                        "(SELECT name FROM network_addresses "
-	                                "WHERE ip = ?2),"
-	                        "(SELECT nameUpdated FROM network_addresses "
-	                                "WHERE ip = ?2));";
-
-	int rc = sqlite3_prepare_v2(db, querystr, -1, &query_stmt, NULL);
 	if(rc != SQLITE_OK)
 	{
-		logg("add_netDB_network_address(%i, \"%s\") - SQL error prepare (%i): %s",
-		     network_id, ip, rc, sqlite3_errstr(rc));
+		logg("%s(): Failed to store network data (error %d): %s",
+		     func, rc, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		return rc;
 	}
 
 	if(config.debug & DEBUG_DATABASE)
 	{
-		logg("dbquery: \"%s\" with arguments ?1 = %i and ?2 = \"%s\"",
-		     querystr, network_id, ip);
+		char *sql = sqlite3_expanded_sql(stmt);
+		logg("dbquery: \"%s\"", sql);
+		sqlite3_free(sql);
 	}
 
-	// Bind network_id to prepared statement (1st argument)
-	if((rc = sqlite3_bind_int(query_stmt, 1, network_id)) != SQLITE_OK)
-	{
-		logg("add_netDB_network_address(%i, \"%s\"): Failed to bind network_id (error %d): %s",
-		     network_id, ip, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
-	// Bind ip to prepared statement (2nd argument)
-	if((rc = sqlite3_bind_text(query_stmt, 2, ip, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("add_netDB_network_address(%i, \"%s\"): Failed to bind name (error %d): %s",
-		     network_id, ip, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
-	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return rc;
+}
 
-	// Perform step
-	if ((rc = sqlite3_step(query_stmt)) != SQLITE_DONE)
+static void netDB_cache_free(netDBcache *cache)
+{
+	sqlite3_finalize(cache->stmt.insert_device);
+	sqlite3_finalize(cache->stmt.unmock_device);
+	sqlite3_finalize(cache->stmt.update_device);
+	sqlite3_finalize(cache->stmt.upsert_address);
+
+	for(unsigned int i = 0; i < cache->devices.count; i++)
 	{
-		logg("add_netDB_network_address(%i, \"%s\"): Failed to step (error %d): %s",
-		     network_id, ip, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
+		netDBdevice *device = cache->devices.by_id[i];
+		free(device->hwaddr);
+		free(device->iface);
+		free(device);
 	}
+	if(cache->devices.by_id != NULL)
+		free(cache->devices.by_id);
+	if(cache->devices.by_hwaddr != NULL)
+		free(cache->devices.by_hwaddr);
 
-	// Finalize statement
-	if ((rc = sqlite3_finalize(query_stmt)) != SQLITE_OK)
+	for(unsigned int i = 0; i < cache->addresses.count; i++)
 	{
-		logg("add_netDB_network_address(%i, \"%s\"): Failed to finalize (error %d): %s",
-		     network_id, ip, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		sqlite3_reset(query_stmt);
-		return rc;
+		netDBaddress *address = cache->addresses.by_ip[i];
+		free(address->ip);
+		if(address->name != NULL)
+			free(address->name);
+		free(address);
 	}
+	if(cache->addresses.by_ip != NULL)
+		free(cache->addresses.by_ip);
 
-	return SQLITE_OK;
+	memset(cache, 0, sizeof(*cache));
 }
 
-// Insert a new record into the network table
-static int insert_netDB_device(sqlite3 *db, const char *hwaddr, time_t now, time_t lastQuery,
-                               unsigned int numQueriesARP, const char *macVendor)
+// Load the network and network_addresses tables into memory and prepare the
+// statements used for writing back changes
+static bool netDB_cache_init(netDBcache *cache, sqlite3 *db, const time_t now)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
-
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "INSERT INTO network "\
-	                        "(hwaddr,interface,firstSeen,lastQuery,numQueries,macVendor) "\
-	                        "VALUES (?1,\'N/A\',?2,?3,?4,?5);";
+	memset(cache, 0, sizeof(*cache));
+	cache->db = db;
+	cache->now = now;
+
+	if(!netDB_prepare(cache, &cache->stmt.insert_device,
+	                  "INSERT INTO network "
+	                  "(hwaddr,interface,firstSeen,lastQuery,numQueries,macVendor) "
+	                  "VALUES (?1,\'N/A\',?2,?3,?4,?5);") ||
+	   !netDB_prepare(cache, &cache->stmt.unmock_device,
+	                  "UPDATE network SET hwaddr = ?1, macVendor = ?2 WHERE id = ?3;") ||
+	   !netDB_prepare(cache, &cache->stmt.update_device,
+	                  "UPDATE network SET interface = ?1, lastQuery = ?2, numQueries = ?3 "
+	                  "WHERE id = ?4;") ||
+	   !netDB_prepare(cache, &cache->stmt.upsert_address,
+	                  "INSERT INTO network_addresses (network_id,ip,lastSeen,name,nameUpdated) "
+	                  "VALUES (?1,?2,?3,?4,?5) ON CONFLICT(ip) DO UPDATE SET "
+	                  "network_id = ?1, lastSeen = ?3, name = ?4, nameUpdated = ?5;"))
+		return false;
 
-	int rc = sqlite3_prepare_v2(db, querystr, -1, &query_stmt, NULL);
+	// Load devices
+	sqlite3_stmt *stmt = NULL;
+	const char *devicestr = "SELECT id,hwaddr,interface,firstSeen,lastQuery,numQueries "
+	                        "FROM network ORDER BY id;";
+	int rc = sqlite3_prepare_v2(db, devicestr, -1, &stmt, NULL);
 	if(rc != SQLITE_OK)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\") - SQL error prepare (%i): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
+		logg("netDB_cache_init(\"%s\") - SQL error prepare: %s", devicestr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		return rc;
+		return false;
 	}
-
-	if(config.debug & DEBUG_DATABASE)
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
-		logg("dbquery: \"%s\" with arguments ?1-?5 = (\"%s\",%lu,%lu,%u,\"%s\")",
-		     querystr, hwaddr, now, lastQuery, numQueriesARP, macVendor);
+		const char *hwaddr = (const char*)sqlite3_column_text(stmt, 1);
+		if(hwaddr == NULL)
+			continue;
+		if(netDB_cache_device(cache, sqlite3_column_int(stmt, 0), hwaddr,
+		                      (const char*)sqlite3_column_text(stmt, 2),
+		                      sqlite3_column_int64(stmt, 3),
+		                      sqlite3_column_int64(stmt, 4),
+		                      sqlite3_column_int(stmt, 5), false) == NULL)
+		{
+			rc = SQLITE_NOMEM;
+			break;
+		}
 	}
-
-	// Bind hwaddr to prepared statement (1st argument)
-	if((rc = sqlite3_bind_text(query_stmt, 1, hwaddr, -1, SQLITE_STATIC)) != SQLITE_OK)
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_DONE)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to bind hwaddr (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
+		logg("netDB_cache_init(\"%s\") - SQL error step: %s", devicestr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		return rc;
+		return false;
 	}
 
-	// Bind now to prepared statement (2nd argument)
-	if((rc = sqlite3_bind_int(query_stmt, 2, now)) != SQLITE_OK)
+	// Sort the hwaddr index once instead of inserting every device
+	if(cache->devices.count > 0)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to bind now (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		memcpy(cache->devices.by_hwaddr, cache->devices.by_id, cache->devices.count*sizeof(netDBdevice*));
+		qsort(cache->devices.by_hwaddr, cache->devices.count, sizeof(netDBdevice*), netDB_cmp_hwaddr);
 	}
 
-	// Bind lastQuery to prepared statement (3rd argument)
-	if((rc = sqlite3_bind_int(query_stmt, 3, lastQuery)) != SQLITE_OK)
+	// Load addresses
+	const char *addressstr = "SELECT network_id,ip,lastSeen,name,nameUpdated "
+	                         "FROM network_addresses ORDER BY ip;";
+	rc = sqlite3_prepare_v2(db, addressstr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to bind lastQuery (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
+		logg("netDB_cache_init(\"%s\") - SQL error prepare: %s", addressstr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		return rc;
+		return false;
 	}
-
-	// Bind numQueriesARP to prepared statement (4th argument)
-	if((rc = sqlite3_bind_int(query_stmt, 4, numQueriesARP)) != SQLITE_OK)
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to bind numQueriesARP (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		const char *ip = (const char*)sqlite3_column_text(stmt, 1);
+		if(ip == NULL)
+			continue;
+		netDBaddress *address = netDB_cache_address(cache, ip);
+		if(address == NULL)
+		{
+			rc = SQLITE_NOMEM;
+			break;
+		}
+		address->network_id = sqlite3_column_int(stmt, 0);
+		address->lastSeen = sqlite3_column_int64(stmt, 2);
+		const char *name = (const char*)sqlite3_column_text(stmt, 3);
+		address->name = name != NULL ? strdup(name) : NULL;
+		address->nameUpdated = sqlite3_column_int64(stmt, 4);
 	}
-
-	// Bind macVendor to prepared statement (5th argument) - the macVendor can be NULL here
-	if((rc = sqlite3_bind_text(query_stmt, 5, macVendor, -1, SQLITE_STATIC)) != SQLITE_OK)
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_DONE)
 	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to bind macVendor (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
+		logg("netDB_cache_init(\"%s\") - SQL error step: %s", addressstr, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		return rc;
+		return false;
 	}
 
-	// Perform step
-	if ((rc = sqlite3_step(query_stmt)) != SQLITE_DONE)
-	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to step (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
+	if(config.debug & DEBUG_ARP)
+		logg("Network table: Loaded %u devices and %u addresses into memory",
+		     cache->devices.count, cache->addresses.count);
 
-	// Finalize statement
-	if ((rc = sqlite3_finalize(query_stmt)) != SQLITE_OK)
-	{
-		logg("insert_netDB_device(\"%s\",%lu, %lu, %u, \"%s\"): Failed to finalize (error %d): %s",
-		     hwaddr, now, lastQuery, numQueriesARP, macVendor, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
+	return true;
+}
+
+// Insert a new record into the network table. This is done immediately as we
+// need the ID of the new row
+static netDBdevice *netDB_insert_device(netDBcache *cache, const char *hwaddr, time_t firstSeen,
+                                        time_t lastQuery, unsigned int numQueries,
+                                        const char *macVendor)
+{
+	sqlite3_stmt *stmt = cache->stmt.insert_device;
+	int rc = sqlite3_bind_text(stmt, 1, hwaddr, -1, SQLITE_STATIC);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_int64(stmt, 2, firstSeen);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_int64(stmt, 3, lastQuery);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_int(stmt, 4, numQueries);
+	// The macVendor can be NULL here
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_text(stmt, 5, macVendor, -1, SQLITE_STATIC);
+
+	if(netDB_step(stmt, rc, __FUNCTION__) != SQLITE_OK)
+		return NULL;
 
-	return SQLITE_OK;
+	return netDB_cache_device(cache, sqlite3_last_insert_rowid(cache->db), hwaddr, "N/A",
+	                          firstSeen, lastQuery, numQueries, true);
 }
 
 // Convert mock-device into a real one by changing the hardware address (and possibly adding a vendor string)
-static int unmock_netDB_device(sqlite3 *db, const char *hwaddr, const char *macVendor, const int dbID)
+static bool netDB_unmock_device(netDBcache *cache, netDBdevice *device, const char *hwaddr, const char *macVendor)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
-
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "UPDATE network SET "\
-	                        "hwaddr = ?1, macVendor=?2 WHERE id = ?3;";
+	sqlite3_stmt *stmt = cache->stmt.unmock_device;
+	int rc = sqlite3_bind_text(stmt, 1, hwaddr, -1, SQLITE_STATIC);
+	// The macVendor can be NULL here
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_text(stmt, 2, macVendor, -1, SQLITE_STATIC);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_int(stmt, 3, device->id);
+
+	if(netDB_step(stmt, rc, __FUNCTION__) != SQLITE_OK)
+		return false;
 
-	int rc = sqlite3_prepare_v2(db, querystr, -1, &query_stmt, NULL);
-	if(rc != SQLITE_OK)
+	// Re-sort device under its new hardware address
+	unsigned int pos = 0u;
+	if(netDB_search_hwaddr(cache, device->hwaddr, &pos))
 	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i) - SQL error prepare (%i): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		return rc;
+		memmove(&cache->devices.by_hwaddr[pos], &cache->devices.by_hwaddr[pos+1],
+		        (cache->devices.count - pos - 1)*sizeof(netDBdevice*));
+		cache->devices.count--;
+		free(device->hwaddr);
+		device->hwaddr = strdup(hwaddr);
+		netDB_index_hwaddr(cache, device);
+		cache->devices.count++;
 	}
 
-	if(config.debug & DEBUG_DATABASE)
-	{
-		logg("dbquery: \"%s\" with arguments ?1 = \"%s\", ?2 = \"%s\", ?3 = %i",
-		     querystr, hwaddr, macVendor, dbID);
-	}
+	return true;
+}
 
-	// Bind hwaddr to prepared statement (1st argument)
-	if((rc = sqlite3_bind_text(query_stmt, 1, hwaddr, -1, SQLITE_STATIC)) != SQLITE_OK)
+// Update lastQuery, numQueries and interface of a device. lastQuery is only
+// used if larger than zero. client->lastQuery may be zero if this client is
+// only known from a database entry but has not been seen since then (skip in
+// this case). numQueries is added to the stored value
+static void netDB_update_device(netDBdevice *device, const time_t lastQuery,
+                                const unsigned int numQueries, const char *iface)
+{
+	if(lastQuery > device->lastQuery)
 	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i): Failed to bind hwaddr (error %d): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		device->lastQuery = lastQuery;
+		device->changed = true;
 	}
 
-	// Bind macVendor to prepared statement (2nd argument) - the macVendor can be NULL here
-	if((rc = sqlite3_bind_text(query_stmt, 2, macVendor, -1, SQLITE_STATIC)) != SQLITE_OK)
+	if(numQueries > 0)
 	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i): Failed to bind macVendor (error %d): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		device->numQueries += numQueries;
+		device->changed = true;
 	}
 
-	// Bind now to prepared statement (3rd argument)
-	if((rc = sqlite3_bind_int(query_stmt, 3, dbID)) != SQLITE_OK)
+	if(iface != NULL && strlen(iface) > 0 && strcmp(device->iface, iface) != 0)
 	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i): Failed to bind now (error %d): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		free(device->iface);
+		device->iface = strdup(iface);
+		device->changed = true;
 	}
+}
 
-	// Perform step
-	if ((rc = sqlite3_step(query_stmt)) != SQLITE_DONE)
-	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i): Failed to step (error %d): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
+// Add IP address record if it does not exist. If it already exists, it is
+// reassigned to this device. We preserve a possibly existing IP -> host name
+// association here
+static bool netDB_add_address(netDBcache *cache, const int network_id, const char *ip)
+{
+	// Return early if there is nothing to be done in here
+	if(ip == NULL || strlen(ip) == 0)
+		return true;
 
-	// Finalize statement
-	if ((rc = sqlite3_finalize(query_stmt)) != SQLITE_OK)
+	netDBaddress *address = netDB_cache_address(cache, ip);
+	if(address == NULL)
+		return false;
+
+	if(address->network_id != network_id || address->lastSeen != cache->now)
 	{
-		logg("unmock_netDB_device(\"%s\", \"%s\", %i): Failed to finalize (error %d): %s",
-		     hwaddr, macVendor, dbID, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		address->network_id = network_id;
+		address->lastSeen = cache->now;
+		address->changed = true;
 	}
 
-	return SQLITE_OK;
+	return true;
 }
 
-// Update interface of device
-static int update_netDB_interface(sqlite3 *db, const int network_id, const char *iface)
+// Store hostname of device identified by its IP address
+static void netDB_update_name(netDBcache *cache, const char *ip, const char *name)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
-
-	// Return early if there is nothing to be done in here
-	if(iface == NULL || strlen(iface) == 0)
-		return SQLITE_OK;
+	// Skip if hostname is NULL or an empty string (= no result)
+	if(name == NULL || strlen(name) < 1)
+		return;
 
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "UPDATE network SET interface = ?1 WHERE id = ?2";
+	netDBaddress *address = netDB_find_address(cache, ip);
+	if(address == NULL)
+		return;
 
-	int rc = sqlite3_prepare_v2(db, querystr, -1, &query_stmt, NULL);
-	if(rc != SQLITE_OK)
+	if(address->name == NULL || strcmp(address->name, name) != 0)
 	{
-		logg("update_netDB_interface(%i, \"%s\") - SQL error prepare (%i): %s",
-		     network_id, iface, rc, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		return rc;
+		if(address->name != NULL)
+			free(address->name);
+		address->name = strdup(name);
 	}
+	address->nameUpdated = cache->now;
+	address->changed = true;
+}
 
-	if(config.debug & DEBUG_DATABASE)
+// Write all changed rows back to the database
+static int netDB_flush(netDBcache *cache, unsigned int *devices, unsigned int *addresses)
+{
+	int rc = SQLITE_OK;
+	for(unsigned int i = 0; i < cache->devices.count && rc == SQLITE_OK; i++)
 	{
-		logg("dbquery: \"%s\" with arguments ?1 = \"%s\" and ?2 = %i",
-		     querystr, iface, network_id);
-	}
+		netDBdevice *device = cache->devices.by_id[i];
+		if(!device->changed)
+			continue;
 
-	// Bind iface to prepared statement (1st argument)
-	if((rc = sqlite3_bind_text(query_stmt, 1, iface, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("update_netDB_interface(%i, \"%s\"): Failed to bind iface (error %d): %s",
-		     network_id, iface, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
-	// Bind network_id to prepared statement (2nd argument)
-	if((rc = sqlite3_bind_int(query_stmt, 2, network_id)) != SQLITE_OK)
-	{
-		logg("update_netDB_interface(%i, \"%s\"): Failed to bind name (error %d): %s",
-		     network_id, iface, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
+		sqlite3_stmt *stmt = cache->stmt.update_device;
+		rc = sqlite3_bind_text(stmt, 1, device->iface, -1, SQLITE_STATIC);
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_int64(stmt, 2, device->lastQuery);
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_int(stmt, 3, device->numQueries);
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_int(stmt, 4, device->id);
+		rc = netDB_step(stmt, rc, __FUNCTION__);
 
-	// Perform step
-	if ((rc = sqlite3_step(query_stmt)) != SQLITE_DONE)
-	{
-		logg("update_netDB_interface(%i, \"%s\"): Failed to step (error %d): %s",
-		     network_id, iface, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
+		device->changed = false;
+		(*devices)++;
 	}
 
-	// Finalize statement
-	if ((rc = sqlite3_finalize(query_stmt)) != SQLITE_OK)
+	for(unsigned int i = 0; i < cache->addresses.count && rc == SQLITE_OK; i++)
 	{
-		logg("update_netDB_interface(%i, \"%s\"): Failed to finalize (error %d): %s",
-		     network_id, iface, rc, sqlite3_errstr(rc));
-		sqlite3_reset(query_stmt);
-		checkFTLDBrc(rc);
-		return rc;
-	}
+		netDBaddress *address = cache->addresses.by_ip[i];
+		if(!address->changed)
+			continue;
 
-	return SQLITE_OK;
+		sqlite3_stmt *stmt = cache->stmt.upsert_address;
+		rc = sqlite3_bind_int(stmt, 1, address->network_id);
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_text(stmt, 2, address->ip, -1, SQLITE_STATIC);
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_int64(stmt, 3, address->lastSeen);
+		// The name may be NULL here
+		if(rc == SQLITE_OK)
+			rc = sqlite3_bind_text(stmt, 4, address->name, -1, SQLITE_STATIC);
+		if(rc == SQLITE_OK)
+			rc = address->nameUpdated > 0 ?
+			       sqlite3_bind_int64(stmt, 5, address->nameUpdated) :
+			       sqlite3_bind_null(stmt, 5);
+		rc = netDB_step(stmt, rc, __FUNCTION__);
+
+		address->changed = false;
+		(*addresses)++;
+	}
+
+	return rc;
 }
 
 // Loop over all clients known to FTL and ensure we add them all to the database
-static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *client_status, time_t now,
+static bool add_FTL_clients_to_network_table(netDBcache *cache, enum arp_status *client_status,
+                                             unsigned int *client_accounted, const int num_clients,
                                              unsigned int *additional_entries)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return false;
-
-	int rc = SQLITE_OK;
 	char hwaddr[128];
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	for(int clientID = 0; clientID < num_clients; clientID++)
 	{
 		// Check thread cancellation
 		if(killed)
 			break;
 
+		// Skip if already handled in the neighbor cache loop
+		if(client_status[clientID] != CLIENT_NOT_HANDLED)
+			continue;
+
 		// Get client pointer
 		lock_shm();
 		clientsData *client = getClient(clientID, true);
@@ -792,51 +839,37 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 			continue;
 		}
 
-		// Get hostname and IP address of this client
-		char *hostname, *ipaddr, *interface;
-		ipaddr = strdup(getstr(client->ippos));
-		hostname = strdup(getstr(client->namepos));
-		interface = strdup(getstr(client->ifacepos));
-
-		// Skip if already handled above (first check against clients_array_size as we might have added
-		// more clients to FTL's memory herein (those known only from the database))
-		if(client_status[clientID] != CLIENT_NOT_HANDLED)
-		{
-			if(config.debug & DEBUG_ARP)
-				logg("Network table: Client %s known through ARP/neigh cache",
-				     ipaddr);
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			unlock_shm();
-			continue;
-		}
-		else if(config.debug & DEBUG_ARP)
-		{
-			logg("Network table: %s NOT known through ARP/neigh cache", ipaddr);
-		}
-
-		//
-		// Variant 1: Try to find a device with an EDNS(0)-provided hardware address
-		//
-		int dbID = DB_NODATA;
-		if(client->hwlen == 6)
+		// Get hostname, IP address and query data of this client. We
+		// copy them as we do not hold the lock while working on the
+		// database below
+		char *ipaddr = strdup(getstr(client->ippos));
+		char *hostname = strdup(getstr(client->namepos));
+		char *interface = strdup(getstr(client->ifacepos));
+		const bool has_hwaddr = client->hwlen == 6;
+		if(has_hwaddr)
 		{
 			snprintf(hwaddr, sizeof(hwaddr), "%02X:%02X:%02X:%02X:%02X:%02X",
 			         client->hwaddr[0], client->hwaddr[1],
 			         client->hwaddr[2], client->hwaddr[3],
 			         client->hwaddr[4], client->hwaddr[5]);
-			hwaddr[6*2+5] = '\0';
+		}
+		const time_t lastQuery = client->lastQuery;
+		const unsigned int numQueriesARP = client->numQueriesARP;
+		unlock_shm();
 
-			unlock_shm();
-			dbID = find_device_by_hwaddr(db, hwaddr);
-			lock_shm();
+		if(config.debug & DEBUG_ARP)
+			logg("Network table: %s NOT known through ARP/neigh cache", ipaddr);
 
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
+		netDBdevice *device = NULL;
+		if(has_hwaddr)
+		{
+			//
+			// Variant 1: Try to find a device with an EDNS(0)-provided hardware address
+			//
+			device = netDB_find_device_by_hwaddr(cache, hwaddr);
 
-			if(config.debug & DEBUG_ARP && dbID >= 0)
-				logg("Network table: Client with MAC %s is network ID %i", hwaddr, dbID);
+			if(config.debug & DEBUG_ARP && device != NULL)
+				logg("Network table: Client with MAC %s is network ID %i", hwaddr, device->id);
 		}
 		else
 		{
@@ -844,92 +877,47 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 			// Variant 2: Try to find a device using the same IP address within the last 24 hours
 			// Only try this when there is no EDNS(0) MAC address available
 			//
-			unlock_shm();
-			dbID = find_device_by_recent_ip(db, ipaddr);
-			lock_shm();
+			device = netDB_find_device_by_recent_ip(cache, ipaddr);
 
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
-
-			if(config.debug & DEBUG_ARP && dbID >= 0)
+			if(config.debug & DEBUG_ARP && device != NULL)
 				logg("Network table: Client with IP %s has no MAC info but was recently be seen for network ID %i",
-				     ipaddr, dbID);
+				     ipaddr, device->id);
 
 			//
 			// Variant 3: Try to find a device with mock IP address
 			// Only try this when there is no EDNS(0) MAC address available
 			//
-			if(dbID < 0)
+			if(device == NULL)
 			{
-				unlock_shm();
-				dbID = find_device_by_mock_hwaddr(db, ipaddr);
-				lock_shm();
-
-				// Reacquire client pointer (if may have changed when unlocking above)
-				client = getClient(clientID, true);
+				device = netDB_find_device_by_mock_hwaddr(cache, ipaddr);
 
-				if(config.debug & DEBUG_ARP && dbID >= 0)
+				if(config.debug & DEBUG_ARP && device != NULL)
 					logg("Network table: Client with IP %s has no MAC info but is known as mock-hwaddr client with network ID %i",
-					     ipaddr, dbID);
+					     ipaddr, device->id);
 			}
 
 			// Create mock hardware address in the style of "ip-<IP address>", like "ip-127.0.0.1"
-			strcpy(hwaddr, "ip-");
-			strncpy(hwaddr+3, ipaddr, sizeof(hwaddr)-4);
-			hwaddr[sizeof(hwaddr)-1] = '\0';
+			snprintf(hwaddr, sizeof(hwaddr), "ip-%s", ipaddr);
 		}
 
-		if(dbID == DB_FAILED)
-		{
-			// SQLite error
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
-		}
 		// Device not in database, add new entry
-		else if(dbID == DB_NODATA)
+		if(device == NULL)
 		{
-			char *macVendor = NULL;
-			if(client->hwlen == 6)
-			{
-				// Normal client, MAC was likely obtained from EDNS(0) data
-				unlock_shm();
-				macVendor = getMACVendor(hwaddr);
-				lock_shm();
-
-				// Reacquire client pointer (if may have changed when unlocking above)
-				client = getClient(clientID, true);
-			}
+			// Normal client, MAC was likely obtained from EDNS(0) data
+			char *macVendor = has_hwaddr ? getMACVendor(hwaddr) : NULL;
 
 			if(config.debug & DEBUG_ARP)
 				logg("Network table: Creating new FTL device MAC = %s, IP = %s, hostname = \"%s\", vendor = \"%s\", interface = \"%s\"",
 				     hwaddr, ipaddr, hostname, macVendor, interface);
 
 			// Add new device to database
-			const time_t lastQuery = client->lastQuery;
-			const unsigned int numQueriesARP = client->numQueriesARP;
-			unlock_shm();
-			insert_netDB_device(db, hwaddr, now, lastQuery, numQueriesARP, macVendor);
-			lock_shm();
-
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
-
-			// Reset client counter
-			client->numQueriesARP = 0;
+			device = netDB_insert_device(cache, hwaddr, cache->now, lastQuery, numQueriesARP, macVendor);
 
 			// Free allocated memory (if allocated)
 			if(macVendor != NULL)
-			{
 				free(macVendor);
-				macVendor = NULL;
-			}
-
-			// Obtain ID which was given to this new entry
-			dbID = sqlite3_last_insert_rowid(db);
 		}
-		else	// Device already in database
+		else // Device already in database
 		{
 			if(config.debug & DEBUG_ARP)
 			{
@@ -937,69 +925,26 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 				     hwaddr, ipaddr, hostname, interface);
 			}
 
-			// Update timestamp of last query if applicable
-			const time_t lastQuery = client->lastQuery;
-			const unsigned int numQueriesARP = client->numQueriesARP;
-			unlock_shm();
-			rc = update_netDB_lastQuery(db, dbID, lastQuery);
-			if(rc != SQLITE_OK)
-			{
-				if(ipaddr) free(ipaddr);
-				if(hostname) free(hostname);
-				if(interface) free(interface);
-				break;
-			}
-
-			// Update number of queries if applicable
-			rc = update_netDB_numQueries(db, dbID, numQueriesARP);
-			if(rc != SQLITE_OK)
-			{
-				if(ipaddr) free(ipaddr);
-				if(hostname) free(hostname);
-				if(interface) free(interface);
-				break;
-			}
-
-			lock_shm();
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
-			client->numQueriesARP = 0;
+			// Update timestamp of last query and number of queries
+			// if applicable
+			netDB_update_device(device, lastQuery, numQueriesARP, NULL);
 		}
 
-		unlock_shm();
-
-		// Add unique IP address / mock-MAC pair to network_addresses table
-		// ipaddr is a local copy
-		rc = add_netDB_network_address(db, dbID, ipaddr);
-		if(rc != SQLITE_OK)
+		if(device == NULL || !netDB_add_address(cache, device->id, ipaddr))
 		{
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
+			free(ipaddr);
+			free(hostname);
+			free(interface);
+			return false;
 		}
 
-		// Update hostname if available
-		// hostname is a local copy
-		rc = update_netDB_name(db, ipaddr, hostname);
-		if(rc != SQLITE_OK)
-		{
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
-		}
+		// Remember the queries accounted for in the database, the client
+		// counter is reset once the transaction has been committed
+		client_accounted[clientID] = numQueriesARP;
 
-		// Update interface if available
-		// interface is a local copy
-		rc = update_netDB_interface(db, dbID, interface);
-		if(rc != SQLITE_OK)
-		{
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
-		}
+		// Update hostname and interface if available
+		netDB_update_name(cache, ipaddr, hostname);
+		netDB_update_device(device, 0, 0, interface);
 
 		// Add to number of processed ARP cache entries
 		(*additional_entries)++;
@@ -1010,29 +955,11 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 		free(interface);
 	}
 
-	// Check for possible error in loop
-	if(rc != SQLITE_OK)
-	{
-		const char *text;
-		if( rc == SQLITE_BUSY )
-			text = "WARNING";
-		else
-			text = "ERROR";
-
-		logg("%s: Storing devices in network table failed: %s", text, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
-		return false;
-	}
-
 	return true;
 }
 
-static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsigned int *additional_entries)
+static bool add_local_interfaces_to_network_table(netDBcache *cache, unsigned int *additional_entries)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return SQLITE_ERROR;
-
 	// Try to access the kernel's Internet protocol address management
 	FILE *ip_pipe = NULL;
 	const char cmd[] = "ip address show";
@@ -1046,8 +973,8 @@ static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsig
 	// Buffers
 	char *linebuffer = NULL;
 	size_t linebuffersize = 0u;
-	int iface_no, rc;
-	bool has_iface = false, has_hwaddr = false;
+	int iface_no;
+	bool has_iface = false, has_hwaddr = false, success = true;
 	char ipaddr[128], hwaddr[128], iface[128];
 
 	// Read response line by line
@@ -1120,26 +1047,18 @@ static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsig
 		}
 
 		// Try to find the device we parsed above
-		int dbID = find_device_by_hwaddr(db, hwaddr);
-		if(config.debug & DEBUG_ARP && dbID >= 0)
+		netDBdevice *device = netDB_find_device_by_hwaddr(cache, hwaddr);
+		if(config.debug & DEBUG_ARP && device != NULL)
 		{
 			logg("Network table (ip a): Client with MAC %s was recently be seen for network ID %i",
-			     hwaddr, dbID);
-		}
-
-		// Break on SQLite error
-		if(dbID == DB_FAILED)
-		{
-			// SQLite error
-			break;
+			     hwaddr, device->id);
 		}
 
-		// Get vendor
-		char *macVendor = getMACVendor(hwaddr);
-
 		// Device not in database, add new entry
-		if(dbID == DB_NODATA)
+		if(device == NULL)
 		{
+			// Get vendor
+			char *macVendor = getMACVendor(hwaddr);
 
 			if(config.debug & DEBUG_ARP)
 			{
@@ -1148,67 +1067,39 @@ static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsig
 			}
 
 			// Try to import query data from a possibly previously existing mock-device
-			int mockID = find_device_by_mock_hwaddr(db, ipaddr);
-			int lastQuery = 0, firstSeen = now, numQueries = 0;
-			if(mockID >= 0)
+			const netDBdevice *mock = netDB_find_device_by_mock_hwaddr(cache, ipaddr);
+			time_t lastQuery = 0, firstSeen = cache->now;
+			unsigned int numQueries = 0;
+			if(mock != NULL)
 			{
-				char *querystr = NULL;
-				if(asprintf(&querystr, "SELECT lastQuery from network where id = %i", mockID) < 10)
-				{
-					free(macVendor);
-					return false;
-				}
-				lastQuery = db_query_int(db, querystr);
-				free(querystr);
-
-				if(asprintf(&querystr, "SELECT firstSeen from network where id = %i", mockID) < 10)
-				{
-					free(macVendor);
-					return false;
-				}
-				firstSeen = db_query_int(db, querystr);
-				free(querystr);
-
-				if(asprintf(&querystr, "SELECT numQueries from network where id = %i", mockID) < 10)
-				{
-					free(macVendor);
-					return false;
-				}
-				numQueries = db_query_int(db, querystr);
-				free(querystr);
+				lastQuery = mock->lastQuery;
+				firstSeen = mock->firstSeen;
+				numQueries = mock->numQueries;
 			}
 
 			// Add new device to database
-			insert_netDB_device(db, hwaddr, firstSeen, lastQuery, numQueries, macVendor);
+			device = netDB_insert_device(cache, hwaddr, firstSeen, lastQuery, numQueries, macVendor);
 
-			// Obtain ID which was given to this new entry
-			dbID = sqlite3_last_insert_rowid(db);
-		}
-		else	// Device already in database
-		{
-			if(config.debug & DEBUG_ARP)
-			{
-				logg("Network table: Updating existing ip a device MAC = %s, IP = %s, interface = \"%s\"",
-				     hwaddr, ipaddr, iface);
-			}
+			// Free allocated memory
+			if(macVendor != NULL)
+				free(macVendor);
 		}
-
-		//Free allocated memory
-		if(macVendor != NULL)
+		else if(config.debug & DEBUG_ARP)
 		{
-			free(macVendor);
-			macVendor = NULL;
+			// Device already in database
+			logg("Network table: Updating existing ip a device MAC = %s, IP = %s, interface = \"%s\"",
+			     hwaddr, ipaddr, iface);
 		}
 
 		// Add unique IP address / mock-MAC pair to network_addresses table
-		rc = add_netDB_network_address(db, dbID, ipaddr);
-		if(rc != SQLITE_OK)
+		if(device == NULL || !netDB_add_address(cache, device->id, ipaddr))
+		{
+			success = false;
 			break;
+		}
 
 		// Update interface if available
-		rc = update_netDB_interface(db, dbID, iface);
-		if(rc != SQLITE_OK)
-			break;
+		netDB_update_device(device, 0, 0, iface);
 
 		// Add to number of processed ARP cache entries
 		(*additional_entries)++;
@@ -1219,11 +1110,20 @@ static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsig
 	if(linebuffer != NULL)
 		free(linebuffer);
 
-	return true;
+	return success;
 }
 
-// Parse kernel's neighbor cache
-void parse_neighbor_cache(sqlite3* db)
+// One line of the kernel's neighbor cache
+typedef struct {
+	char ip[128];
+	char iface[128];
+	char hwaddr[128];
+	bool complete;
+} neighborEntry;
+
+// Read the complete neighbor cache snapshot into memory. This ensures we
+// do not keep the pipe open while processing the entries
+static neighborEntry *read_neighbor_cache(unsigned int *num)
 {
 	// Try to access the kernel's neighbor cache
 	FILE *arpfp = NULL;
@@ -1232,17 +1132,84 @@ void parse_neighbor_cache(sqlite3* db)
 	if((arpfp = popen(cmd, "r")) == NULL)
 	{
 		logg("WARN: Command \"%s\" failed: %s", cmd, strerror(errno));
-		return;
+		return NULL;
 	}
 
+	// Prepare buffers
+	char *linebuffer = NULL;
+	size_t linebuffersize = 0u;
+	neighborEntry *entries = NULL;
+	unsigned int size = 0u;
+	*num = 0u;
+
+	// Read ARP cache line by line
+	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	{
+		// Skip if line buffer is invalid
+		if(linebuffer == NULL)
+			continue;
+
+		// Check thread cancellation
+		if(killed)
+			break;
+
+		if(*num >= size)
+		{
+			size += NETDB_ALLOC_STEP;
+			neighborEntry *new_entries = realloc(entries, size*sizeof(neighborEntry));
+			if(new_entries == NULL)
+				break;
+			entries = new_entries;
+		}
+
+		neighborEntry *entry = &entries[*num];
+		const int n = sscanf(linebuffer, "%99s dev %99s lladdr %99s",
+		                     entry->ip, entry->iface, entry->hwaddr);
+
+		// Ensure strings are null-terminated in case we hit the max.
+		// length limitation
+		entry->ip[sizeof(entry->ip)-1] = '\0';
+		entry->iface[sizeof(entry->iface)-1] = '\0';
+		entry->hwaddr[sizeof(entry->hwaddr)-1] = '\0';
+
+		// Incomplete lines (n == 2) are remembered to skip mock-device
+		// creation after ARP processing, all other lines are skipped
+		if(n < 2)
+			continue;
+
+		entry->complete = n == 3;
+		(*num)++;
+	}
+
+	// Close pipe handle and free allocated memory
+	pclose(arpfp);
+	if(linebuffer != NULL)
+		free(linebuffer);
+
+	// Return empty (but valid) array if there are no entries
+	if(entries == NULL)
+		entries = calloc(1, sizeof(neighborEntry));
+
+	return entries;
+}
+
+// Parse kernel's neighbor cache
+void parse_neighbor_cache(sqlite3* db)
+{
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		return;
+
 	// Start ARP timer
 	if(config.debug & DEBUG_ARP)
 		timer_start(ARP_TIMER);
 
-	// Prepare buffers
-	char *linebuffer = NULL;
-	size_t linebuffersize = 0u;
-	char ip[128], hwaddr[128], iface[128];
+	// Stage the entire neighbor cache in memory
+	unsigned int num_neigh = 0u;
+	neighborEntry *neigh = read_neighbor_cache(&num_neigh);
+	if(neigh == NULL)
+		return;
+
 	unsigned int entries = 0u, additional_entries = 0u;
 	time_t now = time(NULL);
 
@@ -1258,29 +1225,35 @@ void parse_neighbor_cache(sqlite3* db)
 
 		// dbquery() above already logs the reason for why the query failed
 		logg("%s: Storing devices in network table (\"%s\") failed", text, sql);
-		pclose(arpfp);
+		free(neigh);
 		return;
 	}
 
 	// Remove all but the most recent IP addresses not seen for more than a certain time
 	if(config.network_expire > 0u)
 	{
-		const time_t limit = time(NULL)-24*3600*config.network_expire;
+		const time_t limit = now-24*3600*config.network_expire;
 		rc = dbquery(db, "DELETE FROM network_addresses "
 		                        "WHERE lastSeen < %lu;", (unsigned long)limit);
+		if(rc == SQLITE_OK)
+			rc = dbquery(db, "UPDATE network_addresses SET name = NULL "
+			                        "WHERE nameUpdated < %lu;", (unsigned long)limit);
 		if(rc != SQLITE_OK)
 		{
-			pclose(arpfp);
+			dbquery(db, "ROLLBACK TRANSACTION");
+			free(neigh);
 			return;
 		}
+	}
 
-		rc = dbquery(db, "UPDATE network_addresses SET name = NULL "
-		                        "WHERE nameUpdated < %lu;", (unsigned long)limit);
-		if(rc != SQLITE_OK)
-		{
-			pclose(arpfp);
-			return;
-		}
+	// Load the current state of the network tables into memory
+	netDBcache cache;
+	if(!netDB_cache_init(&cache, db, now))
+	{
+		netDB_cache_free(&cache);
+		dbquery(db, "ROLLBACK TRANSACTION");
+		free(neigh);
+		return;
 	}
 
 	// Initialize array of status for individual clients used to
@@ -1288,115 +1261,89 @@ void parse_neighbor_cache(sqlite3* db)
 	lock_shm();
 	const int clients = counters->clients;
 	unlock_shm();
-	enum arp_status client_status[clients];
-	for(int i = 0; i < clients; i++)
-	{
-		client_status[i] = CLIENT_NOT_HANDLED;
+	enum arp_status *client_status = calloc(clients > 0 ? clients : 1, sizeof(enum arp_status));
+	unsigned int *client_accounted = calloc(clients > 0 ? clients : 1, sizeof(unsigned int));
+	if(client_status == NULL || client_accounted == NULL)
+	{
+		if(client_status != NULL)
+			free(client_status);
+		if(client_accounted != NULL)
+			free(client_accounted);
+		netDB_cache_free(&cache);
+		dbquery(db, "ROLLBACK TRANSACTION");
+		free(neigh);
+		return;
 	}
 
-	// Read ARP cache line by line
-	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	bool success = true;
+	for(unsigned int i = 0; i < num_neigh; i++)
 	{
-		// Skip if line buffer is invalid
-		if(linebuffer == NULL)
-			continue;
-
 		// Check thread cancellation
 		if(killed)
 			break;
 
-		int num = sscanf(linebuffer, "%99s dev %99s lladdr %99s",
-		                 ip, iface, hwaddr);
+		const char *ip = neigh[i].ip;
+		const char *iface = neigh[i].iface;
+		const char *hwaddr = neigh[i].hwaddr;
 
-		// Ensure strings are null-terminated in case we hit the max.
-		// length limitation
-		ip[sizeof(ip)-1] = '\0';
-		iface[sizeof(iface)-1] = '\0';
-		hwaddr[sizeof(hwaddr)-1] = '\0';
+		// If we reach this point, we can check if this client
+		// is known to pihole-FTL
+		// false = do not create a new record if the client is
+		//         unknown (only DNS requesting clients do this)
+		lock_shm();
+		const int clientID = findClientID(ip, false, false);
+		clientsData *client = clientID >= 0 && clientID < clients ? getClient(clientID, true) : NULL;
 
 		// Check if we want to process the line we just read
-		if(num != 3)
+		if(!neigh[i].complete)
 		{
-			if(num == 2)
-			{
-				// This line is incomplete, remember this to skip
-				// mock-device creation after ARP processing
-				lock_shm();
-				int clientID = findClientID(ip, false, false);
-				unlock_shm();
-				if(clientID >= 0)
-					client_status[clientID] = CLIENT_ARP_INCOMPLETE;
-			}
+			// This line is incomplete, remember this to skip
+			// mock-device creation after ARP processing
+			if(client != NULL)
+				client_status[clientID] = CLIENT_ARP_INCOMPLETE;
+			unlock_shm();
 
 			// Skip to the next row in the neigh cache rather when
 			// marking as incomplete client
 			continue;
 		}
 
-		// Get ID of this device in our network database. If it cannot be
-		// found, then this is a new device. We only use the hardware address
-		// to uniquely identify clients and only use the first returned ID.
-		//
-		// Same MAC, two IPs: Non-deterministic (sequential) DHCP server, we
-		// update the IP address to the last seen one.
-		//
-		// We can run this SELECT inside the currently active transaction as
-		// only the changed to the database are collected for latter
-		// commitment. Read-only access such as this SELECT command will be
-		// executed immediately on the database.
-		int dbID = find_device_by_hwaddr(db, hwaddr);
-
-		if(dbID == DB_FAILED)
-		{
-			// Get SQLite error code and return early from loop
-			rc = sqlite3_errcode(db);
-			break;
-		}
-
-		// If we reach this point, we can check if this client
-		// is known to pihole-FTL
-		// false = do not create a new record if the client is
-		//         unknown (only DNS requesting clients do this)
-		lock_shm();
-		int clientID = findClientID(ip, false, false);
-
 		// Get hostname of this client if the client is known
 		char *hostname = NULL;
-		bool client_valid = false;
 		time_t lastQuery = 0;
 		unsigned int numQueries = 0;
 
 		// This client is known (by its IP address) to pihole-FTL if
 		// findClientID() returned a non-negative index
-		if(clientID >= 0)
+		if(client != NULL)
 		{
-			clientsData *client = getClient(clientID, true);
-			if(!client)
-				continue;
-
-			client_valid = true;
 			hostname = strdup(getstr(client->namepos));
 			lastQuery = client->lastQuery;
 			numQueries = client->numQueriesARP;
 			client_status[clientID] = CLIENT_ARP_COMPLETE;
 		}
-		else
-		{
-			hostname = strdup("");
-		}
 		unlock_shm();
 
+		// Get this device in our network database. If it cannot be
+		// found, then this is a new device. We only use the hardware
+		// address to uniquely identify clients.
+		//
+		// Same MAC, two IPs: Non-deterministic (sequential) DHCP server, we
+		// update the IP address to the last seen one.
+		netDBdevice *device = netDB_find_device_by_hwaddr(&cache, hwaddr);
+		bool accounted = false;
+
 		// Device not in database, add new entry
-		if(dbID == DB_NODATA)
+		if(device == NULL)
 		{
 			// Try to obtain vendor from MAC database
 			char *macVendor = getMACVendor(hwaddr);
 
 			// Check if we recently added a mock-device with the same IP address
 			// and the ARP entry just came a bit delayed (reported by at least one user)
-			dbID = find_recent_device_by_mock_hwaddr(db, ip);
+			device = netDB_find_recent_device_by_mock_hwaddr(&cache, ip);
 
-			if(dbID == DB_NODATA)
+			if(device == NULL)
 			{
 				// Device not known AND no recent mock-device found ---> create new device record
 				if(config.debug & DEBUG_ARP)
@@ -1406,34 +1353,8 @@ void parse_neighbor_cache(sqlite3* db)
 				}
 
 				// Create new record (INSERT)
-				insert_netDB_device(db, hwaddr, now, lastQuery, numQueries, macVendor);
-
-				lock_shm();
-				clientsData *client = getClient(clientID, true);
-				if(client != NULL)
-				{
-					// Reacquire client pointer (if may have changed when unlocking above)
-					client = getClient(clientID, true);
-					// Reset client ARP counter (we stored the entry in the database)
-					client->numQueriesARP = 0;
-				}
-				unlock_shm();
-
-				// Obtain ID which was given to this new entry
-				dbID = sqlite3_last_insert_rowid(db);
-
-				// Store hostname in the appropriate network_address record (if available)
-				if(strlen(hostname) > 0)
-				{
-					rc = update_netDB_name(db, ip, hostname);
-					if(rc != SQLITE_OK)
-					{
-						// Free allocated memory
-						free(hostname);
-						free(macVendor);
-						break;
-					}
-				}
+				device = netDB_insert_device(&cache, hwaddr, now, lastQuery, numQueries, macVendor);
+				accounted = device != NULL;
 			}
 			else
 			{
@@ -1445,17 +1366,17 @@ void parse_neighbor_cache(sqlite3* db)
 				}
 
 				// Update/replace important device properties
-				unmock_netDB_device(db, hwaddr, macVendor, dbID);
-
 				// Host name, count and last query timestamp will be set in the next
 				// loop iteration for the sake of simplicity
+				if(!netDB_unmock_device(&cache, device, hwaddr, macVendor))
+					device = NULL;
 			}
 
 			// Free allocated memory
 			free(macVendor);
 		}
 		// Device in database AND client known to Pi-hole
-		else if(client_valid)
+		else if(hostname != NULL)
 		{
 			if(config.debug & DEBUG_ARP)
 			{
@@ -1463,95 +1384,68 @@ void parse_neighbor_cache(sqlite3* db)
 				     hwaddr, ip, hostname);
 			}
 
-			// Update timestamp of last query if applicable
-			rc = update_netDB_lastQuery(db, dbID, lastQuery);
-			if(rc != SQLITE_OK)
-			{
-				// Free allocated memory
-				free(hostname);
-				break;
-			}
-
-			// Update number of queries if applicable
-			rc = update_netDB_numQueries(db, dbID, numQueries);
-			if(rc != SQLITE_OK)
-			{
-				// Free allocated memory
-				free(hostname);
-				break;
-			}
-
-			lock_shm();
-			// Acquire client pointer
-			clientsData *client = getClient(clientID, true);
-			if(client != NULL)
-			{
-				// Reset client ARP counter (we stored the entry in the database)
-				client->numQueriesARP = 0;
-			}
-			unlock_shm();
-
-			// Update hostname if available
-			rc = update_netDB_name(db, ip, hostname);
-			if(rc != SQLITE_OK)
-			{
-				// Free allocated memory
-				free(hostname);
-				break;
-			}
+			// Update timestamp of last query and number of queries
+			// if applicable
+			netDB_update_device(device, lastQuery, numQueries, NULL);
+			accounted = true;
 		}
 		// else: Device in database but not known to Pi-hole
 
-		free(hostname);
-		hostname = NULL;
-
-		// Store interface if available
-		rc = update_netDB_interface(db, dbID, iface);
-		if(rc != SQLITE_OK)
-			break;
-
 		// Add unique IP address / mock-MAC pair to network_addresses table
-		rc = add_netDB_network_address(db, dbID, ip);
-		if(rc != SQLITE_OK)
+		if(device == NULL || !netDB_add_address(&cache, device->id, ip))
+		{
+			if(hostname != NULL)
+				free(hostname);
+			success = false;
 			break;
+		}
+
+		// Remember the queries accounted for in the database, the client
+		// ARP counter is reset once the transaction has been committed
+		if(accounted)
+			client_accounted[clientID] = numQueries;
+
+		// Store interface and hostname if available
+		netDB_update_device(device, 0, 0, iface);
+		if(hostname != NULL)
+		{
+			netDB_update_name(&cache, ip, hostname);
+			free(hostname);
+		}
 
 		// Count number of processed ARP cache entries
 		entries++;
 	}
 
-	// Close pipe handle and free allocated memory
-	pclose(arpfp);
-	if(linebuffer != NULL)
-		free(linebuffer);
-
-	if(rc != SQLITE_OK)
-	{
-		logg("Database error in ARP cache processing loop");
-		return;
-	}
-
-	// Check thread cancellation
-	if(killed)
-		return;
+	free(neigh);
 
 	// Loop over all clients known to FTL and ensure we add them all to the
 	// database
-	if(!add_FTL_clients_to_network_table(db, client_status, now, &additional_entries))
-		return;
-
-	// Check thread cancellation
-	if(killed)
-		return;
+	if(success && !killed)
+		success = add_FTL_clients_to_network_table(&cache, client_status, client_accounted,
+		                                           clients, &additional_entries);
+	free(client_status);
 
 	// Finally, loop over the available interfaces to ensure we list the
 	// IP addresses correctly (local addresses are NOT contained in the
 	// ARP/neighbor cache).
-	if(!add_local_interfaces_to_network_table(db, now, &additional_entries))
-		return;
+	if(success && !killed)
+		success = add_local_interfaces_to_network_table(&cache, &additional_entries);
+
+	// Write back only the rows which changed during this run
+	unsigned int changed_devices = 0u, changed_addresses = 0u;
+	if(success && !killed)
+		success = netDB_flush(&cache, &changed_devices, &changed_addresses) == SQLITE_OK;
+	netDB_cache_free(&cache);
 
-	// Check thread cancellation
-	if(killed)
+	if(!success || killed)
+	{
+		if(!success)
+			logg("Database error in ARP cache processing loop");
+		dbquery(db, "ROLLBACK TRANSACTION");
+		free(client_accounted);
 		return;
+	}
 
 	// Ensure mock-devices which are not assigned to any addresses any more
 	// (they have been converted to "real" devices), are removed at this point
@@ -1562,6 +1456,8 @@ void parse_neighbor_cache(sqlite3* db)
 	{
 		logg("Database error in mock-device cleaning statement");
 		checkFTLDBrc(rc);
+		dbquery(db, "ROLLBACK TRANSACTION");
+		free(client_accounted);
 		return;
 	}
 
@@ -1575,14 +1471,30 @@ void parse_neighbor_cache(sqlite3* db)
 
 		logg("%s: Storing devices in network table failed: %s", text, sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
+		free(client_accounted);
 		return;
 	}
 
+	// Reset the ARP counters of the clients by the queries which are now
+	// accounted for in the database
+	lock_shm();
+	for(int clientID = 0; clientID < clients; clientID++)
+	{
+		if(client_accounted[clientID] == 0)
+			continue;
+		clientsData *client = getClient(clientID, true);
+		if(client != NULL)
+			client->numQueriesARP = client->numQueriesARP > client_accounted[clientID] ?
+			                        client->numQueriesARP - client_accounted[clientID] : 0;
+	}
+	unlock_shm();
+	free(client_accounted);
+
 	// Debug logging
 	if(config.debug & DEBUG_ARP)
 	{
-		logg("ARP table processing (%i entries from ARP, %i from FTL's cache) took %.1f ms",
-		     entries, additional_entries, timer_elapsed_msec(ARP_TIMER));
+		logg("ARP table processing (%u entries from ARP, %u from FTL's cache, %u devices and %u addresses changed) took %.1f ms",
+		     entries, additional_entries, changed_devices, changed_addresses, timer_elapsed_msec(ARP_TIMER));
 	}
 }
 
@@ -0,0 +1,298 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Time-partitioned query storage routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "query-partitions.h"
+#include "common.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+
+// When partitioning is enabled, queries are stored in one table per day or
+// week instead of the single query_storage table. All partitions are
+// registered in the query_partitions table together with the time range
+// [start, end) they cover. The queries VIEW combines query_storage (which
+// still holds all queries stored before partitioning was enabled) with all
+// partitions. Expiring old queries means dropping entire partitions which
+// is much cheaper than deleting millions of rows from one huge table.
+//
+// Query IDs have to be unique across all tables. We use the AUTOINCREMENT
+// sequence of query_storage as global counter for this, see
+// get_max_query_ID() and set_max_query_ID()
+
+// SQLite3 limits the number of terms in a compound SELECT to 500 by default,
+// we nest larger compounds
+#define MAX_COMPOUND_TERMS 256
+
+bool create_query_partitions_table(sqlite3 *db)
+{
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	// Create table holding the time ranges of all partitions
+	SQL_bool(db, "CREATE TABLE query_partitions (name TEXT PRIMARY KEY, start INTEGER NOT NULL, end INTEGER NOT NULL);");
+
+	// Update database version to 13
+	if(!db_set_FTL_property(db, DB_VERSION, 13))
+	{
+		logg("create_query_partitions_table(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+// Get the nominal range of the partition <timestamp> belongs to. Partitions
+// are aligned to UTC days. Weekly partitions start on Mondays (the epoch
+// was a Thursday)
+static void get_partition_range(const time_t timestamp, time_t *start, time_t *end)
+{
+	if(config.DBpartitioning == DB_PARTITION_WEEK)
+	{
+		const time_t week = 7*86400;
+		*start = timestamp - (timestamp + 3*86400) % week;
+		*end = *start + week;
+	}
+	else
+	{
+		*start = timestamp - timestamp % 86400;
+		*end = *start + 86400;
+	}
+}
+
+// Build a compound SELECT over query_storage and all partitions overlapping
+// with [from, until). Each term is generated from <term> where %s is
+// substituted by the table name. Returns NULL on error, the returned string
+// has to be free'd by the caller using sqlite3_free()
+char *get_query_tables_union(sqlite3 *db, const sqlite3_int64 from, const sqlite3_int64 until, const char *term)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT name FROM query_partitions WHERE end > ?1 AND start < ?2 ORDER BY start", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("get_query_tables_union() - SQL error prepare: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return NULL;
+	}
+	sqlite3_bind_int64(stmt, 1, from);
+	sqlite3_bind_int64(stmt, 2, until);
+
+	// The legacy table always comes first
+	sqlite3_str *sql = sqlite3_str_new(db);
+	sqlite3_str_appendall(sql, "SELECT * FROM (");
+	sqlite3_str_appendf(sql, term, "query_storage");
+
+	unsigned int terms = 1;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		// Start a new nested compound if this one is full
+		if(terms++ % MAX_COMPOUND_TERMS == 0)
+			sqlite3_str_appendall(sql, ") UNION ALL SELECT * FROM (");
+		else
+			sqlite3_str_appendall(sql, " UNION ALL ");
+		sqlite3_str_appendf(sql, term, (const char*)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_str_appendall(sql, ")");
+	sqlite3_finalize(stmt);
+
+	char *result = sqlite3_str_finish(sql);
+	if(rc != SQLITE_DONE)
+	{
+		logg("get_query_tables_union() - SQL error step: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		sqlite3_free(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+// (Re-)create the queries VIEW so it covers all partitions
+bool rebuild_queries_view(sqlite3 *db)
+{
+	char *tables = get_query_tables_union(db, 0, LLONG_MAX, "SELECT "QUERY_COLUMNS" FROM %s");
+	if(tables == NULL)
+		return false;
+
+	SQL_bool(db, "DROP VIEW IF EXISTS queries");
+	const int rc = dbquery(db, "CREATE VIEW queries AS "
+	                             "SELECT id, timestamp, type, status, "
+	                               "CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,"
+	                               "CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,"
+	                               "CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,"
+	                               "CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info, "
+	                               "reply_type, reply_time, dnssec "
+	                               "FROM (%s) q", tables);
+	sqlite3_free(tables);
+
+	return rc == SQLITE_OK;
+}
+
+// Get the time range covered by an existing partition. Returns false if
+// there is no partition covering <timestamp> or on error
+static bool find_query_partition(sqlite3 *db, const time_t timestamp, queryPartition *partition)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT name,start,end FROM query_partitions WHERE start <= ?1 AND end > ?1", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("find_query_partition() - SQL error prepare: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+	sqlite3_bind_int64(stmt, 1, timestamp);
+
+	bool found = false;
+	if((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		strncpy(partition->name, (const char*)sqlite3_column_text(stmt, 0), sizeof(partition->name) - 1);
+		partition->name[sizeof(partition->name) - 1] = '\0';
+		partition->start = sqlite3_column_int64(stmt, 1);
+		partition->end = sqlite3_column_int64(stmt, 2);
+		found = true;
+	}
+	else if(rc != SQLITE_DONE)
+	{
+		logg("find_query_partition() - SQL error step: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+	}
+	sqlite3_finalize(stmt);
+
+	return found;
+}
+
+// Get the partition queries from <timestamp> are stored in, the partition is
+// created if it does not exist yet. This has to be called within a
+// transaction so the new table and the updated VIEW appear atomically
+bool get_query_partition(sqlite3 *db, const time_t timestamp, queryPartition *partition)
+{
+	if(find_query_partition(db, timestamp, partition))
+		return true;
+
+	// Partitions created before the partitioning interval was changed may
+	// overlap with the nominal range. Shrink the new partition to fill the
+	// gap between the existing neighbors
+	get_partition_range(timestamp, &partition->start, &partition->end);
+	char *querystr = NULL;
+	if(asprintf(&querystr, "SELECT MAX(end) FROM query_partitions WHERE end > %lld AND end <= %lld",
+	            (long long)partition->start, (long long)timestamp) > 0)
+	{
+		const int64_t prev_end = db_query_int64(db, querystr);
+		if(prev_end > 0)
+			partition->start = (time_t)prev_end;
+		free(querystr);
+	}
+	if(asprintf(&querystr, "SELECT MIN(start) FROM query_partitions WHERE start > %lld AND start < %lld",
+	            (long long)timestamp, (long long)partition->end) > 0)
+	{
+		const int64_t next_start = db_query_int64(db, querystr);
+		if(next_start > 0)
+			partition->end = (time_t)next_start;
+		free(querystr);
+	}
+
+	// Name partitions after the first day they contain
+	struct tm tm;
+	gmtime_r(&partition->start, &tm);
+	if(partition->start % 86400 == 0)
+		strftime(partition->name, sizeof(partition->name), "query_storage_%Y%m%d", &tm);
+	else
+		strftime(partition->name, sizeof(partition->name), "query_storage_%Y%m%d_%H%M%S", &tm);
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("Creating query partition %s for [%lld, %lld)", partition->name,
+		     (long long)partition->start, (long long)partition->end);
+
+	SQL_bool(db, "CREATE TABLE %s (id INTEGER PRIMARY KEY, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER, additional_info INTEGER, reply_type INTEGER, reply_time REAL, dnssec INTEGER);",
+	         partition->name);
+	SQL_bool(db, "CREATE INDEX idx_%s_timestamps ON %s (timestamp);", partition->name, partition->name);
+	SQL_bool(db, "INSERT INTO query_partitions (name,start,end) VALUES ('%s',%lld,%lld);",
+	         partition->name, (long long)partition->start, (long long)partition->end);
+
+	return rebuild_queries_view(db);
+}
+
+// Drop all partitions which contain only queries older than <cutoff>.
+// Returns the number of dropped partitions or -1 on error
+int drop_expired_query_partitions(sqlite3 *db, const time_t cutoff)
+{
+	// Tables cannot be dropped while there are active statements so we
+	// collect the names of all expired partitions first
+	char *querystr = NULL;
+	if(asprintf(&querystr, "SELECT GROUP_CONCAT(name,' ') FROM query_partitions WHERE end <= %lld", (long long)cutoff) < 0)
+		return -1;
+
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	free(querystr);
+	if(rc != SQLITE_OK)
+	{
+		logg("drop_expired_query_partitions() - SQL error prepare: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return -1;
+	}
+
+	char *names = NULL;
+	if((rc = sqlite3_step(stmt)) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_TEXT)
+		names = strdup((const char*)sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	// Nothing to do
+	if(names == NULL)
+		return rc == SQLITE_ROW ? 0 : -1;
+
+	if(dbquery(db, "BEGIN TRANSACTION IMMEDIATE") != SQLITE_OK)
+	{
+		free(names);
+		return -1;
+	}
+
+	int dropped = 0;
+	bool error = false;
+	char *saveptr = NULL;
+	for(const char *name = strtok_r(names, " ", &saveptr); name != NULL; name = strtok_r(NULL, " ", &saveptr))
+	{
+		if(dbquery(db, "DROP TABLE %s", name) != SQLITE_OK)
+		{
+			error = true;
+			break;
+		}
+		if(config.debug & DEBUG_DATABASE)
+			logg("Dropped expired query partition %s", name);
+		dropped++;
+	}
+	free(names);
+
+	if(error ||
+	   dbquery(db, "DELETE FROM query_partitions WHERE end <= %lld", (long long)cutoff) != SQLITE_OK ||
+	   !rebuild_queries_view(db) ||
+	   dbquery(db, "COMMIT") != SQLITE_OK)
+	{
+		logg("drop_expired_query_partitions(): Failed to drop expired partitions");
+		dbquery(db, "ROLLBACK");
+		return -1;
+	}
+
+	return dropped;
+}
+
+// Update the global query ID counter after storing queries with explicit IDs
+bool set_max_query_ID(sqlite3 *db, const long int id)
+{
+	SQL_bool(db, "UPDATE sqlite_sequence SET seq = %ld WHERE name = 'query_storage' AND seq < %ld;", id, id);
+	if(sqlite3_changes(db) == 0 && db_query_int(db, "SELECT COUNT(*) FROM sqlite_sequence WHERE name = 'query_storage'") == 0)
+		SQL_bool(db, "INSERT INTO sqlite_sequence (name,seq) VALUES ('query_storage',%ld);", id);
+
+	return true;
+}
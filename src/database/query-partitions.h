@@ -0,0 +1,33 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Time-partitioned query storage prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DATABASE_QUERY_PARTITIONS_H
+#define DATABASE_QUERY_PARTITIONS_H
+
+#include "sqlite3.h"
+// LLONG_MAX
+#include <limits.h>
+
+// Columns of the query tables (same order in all of them)
+#define QUERY_COLUMNS "id,timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec"
+
+typedef struct {
+	char name[32];
+	time_t start;
+	time_t end;
+} queryPartition;
+
+bool create_query_partitions_table(sqlite3 *db);
+char *get_query_tables_union(sqlite3 *db, const sqlite3_int64 from, const sqlite3_int64 until, const char *term);
+bool rebuild_queries_view(sqlite3 *db);
+bool get_query_partition(sqlite3 *db, const time_t timestamp, queryPartition *partition);
+int drop_expired_query_partitions(sqlite3 *db, const time_t cutoff);
+bool set_max_query_ID(sqlite3 *db, const long int id);
+
+#endif //DATABASE_QUERY_PARTITIONS_H
@@ -25,6 +25,10 @@
 #include "../config.h"
 // getstr()
 #include "../shmem.h"
+// get_query_partition()
+#include "query-partitions.h"
+// prepare_rollup()
+#include "rollup-table.h"
 
 static bool saving_failed_before = false;
 
@@ -49,13 +53,32 @@ int get_number_of_queries_in_DB(sqlite3 *db)
 	}
 
 	// Count number of rows using the index timestamp is faster than select(*)
-	int result = db_query_int(db, "SELECT COUNT(timestamp) FROM query_storage");
+	int result = DB_FAILED;
+	char *tables = get_query_tables_union(db, 0, LLONG_MAX, "SELECT COUNT(timestamp) n FROM %s");
+	if(tables != NULL)
+	{
+		char *querystr = sqlite3_mprintf("SELECT SUM(n) FROM (%s)", tables);
+		if(querystr != NULL)
+			result = db_query_int(db, querystr);
+		sqlite3_free(querystr);
+		sqlite3_free(tables);
+	}
 
 	if(db_opened) dbclose(&db);
 
 	return result;
 }
 
+// Get the type a query is stored with in the database: the mapped type or,
+// for queries of type OTHER, the query type + 100
+int __attribute__ ((pure)) get_query_type_in_DB(const queriesData *query)
+{
+	if(query->type != TYPE_OTHER)
+		return query->type;
+	else
+		return query->qtype + 100;
+}
+
 int DB_save_queries(sqlite3 *db)
 {
 	// Return early if database is known to be broken
@@ -86,6 +109,7 @@ int DB_save_queries(sqlite3 *db)
 	sqlite3_stmt *client_stmt = NULL;
 	sqlite3_stmt *forward_stmt = NULL;
 	sqlite3_stmt *addinfo_stmt = NULL;
+	sqlite3_stmt *rollup_stmt[ROLLUP_MAX] = { NULL };
 
 	int rc = dbquery(db, "BEGIN TRANSACTION IMMEDIATE");
 	if( rc != SQLITE_OK )
@@ -104,41 +128,8 @@ int DB_save_queries(sqlite3 *db)
 		return DB_FAILED;
 	}
 
-	// Prepare statements
-	rc  = sqlite3_prepare_v3(db, "INSERT INTO query_storage "
-	                                 "(timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec) "
-	                                 "VALUES "
-	                                 "(?1,?2,?3,"
-	                                 "(SELECT id FROM domain_by_id WHERE domain = ?4),"
-	                                 "(SELECT id FROM client_by_id WHERE ip = ?5 AND name = ?6),"
-	                                 "(SELECT id FROM forward_by_id WHERE forward = ?7),"
-	                                 "(SELECT id FROM addinfo_by_id WHERE type = ?8 AND content = ?9),"
-	                                 "?10,?11,?12)",
-	                         -1, SQLITE_PREPARE_PERSISTENT, &query_stmt, NULL);
-	if( rc != SQLITE_OK )
-	{
-		const char *text, *spaces;
-		if( rc == SQLITE_BUSY )
-		{
-			text   = "WARNING";
-			spaces = "       ";
-		}
-		else
-		{
-			text   = "ERROR";
-			spaces = "     ";
-		}
-
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
-
-		if(db_opened) dbclose(&db);
-
-		return DB_FAILED;
-	}
-
+	// Prepare statements. The statement for inserting into the query tables
+	// is prepared below as it depends on the partition we are storing to
 	rc = sqlite3_prepare_v3(db, "INSERT OR IGNORE INTO domain_by_id (domain) VALUES (?)",
 	                        -1, SQLITE_PREPARE_PERSISTENT, &domain_stmt, NULL);
 	if( rc != SQLITE_OK )
@@ -243,9 +234,32 @@ int DB_save_queries(sqlite3 *db)
 		return DB_FAILED;
 	}
 
+	// Prepare statements for the enabled rollups
+	for(unsigned int i = 0; i < ROLLUP_MAX; i++)
+	{
+		if(rollup_enabled(i) && (rollup_stmt[i] = prepare_rollup(db, i)) == NULL)
+		{
+			logg("ERROR: Storing queries in long-term database failed: Cannot prepare rollup");
+			saving_failed_before = true;
+
+			for(unsigned int j = 0; j < i; j++)
+				sqlite3_finalize(rollup_stmt[j]);
+			if(db_opened) dbclose(&db);
+
+			return DB_FAILED;
+		}
+	}
+
 	// Get last ID stored in the database
 	long int lastID = get_max_query_ID(db);
 
+	// Queries are stored in query_storage unless partitioning is enabled.
+	// In this case, they are stored in the partition covering their
+	// timestamp. As queries are mostly sorted by time, the statement needs
+	// to be prepared again only when crossing partition boundaries
+	queryPartition partition = { "query_storage", 0, 0 };
+	const bool partitioned = config.DBpartitioning != DB_PARTITION_NONE;
+
 	int total = 0, blocked = 0;
 	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
@@ -279,20 +293,52 @@ int DB_save_queries(sqlite3 *db)
 			continue;
 		}
 
+		// Prepare statement for the partition of this query if needed
+		if(query_stmt == NULL ||
+		   (partitioned && (query->timestamp < partition.start || query->timestamp >= partition.end)))
+		{
+			if(query_stmt != NULL)
+			{
+				sqlite3_finalize(query_stmt);
+				query_stmt = NULL;
+			}
+
+			if(partitioned && !get_query_partition(db, query->timestamp, &partition))
+			{
+				logg("Encountered error while trying to create partition in long-term database");
+				error = true;
+				break;
+			}
+
+			char *querystr = sqlite3_mprintf("INSERT INTO %s "
+			                                 "(timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec,id) "
+			                                 "VALUES "
+			                                 "(?1,?2,?3,"
+			                                 "(SELECT id FROM domain_by_id WHERE domain = ?4),"
+			                                 "(SELECT id FROM client_by_id WHERE ip = ?5 AND name = ?6),"
+			                                 "(SELECT id FROM forward_by_id WHERE forward = ?7),"
+			                                 "(SELECT id FROM addinfo_by_id WHERE type = ?8 AND content = ?9),"
+			                                 "?10,?11,?12,?13)", partition.name);
+			rc = querystr == NULL ? SQLITE_NOMEM :
+			     sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &query_stmt, NULL);
+			sqlite3_free(querystr);
+			if( rc != SQLITE_OK )
+			{
+				logg("%s: Storing queries in long-term database failed: %s",
+				     rc == SQLITE_BUSY ? "WARNING" : "ERROR", sqlite3_errstr(rc));
+				if(!checkFTLDBrc(rc))
+					logg("Keeping queries in memory for later new attempt");
+				saving_failed_before = true;
+				error = true;
+				break;
+			}
+		}
+
 		// TIMESTAMP
 		sqlite3_bind_int(query_stmt, 1, query->timestamp);
 
 		// TYPE
-		if(query->type != TYPE_OTHER)
-		{
-			// Store mapped type if query->type is not OTHER
-			sqlite3_bind_int(query_stmt, 2, query->type);
-		}
-		else
-		{
-			// Store query type + offset if query-> type is OTHER
-			sqlite3_bind_int(query_stmt, 2, query->qtype + 100);
-		}
+		sqlite3_bind_int(query_stmt, 2, get_query_type_in_DB(query));
 
 		// STATUS
 		sqlite3_bind_int(query_stmt, 3, query->status);
@@ -344,6 +390,9 @@ int DB_save_queries(sqlite3 *db)
 				{
 					// Use transient here as we step only after the buffer is freed below
 					sqlite3_bind_text(query_stmt, 7, buffer, len, SQLITE_TRANSIENT);
+					for(unsigned int i = 0; i < ROLLUP_MAX; i++)
+						if(rollup_stmt[i] != NULL)
+							sqlite3_bind_text(rollup_stmt[i], 7, buffer, len, SQLITE_TRANSIENT);
 					// Use static here as we insert right away
 					sqlite3_bind_text(forward_stmt, 1, buffer, len, SQLITE_STATIC);
 
@@ -434,6 +483,12 @@ int DB_save_queries(sqlite3 *db)
 		// DNSSEC
 		sqlite3_bind_int(query_stmt, 12, query->dnssec);
 
+		// ID (assigned by AUTOINCREMENT in query_storage)
+		if(partitioned)
+			sqlite3_bind_int64(query_stmt, 13, lastID + 1);
+		else
+			sqlite3_bind_null(query_stmt, 13);
+
 		// Step and check if successful
 		if(sqlite3_step(query_stmt) != SQLITE_DONE)
 		{
@@ -444,6 +499,21 @@ int DB_save_queries(sqlite3 *db)
 		sqlite3_clear_bindings(query_stmt);
 		sqlite3_reset(query_stmt);
 
+		// Count this query in the rollups
+		bool rollup_error = false;
+		for(unsigned int i = 0; i < ROLLUP_MAX; i++)
+		{
+			if(rollup_stmt[i] != NULL &&
+			   !step_rollup(rollup_stmt[i], query, domain, clientIP, clientName))
+				rollup_error = true;
+		}
+		if(rollup_error)
+		{
+			logg("Encountered error while trying to update rollups in long-term database");
+			error = true;
+			break;
+		}
+
 		// Increment counters
 		saved++;
 		lastID++;
@@ -465,7 +535,9 @@ int DB_save_queries(sqlite3 *db)
 	   sqlite3_finalize(domain_stmt) != SQLITE_OK ||
 	   sqlite3_finalize(client_stmt) != SQLITE_OK ||
 	   sqlite3_finalize(forward_stmt) != SQLITE_OK ||
-	   sqlite3_finalize(addinfo_stmt) != SQLITE_OK)
+	   sqlite3_finalize(addinfo_stmt) != SQLITE_OK ||
+	   sqlite3_finalize(rollup_stmt[ROLLUP_HOURLY]) != SQLITE_OK ||
+	   sqlite3_finalize(rollup_stmt[ROLLUP_DAILY]) != SQLITE_OK)
 	{
 		logg("Statement finalization failed when trying to store queries to long-term database");
 
@@ -486,6 +558,8 @@ int DB_save_queries(sqlite3 *db)
 	{
 		lastdbindex = queryID;
 		db_set_FTL_property(db, DB_LASTTIMESTAMP, newlasttimestamp);
+		if(partitioned)
+			set_max_query_ID(db, lastID);
 		db_update_counters(db, total, blocked);
 	}
 
@@ -530,6 +604,16 @@ void delete_old_queries_in_DB(sqlite3 *db)
 
 	int timestamp = time(NULL) - config.maxDBdays * 86400;
 
+	// Drop partitions containing only expired queries. Partitions are kept
+	// as a whole until their last query has expired
+	const int dropped = drop_expired_query_partitions(db, timestamp + 1);
+	if(dropped < 0)
+	{
+		logg("delete_old_queries_in_DB(): Dropping partitions due to age of entries failed!");
+		return;
+	}
+
+	// The (legacy) unpartitioned table still needs to be cleaned row-wise
 	if(dbquery(db, "DELETE FROM query_storage WHERE timestamp <= %i", timestamp) != SQLITE_OK)
 	{
 		logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
@@ -540,8 +624,9 @@ void delete_old_queries_in_DB(sqlite3 *db)
 	const int affected = sqlite3_changes(db);
 
 	// Print final message only if there is a difference
-	if((config.debug & DEBUG_DATABASE) || affected)
-		logg("Notice: Database size is %.2f MB, deleted %i rows", 1e-6*get_FTL_db_filesize(), affected);
+	if((config.debug & DEBUG_DATABASE) || affected || dropped)
+		logg("Notice: Database size is %.2f MB, deleted %i rows and %i partition%s",
+		     1e-6*get_FTL_db_filesize(), affected, dropped, dropped == 1 ? "" : "s");
 }
 
 bool add_additional_info_column(sqlite3 *db)
@@ -703,7 +788,24 @@ void DB_read_queries(void)
 	// Get time stamp 24 hours in the past
 	const time_t now = time(NULL);
 	const time_t mintime = now - config.maxlogage;
-	const char *querystr = "SELECT id,timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec FROM queries WHERE timestamp >= ?";
+	// Only read from the partitions overlapping with the requested time range
+	char *querystr = NULL;
+	char *tables = get_query_tables_union(db, mintime, LLONG_MAX, "SELECT "QUERY_COLUMNS" FROM %s WHERE timestamp >= ?1");
+	if(tables != NULL)
+		querystr = sqlite3_mprintf("SELECT id,timestamp,type,status,"
+		                             "CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,"
+		                             "CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,"
+		                             "CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,"
+		                             "CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info,"
+		                             "reply_type,reply_time,dnssec FROM (%s) q", tables);
+	sqlite3_free(tables);
+	if(querystr == NULL)
+	{
+		logg("DB_read_queries() - Failed to get query tables");
+		dbclose(&db);
+		return;
+	}
+
 	// Log FTL_db query string in debug mode
 	if(config.debug & DEBUG_DATABASE)
 		logg("DB_read_queries(): \"%s\" with ? = %lli", querystr, (long long)mintime);
@@ -711,6 +813,7 @@ void DB_read_queries(void)
 	// Prepare SQLite3 statement
 	sqlite3_stmt* stmt = NULL;
 	int rc = sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+	sqlite3_free(querystr);
 	if( rc != SQLITE_OK ){
 		logg("DB_read_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
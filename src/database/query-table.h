@@ -11,12 +11,15 @@
 #define DATABASE_QUERY_TABLE_H
 
 #include "sqlite3.h"
+// type queriesData
+#include "../datastructure.h"
 
 int get_number_of_queries_in_DB(sqlite3 *db);
 void delete_old_queries_in_DB(sqlite3 *db);
 bool add_additional_info_column(sqlite3 *db);
 bool optimize_queries_table(sqlite3 *db);
 bool create_addinfo_table(sqlite3 *db);
+int get_query_type_in_DB(const queriesData *query) __attribute__ ((pure));
 int DB_save_queries(sqlite3 *db);
 void DB_read_queries(void);
 bool add_query_storage_columns(sqlite3 *db);
@@ -0,0 +1,193 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query rollup table routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "rollup-table.h"
+#include "common.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+// get_query_tables_union()
+#include "query-partitions.h"
+// get_query_type_in_DB()
+#include "query-table.h"
+
+// The rollup tables hold the number of queries per hour or day (UTC) for
+// every combination of domain, client, upstream, status and type. Domains,
+// clients and upstreams are referenced by their IDs in the linking tables,
+// queries without upstream are counted with forward = 0. The rollups are
+// updated by DB_save_queries() in the same transaction as the queries
+// themselves and are pruned independently of the queries (ROLLUP_RETENTION)
+
+static const struct {
+	const char *table;
+	unsigned int period;
+} rollups[ROLLUP_MAX] = {
+	{ "query_rollup_hourly", 3600 },
+	{ "query_rollup_daily", 86400 },
+};
+
+// Get the number of days the given rollup is kept, 0 = rollup disabled
+static unsigned int __attribute__ ((pure)) rollup_retention(const enum rollup_type type)
+{
+	return type == ROLLUP_HOURLY ? config.rollup_retention.hourly : config.rollup_retention.daily;
+}
+
+bool rollup_enabled(const enum rollup_type type)
+{
+	return rollup_retention(type) > 0;
+}
+
+// Fill a rollup table from the queries already stored in the database. Old
+// queries may still reference domains, clients and upstreams by their names
+// instead of their IDs in the linking tables. They are mapped to IDs the same
+// way as by prepare_rollup(), missing entries are added to the linking tables.
+// Clients stored by name are only known by their IP address
+static bool backfill_rollup(sqlite3 *db, const enum rollup_type type)
+{
+	const time_t cutoff = time(NULL) - rollup_retention(type) * 86400;
+	char *term = sqlite3_mprintf("SELECT timestamp,domain,client,forward,status,type FROM %%s WHERE timestamp >= %lld",
+	                             (long long)cutoff);
+	if(term == NULL)
+		return false;
+
+	char *tables = get_query_tables_union(db, cutoff, LLONG_MAX, term);
+	sqlite3_free(term);
+	if(tables == NULL)
+		return false;
+
+	int rc = dbquery(db, "INSERT OR IGNORE INTO domain_by_id (domain) "
+	                     "SELECT DISTINCT domain FROM (%s) WHERE typeof(domain) = 'text';", tables);
+	if(rc == SQLITE_OK)
+		rc = dbquery(db, "INSERT OR IGNORE INTO client_by_id (ip,name) "
+		                 "SELECT DISTINCT client,'' FROM (%s) q WHERE typeof(client) = 'text' AND "
+		                 "NOT EXISTS (SELECT 1 FROM client_by_id c WHERE c.ip = q.client);", tables);
+	if(rc == SQLITE_OK)
+		rc = dbquery(db, "INSERT OR IGNORE INTO forward_by_id (forward) "
+		                 "SELECT DISTINCT forward FROM (%s) WHERE typeof(forward) = 'text';", tables);
+	if(rc == SQLITE_OK)
+		rc = dbquery(db, "INSERT INTO %s (timestamp,domain,client,forward,status,type,count) "
+		                 "SELECT timestamp/%u*%u,"
+		                 "CASE typeof(domain) WHEN 'integer' THEN domain ELSE (SELECT id FROM domain_by_id d WHERE d.domain = q.domain) END,"
+		                 "CASE typeof(client) WHEN 'integer' THEN client ELSE (SELECT MIN(id) FROM client_by_id c WHERE c.ip = q.client) END,"
+		                 "CASE typeof(forward) WHEN 'integer' THEN forward WHEN 'text' THEN IFNULL((SELECT id FROM forward_by_id f WHERE f.forward = q.forward),0) ELSE 0 END,"
+		                 "status,type,COUNT(*) "
+		                 "FROM (%s) q GROUP BY 1,2,3,4,5,6;",
+		             rollups[type].table, rollups[type].period, rollups[type].period, tables);
+	sqlite3_free(tables);
+
+	return rc == SQLITE_OK;
+}
+
+bool create_rollup_tables(sqlite3 *db)
+{
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	for(unsigned int i = 0; i < ROLLUP_MAX; i++)
+	{
+		// WITHOUT ROWID: The rollups are only ever accessed through their
+		// primary key which starts with the timestamp
+		SQL_bool(db, "CREATE TABLE %s (timestamp INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER NOT NULL, status INTEGER NOT NULL, type INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, domain, client, forward, status, type)) WITHOUT ROWID;",
+		         rollups[i].table);
+
+		// Import queries stored before rollups were available
+		if(rollup_enabled(i) && !backfill_rollup(db, i))
+		{
+			logg("create_rollup_tables(): Failed to import existing queries into %s!", rollups[i].table);
+			return false;
+		}
+	}
+
+	// Update database version to 14
+	if(!db_set_FTL_property(db, DB_VERSION, 14))
+	{
+		logg("create_rollup_tables(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+// Prepare statement counting one query in the given rollup. The parameters
+// are bound by step_rollup() and the forward destination (?7) is bound by the
+// caller
+sqlite3_stmt *prepare_rollup(sqlite3 *db, const enum rollup_type type)
+{
+	sqlite3_stmt *stmt = NULL;
+	char *querystr = sqlite3_mprintf("INSERT INTO %s (timestamp,domain,client,forward,status,type,count) "
+	                                 "VALUES (?1/%u*%u,"
+	                                 "(SELECT id FROM domain_by_id WHERE domain = ?4),"
+	                                 "(SELECT id FROM client_by_id WHERE ip = ?5 AND name = ?6),"
+	                                 "IFNULL((SELECT id FROM forward_by_id WHERE forward = ?7),0),"
+	                                 "?3,?2,1) "
+	                                 "ON CONFLICT DO UPDATE SET count = count + 1",
+	                                 rollups[type].table, rollups[type].period, rollups[type].period);
+	if(querystr == NULL)
+		return NULL;
+
+	const int rc = sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+	sqlite3_free(querystr);
+	if(rc != SQLITE_OK)
+	{
+		logg("prepare_rollup(%s) - SQL error prepare: %s", rollups[type].table, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return NULL;
+	}
+
+	return stmt;
+}
+
+// Count one query in a rollup table, using the same type and status as the
+// query itself is stored with (see DB_save_queries())
+bool step_rollup(sqlite3_stmt *stmt, const queriesData *query,
+                 const char *domain, const char *clientIP, const char *clientName)
+{
+	sqlite3_bind_int64(stmt, 1, query->timestamp);
+	sqlite3_bind_int(stmt, 2, get_query_type_in_DB(query));
+	sqlite3_bind_int(stmt, 3, query->status);
+	sqlite3_bind_text(stmt, 4, domain, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 5, clientIP, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 6, clientName, -1, SQLITE_STATIC);
+
+	const int rc = sqlite3_step(stmt);
+	sqlite3_clear_bindings(stmt);
+	sqlite3_reset(stmt);
+
+	return rc == SQLITE_DONE;
+}
+
+void delete_old_rollups_in_DB(sqlite3 *db)
+{
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		return;
+
+	for(unsigned int i = 0; i < ROLLUP_MAX; i++)
+	{
+		// Keep disabled rollups as they are
+		if(!rollup_enabled(i))
+			continue;
+
+		const time_t cutoff = time(NULL) - rollup_retention(i) * 86400;
+		if(dbquery(db, "DELETE FROM %s WHERE timestamp < %lld", rollups[i].table, (long long)cutoff) != SQLITE_OK)
+		{
+			logg("delete_old_rollups_in_DB(): Deleting %s due to age of entries failed!", rollups[i].table);
+			continue;
+		}
+
+		if(config.debug & DEBUG_DATABASE)
+			logg("Notice: Deleted %i rows from %s", sqlite3_changes(db), rollups[i].table);
+	}
+}
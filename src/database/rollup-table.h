@@ -0,0 +1,30 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query rollup table prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DATABASE_ROLLUP_TABLE_H
+#define DATABASE_ROLLUP_TABLE_H
+
+#include "sqlite3.h"
+// type queriesData
+#include "../datastructure.h"
+
+enum rollup_type {
+	ROLLUP_HOURLY,
+	ROLLUP_DAILY,
+	ROLLUP_MAX
+} __attribute__ ((packed));
+
+bool create_rollup_tables(sqlite3 *db);
+bool rollup_enabled(const enum rollup_type type) __attribute__ ((pure));
+sqlite3_stmt *prepare_rollup(sqlite3 *db, const enum rollup_type type);
+bool step_rollup(sqlite3_stmt *stmt, const queriesData *query,
+                 const char *domain, const char *clientIP, const char *clientName);
+void delete_old_rollups_in_DB(sqlite3 *db);
+
+#endif //DATABASE_ROLLUP_TABLE_H
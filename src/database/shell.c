@@ -20664,6 +20664,9 @@ static void shellUSleepFunc(
 ** Make sure the database is open.  If it is not, then open it.  If
 ** the database fails to open, print an error message and exit.
 */
+/* Pi-hole modification: Defined in sqlite3-ext.c */
+extern int sqlite3_pihole_latency_init(sqlite3*,const char**,const sqlite3_api_routines*);
+
 static void open_db(ShellState *p, int openFlags){
   if( p->db==0 ){
     const char *zDbFilename = p->pAuxDb->zDbFilename;
@@ -20742,6 +20745,8 @@ static void open_db(ShellState *p, int openFlags){
     sqlite3_regexp_init(p->db, 0, 0);
     sqlite3_ieee_init(p->db, 0, 0);
     sqlite3_series_init(p->db, 0, 0);
+    /* Pi-hole modification: ftl_latency() */
+    sqlite3_pihole_latency_init(p->db, 0, 0);
 #ifndef SQLITE_SHELL_FIDDLE
     sqlite3_fileio_init(p->db, 0, 0);
     sqlite3_completion_init(p->db, 0, 0);
@@ -28,6 +28,8 @@
 
 // isMAC()
 #include "network-table.h"
+// get_metrics_json()
+#include "../metrics.h"
 
 // Counting number of occurrences of a specific char in a string
 static size_t __attribute__ ((pure)) count_char(const char *haystack, const char needle)
@@ -180,6 +182,24 @@ static void subnet_match_impl(sqlite3_context *context, int argc, sqlite3_value
 	sqlite3_result_int(context, match ? cidr : 0);
 }
 
+static void ftl_latency_impl(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+	// This function takes no arguments
+	(void)argc;
+	(void)argv;
+
+	// Get latency metrics of the running FTL instance as JSON object
+	// Returns NULL if FTL is not running
+	char *json = get_metrics_json();
+	if(json == NULL)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+
+	sqlite3_result_text(context, json, -1, free);
+}
+
 int sqlite3_pihole_extensions_init(sqlite3 *db, const char **pzErrMsg, const struct sqlite3_api_routines *pApi)
 {
 	(void)pzErrMsg;  /* Unused parameter */
@@ -196,5 +216,25 @@ int sqlite3_pihole_extensions_init(sqlite3 *db, const char **pzErrMsg, const str
 		     sqlite3_errstr(rc));
 	}
 
+	return rc;
+}
+
+// Only registered on the connection of the embedded SQLite3 shell (see
+// open_db() in shell.c), FTL's own connections do not need it
+int sqlite3_pihole_latency_init(sqlite3 *db, const char **pzErrMsg, const struct sqlite3_api_routines *pApi)
+{
+	(void)pzErrMsg;  /* Unused parameter */
+
+	// Register new sqlite function ftl_latency taking no arguments. The
+	// result changes over time so this function is not deterministic
+	const int rc = sqlite3_create_function(db, "ftl_latency", 0, SQLITE_UTF8, NULL,
+	                                       ftl_latency_impl, NULL, NULL);
+
+	if(rc != SQLITE_OK)
+	{
+		logg("Error while initializing the SQLite3 extension ftl_latency: %s",
+		     sqlite3_errstr(rc));
+	}
+
 	return rc;
 }
\ No newline at end of file
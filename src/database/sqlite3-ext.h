@@ -10,3 +10,4 @@
 
 // Initialization point for SQLite3 extensions
 extern int sqlite3_pihole_extensions_init(sqlite3 *db, const char **pzErrMsg, const struct sqlite3_api_routines *pApi);
+extern int sqlite3_pihole_latency_init(sqlite3 *db, const char **pzErrMsg, const struct sqlite3_api_routines *pApi);
@@ -16,6 +16,8 @@
 #include "regex_r.h"
 // reload_per_client_regex()
 #include "database/gravity-db.h"
+// gravity_diff_prepare_cache()
+#include "database/gravity-diff.h"
 // bool startup
 #include "main.h"
 // reset_aliasclient()
@@ -267,10 +269,15 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// This may be a alias-client, the ID is set elsewhere
 	client->flags.aliasclient = aliasclient;
 	client->aliasclient_id = -1;
+	client->members.first = -1;
+	client->members.next = -1;
 
 	// Initialize client-specific overTime data
 	memset(client->overTime, 0, sizeof(client->overTime));
 
+	// The rate-limiting bucket is filled on the first query
+	memset(&client->rate_limit, 0, sizeof(client->rate_limit));
+
 	// Store client ID
 	client->id = clientID;
 
@@ -496,27 +503,65 @@ void FTL_reset_per_client_domain_data(void)
 // Reloads all domainlists and performs a few extra tasks such as cleaning the
 // message table
 // May only be called from the database thread
+//
+// The new gravity database connection, its list statements and the regex
+// filters are prepared without holding the SHM lock. Queries arriving in the
+// meantime are still answered using the current set which is only replaced
+// (and retired) once the new one is ready
 void FTL_reload_all_domainlists(void)
 {
+	// Prepare new gravity database connection and read and compile possible
+	// regex filters from it
+	bool staged = gravityDB_stage(), discarded = false;
+	int gravity = DB_FAILED;
+	if(staged)
+	{
+		// Get number of blocked domains
+		gravity = gravityDB_count(GRAVITY_TABLE);
+		if(gravityDB_staged())
+			stage_regex_from_database();
+
+		// Errors on the staged connection discard it, the current one
+		// is kept in this case (including its number of blocked domains)
+		if(!gravityDB_staged())
+		{
+			discard_staged_regex();
+			staged = false;
+			discarded = true;
+		}
+		else
+		{
+			// Find cached blocking decisions affected by the changes
+			gravity_diff_prepare_cache();
+		}
+	}
+	if(!staged)
+		logg("WARN: Cannot use new gravity database, keeping the current one");
+
 	lock_shm();
 
-	// (Re-)open gravity database connection
-	gravityDB_reopen();
+	if(staged)
+	{
+		// Swap in the new gravity database connection and regex filters
+		gravityDB_swap();
+		swap_staged_regex();
+
+		// Reset FTL's internal DNS cache storing whether a specific
+		// domain has already been validated for a specific user. Only
+		// entries possibly affected by the changes are reset
+		gravity_diff_apply_cache();
+	}
+	else if(!discarded)
+		gravity = gravityDB_count(GRAVITY_TABLE);
+	else
+		gravity = counters->gravity;
 
 	// Reset number of blocked domains
-	counters->gravity = gravityDB_count(GRAVITY_TABLE);
-
-	// Read and compile possible regex filters
-	// only after having called gravityDB_open()
-	read_regex_from_database();
+	counters->gravity = gravity;
 
 	// Check for inaccessible adlist URLs
 	check_inaccessible_adlists();
 
-	// Reset FTL's internal DNS cache storing whether a specific domain
-	// has already been validated for a specific user
-	FTL_reset_per_client_domain_data();
-
 	unlock_shm();
 }
 
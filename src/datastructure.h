@@ -61,6 +61,13 @@ typedef struct {
 	size_t ippos;
 	size_t namepos;
 	time_t lastQuery;
+	// Exponentially weighted moving averages of round-trip time and
+	// failure rate (see upstreams.c)
+	struct {
+		float rtt;
+		float failures;
+		time_t checked;
+	} ewma;
 } upstreamsData;
 
 typedef struct {
@@ -77,8 +84,11 @@ typedef struct {
 	int count;
 	int blockedcount;
 	int aliasclient_id;
+	struct {
+		int first;
+		int next;
+	} members;
 	unsigned int id;
-	unsigned int rate_limit;
 	unsigned int numQueriesARP;
 	int overTime[OVERTIME_SLOTS];
 	size_t groupspos;
@@ -87,6 +97,12 @@ typedef struct {
 	size_t ifacepos;
 	time_t lastQuery;
 	time_t firstSeen;
+	struct {
+		float tokens;
+		unsigned int refused;
+		time_t refilled;
+		time_t since;
+	} rate_limit;
 } clientsData;
 
 typedef struct {
@@ -132,8 +132,9 @@ void *blockdata_retrieve(struct blockdata *block, size_t len, void *data)
   struct  blockdata *b;
   void *new, *d;
   
-  static unsigned int buff_len = 0;
-  static unsigned char *buff = NULL;
+  /* Pi-hole modification: per-thread, used by verify() in the DNSSEC workers */
+  static __thread unsigned int buff_len = 0;
+  static __thread unsigned char *buff = NULL;
    
   if (!data)
     {
@@ -211,7 +211,7 @@ void rehash(int size)
     }
 }
   
-static struct crec **hash_bucket(char *name)
+static unsigned int hash_name(char *name)
 {
   unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
   const unsigned char *mix_tab = (const unsigned char*)typestr; 
@@ -224,8 +224,13 @@ static struct crec **hash_bucket(char *name)
       val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
     } 
   
+  return val ^ (val >> 16);
+}
+
+static struct crec **hash_bucket(char *name)
+{
   /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+  return hash_table + (hash_name(name) & (hash_size - 1));
 }
 
 static void cache_hash(struct crec *crecp)
@@ -737,6 +742,9 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
     new->addr = *addr;	
 
   new->ttd = now + (time_t)ttl;
+  /* Pi-hole modification */
+  new->ttl = ttl;
+  /************************/
   new->next = new_chain;
   new_chain = new;
   
@@ -899,6 +907,292 @@ int cache_recv_insert(time_t now, int fd)
     }
 }
 	
+/* Pi-hole modification */
+/* Persistent cache. Live records learned from upstream are written to
+   --cache-file on exit and every CACHE_SAVE_INTERVAL seconds, and those
+   which haven't expired yet are loaded again at startup so that the cache
+   is warm right away. Records are encoded like the ones sent up the pipe by
+   TCP children, but with the original TTL added and, for CNAMEs, the name
+   of the target, as targets aren't stored right in front of their CNAMEs. */
+#define CACHE_FILE_MAGIC   0x46544c43 /* "FTLC" */
+#define CACHE_FILE_VERSION 1
+#define CACHE_FILE_BUFSIZE 65536 /* records are small, write them in chunks */
+
+static int cache_persistent(struct crec *crecp, time_t now)
+{
+  return (crecp->flags & F_FORWARD) &&
+    !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)) &&
+    difftime(crecp->ttd, now) > 0 &&
+    !((crecp->flags & F_CNAME) && (crecp->addr.cname.is_name_ptr || is_outdated_cname_pointer(crecp)));
+}
+
+static int cache_write(FILE *f, const void *data, size_t len)
+{
+  return fwrite(data, 1, len, f) == len;
+}
+
+static int cache_write_block(FILE *f, struct blockdata *block, size_t len)
+{
+  void *data;
+
+  if (len == 0)
+    return 1;
+
+  return (data = blockdata_retrieve(block, len, NULL)) && cache_write(f, data, len);
+}
+
+static int cache_write_crec(struct crec *crecp, FILE *f)
+{
+  char *name = cache_get_name(crecp);
+  ssize_t m = strlen(name);
+  unsigned int flags = crecp->flags & ~(F_BIGNAME | F_NAMEP);
+#ifdef HAVE_DNSSEC
+  u16 class = crecp->uid;
+#endif
+  
+  if (!cache_write(f, &m, sizeof(m)) ||
+      !cache_write(f, name, m) ||
+      !cache_write(f, &crecp->ttd, sizeof(crecp->ttd)) ||
+      !cache_write(f, &crecp->ttl, sizeof(crecp->ttl)) ||
+      !cache_write(f, &flags, sizeof(flags)))
+    return 0;
+
+  if ((flags & (F_IPV4 | F_IPV6 | F_DNSKEY | F_DS | F_SRV)) &&
+      !cache_write(f, &crecp->addr, sizeof(crecp->addr)))
+    return 0;
+  
+  if ((flags & F_SRV) && !(flags & F_NEG) &&
+      !cache_write_block(f, crecp->addr.srv.target, crecp->addr.srv.targetlen))
+    return 0;
+#ifdef HAVE_DNSSEC
+  if (flags & (F_DNSKEY | F_DS))
+    {
+      if (!cache_write(f, &class, sizeof(class)))
+	return 0;
+      if (!(flags & F_NEG) &&
+	  !cache_write_block(f, crecp->addr.key.keydata, crecp->addr.key.keylen))
+	return 0;
+    }
+#endif
+
+  if (flags & F_CNAME)
+    {
+      name = cache_get_name(crecp->addr.cname.target.cache);
+      m = strlen(name);
+      if (!cache_write(f, &m, sizeof(m)) ||
+	  !cache_write(f, name, m))
+	return 0;
+    }
+
+  return 1;
+}
+
+static int same_set(struct crec *a, struct crec *b, time_t now)
+{
+  return cache_persistent(b, now) &&
+    !(a->flags & F_CNAME) == !(b->flags & F_CNAME) &&
+    hostname_isequal(cache_get_name(a), cache_get_name(b));
+}
+
+void cache_save(time_t now)
+{
+  unsigned int header[3] = { CACHE_FILE_MAGIC, CACHE_FILE_VERSION, sizeof(union all_addr) };
+  struct crec *crecp, *tmp;
+  int fd, i, cnames, count = 0, ok;
+  ssize_t m = -1;
+  char *newname, *buf;
+  FILE *f;
+  
+  if (!daemon->cache_file || !(newname = whine_malloc(strlen(daemon->cache_file) + 5 + CACHE_FILE_BUFSIZE)))
+    return;
+
+  buf = newname + strlen(daemon->cache_file) + 5;
+  sprintf(newname, "%s.new", daemon->cache_file);
+  
+  if ((fd = open(newname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1 ||
+      !(f = fdopen(fd, "w")))
+    {
+      my_syslog(LOG_ERR, _("cannot write cache file %s: %s"), newname, strerror(errno));
+      if (fd != -1)
+	{
+	  close(fd);
+	  unlink(newname);
+	}
+      free(newname);
+      return;
+    }
+  
+  setvbuf(f, buf, _IOFBF, CACHE_FILE_BUFSIZE);
+  ok = cache_write(f, header, sizeof(header));
+
+  /* All records of a name go out together, the loader inserts them as one set.
+     CNAMEs come last, so their targets are already in the cache when loading. */
+  for (cnames = 0; ok && cnames < 2; cnames++)
+    for (i = 0; ok && i < hash_size; i++)
+      for (crecp = hash_table[i]; ok && crecp; crecp = crecp->hash_next)
+	{
+	  if (!cache_persistent(crecp, now) || !(crecp->flags & F_CNAME) != !cnames)
+	    continue;
+
+	  /* Already written with an earlier record of the same name? */
+	  for (tmp = hash_table[i]; tmp != crecp; tmp = tmp->hash_next)
+	    if (same_set(crecp, tmp, now))
+	      break;
+	  
+	  if (tmp == crecp)
+	    for (; ok && tmp; tmp = tmp->hash_next)
+	      if (same_set(crecp, tmp, now))
+		{
+		  ok = cache_write_crec(tmp, f);
+		  count++;
+		}
+	}
+
+  if (ok)
+    ok = cache_write(f, &m, sizeof(m));
+  
+  /* fclose() flushes what's left in the buffer. */
+  if (fclose(f) != 0 || !ok || rename(newname, daemon->cache_file) == -1)
+    {
+      my_syslog(LOG_ERR, _("cannot write cache file %s: %s"), newname, strerror(errno));
+      unlink(newname);
+    }
+  else
+    my_syslog(LOG_INFO, _("saved %d cache entries to %s"), count, daemon->cache_file);
+  
+  free(newname);
+}
+
+/* Called once at startup, before any queries are answered. */
+void cache_load(time_t now)
+{
+  unsigned int header[3], flags, ttl;
+  int fd, count = 0;
+  char *prev, *target;
+  union all_addr addr;
+  struct crec *crecp;
+  time_t ttd;
+  ssize_t m;
+  
+  if (!daemon->cache_file)
+    return;
+  
+  if ((fd = open(daemon->cache_file, O_RDONLY)) == -1)
+    {
+      if (errno != ENOENT)
+	my_syslog(LOG_ERR, _("cannot read cache file %s: %s"), daemon->cache_file, strerror(errno));
+      return;
+    }
+
+  if (!read_write(fd, (unsigned char *)header, sizeof(header), 1) ||
+      header[0] != CACHE_FILE_MAGIC || header[1] != CACHE_FILE_VERSION || header[2] != sizeof(union all_addr) ||
+      !(prev = whine_malloc(2 * MAXDNAME)))
+    {
+      my_syslog(LOG_WARNING, _("ignoring cache file %s: unknown format"), daemon->cache_file);
+      close(fd);
+      return;
+    }
+  
+  target = prev + MAXDNAME;
+  *prev = 0;
+  cache_start_insert();
+  
+  while (read_write(fd, (unsigned char *)&m, sizeof(m), 1) && m >= 0 && m < MAXDNAME)
+    {
+      int keep;
+      
+      if (!read_write(fd, (unsigned char *)daemon->namebuff, m, 1) ||
+	  !read_write(fd, (unsigned char *)&ttd, sizeof(ttd), 1) ||
+	  !read_write(fd, (unsigned char *)&ttl, sizeof(ttl), 1) ||
+	  !read_write(fd, (unsigned char *)&flags, sizeof(flags), 1))
+	break;
+
+      daemon->namebuff[m] = 0;
+      keep = difftime(ttd, now) > 0;
+      crecp = NULL;
+
+      /* Each name is a separate insert, one bad record shouldn't spoil the rest. */
+      if (!hostname_isequal(prev, daemon->namebuff))
+	{
+	  cache_end_insert();
+	  cache_start_insert();
+	  strcpy(prev, daemon->namebuff);
+	}
+      
+      if (flags & (F_IPV4 | F_IPV6 | F_DNSKEY | F_DS | F_SRV))
+	{
+	  unsigned short class = C_IN;
+	  
+	  if (!read_write(fd, (unsigned char *)&addr, sizeof(addr), 1))
+	    break;
+	  
+	  if ((flags & F_SRV) && !(flags & F_NEG) && !(addr.srv.target = blockdata_read(fd, addr.srv.targetlen)))
+	    break;
+#ifdef HAVE_DNSSEC
+	  if (flags & (F_DNSKEY | F_DS))
+	    {
+	      if (!read_write(fd, (unsigned char *)&class, sizeof(class), 1) ||
+		  (!(flags & F_NEG) && !(addr.key.keydata = blockdata_read(fd, addr.key.keylen))))
+		break;
+	    }
+#endif
+	  
+	  if (keep)
+	    crecp = really_insert(daemon->namebuff, &addr, class, now, difftime(ttd, now), flags);
+	  
+	  if (!crecp)
+	    {
+	      if ((flags & F_SRV) && !(flags & F_NEG))
+		blockdata_free(addr.srv.target);
+#ifdef HAVE_DNSSEC
+	      else if ((flags & (F_DNSKEY | F_DS)) && !(flags & F_NEG))
+		blockdata_free(addr.key.keydata);
+#endif
+	    }
+	}
+      else if (flags & F_CNAME)
+	{
+	  struct crec *tcrecp;
+
+	  if (!read_write(fd, (unsigned char *)&m, sizeof(m), 1) || m < 0 || m >= MAXDNAME ||
+	      !read_write(fd, (unsigned char *)target, m, 1))
+	    break;
+	  
+	  target[m] = 0;
+	  
+	  for (tcrecp = keep ? *hash_bucket(target) : NULL; tcrecp; tcrecp = tcrecp->hash_next)
+	    if ((tcrecp->flags & F_FORWARD) && !(tcrecp->flags & (F_DNSKEY | F_DS)) &&
+		!is_expired(now, tcrecp) && hostname_isequal(cache_get_name(tcrecp), target))
+	      break;
+
+	  /* Don't restore CNAMEs whose target is gone. */
+	  if (tcrecp && (crecp = really_insert(daemon->namebuff, NULL, C_IN, now, difftime(ttd, now), flags)))
+	    {
+	      next_uid(tcrecp);
+	      crecp->addr.cname.is_name_ptr = 0;
+	      crecp->addr.cname.target.cache = tcrecp;
+	      crecp->addr.cname.uid = tcrecp->uid;
+	    }
+	}
+      else if (keep)
+	crecp = really_insert(daemon->namebuff, NULL, C_IN, now, difftime(ttd, now), flags);
+
+      /* really_insert() returns /etc/hosts and DHCP records duplicating ours. */
+      if (crecp && !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
+	{
+	  crecp->ttl = ttl;
+	  count++;
+	}
+    }
+  
+  cache_end_insert();
+  close(fd);
+  free(prev);
+  
+  my_syslog(LOG_INFO, _("loaded %d cache entries from %s"), count, daemon->cache_file);
+}
+/************************/
+
 int cache_find_non_terminal(char *name, time_t now)
 {
   struct crec *crecp;
@@ -1070,8 +1364,12 @@ void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen,
   struct crec *lookup = NULL;
 
   /* Remove duplicates in hosts files. */
-  while ((lookup = cache_find_by_name(lookup, cache_get_name(cache), 0, cache->flags & (F_IPV4 | F_IPV6))))
-    if ((lookup->flags & F_HOSTS) && memcmp(&lookup->addr, addr, addrlen) == 0)
+  /* Pi-hole modification: walk the name's hash chain directly,
+     cache_find_by_name() reorders it and is much slower */
+  for (lookup = *hash_bucket(cache_get_name(cache)); lookup; lookup = lookup->hash_next)
+    if ((lookup->flags & F_HOSTS) && (lookup->flags & cache->flags & (F_IPV4 | F_IPV6)) &&
+	memcmp(&lookup->addr, addr, addrlen) == 0 &&
+	hostname_isequal(cache_get_name(lookup), cache_get_name(cache)))
       {
 	free(cache);
 	return;
@@ -1096,8 +1394,10 @@ void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen,
   if (rhash)
     {
       /* hash address */
+      /* Pi-hole modification: j*2 covered only a few thousand buckets for IPv4 */
       for (j = 0, i = 0; i < addrlen; i++)
-	j = (j*2 +((unsigned char *)addr)[i]) % hashsz;
+	j = j*33 + ((unsigned char *)addr)[i];
+      j %= hashsz;
       
       for (lookup = rhash[j]; lookup; lookup = lookup->next)
 	if ((lookup->flags & cache->flags & (F_IPV4 | F_IPV6)) &&
@@ -1128,71 +1428,170 @@ void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen,
   make_non_terminals(cache);
 }
 
-static int eatspace(FILE *f)
+/* Pi-hole modification */
+/* Hosts files with millions of lines are common, so they are read into
+   memory in one go and tokenised in place rather than read through stdio.
+   They are not mapped, a concurrent writer truncating the file (e.g. when
+   reloading it on inotify events) would crash us with SIGBUS. */
+struct hostsbuf {
+  char *data, *p, *end;
+  size_t len;
+};
+
+static int hostsbuf_open(struct hostsbuf *b, char *filename)
 {
-  int c, nl = 0;
+  struct stat st;
+  size_t size = 0;
+  ssize_t n;
+  int fd, errsave;
 
-  while (1)
+  b->data = NULL;
+  b->len = 0;
+  
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    return 0;
+  
+  if (fstat(fd, &st) == -1)
     {
-      if ((c = getc(f)) == '#')
-	while (c != '\n' && c != EOF)
-	  c = getc(f);
-      
-      if (c == EOF)
-	return 1;
+      errsave = errno;
+      close(fd);
+      errno = errsave;
+      return 0;
+    }
+  
+  /* Read regular files with a single read() unless they grow meanwhile */
+  if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (b->data = whine_malloc(st.st_size + 1)))
+    size = st.st_size + 1;
 
-      if (!isspace(c))
+  while (1)
+    {
+      if (b->len == size)
 	{
-	  ungetc(c, f);
-	  return nl;
+	  char *new;
+	  
+	  if (!(new = whine_realloc(b->data, size + 65536)))
+	    break;
+	  b->data = new;
+	  size += 65536;
 	}
-
-      if (c == '\n')
-	nl++;
+      
+      if ((n = read(fd, b->data + b->len, size - b->len)) > 0)
+	b->len += n;
+      else if (n == 0 || errno != EINTR)
+	break;
     }
+
+  close(fd);
+  b->p = b->data;
+  b->end = b->data + b->len;
+
+  return 1;
 }
-	 
-static int gettok(FILE *f, char *token)
+
+static void hostsbuf_close(struct hostsbuf *b)
 {
-  int c, count = 0;
- 
+  if (b->data)
+    free(b->data);
+}
+
+static int eatspace(struct hostsbuf *b)
+{
+  int nl = 0;
+
   while (1)
     {
-      if ((c = getc(f)) == EOF)
-	return (count == 0) ? -1 : 1;
+      if (b->p == b->end)
+	return 1;
 
-      if (isspace(c) || c == '#')
+      if (*b->p == '#')
 	{
-	  ungetc(c, f);
-	  return eatspace(f);
+	  char *eol = memchr(b->p, '\n', b->end - b->p);
+	  b->p = eol ? eol : b->end;
+	  continue;
 	}
       
-      if (count < (MAXDNAME - 1))
-	{
-	  token[count++] = c;
-	  token[count] = 0;
-	}
+      if (!isspace((unsigned char)*b->p))
+	return nl;
+
+      if (*b->p++ == '\n')
+	nl++;
     }
 }
+	 
+static int gettok(struct hostsbuf *b, char *token)
+{
+  char *start = b->p;
+  size_t len;
 
-int read_hostsfile(char *filename, unsigned int index, int cache_size, struct crec **rhash, int hashsz)
+  if (b->p == b->end)
+    return -1;
+  
+  while (b->p < b->end && !isspace((unsigned char)*b->p) && *b->p != '#')
+    b->p++;
+
+  if ((len = b->p - start) > MAXDNAME - 1)
+    len = MAXDNAME - 1;
+  memcpy(token, start, len);
+  token[len] = 0;
+
+  return eatspace(b);
+}
+
+/* When re-reading a file, take the entry for an unchanged line from the
+   records the file had before instead of inserting a new one. */
+static int hosts_reuse(struct crec *cache, union all_addr *addr, int addrlen,
+		       struct crec **stale, unsigned int stalesz)
+{
+  char *name = cache_get_name(cache);
+  struct crec *crecp, **up;
+  
+  for (up = &stale[hash_name(name) & (stalesz - 1)]; (crecp = *up); up = &crecp->next)
+    if ((crecp->flags & cache->flags & (F_IPV4 | F_IPV6)) &&
+	memcmp(&crecp->addr, addr, addrlen) == 0 &&
+	hostname_isequal(cache_get_name(crecp), name))
+      {
+	*up = crecp->next;
+	cache_hash(crecp);
+	return 1;
+      }
+
+  return 0;
+}
+
+static int read_hostsfile_real(char *filename, unsigned int index, int cache_size, struct crec **rhash, int hashsz,
+			       struct crec **stale, unsigned int stalesz)
 {  
-  FILE *f = fopen(filename, "r");
+  struct hostsbuf b;
   char *token = daemon->namebuff, *domain_suffix = NULL;
   int names_done = 0, name_count = cache_size, lineno = 1;
   unsigned int flags = 0;
   union all_addr addr;
   int atnl, addrlen = 0;
 
-  if (!f)
+  if (!hostsbuf_open(&b, filename))
     {
       my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
       return cache_size;
     }
+
+  if (rhash)
+    {
+      /* One name per line is the common case, size the hash table for
+	 that right away instead of growing it every 1000 names. */
+      char *p;
+      int lines = 0;
+
+      for (p = b.data; p && (p = memchr(p, '\n', b.end - p)); p++)
+	lines++;
+      
+      rehash(cache_size + lines);
+      cache_size += lines;
+    }
   
-  lineno += eatspace(f);
+  lineno += eatspace(&b);
   
-  while ((atnl = gettok(f, token)) != -1)
+  while ((atnl = gettok(&b, token)) != -1)
     {
       if (inet_pton(AF_INET, token, &addr) > 0)
 	{
@@ -1210,7 +1609,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	{
 	  my_syslog(LOG_ERR, _("bad address at %s line %d"), filename, lineno); 
 	  while (atnl == 0)
-	    atnl = gettok(f, token);
+	    atnl = gettok(&b, token);
 	  lineno += atnl;
 	  continue;
 	}
@@ -1228,7 +1627,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	  int fqdn, nomem;
 	  char *canon;
 	  
-	  if ((atnl = gettok(f, token)) == -1)
+	  if ((atnl = gettok(&b, token)) == -1)
 	    break;
 
 	  fqdn = !!strchr(token, '.');
@@ -1244,7 +1643,10 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 		  strcat(cache->name.sname, domain_suffix);
 		  cache->flags = flags;
 		  cache->ttd = daemon->local_ttl;
-		  add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
+		  if (stale && hosts_reuse(cache, &addr, addrlen, stale, stalesz))
+		    free(cache);
+		  else
+		    add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
 		  name_count++;
 		  names_done++;
 		}
@@ -1253,7 +1655,10 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 		  strcpy(cache->name.sname, canon);
 		  cache->flags = flags;
 		  cache->ttd = daemon->local_ttl;
-		  add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
+		  if (stale && hosts_reuse(cache, &addr, addrlen, stale, stalesz))
+		    free(cache);
+		  else
+		    add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
 		  name_count++;
 		  names_done++;
 		}
@@ -1267,7 +1672,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
       lineno += atnl;
     } 
 
-  fclose(f);
+  hostsbuf_close(&b);
   
   if (rhash)
     rehash(name_count); 
@@ -1276,12 +1681,77 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
   
   return name_count;
 }
+
+int read_hostsfile(char *filename, unsigned int index, int cache_size, struct crec **rhash, int hashsz)
+{
+  return read_hostsfile_real(filename, index, cache_size, rhash, hashsz, NULL, 0);
+}
+
+/* Re-read a file from a hosts directory after inotify reported a change.
+   Records for lines which are still there stay in the cache as they are,
+   only added and removed names are applied. Returns the number of names
+   removed. */
+unsigned int reload_hostsfile(char *filename, unsigned int index)
+{
+  struct crec *crecp, *tmp, **up, **stale;
+  unsigned int removed = 0, count = 0, stalesz, i;
+
+  for (i = 0; i < (unsigned int)hash_size; i++)
+    for (crecp = hash_table[i]; crecp; crecp = crecp->hash_next)
+      if ((crecp->flags & F_HOSTS) && crecp->uid == index)
+	count++;
+
+  for (stalesz = 64; stalesz < count; stalesz <<= 1);
+
+  if (!(stale = whine_malloc(stalesz * sizeof(struct crec *))))
+    {
+      removed = cache_remove_uid(index);
+      read_hostsfile(filename, index, 0, NULL, 0);
+      return removed;
+    }
+
+  /* Move the file's records out of the cache into a hash of their own,
+     chained by ->next which is unused for hosts entries. */
+  for (i = 0; i < (unsigned int)hash_size; i++)
+    for (crecp = hash_table[i], up = &hash_table[i]; crecp; crecp = tmp)
+      {
+	tmp = crecp->hash_next;
+	if ((crecp->flags & F_HOSTS) && crecp->uid == index)
+	  {
+	    unsigned int j = hash_name(cache_get_name(crecp)) & (stalesz - 1);
+	    
+	    *up = tmp;
+	    crecp->next = stale[j];
+	    stale[j] = crecp;
+	  }
+	else
+	  up = &crecp->hash_next;
+      }
+  
+  read_hostsfile_real(filename, index, 0, NULL, 0, stale, stalesz);
+
+  /* Whatever wasn't claimed again is gone from the file. */
+  for (i = 0; i < stalesz; i++)
+    for (crecp = stale[i]; crecp; crecp = tmp)
+      {
+	tmp = crecp->next;
+	free(crecp);
+	removed++;
+      }
+
+  free(stale);
+
+  return removed;
+}
+/************************/
 	    
 void cache_reload(void)
 {
-  struct crec *cache, **up, *tmp;
+  struct crec *cache, **up, *tmp, **rhash; /* Pi-hole modification */
   int revhashsz, i, total_size = daemon->cachesize;
   struct hostsfile *ah;
+  struct stat st; /* Pi-hole modification */
+  off_t hosts_size = 0; /* Pi-hole modification */
   struct host_record *hr;
   struct name_list *nl;
   struct cname *a;
@@ -1297,6 +1767,11 @@ void cache_reload(void)
 
   daemon->metrics[METRIC_DNS_CACHE_INSERTED] = 0;
   daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED] = 0;
+
+#ifdef HAVE_DNSSEC
+  /* Pi-hole modification */
+  dnssec_aggressive_flush();
+#endif
   
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
@@ -1356,11 +1831,33 @@ void cache_reload(void)
       }
 #endif
   
-  /* borrow the packet buffer for a temporary by-address hash */
-  memset(daemon->packet, 0, daemon->packet_buff_sz);
+  /* Pi-hole modification */
+  /* Size the by-address hash from the hosts files we are about to read,
+     a few thousand buckets are far too few for lists with millions of
+     names. Roughly one address per 32 bytes of file. */
+  if (daemon->addn_hosts)
+    daemon->addn_hosts = expand_filelist(daemon->addn_hosts);
+  
+  if (!option_bool(OPT_NO_HOSTS) && stat(HOSTSFILE, &st) == 0)
+    hosts_size += st.st_size;
+  
+  for (ah = daemon->addn_hosts; ah; ah = ah->next)
+    if (!(ah->flags & AH_INACTIVE) && stat(ah->fname, &st) == 0)
+      hosts_size += st.st_size;
+
   revhashsz = daemon->packet_buff_sz / sizeof(struct crec *);
-  /* we overwrote the buffer... */
-  daemon->srv_save = NULL;
+  if (hosts_size / 32 > revhashsz &&
+      (rhash = whine_malloc((hosts_size / 32) * sizeof(struct crec *))))
+    revhashsz = hosts_size / 32;
+  else
+    {
+      /* borrow the packet buffer for a temporary by-address hash */
+      memset(daemon->packet, 0, daemon->packet_buff_sz);
+      rhash = (struct crec **)daemon->packet;
+      /* we overwrote the buffer... */
+      daemon->srv_save = NULL;
+    }
+  /************************/
 
   /* Do host_records in config. */
   for (hr = daemon->host_records; hr; hr = hr->next)
@@ -1372,7 +1869,7 @@ void cache_reload(void)
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4 | F_NAMEP | F_CONFIG;
-	    add_hosts_entry(cache, (union all_addr *)&hr->addr, INADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    add_hosts_entry(cache, (union all_addr *)&hr->addr, INADDRSZ, SRC_CONFIG, rhash, revhashsz);
 	  }
 
 	if ((hr->flags & HR_6) &&
@@ -1381,7 +1878,7 @@ void cache_reload(void)
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV6 | F_NAMEP | F_CONFIG;
-	    add_hosts_entry(cache, (union all_addr *)&hr->addr6, IN6ADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    add_hosts_entry(cache, (union all_addr *)&hr->addr6, IN6ADDRSZ, SRC_CONFIG, rhash, revhashsz);
 	  }
       }
 	
@@ -1393,12 +1890,11 @@ void cache_reload(void)
   else
     {
       if (!option_bool(OPT_NO_HOSTS))
-	total_size = read_hostsfile(HOSTSFILE, SRC_HOSTS, total_size, (struct crec **)daemon->packet, revhashsz);
+	total_size = read_hostsfile(HOSTSFILE, SRC_HOSTS, total_size, rhash, revhashsz);
       
-      daemon->addn_hosts = expand_filelist(daemon->addn_hosts);
       for (ah = daemon->addn_hosts; ah; ah = ah->next)
 	if (!(ah->flags & AH_INACTIVE))
-	  total_size = read_hostsfile(ah->fname, ah->index, total_size, (struct crec **)daemon->packet, revhashsz);
+	  total_size = read_hostsfile(ah->fname, ah->index, total_size, rhash, revhashsz);
     }
   
   /* Make non-terminal records for all locally-define RRs */
@@ -1435,9 +1931,13 @@ void cache_reload(void)
     }
   
 #ifdef HAVE_INOTIFY
-  set_dynamic_inotify(AH_HOSTS, total_size, (struct crec **)daemon->packet, revhashsz);
+  set_dynamic_inotify(AH_HOSTS, total_size, rhash, revhashsz);
 #endif
-  
+
+  /* Pi-hole modification */
+  if (rhash != (struct crec **)daemon->packet)
+    free(rhash);
+  /************************/
 } 
 
 #ifdef HAVE_DHCP
@@ -1905,6 +2405,16 @@ void dump_cache(time_t now)
 #ifdef HAVE_AUTH
   my_syslog(LOG_INFO, _("queries for authoritative zones %u"), daemon->metrics[METRIC_DNS_AUTH_ANSWERED]);
 #endif
+#ifdef HAVE_DNSSEC
+  /* Pi-hole modification */
+  if (option_bool(OPT_DNSSEC_VALID))
+    {
+      my_syslog(LOG_INFO, _("DNSSEC signature verifications %u, answered from signature cache %u"),
+		daemon->metrics[METRIC_DNSSEC_SIG_CACHE_MISS], daemon->metrics[METRIC_DNSSEC_SIG_CACHE_HIT]);
+      my_syslog(LOG_INFO, _("negative answers synthesised from NSEC/NSEC3 %u"),
+		daemon->metrics[METRIC_DNSSEC_AGGRESSIVE_NEG]);
+    }
+#endif
 
   blockdata_report();
 
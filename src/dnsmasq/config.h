@@ -19,10 +19,18 @@
 #define CHILD_LIFETIME 300 /* secs 'till terminated (RFC1035 suggests > 120s) */
 #define TCP_MAX_QUERIES 100 /* Maximum number of queries per incoming TCP connection */
 #define TCP_BACKLOG 32  /* kernel backlog limit for TCP connections */
+#define TCP_MAX_WORKERS 16 /* Upper limit for --tcp-workers, has to be below MAX_PROCS */
+#define TCP_WORKER_LIFETIME 60 /* secs before an idle pre-forked TCP worker is replaced */
 #define EDNS_PKTSZ 1232 /* default max EDNS.0 UDP packet from from  /dnsflagday.net/2020 */
 #define SAFE_PKTSZ 1232 /* "go anywhere" UDP packet size, see https://dnsflagday.net/2020/ */
 #define KEYBLOCK_LEN 40 /* choose to minimise fragmentation when storing DNSSEC keys */
 #define DNSSEC_WORK 50 /* Max number of queries to validate one question */
+#define DNSSEC_SIG_CACHE 1024 /* Successful signature verifications remembered, multiple of 4 */
+#define DNSSEC_NSEC_ZONES 64 /* Zones with NSEC/NSEC3 spans remembered for aggressive negative caching */
+#define DNSSEC_NSEC_SPANS 64 /* NSEC/NSEC3 spans remembered per zone */
+#define DNSSEC_NSEC3_ITERATIONS 150 /* NSEC3 with more iterations is not used for aggressive negative caching, RFC 9276 */
+#define DNSSEC_MAX_WORKERS 16 /* Upper limit for --dnssec-workers */
+#define DNSSEC_ASYNC_TASKS 64 /* Signature checks handed to the workers per reply */
 #define TIMEOUT 10     /* drop UDP queries after TIMEOUT seconds */
 #define SMALL_PORT_RANGE 30 /* If DNS port range is smaller than this, use different allocation. */
 #define FORWARD_TEST 1000 /* try all servers every 1000 queries */
@@ -63,6 +71,7 @@
 #define LOOP_TEST_TYPE T_TXT
 #define DEFAULT_FAST_RETRY 1000 /* ms, default delay before fast retry */
 #define STALE_CACHE_EXPIRY 86400 /* 1 day in secs, default maximum expiry time for stale cache data */
+#define CACHE_SAVE_INTERVAL 3600 /* secs between writes of --cache-file */
  
 /* compile-time options: uncomment below to enable or do eg.
    make COPTS=-DHAVE_BROKEN_RTC
@@ -161,8 +161,9 @@ static int dnsmasq_rsa_verify(struct blockdata *key_data, unsigned int key_len,
   unsigned char *p;
   size_t exp_len;
   
-  static struct rsa_public_key *key = NULL;
-  static mpz_t sig_mpz;
+  /* Pi-hole modification: per-thread, verify() also runs in the DNSSEC workers */
+  static __thread struct rsa_public_key *key = NULL;
+  static __thread mpz_t sig_mpz;
 
   (void)digest_len;
   
@@ -215,9 +216,10 @@ static int dnsmasq_ecdsa_verify(struct blockdata *key_data, unsigned int key_len
   unsigned int t;
   struct ecc_point *key;
 
-  static struct ecc_point *key_256 = NULL, *key_384 = NULL;
-  static mpz_t x, y;
-  static struct dsa_signature *sig_struct;
+  /* Pi-hole modification: per-thread, verify() also runs in the DNSSEC workers */
+  static __thread struct ecc_point *key_256 = NULL, *key_384 = NULL;
+  static __thread mpz_t x, y;
+  static __thread struct dsa_signature *sig_struct;
 #if !MIN_VERSION(3, 4)
 #define nettle_get_secp_256r1() (&nettle_secp_256r1)
 #define nettle_get_secp_384r1() (&nettle_secp_384r1)
@@ -288,9 +290,10 @@ static int dnsmasq_gostdsa_verify(struct blockdata *key_data, unsigned int key_l
 {
   unsigned char *p;
   
-  static struct ecc_point *gost_key = NULL;
-  static mpz_t x, y;
-  static struct dsa_signature *sig_struct;
+  /* Pi-hole modification: per-thread, verify() also runs in the DNSSEC workers */
+  static __thread struct ecc_point *gost_key = NULL;
+  static __thread mpz_t x, y;
+  static __thread struct dsa_signature *sig_struct;
 
   if (algo != 12 ||
       sig_len != 64 || key_len != 64 ||
@@ -418,6 +421,53 @@ int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig,
   return (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
 }
 
+/* Pi-hole modification */
+/* Return the data a signature is checked against. This is the digest
+   itself except for the EdDSA algorithms, where the "null hash" digest
+   only refers to the whole message. */
+unsigned char *digest_data(unsigned char *digest, size_t *digest_len, int algo)
+{
+#if MIN_VERSION(3, 1)
+  char *name = algo_digest_name(algo);
+
+  if (name && strcmp(name, null_hash.name) == 0)
+    {
+      struct null_hash_digest *null_digest = (struct null_hash_digest *)digest;
+
+      *digest_len = null_digest->len;
+      return null_digest->buff;
+    }
+#else
+  (void)algo;
+#endif
+
+  return digest;
+}
+
+/* Counterpart of verify() taking the data returned by digest_data() instead
+   of the digest. It doesn't use the shared null_hash buffer, so it can be
+   called from the DNSSEC worker threads. */
+int verify_data(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+		unsigned char *data, size_t data_len, int algo)
+{
+#if MIN_VERSION(3, 1)
+  char *name = algo_digest_name(algo);
+
+  if (name && strcmp(name, null_hash.name) == 0)
+    {
+      struct null_hash_digest null_digest;
+
+      null_digest.buff = data;
+      null_digest.len = data_len;
+
+      return verify(key_data, key_len, sig, sig_len, (unsigned char *)&null_digest, sizeof(null_digest), algo);
+    }
+#endif
+
+  return verify(key_data, key_len, sig, sig_len, data, data_len, algo);
+}
+/************************/
+
 /* Note the ds_digest_name(), algo_digest_name() and nsec3_digest_name()
    define which algo numbers we support. If algo_digest_name() returns
    non-NULL for an algorithm number, we assume that algorithm is 
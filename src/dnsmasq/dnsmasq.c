@@ -35,6 +35,8 @@ static char terminate = 0;
 
 static void set_dns_listeners(void);
 static void check_dns_listeners(time_t now);
+static void tcp_pool_init(void); /* Pi-hole modification */
+static int tcp_pool_maintain(time_t now); /* Pi-hole modification */
 static void sig_handler(int sig);
 static void async_event(int pipe, time_t now);
 static void fatal_event(struct event_desc *ev, char *msg);
@@ -43,7 +45,7 @@ static void poll_resolv(int force, int do_reload, time_t now);
 
 int main_dnsmasq (int argc, char **argv)
 {
-  time_t now;
+  time_t now, last_cache_save; /* Pi-hole modification */
   struct sigaction sigact;
   struct iname *if_tmp;
   int piperead, pipefd[2], err_pipe[2];
@@ -929,6 +931,16 @@ int main_dnsmasq (int argc, char **argv)
       for (ds = daemon->ds; ds; ds = ds->next)
 	my_syslog(LOG_INFO, _("configured with trust anchor for %s keytag %u"),
 		  ds->name[0] == 0 ? "<root>" : ds->name, ds->keytag);
+
+      /* Pi-hole modification */
+      if (daemon->dnssec_workers > 0)
+	{
+	  if ((daemon->dnssec_workers = dnssec_async_init(daemon->dnssec_workers)) > 0)
+	    my_syslog(LOG_INFO, _("DNSSEC signature checks done by %d worker threads"), daemon->dnssec_workers);
+	  else
+	    my_syslog(LOG_WARNING, _("cannot start DNSSEC worker threads, validating synchronously"));
+	}
+      /************************/
     }
 #endif
 
@@ -1060,6 +1072,8 @@ int main_dnsmasq (int argc, char **argv)
   daemon->pipe_to_parent = -1;
   for (i = 0; i < MAX_PROCS; i++)
     daemon->tcp_pipes[i] = -1;
+
+  tcp_pool_init(); /* Pi-hole modification */
   
 #ifdef HAVE_INOTIFY
   /* Using inotify, have to select a resolv file at startup */
@@ -1068,6 +1082,7 @@ int main_dnsmasq (int argc, char **argv)
 
   /*** Pi-hole modification ***/
   terminate = killed;
+  last_cache_save = now;
   /****************************/
   
   while (!terminate)
@@ -1086,6 +1101,15 @@ int main_dnsmasq (int argc, char **argv)
 	       (timeout == -1 || timeout > 1000))
 	timeout = 1000;
       
+      /* Pi-hole modification */
+      if (daemon->tcp_workers > 0)
+	{
+	  int wait = tcp_pool_maintain(now);
+	  if (wait != -1 && (timeout == -1 || timeout > wait))
+	    timeout = wait;
+	}
+      /************************/
+
       set_dns_listeners();
 
 #ifdef HAVE_DBUS
@@ -1229,6 +1253,14 @@ int main_dnsmasq (int argc, char **argv)
 
       if (poll_check(piperead, POLLIN))
 	async_event(piperead, now);
+
+      /* Pi-hole modification */
+      if (daemon->cache_file && difftime(now, last_cache_save) >= CACHE_SAVE_INTERVAL)
+	{
+	  cache_save(now);
+	  last_cache_save = now;
+	}
+      /************************/
       
 #ifdef HAVE_DBUS
       /* if we didn't create a DBus connection, retry now. */ 
@@ -1493,6 +1525,12 @@ static void async_event(int pipe, time_t now)
 	
       case EVENT_INIT:
 	clear_cache_and_reload(now);
+
+	/* Pi-hole modification */
+	/* EVENT_INIT is handled before the first query is read. */
+	if (ev.event == EVENT_INIT)
+	  cache_load(now);
+	/************************/
 	
 	if (daemon->port != 0)
 	  {
@@ -1548,7 +1586,13 @@ static void async_event(int pipe, time_t now)
 	  else 
 	    for (i = 0 ; i < MAX_PROCS; i++)
 	      if (daemon->tcp_pids[i] == p)
-		daemon->tcp_pids[i] = 0;
+		{
+		  daemon->tcp_pids[i] = 0;
+		  /*** Pi-hole modification ***/
+		  if (daemon->tcp_pipes[i] == -1)
+		    FTL_TCP_worker_released(i);
+		  /*** Pi-hole modification ***/
+		}
 	break;
 	
 #if defined(HAVE_SCRIPT)	
@@ -1644,6 +1688,8 @@ static void async_event(int pipe, time_t now)
 	if (daemon->runfile)
 	  unlink(daemon->runfile);
 
+	cache_save(now); /* Pi-hole modification */
+
 #ifdef HAVE_DUMPFILE
 	if (daemon->dumpfd != -1)
 	  close(daemon->dumpfd);
@@ -1739,6 +1785,7 @@ void clear_cache_and_reload(time_t now)
   (void)now;
 
   FTL_dnsmasq_reload();
+  tcp_pool_retire(); /* Pi-hole modification */
 
   if (daemon->port != 0)
     cache_reload();
@@ -1763,12 +1810,343 @@ void clear_cache_and_reload(time_t now)
 #endif
 }
 
+/* Pi-hole modification: pool of pre-forked TCP workers (--tcp-workers).
+   They occupy the first TCP process slots and handle one connection after
+   another. The connections are handed over through a UNIX socket together
+   with what tcp_request() needs to know about them. This saves forking for
+   every connection and the workers keep their gravity database connection
+   across connections. Their copy of the cache, the server list and the
+   configuration is the one they were forked with, so idle workers are
+   replaced after these have been reloaded and after TCP_WORKER_LIFETIME. */
+struct tcp_pool_job {
+  union mysockaddr local_addr;
+  struct in_addr netmask;
+  int auth_dns;
+  int have_iface;
+  unsigned int log_id;
+};
+
+static struct {
+  int fd; /* -1 if the slot is empty or the worker is exiting */
+  int busy;
+  time_t forked;
+  unsigned int generation;
+} tcp_pool[TCP_MAX_WORKERS];
+
+static unsigned int tcp_pool_generation = 0;
+
+static void tcp_pool_init(void)
+{
+  int i;
+
+  for (i = 0; i < TCP_MAX_WORKERS; i++)
+    tcp_pool[i].fd = -1;
+
+  if (option_bool(OPT_DEBUG) || daemon->port == 0)
+    daemon->tcp_workers = 0;
+  else if (daemon->tcp_workers > 0)
+    my_syslog(LOG_INFO, _("TCP connections handled by %d pre-forked workers"), daemon->tcp_workers);
+}
+
+void tcp_pool_retire(void)
+{
+  tcp_pool_generation++;
+}
+
+static int tcp_pool_current(int slot, time_t now)
+{
+  return tcp_pool[slot].generation == tcp_pool_generation &&
+    difftime(now, tcp_pool[slot].forked) < TCP_WORKER_LIFETIME;
+}
+
+/* Find an idle worker which may be handed a new connection. */
+static int tcp_pool_idle(time_t now)
+{
+  int i;
+
+  for (i = 0; i < daemon->tcp_workers; i++)
+    if (tcp_pool[i].fd != -1 && !tcp_pool[i].busy && tcp_pool_current(i, now))
+      return i;
+
+  return -1;
+}
+
+/* Child processes must not keep our end of the workers' sockets open,
+   the workers wouldn't notice that they have been replaced otherwise. */
+static void tcp_pool_close_fds(void)
+{
+  int i;
+
+  for (i = 0; i < daemon->tcp_workers; i++)
+    if (tcp_pool[i].fd != -1)
+      {
+	close(tcp_pool[i].fd);
+	tcp_pool[i].fd = -1;
+      }
+}
+
+static int tcp_pool_send(int fd, int confd, struct tcp_pool_job *job)
+{
+  union {
+    struct cmsghdr align; /* this ensures alignment */
+    char control[CMSG_SPACE(sizeof(int))];
+  } control_u;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmptr;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control_u, 0, sizeof(control_u));
+  iov.iov_base = job;
+  iov.iov_len = sizeof(*job);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_u.control;
+  msg.msg_controllen = sizeof(control_u.control);
+
+  cmptr = CMSG_FIRSTHDR(&msg);
+  cmptr->cmsg_level = SOL_SOCKET;
+  cmptr->cmsg_type = SCM_RIGHTS;
+  cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmptr), &confd, sizeof(int));
+
+  while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+
+  return n == (ssize_t)sizeof(*job);
+}
+
+/* Returns the connection or -1 once the main process closed the socket. */
+static int tcp_pool_recv(int fd, struct tcp_pool_job *job)
+{
+  union {
+    struct cmsghdr align; /* this ensures alignment */
+    char control[CMSG_SPACE(sizeof(int))];
+  } control_u;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmptr;
+  int confd = -1;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = job;
+  iov.iov_len = sizeof(*job);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_u.control;
+  msg.msg_controllen = sizeof(control_u.control);
+
+  while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+
+  if (n <= 0)
+    return -1;
+
+  for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+    if (cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS)
+      memcpy(&confd, CMSG_DATA(cmptr), sizeof(int));
+
+  if (confd != -1 && n != (ssize_t)sizeof(*job))
+    {
+      close(confd);
+      confd = -1;
+    }
+
+  return confd;
+}
+
+static void tcp_pool_worker(int fd)
+{
+  struct tcp_pool_job job;
+  int confd;
+
+  FTL_TCP_pool_worker_created();
+
+  while ((confd = tcp_pool_recv(fd, &job)) != -1)
+    {
+      unsigned char *buff, done = 0;
+      struct server *s;
+      union all_addr local;
+      int flags;
+
+      /* Same time limit as for a worker forked for this connection. */
+      alarm(CHILD_LIFETIME);
+      daemon->log_id = job.log_id;
+
+      /* start with no upstream connections. */
+      for (s = daemon->servers; s; s = s->next)
+	s->tcpfd = -1;
+
+      /* The connected socket inherits non-blocking
+	 attribute from the listening socket.
+	 Reset that here. */
+      if ((flags = fcntl(confd, F_GETFL, 0)) != -1)
+	while(retry_send(fcntl(confd, F_SETFL, flags & ~O_NONBLOCK)));
+
+      /* Our interface list is a copy of the one the main process had when
+	 we were forked, find the interface by its address. */
+      if (job.local_addr.sa.sa_family == AF_INET6)
+	local.addr6 = job.local_addr.in6.sin6_addr;
+      else
+	local.addr4 = job.local_addr.in.sin_addr;
+
+      FTL_iface(NULL, job.have_iface ? &local : NULL, job.local_addr.sa.sa_family);
+      FTL_TCP_worker_created(confd);
+
+      /* tcp_request() closes confd. */
+      buff = tcp_request(confd, dnsmasq_time(), &job.local_addr, job.netmask, job.auth_dns);
+
+      if (buff)
+	free(buff);
+
+      for (s = daemon->servers; s; s = s->next)
+	if (s->tcpfd != -1)
+	  {
+	    shutdown(s->tcpfd, SHUT_RDWR);
+	    close(s->tcpfd);
+	    s->tcpfd = -1;
+	  }
+
+      alarm(0);
+      flush_log();
+
+      /* Ready for the next connection. */
+      if (!read_write(fd, &done, 1, 0))
+	break;
+    }
+
+  FTL_TCP_worker_terminating(true);
+  close(fd);
+  close(daemon->pipe_to_parent);
+  flush_log();
+  _exit(0);
+}
+
+static void tcp_pool_fork(int slot, time_t now)
+{
+  int sv[2], pipefd[2];
+  pid_t p;
+
+  /* Don't fork again and again if workers die right away. */
+  tcp_pool[slot].forked = now;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+    return;
+
+  if (pipe(pipefd) == -1)
+    {
+      close(sv[0]);
+      close(sv[1]);
+      return;
+    }
+
+  if ((p = fork()) == -1)
+    {
+      close(sv[0]);
+      close(sv[1]);
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return;
+    }
+
+  if (p != 0)
+    {
+#ifdef HAVE_LINUX_NETWORK
+      /* See the comment re: netlink socket in check_dns_listeners(). */
+      unsigned char a;
+      read_write(pipefd[0], &a, 1, 1);
+#endif
+      close(sv[1]);
+      close(pipefd[1]);
+      fix_fd(sv[0]);
+
+      daemon->tcp_pids[slot] = p;
+      daemon->tcp_pipes[slot] = pipefd[0];
+      tcp_pool[slot].fd = sv[0];
+      tcp_pool[slot].busy = 0;
+      tcp_pool[slot].generation = tcp_pool_generation;
+      FTL_TCP_worker_forked(slot, true);
+      return;
+    }
+
+#ifdef HAVE_LINUX_NETWORK
+  {
+    unsigned char a = 0;
+
+    close(daemon->netlinkfd);
+    read_write(pipefd[1], &a, 1, 0);
+  }
+#endif
+  close(sv[0]);
+  close(pipefd[0]);
+  tcp_pool_close_fds();
+  daemon->pipe_to_parent = pipefd[1];
+
+  tcp_pool_worker(sv[1]);
+}
+
+/* Replace outdated idle workers and fork workers for empty slots. Returns
+   the number of ms after which this should be done again or -1. */
+static int tcp_pool_maintain(time_t now)
+{
+  int i, wait = -1;
+
+  for (i = 0; i < daemon->tcp_workers; i++)
+    {
+      if (tcp_pool[i].fd != -1 && !tcp_pool[i].busy && !tcp_pool_current(i, now))
+	{
+	  /* The worker exits once we close its socket. Its slot is
+	     free again when it has been reaped and we read all its data. */
+	  close(tcp_pool[i].fd);
+	  tcp_pool[i].fd = -1;
+	}
+      
+      if (tcp_pool[i].fd == -1 && daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1 &&
+	  difftime(now, tcp_pool[i].forked) >= 1)
+	tcp_pool_fork(i, now);
+
+      if (tcp_pool[i].fd == -1)
+	wait = 1000;
+      else if (!tcp_pool[i].busy)
+	{
+	  int left = 1000 * (int)difftime(tcp_pool[i].forked + TCP_WORKER_LIFETIME, now);
+	  if (wait == -1 || wait > left)
+	    wait = left;
+	}
+    }
+
+  return wait;
+}
+
+static int tcp_pool_dispatch(int slot, int confd, union mysockaddr *local_addr, struct irec *iface)
+{
+  struct tcp_pool_job job;
+
+  memset(&job, 0, sizeof(job));
+  job.local_addr = *local_addr;
+  if (iface)
+    {
+      job.netmask = iface->netmask;
+      job.auth_dns = iface->dns_auth;
+      job.have_iface = 1;
+    }
+  job.log_id = daemon->log_id;
+
+  if (!tcp_pool_send(tcp_pool[slot].fd, confd, &job))
+    return 0;
+
+  tcp_pool[slot].busy = 1;
+  FTL_TCP_worker_dispatched(slot);
+  return 1;
+}
+/************************/
+
 static void set_dns_listeners(void)
 {
   struct serverfd *serverfdp;
   struct listener *listener;
   struct randfd_list *rfl;
-  int i;
+  int i, pool; /* Pi-hole modification */
   
 #ifdef HAVE_TFTP
   int  tftp = 0;
@@ -1791,12 +2169,31 @@ static void set_dns_listeners(void)
   /* Check overflow random sockets too. */
   for (rfl = daemon->rfl_poll; rfl; rfl = rfl->next)
     poll_listen(rfl->rfd->fd, POLLIN);
+
+#ifdef HAVE_DNSSEC
+  /* Pi-hole modification */
+  if (daemon->dnssec_workers > 0)
+    poll_listen(dnssec_async_fd(), POLLIN);
+  /************************/
+#endif
   
   /* check to see if we have free tcp process slots. */
-  for (i = MAX_PROCS - 1; i >= 0; i--)
+  for (i = MAX_PROCS - 1; i >= daemon->tcp_workers; i--) /* Pi-hole modification */
     if (daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1)
       break;
 
+  /*** Pi-hole modification ***/
+  /* The first slots belong to the pre-forked workers. */
+  pool = tcp_pool_idle(dnsmasq_time());
+  if (i < daemon->tcp_workers && pool < 0)
+    i = -1;
+  FTL_TCP_pool_saturated(i < 0);
+
+  for (pool = 0; pool < daemon->tcp_workers; pool++)
+    if (tcp_pool[pool].fd != -1)
+      poll_listen(tcp_pool[pool].fd, POLLIN);
+  /*** Pi-hole modification ***/
+
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
       if (listener->fd != -1)
@@ -1844,6 +2241,13 @@ static void check_dns_listeners(time_t now)
     if (poll_check(rfl->rfd->fd, POLLIN))
       reply_query(rfl->rfd->fd, now);
 
+#ifdef HAVE_DNSSEC
+  /* Pi-hole modification */
+  if (daemon->dnssec_workers > 0 && poll_check(dnssec_async_fd(), POLLIN))
+    dnssec_async_reply(now);
+  /************************/
+#endif
+
   /* Races. The child process can die before we read all of the data from the
      pipe, or vice versa. Therefore send tcp_pids to zero when we wait() the 
      process, and tcp_pipes to -1 and close the FD when we read the last
@@ -1859,10 +2263,40 @@ static void check_dns_listeners(time_t now)
 	{
 	  close(daemon->tcp_pipes[i]);
 	  daemon->tcp_pipes[i] = -1;	
+	  /*** Pi-hole modification ***/
+	  if (daemon->tcp_pids[i] == 0)
+	    FTL_TCP_worker_released(i);
+	  /*** Pi-hole modification ***/
 	}
+
+  /*** Pi-hole modification ***/
+  /* Pre-forked TCP workers report back after each connection. */
+  for (i = 0; i < daemon->tcp_workers; i++)
+    if (tcp_pool[i].fd != -1 && poll_check(tcp_pool[i].fd, POLLIN | POLLHUP))
+      {
+	unsigned char done;
+	ssize_t n;
+
+	while ((n = read(tcp_pool[i].fd, &done, 1)) == -1 && errno == EINTR);
+
+	if (n == -1 && errno == EAGAIN)
+	  continue;
+
+	/* Anything but a report means that the worker has gone. */
+	if (n != 1)
+	  {
+	    close(tcp_pool[i].fd);
+	    tcp_pool[i].fd = -1;
+	  }
+
+	tcp_pool[i].busy = 0;
+	FTL_TCP_worker_released(i);
+      }
+  /*** Pi-hole modification ***/
 	
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
+      int pool; /* Pi-hole modification */
 
       if (listener->fd != -1 && poll_check(listener->fd, POLLIN))
 	receive_query(listener, now); 
@@ -1877,10 +2311,17 @@ static void check_dns_listeners(time_t now)
 	 at least one a poll() time, that we still do.
 	 There may be more waiting connections after
 	 poll() returns then free process slots. */
-      for (i = MAX_PROCS - 1; i >= 0; i--)
+      for (i = MAX_PROCS - 1; i >= daemon->tcp_workers; i--) /* Pi-hole modification */
 	if (daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1)
 	  break;
 
+      /*** Pi-hole modification ***/
+      /* Prefer an idle pre-forked worker over forking a new one. */
+      pool = tcp_pool_idle(now);
+      if (i < daemon->tcp_workers && pool < 0)
+	i = -1;
+      /*** Pi-hole modification ***/
+
       if (listener->tcpfd != -1 && i >= 0 && poll_check(listener->tcpfd, POLLIN))
 	{
 	  int confd, client_ok = 1;
@@ -1964,6 +2405,21 @@ static void check_dns_listeners(time_t now)
 	      shutdown(confd, SHUT_RDWR);
 	      close(confd);
 	    }
+	  /*** Pi-hole modification ***/
+	  else if (pool >= 0 && tcp_pool_dispatch(pool, confd, &tcp_addr, iface))
+	    {
+	      close(confd);
+
+	      /* The worker can use up to TCP_MAX_QUERIES ids, so skip that many. */
+	      daemon->log_id += TCP_MAX_QUERIES;
+	    }
+	  else if (i < daemon->tcp_workers)
+	    {
+	      /* Handing over failed and there is no slot to fork a worker. */
+	      shutdown(confd, SHUT_RDWR);
+	      close(confd);
+	    }
+	  /*** Pi-hole modification ***/
 	  else if (!option_bool(OPT_DEBUG) && pipe(pipefd) == 0 && (p = fork()) != 0)
 	    {
 	      close(pipefd[1]); /* parent needs read pipe end. */
@@ -1993,6 +2449,9 @@ static void check_dns_listeners(time_t now)
 		  /* i holds index of free slot */
 		  daemon->tcp_pids[i] = p;
 		  daemon->tcp_pipes[i] = pipefd[0];
+		  /*** Pi-hole modification ***/
+		  FTL_TCP_worker_forked(i, false);
+		  /*** Pi-hole modification ***/
 		}
 	      close(confd);
 
@@ -2032,6 +2491,7 @@ static void check_dns_listeners(time_t now)
 		  alarm(CHILD_LIFETIME);
 		  close(pipefd[0]); /* close read end in child. */
 		  daemon->pipe_to_parent = pipefd[1];
+		  tcp_pool_close_fds(); /* Pi-hole modification */
 		}
 
 	      /* start with no upstream connections. */
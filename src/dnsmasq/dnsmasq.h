@@ -475,6 +475,9 @@ struct crec {
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
   unsigned int flags;
+  /* Pi-hole modification */
+  unsigned int ttl; /* original TTL, used for prefetching */
+  /************************/
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -755,6 +758,10 @@ struct dyndir {
 #define FREC_TEST_PKTSZ       256
 #define FREC_HAS_EXTRADATA    512
 #define FREC_HAS_PHEADER     1024
+/* Pi-hole modification */
+#define FREC_ASYNC           2048
+#define FREC_ASYNC_DONE      4096
+/************************/
 
 #define HASH_SIZE 32 /* SHA-256 digest size */
 
@@ -782,6 +789,7 @@ struct frec {
   struct frec *dependent; /* Query awaiting internally-generated DNSKEY or DS query */
   struct frec *next_dependent; /* list of above. */
   struct frec *blocking_query; /* Query which is blocking us. */
+  struct async_job *async_job; /* Signature checks we are parked for, Pi-hole modification */
 #endif
   struct frec *next;
 };
@@ -814,6 +822,9 @@ struct frec {
 #define LEASE_TA            64  /* IPv6 temporary lease */
 #define LEASE_HAVE_HWADDR  128  /* Have set hwaddress */
 #define LEASE_EXP_CHANGED  256  /* Lease expiry time changed */
+/* Pi-hole modification */
+#define LEASE_JOURNAL      512  /* not yet written to the lease journal */
+/************************/
 
 struct dhcp_lease {
   int clid_len;          /* length of client identifier */
@@ -844,6 +855,10 @@ struct dhcp_lease {
   } *slaac_address;
   int vendorclass_count;
 #endif
+  /* Pi-hole modification */
+  u64 seq;               /* allocation order */
+  struct dhcp_lease *clid_next, *hw_next, *addr_next; /* hash chains */
+  /************************/
   struct dhcp_lease *next;
 };
 
@@ -1207,9 +1222,12 @@ extern struct daemon {
   u32 metrics[__METRIC_MAX];
   int fast_retry_time, fast_retry_timeout;
   int cache_max_expiry;
+  char *cache_file; /* Pi-hole modification */
 #ifdef HAVE_DNSSEC
   struct ds_config *ds;
   char *timestamp_file;
+  int dnssec_workers; /* Pi-hole modification */
+  int tcp_workers; /* Pi-hole modification */
 #endif
 
   /* globally used stuff for DNS */
@@ -1346,6 +1364,10 @@ void cache_add_dhcp_entry(char *host_name, int prot, union all_addr *host_addres
 struct in_addr a_record_from_hosts(char *name, time_t now);
 void cache_unhash_dhcp(void);
 void dump_cache(time_t now);
+/* Pi-hole modification */
+void cache_save(time_t now);
+void cache_load(time_t now);
+/************************/
 #ifndef NO_ID
 int cache_make_stat(struct txt_record *t);
 #endif
@@ -1354,6 +1376,7 @@ char *cache_get_cname_target(struct crec *crecp);
 struct crec *cache_enumerate(int init);
 int read_hostsfile(char *filename, unsigned int index, int cache_size, 
 		   struct crec **rhash, int hashsz);
+unsigned int reload_hostsfile(char *filename, unsigned int index); /* Pi-hole modification */
 
 /* blockdata.c */
 void blockdata_init(void);
@@ -1420,6 +1443,14 @@ int dnskey_keytag(int alg, int flags, unsigned char *key, int keylen);
 size_t filter_rrsigs(struct dns_header *header, size_t plen);
 int setup_timestamp(void);
 int errflags_to_ede(int status);
+/* Pi-hole modification */
+int dnssec_aggressive_nsec(time_t now, struct dns_header *header, size_t plen);
+void dnssec_aggressive_flush(void);
+int dnssec_async_init(int workers);
+int dnssec_async_fd(void);
+int dnssec_async_collect(struct frec *forward, struct dns_header *header, size_t plen, time_t now, int status);
+struct frec *dnssec_async_finish(struct dns_header *header, size_t *plen, int *status);
+/************************/
 #endif
 
 /* hash_questions.c */
@@ -1431,6 +1462,9 @@ const struct nettle_hash *hash_find(char *name);
 int hash_init(const struct nettle_hash *hash, void **ctxp, unsigned char **digestp);
 int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
 	   unsigned char *digest, size_t digest_len, int algo);
+unsigned char *digest_data(unsigned char *digest, size_t *digest_len, int algo); /* Pi-hole modification */
+int verify_data(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+		unsigned char *data, size_t data_len, int algo); /* Pi-hole modification */
 char *ds_digest_name(int digest);
 char *algo_digest_name(int algo);
 char *nsec3_digest_name(int digest);
@@ -1507,6 +1541,9 @@ int option_read_dynfile(char *file, int flags);
 /* forward.c */
 void reply_query(int fd, time_t now);
 void receive_query(struct listener *listen, time_t now);
+#ifdef HAVE_DNSSEC
+void dnssec_async_reply(time_t now); /* Pi-hole modification */
+#endif
 unsigned char *tcp_request(int confd, time_t now,
 			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
 void server_gone(struct server *server);
@@ -1625,6 +1662,7 @@ void queue_event(int event);
 void send_alarm(time_t event, time_t now);
 void send_event(int fd, int event, int data, char *msg);
 void clear_cache_and_reload(time_t now);
+void tcp_pool_retire(void); /* Pi-hole modification */
 
 /* netlink.c */
 #ifdef HAVE_LINUX_NETWORK
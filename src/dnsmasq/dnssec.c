@@ -19,6 +19,10 @@
 
 #ifdef HAVE_DNSSEC
 
+/* Pi-hole modification */
+#include <pthread.h>
+/************************/
+
 #define SERIAL_UNDEF  -100
 #define SERIAL_EQ        0
 #define SERIAL_LT       -1
@@ -131,6 +135,409 @@ static int serial_compare_32(u32 s1, u32 s2)
   return SERIAL_UNDEF;
 }
 
+/* Pi-hole modification */
+/* Cache of successful signature verifications. The public-key operation is
+   by far the most expensive part of validation, and the same RRset is
+   validated again with the same RRSIG and DNSKEY whenever it is refreshed
+   or re-requested after cache eviction. Entries are keyed by a SHA-256 over
+   algorithm, key tag, key, signature and signed data (which includes the
+   canonical RRset) and are valid until the signature expires. The cache is
+   set-associative with LRU replacement within each set. */
+#define SIGCACHE_WAYS 4
+#define SIGCACHE_ID_LEN 32
+
+struct sigcache {
+  unsigned char id[SIGCACHE_ID_LEN];
+  u32 expiration;
+  unsigned int used; /* 0 if unused, else LRU stamp */
+};
+
+static struct sigcache *sigcache = NULL;
+static const struct nettle_hash *sigcache_hash = NULL;
+static void *sigcache_ctx = NULL;
+static unsigned int sigcache_stamp = 0;
+
+static int sigcache_id(struct blockdata *key, unsigned int keylen, unsigned char *sig, size_t sig_len,
+		       unsigned char *digest, size_t digest_len, int algo, int key_tag, unsigned char *id)
+{
+  unsigned char buf[7], *data;
+  unsigned int len;
+  struct blockdata *b;
+
+  if (!sigcache_hash && !(sigcache_hash = hash_find("sha256")))
+    return 0;
+  if (sigcache_hash->digest_size != SIGCACHE_ID_LEN)
+    return 0;
+  if (!sigcache_ctx && !(sigcache_ctx = whine_malloc(sigcache_hash->context_size)))
+    return 0;
+  if (!sigcache && !(sigcache = whine_malloc(DNSSEC_SIG_CACHE * sizeof(struct sigcache))))
+    return 0;
+
+  data = digest_data(digest, &digest_len, algo);
+
+  /* Lengths are included to keep the concatenation unambiguous. */
+  buf[0] = algo;
+  buf[1] = key_tag >> 8;
+  buf[2] = key_tag;
+  buf[3] = keylen >> 8;
+  buf[4] = keylen;
+  buf[5] = sig_len >> 8;
+  buf[6] = sig_len;
+
+  sigcache_hash->init(sigcache_ctx);
+  sigcache_hash->update(sigcache_ctx, sizeof(buf), buf);
+  for (b = key, len = keylen; len > 0 && b; b = b->next)
+    {
+      unsigned int blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
+      sigcache_hash->update(sigcache_ctx, blen, b->key);
+      len -= blen;
+    }
+  sigcache_hash->update(sigcache_ctx, sig_len, sig);
+  sigcache_hash->update(sigcache_ctx, digest_len, data);
+  sigcache_hash->digest(sigcache_ctx, SIGCACHE_ID_LEN, id);
+
+  return 1;
+}
+
+/* Look id up in the signature cache. On a miss, return NULL and leave the
+   slot to replace in *victim. */
+static struct sigcache *sigcache_lookup(unsigned char *id, unsigned long curtime, int time_check,
+					struct sigcache **victim)
+{
+  struct sigcache *set;
+  int i;
+
+  set = &sigcache[(((unsigned int)id[0] << 8 | id[1]) % (DNSSEC_SIG_CACHE / SIGCACHE_WAYS)) * SIGCACHE_WAYS];
+
+  for (*victim = set, i = 0; i < SIGCACHE_WAYS; i++)
+    {
+      if (set[i].used != 0 && memcmp(set[i].id, id, SIGCACHE_ID_LEN) == 0)
+	{
+	  if (!time_check || serial_compare_32(curtime, set[i].expiration) != SERIAL_GT)
+	    {
+	      set[i].used = ++sigcache_stamp;
+	      return &set[i];
+	    }
+	  
+	  /* Signature expired, free the slot */
+	  set[i].used = 0;
+	}
+
+      if (set[i].used < (*victim)->used)
+	*victim = &set[i];
+    }
+
+  return NULL;
+}
+
+static void sigcache_insert(struct sigcache *victim, unsigned char *id, u32 expiration)
+{
+  /* Stamp 0 marks unused slots, skip it on wrap-around */
+  if (++sigcache_stamp == 0)
+    sigcache_stamp = 1;
+
+  memcpy(victim->id, id, SIGCACHE_ID_LEN);
+  victim->expiration = expiration;
+  victim->used = sigcache_stamp;
+}
+
+/* Signature checks offloaded to the --dnssec-workers threads. Before a reply
+   is validated in the main loop, validation is run once in "collect" mode,
+   in which signature checks that miss the signature cache are recorded and
+   assumed to succeed, and nothing is cached. If anything was recorded, the
+   reply is parked and the workers do the public-key operations. When they
+   are all done, the good ones are added to the signature cache and the reply
+   is validated again for real, which now only finds cache hits. Failed
+   checks are not cached and get repeated synchronously, so a bogus answer
+   still ends up bogus. The collecting pass leaves the cache metrics alone,
+   a good worker verdict counts as a miss and the cache hit it causes in the
+   second pass is not counted again. */
+struct async_task {
+  struct async_task *next;    /* work queue */
+  struct async_task *sibling; /* tasks of the same job */
+  struct async_job *job;
+  unsigned char id[SIGCACHE_ID_LEN];
+  u32 expiration;
+  int algo, valid;
+  unsigned int key_len;
+  size_t sig_len, data_len;
+  struct blockdata *key; /* private copy, not from the blockdata pool */
+  unsigned char *sig, *data;
+};
+
+struct async_job {
+  struct frec *forward;
+  int status, count;
+  unsigned int pending; /* protected by async_lock */
+  size_t plen;
+  unsigned char *packet;
+  struct async_task *tasks;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct async_task *async_head = NULL, **async_tail = &async_head;
+static int async_pipe[2] = { -1, -1 };
+static struct async_job *async_job = NULL; /* non-NULL while collecting */
+static unsigned int async_counted = 0; /* second pass hits already counted as misses */
+
+static void async_add(unsigned char *id, struct blockdata *key, unsigned int keylen,
+		      unsigned char *sig, size_t sig_len, unsigned char *digest, size_t digest_len,
+		      int algo, u32 expiration)
+{
+  unsigned int i, nblocks = (keylen + KEYBLOCK_LEN - 1) / KEYBLOCK_LEN;
+  unsigned char *data = digest_data(digest, &digest_len, algo);
+  struct async_task *task;
+  struct blockdata *b;
+
+  /* Anything not handed out is checked synchronously in the second pass. */
+  if (async_job->count >= DNSSEC_ASYNC_TASKS)
+    return;
+
+  if (!(task = whine_malloc(sizeof(struct async_task) + nblocks * sizeof(struct blockdata) + sig_len + digest_len)))
+    return;
+
+  task->job = async_job;
+  memcpy(task->id, id, SIGCACHE_ID_LEN);
+  task->expiration = expiration;
+  task->algo = algo;
+  task->key_len = keylen;
+  task->sig_len = sig_len;
+  task->data_len = digest_len;
+  task->key = (struct blockdata *)(task + 1);
+  task->sig = (unsigned char *)(task->key + nblocks);
+  task->data = task->sig + sig_len;
+  
+  for (b = key, i = 0; i < nblocks && b; b = b->next, i++)
+    {
+      memcpy(task->key[i].key, b->key, KEYBLOCK_LEN);
+      task->key[i].next = (i + 1 < nblocks) ? &task->key[i + 1] : NULL;
+    }
+  memcpy(task->sig, sig, sig_len);
+  memcpy(task->data, data, digest_len);
+  
+  task->sibling = async_job->tasks;
+  async_job->tasks = task;
+  async_job->count++;
+}
+
+/* Drop-in for verify() which consults and fills the signature cache. */
+static int verify_cached(struct blockdata *key, unsigned int keylen, unsigned char *sig, size_t sig_len,
+			 unsigned char *digest, size_t digest_len, int algo, int key_tag,
+			 u32 sig_expiration, unsigned long curtime, int time_check)
+{
+  unsigned char id[SIGCACHE_ID_LEN];
+  struct sigcache *victim;
+
+  if (!sigcache_id(key, keylen, sig, sig_len, digest, digest_len, algo, key_tag, id))
+    return async_job ? 1 : verify(key, keylen, sig, sig_len, digest, digest_len, algo);
+
+  if (sigcache_lookup(id, curtime, time_check, &victim))
+    {
+      if (async_job)
+	return 1;
+      if (async_counted > 0)
+	async_counted--;
+      else
+	daemon->metrics[METRIC_DNSSEC_SIG_CACHE_HIT]++;
+      return 1;
+    }
+
+  if (async_job)
+    {
+      async_add(id, key, keylen, sig, sig_len, digest, digest_len, algo, sig_expiration);
+      return 1;
+    }
+
+  daemon->metrics[METRIC_DNSSEC_SIG_CACHE_MISS]++;
+
+  if (!verify(key, keylen, sig, sig_len, digest, digest_len, algo))
+    return 0;
+
+  sigcache_insert(victim, id, sig_expiration);
+
+  return 1;
+}
+
+static void *async_worker(void *arg)
+{
+  struct async_task *task;
+  struct async_job *job;
+  sigset_t mask;
+  int done;
+
+  (void)arg;
+
+  /* Signals are for the main thread. */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  while (1)
+    {
+      pthread_mutex_lock(&async_lock);
+      while (!async_head)
+	pthread_cond_wait(&async_cond, &async_lock);
+      task = async_head;
+      if (!(async_head = task->next))
+	async_tail = &async_head;
+      pthread_mutex_unlock(&async_lock);
+
+      task->valid = verify_data(task->key, task->key_len, task->sig, task->sig_len,
+				task->data, task->data_len, task->algo);
+
+      job = task->job;
+      pthread_mutex_lock(&async_lock);
+      done = (--job->pending == 0);
+      pthread_mutex_unlock(&async_lock);
+
+      /* The main loop picks the job up from the pipe. */
+      if (done)
+	while (write(async_pipe[1], &job, sizeof(job)) == -1 && errno == EINTR);
+    }
+
+  return NULL;
+}
+
+/* Start the worker threads, returns the number started. */
+int dnssec_async_init(int workers)
+{
+  pthread_t thread;
+  int i;
+
+  if (pipe(async_pipe) == -1 || !fix_fd(async_pipe[0]))
+    return 0;
+
+  for (i = 0; i < workers; i++)
+    if (pthread_create(&thread, NULL, async_worker, NULL) != 0 ||
+	pthread_detach(thread) != 0)
+      break;
+
+  return i;
+}
+
+int dnssec_async_fd(void)
+{
+  return async_pipe[0];
+}
+
+/* Run the collecting pass over a reply about to be validated. Returns 1 if
+   signature checks were handed to the workers, and the reply is parked
+   until dnssec_async_finish() returns it. */
+int dnssec_async_collect(struct frec *forward, struct dns_header *header, size_t plen, time_t now, int status)
+{
+  struct async_job job;
+  struct async_task *task;
+
+  memset(&job, 0, sizeof(job));
+  async_job = &job;
+  async_counted = 0;
+  
+  if (forward->flags & FREC_DNSKEY_QUERY)
+    dnssec_validate_by_ds(now, header, plen, daemon->namebuff, daemon->keyname, forward->class);
+  else if (forward->flags & FREC_DS_QUERY)
+    dnssec_validate_ds(now, header, plen, daemon->namebuff, daemon->keyname, forward->class);
+  else
+    {
+      int class = forward->class;
+      dnssec_validate_reply(now, header, plen, daemon->namebuff, daemon->keyname, &class, 
+			    !option_bool(OPT_DNSSEC_IGN_NS) && (forward->sentto->flags & SERV_DO_DNSSEC),
+			    NULL, NULL, NULL);
+    }
+
+  async_job = NULL;
+
+  if (job.count == 0)
+    return 0;
+  
+  if (!(async_job = whine_malloc(sizeof(struct async_job) + plen)))
+    {
+      for (; job.tasks; job.tasks = task)
+	{
+	  task = job.tasks->sibling;
+	  free(job.tasks);
+	}
+      return 0;
+    }
+
+  *async_job = job;
+  async_job->forward = forward;
+  async_job->status = status;
+  async_job->plen = plen;
+  async_job->packet = (unsigned char *)(async_job + 1);
+  async_job->pending = job.count;
+  memcpy(async_job->packet, header, plen);
+
+  pthread_mutex_lock(&async_lock);
+  for (task = async_job->tasks; task; task = task->sibling)
+    {
+      task->job = async_job;
+      task->next = NULL;
+      *async_tail = task;
+      async_tail = &task->next;
+    }
+  pthread_cond_broadcast(&async_cond);
+  pthread_mutex_unlock(&async_lock);
+
+  forward->async_job = async_job;
+  forward->flags |= FREC_ASYNC;
+  async_job = NULL;
+
+  return 1;
+}
+
+/* Called when the worker pipe is readable. Adds the verdicts of a finished
+   job to the signature cache and the metrics and, if the parked frec is still waiting for it,
+   copies the reply back into header and returns the frec. */
+struct frec *dnssec_async_finish(struct dns_header *header, size_t *plen, int *status)
+{
+  struct async_job *job;
+  struct async_task *task;
+  struct sigcache *victim;
+  struct frec *forward;
+
+  if (read(async_pipe[0], &job, sizeof(job)) != sizeof(job))
+    return NULL;
+
+  async_counted = 0;
+
+  /* Failed checks are repeated and counted in the second pass. */
+  for (; job->tasks; job->tasks = task)
+    {
+      task = job->tasks->sibling;
+      if (job->tasks->valid)
+	{
+	  daemon->metrics[METRIC_DNSSEC_SIG_CACHE_MISS]++;
+	  async_counted++;
+	  if (!sigcache_lookup(job->tasks->id, 0, 0, &victim))
+	    sigcache_insert(victim, job->tasks->id, job->tasks->expiration);
+	}
+      free(job->tasks);
+    }
+
+  /* The frec may have timed out and been reused meanwhile, possibly for
+     another reply parked in a different job. */
+  forward = job->forward;
+  if (!(forward->flags & FREC_ASYNC) || forward->async_job != job || !forward->sentto)
+    {
+      forward = NULL;
+      async_counted = 0;
+    }
+  else
+    {
+      memcpy(header, job->packet, job->plen);
+      *plen = job->plen;
+      *status = job->status;
+      forward->flags &= ~FREC_ASYNC;
+      forward->flags |= FREC_ASYNC_DONE;
+      forward->async_job = NULL;
+    }
+
+  free(job);
+
+  return forward;
+}
+/************************/
+
 /* Called at startup. If the timestamp file is configured and exists, put its mtime on
    timestamp_time. If it doesn't exist, create it, and set the mtime to 1-1-2015.
    return -1 -> Cannot create file.
@@ -730,7 +1137,8 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       if (key)
 	{
 	  if (algo_in == algo && keytag_in == key_tag &&
-	      verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
+	      verify_cached(key, keylen, sig, sig_len, digest, hash->digest_size, algo, key_tag,
+			    sig_expiration, curtime, time_check)) /* Pi-hole modification */
 	    return STAT_SECURE;
 	}
       else
@@ -740,7 +1148,8 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	    if (crecp->addr.key.algo == algo && 
 		crecp->addr.key.keytag == key_tag &&
 		crecp->uid == (unsigned int)class &&
-		verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
+		verify_cached(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size,
+			      algo, key_tag, sig_expiration, curtime, time_check)) /* Pi-hole modification */
 	      return (labels < name_labels) ? STAT_SECURE_WILDCARD : STAT_SECURE;
 	}
     }
@@ -897,6 +1306,12 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
       blockdata_free(key);
     }
 
+  /* Pi-hole modification */
+  /* Only collecting signature checks, don't log or cache anything. */
+  if (async_job)
+    return valid ? STAT_OK : STAT_BOGUS | failflags;
+  /************************/
+
   if (valid)
     {
       /* DNSKEY RRset determined to be OK, now cache it. */
@@ -1012,6 +1427,12 @@ int dnssec_validate_ds(time_t now, struct dns_header *header, size_t plen, char
     rc = STAT_BOGUS;
   else
     rc = dnssec_validate_reply(now, header, plen, name, keyname, NULL, 0, &neganswer, &nons, &neg_ttl);
+
+  /* Pi-hole modification */
+  /* Only collecting signature checks, don't log or cache anything. */
+  if (async_job)
+    return rc;
+  /************************/
   
   if (STAT_ISEQUAL(rc, STAT_INSECURE))
     {
@@ -1772,6 +2193,604 @@ static int prove_non_existence(struct dns_header *header, size_t plen, char *key
     return 0;
 }
 
+/* Pi-hole modification */
+/* Aggressive use of DNSSEC-validated cache (RFC 8198). The NSEC and NSEC3
+   records of validated negative answers are remembered per zone. Later
+   queries for names they prove not to exist are answered from a synthesised
+   negative cache entry instead of being forwarded. Opt-out NSEC3 and
+   NSECs from wildcard expansion are never used. */
+struct nsec_span {
+  time_t ttd;
+  unsigned char *owner, *next; /* NSEC: names in presentation format, NSEC3: hashes */
+  unsigned char *bitmap;
+  int owner_len, next_len, bitmap_len;
+};
+
+struct nsec_zone {
+  struct nsec_zone *next;
+  char *name;
+  int type; /* T_NSEC or T_NSEC3 */
+  int algo, iterations, salt_len; /* NSEC3 parameters */
+  unsigned char salt[255];
+  int count;
+  struct nsec_span *spans[DNSSEC_NSEC_SPANS];
+};
+
+static struct nsec_zone *nsec_zones = NULL;
+
+static int nsec_in_zone(char *zone, char *name)
+{
+  return *zone == 0 || hostname_issubdomain(zone, name);
+}
+
+static int nsec_has_type(struct nsec_span *span, int type)
+{
+  unsigned char *p = span->bitmap;
+  int rdlen = span->bitmap_len;
+  int offset = (type & 0xff) >> 3;
+  int mask = 0x80 >> (type & 0x07);
+
+  while (rdlen >= 2 && p[1] + 2 <= rdlen)
+    {
+      if (p[0] == type >> 8)
+	return offset < p[1] && (p[offset+2] & mask) != 0;
+
+      rdlen -= p[1] + 2;
+      p += p[1] + 2;
+    }
+
+  return 0;
+}
+
+static void nsec_zone_free(struct nsec_zone *zone)
+{
+  int i;
+
+  for (i = 0; i < zone->count; i++)
+    free(zone->spans[i]);
+  free(zone->name);
+  free(zone);
+}
+
+static void nsec_zone_expire(struct nsec_zone *zone, time_t now)
+{
+  int i, j;
+
+  for (i = 0, j = 0; i < zone->count; i++)
+    if (difftime(zone->spans[i]->ttd, now) <= 0)
+      free(zone->spans[i]);
+    else
+      zone->spans[j++] = zone->spans[i];
+
+  zone->count = j;
+}
+
+/* Find or create the state for zone. Zones are kept in most-recently-used order. */
+static struct nsec_zone *nsec_zone_get(char *name, int type, int create)
+{
+  struct nsec_zone *zone, **up, *last = NULL;
+  int count = 0;
+
+  for (up = &nsec_zones, zone = nsec_zones; zone; up = &zone->next, zone = zone->next, count++)
+    if (zone->type == type && hostname_isequal(zone->name, name))
+      {
+	*up = zone->next;
+	zone->next = nsec_zones;
+	nsec_zones = zone;
+	return zone;
+      }
+
+  if (!create)
+    return NULL;
+
+  if (count >= DNSSEC_NSEC_ZONES)
+    {
+      for (up = &nsec_zones; (*up)->next; up = &(*up)->next);
+      last = *up;
+      *up = NULL;
+      nsec_zone_free(last);
+    }
+
+  if (!(zone = whine_malloc(sizeof(struct nsec_zone))))
+    return NULL;
+
+  if (!(zone->name = whine_malloc(strlen(name) + 1)))
+    {
+      free(zone);
+      return NULL;
+    }
+
+  strcpy(zone->name, name);
+  zone->type = type;
+  zone->next = nsec_zones;
+  nsec_zones = zone;
+
+  return zone;
+}
+
+static void nsec_zone_add(struct nsec_zone *zone, time_t ttd, unsigned char *owner, int owner_len,
+			  unsigned char *next, int next_len, unsigned char *bitmap, int bitmap_len)
+{
+  struct nsec_span *span;
+  int i, oldest = 0;
+
+  for (i = 0; i < zone->count; i++)
+    {
+      span = zone->spans[i];
+      if (span->owner_len == owner_len && memcmp(span->owner, owner, owner_len) == 0)
+	break;
+      if (difftime(span->ttd, zone->spans[oldest]->ttd) < 0)
+	oldest = i;
+    }
+
+  if (!(span = whine_malloc(sizeof(struct nsec_span) + owner_len + next_len + bitmap_len)))
+    return;
+
+  span->ttd = ttd;
+  span->owner = (unsigned char *)(span + 1);
+  span->next = span->owner + owner_len;
+  span->bitmap = span->next + next_len;
+  span->owner_len = owner_len;
+  span->next_len = next_len;
+  span->bitmap_len = bitmap_len;
+  memcpy(span->owner, owner, owner_len);
+  memcpy(span->next, next, next_len);
+  memcpy(span->bitmap, bitmap, bitmap_len);
+
+  /* Replace the span for the same owner, or the one expiring first when full */
+  if (i == zone->count && zone->count == DNSSEC_NSEC_SPANS)
+    i = oldest;
+
+  if (i == zone->count)
+    zone->count++;
+  else
+    free(zone->spans[i]);
+
+  zone->spans[i] = span;
+}
+
+/* Remember the validated NSEC and NSEC3 RRs in the authority section of a secure reply. */
+static void nsec_store(struct dns_header *header, size_t plen, time_t now)
+{
+  static char *signer = NULL, *next = NULL;
+  unsigned char *p, *p1, *psave, *auth_start;
+  int i, j, type, class, rdlen, type1, rdlen1, res, labels, neg_ttl = -1;
+  unsigned long ttl, soa_ttl, minimum;
+  char *owner = daemon->workspacename;
+  
+  if (!signer && !(signer = whine_malloc(MAXDNAME)))
+    return;
+  if (!next && !(next = whine_malloc(MAXDNAME)))
+    return;
+
+  if (!(p = skip_questions(header, plen)) ||
+      !(p = skip_section(p, ntohs(header->ancount), header, plen)))
+    return;
+
+  auth_start = p;
+
+  /* Negative TTL as per RFC 9077: the lower of SOA TTL and SOA minimum */
+  for (i = 0; i < ntohs(header->nscount); i++)
+    {
+      if (!(p = skip_name(p, header, plen, 10)))
+	return;
+
+      GETSHORT(type, p);
+      p += 2; /* class */
+      GETLONG(soa_ttl, p);
+      GETSHORT(rdlen, p);
+      psave = p;
+
+      if (type == T_SOA)
+	{
+	  if (!(p = skip_name(p, header, plen, 0)) ||
+	      !(p = skip_name(p, header, plen, 20)))
+	    return;
+	  p += 16; /* serial, refresh, retry, expire */
+	  GETLONG(minimum, p);
+	  neg_ttl = soa_ttl < minimum ? soa_ttl : minimum;
+	}
+
+      p = psave;
+      if (!ADD_RDLEN(header, p, plen, rdlen))
+	return;
+    }
+
+  for (p = auth_start, i = 0; i < ntohs(header->nscount); i++, p = psave + rdlen)
+    {
+      struct nsec_zone *zone;
+      unsigned long sig_ttl = daemon->rr_status[ntohs(header->ancount) + i];
+
+      if (!extract_name(header, plen, &p, owner, 1, 10))
+	return;
+
+      GETSHORT(type, p);
+      GETSHORT(class, p);
+      GETLONG(ttl, p);
+      GETSHORT(rdlen, p);
+      psave = p;
+
+      if (!CHECK_LEN(header, p, plen, rdlen))
+	return;
+      
+      if (class != C_IN || (type != T_NSEC && type != T_NSEC3) || sig_ttl == 0)
+	continue;
+
+      if (sig_ttl < ttl)
+	ttl = sig_ttl;
+      if (neg_ttl >= 0 && (unsigned long)neg_ttl < ttl)
+	ttl = neg_ttl;
+      if (ttl == 0)
+	continue;
+      
+      /* Find the signer name and labels field in the matching RRSIG */
+      for (labels = -1, p1 = auth_start, j = 0; j < ntohs(header->nscount); j++)
+	{
+	  if (!(res = extract_name(header, plen, &p1, owner, 0, 10)))
+	    return;
+
+	  GETSHORT(type1, p1);
+	  p1 += 6; /* class, TTL */
+	  GETSHORT(rdlen1, p1);
+
+	  if (!CHECK_LEN(header, p1, plen, rdlen1))
+	    return;
+
+	  if (res == 1 && type1 == T_RRSIG && rdlen1 >= 18)
+	    {
+	      unsigned char *psig = p1;
+	      int type_covered;
+
+	      GETSHORT(type_covered, psig);
+	      if (type_covered == type)
+		{
+		  labels = psig[1];
+		  psig += 16;
+		  if (!extract_name(header, plen, &psig, signer, 1, 0))
+		    return;
+		  break;
+		}
+	    }
+
+	  p1 += rdlen1;
+	}
+
+      /* No signature or wildcard expansion */
+      if (labels == -1 || labels != count_labels(owner) || !nsec_in_zone(signer, owner))
+	continue;
+
+      p = psave;
+
+      if (type == T_NSEC)
+	{
+	  if (!extract_name(header, plen, &p, next, 1, 0) || !nsec_in_zone(signer, next))
+	    continue;
+
+	  if ((zone = nsec_zone_get(signer, T_NSEC, 1)))
+	    {
+	      nsec_zone_expire(zone, now);
+	      nsec_zone_add(zone, now + ttl, (unsigned char *)owner, strlen(owner) + 1,
+			    (unsigned char *)next, strlen(next) + 1, p, rdlen - (p - psave));
+	    }
+	}
+      else
+	{
+	  int algo, flags, iterations, salt_len, hash_len, owner_len;
+	  unsigned char *salt;
+	  char *zone_name;
+
+	  if (rdlen < 5)
+	    continue;
+
+	  algo = *p++;
+	  flags = *p++;
+	  GETSHORT(iterations, p);
+	  salt_len = *p++;
+	  salt = p;
+	  p += salt_len;
+	  hash_len = *p++;
+
+	  /* Hashing every query name with a high iteration count costs more
+	     than forwarding it, see RFC 9276 3.2 */
+	  if (flags != 0 || iterations > DNSSEC_NSEC3_ITERATIONS || !hash_find(nsec3_digest_name(algo)) ||
+	      p + hash_len > psave + rdlen)
+	    continue;
+
+	  /* The zone is the owner name without the hash label */
+	  zone_name = (zone_name = strchr(owner, '.')) ? zone_name + 1 : "";
+	  if (!hostname_isequal(zone_name, signer) ||
+	      (owner_len = base32_decode(owner, (unsigned char *)next)) != hash_len)
+	    continue;
+
+	  if ((zone = nsec_zone_get(signer, T_NSEC3, 1)))
+	    {
+	      /* Only one set of NSEC3 parameters per zone, newest wins. */
+	      if (zone->count == 0 || zone->algo != algo || zone->iterations != iterations ||
+		  zone->salt_len != salt_len || memcmp(zone->salt, salt, salt_len) != 0)
+		{
+		  for (j = 0; j < zone->count; j++)
+		    free(zone->spans[j]);
+		  zone->count = 0;
+		  zone->algo = algo;
+		  zone->iterations = iterations;
+		  zone->salt_len = salt_len;
+		  memcpy(zone->salt, salt, salt_len);
+		}
+
+	      nsec_zone_expire(zone, now);
+	      nsec_zone_add(zone, now + ttl, (unsigned char *)next, owner_len, p, hash_len,
+			    p + hash_len, rdlen - (p + hash_len - psave));
+	    }
+	}
+    }
+}
+
+/* Does span cover (strictly) the name or hash? */
+static int nsec_covers(struct nsec_zone *zone, struct nsec_span *span, unsigned char *name, int len)
+{
+  int after_owner, before_next, wraps;
+
+  if (zone->type == T_NSEC)
+    {
+      after_owner = hostname_cmp((char *)span->owner, (char *)name) < 0;
+      before_next = hostname_cmp((char *)name, (char *)span->next) < 0;
+      wraps = hostname_cmp((char *)span->owner, (char *)span->next) >= 0;
+    }
+  else
+    {
+      if (span->owner_len != len || span->next_len != len)
+	return 0;
+      after_owner = memcmp(span->owner, name, len) < 0;
+      before_next = memcmp(name, span->next, len) < 0;
+      wraps = memcmp(span->owner, span->next, len) >= 0;
+    }
+
+  /* The last span in the zone wraps around to the apex */
+  return wraps ? (after_owner || before_next) : (after_owner && before_next);
+}
+
+static struct nsec_span *nsec_find(struct nsec_zone *zone, unsigned char *name, int len, int exact)
+{
+  int i;
+
+  for (i = 0; i < zone->count; i++)
+    {
+      struct nsec_span *span = zone->spans[i];
+
+      if (exact)
+	{
+	  if (zone->type == T_NSEC ? hostname_isequal((char *)span->owner, (char *)name) :
+	      (span->owner_len == len && memcmp(span->owner, name, len) == 0))
+	    return span;
+	}
+      else if (nsec_covers(zone, span, name, len))
+	return span;
+    }
+
+  return NULL;
+}
+
+/* Hash name with the zone's NSEC3 parameters into out. */
+static int nsec3_hash(struct nsec_zone *zone, char *name, unsigned char *out)
+{
+  const struct nettle_hash *hash = hash_find(nsec3_digest_name(zone->algo));
+  unsigned char *digest;
+  int len;
+
+  if (!hash || (len = hash_name(name, &digest, hash, zone->salt, zone->salt_len, zone->iterations)) == 0)
+    return 0;
+
+  memcpy(out, digest, len);
+  return len;
+}
+
+/* A NODATA proof from the NSEC(3) at the name itself: neither the type nor a
+   CNAME exists, and it is not the parent side of a delegation. */
+static int nsec_nodata(struct nsec_span *span, int qtype)
+{
+  return !nsec_has_type(span, qtype) && !nsec_has_type(span, T_CNAME) &&
+    (!nsec_has_type(span, T_NS) || nsec_has_type(span, T_SOA));
+}
+
+/* Names below a delegation or a DNAME are not part of this zone, so the
+   span cannot prove anything about them. */
+static int nsec_cut(struct nsec_span *span)
+{
+  return nsec_has_type(span, T_DNAME) ||
+    (nsec_has_type(span, T_NS) && !nsec_has_type(span, T_SOA));
+}
+
+#define NSEC_NODATA 1
+#define NSEC_NXDOMAIN 2
+
+static int nsec_prove(struct nsec_zone *zone, char *name, int qtype, time_t *ttd)
+{
+  static char *wild = NULL;
+  struct nsec_span *span, *wspan;
+  char *ce, *p;
+
+  if (!wild && !(wild = whine_malloc(MAXDNAME * 2)))
+    return 0;
+
+  if ((span = nsec_find(zone, (unsigned char *)name, 0, 1)))
+    {
+      *ttd = span->ttd;
+      return nsec_nodata(span, qtype) ? NSEC_NODATA : 0;
+    }
+
+  if (!(span = nsec_find(zone, (unsigned char *)name, 0, 0)))
+    return 0;
+
+  /* Owner above the query name at a zone cut: the name is in the child zone */
+  if (hostname_issubdomain((char *)span->owner, name) && nsec_cut(span))
+    return 0;
+
+  /* Next name below the query name: name is an empty non-terminal */
+  if (hostname_issubdomain(name, (char *)span->next))
+    return 0;
+
+  /* The closest encloser is the longest ancestor of name which is also an
+     ancestor of the owner or next name of the covering NSEC. */
+  for (ce = name; ce; ce = (p = strchr(ce, '.')) ? p + 1 : NULL)
+    if (hostname_issubdomain(ce, (char *)span->owner) || hostname_issubdomain(ce, (char *)span->next))
+      break;
+
+  if (!ce)
+    ce = "";
+
+  if (!nsec_in_zone(zone->name, ce))
+    return 0;
+
+  if ((wspan = nsec_find(zone, (unsigned char *)ce, 0, 1)) && nsec_cut(wspan))
+    return 0;
+
+  /* No wildcard at the closest encloser either */
+  sprintf(wild, *ce ? "*.%s" : "*", ce);
+  if (!(wspan = nsec_find(zone, (unsigned char *)wild, 0, 0)))
+    return 0;
+
+  *ttd = difftime(span->ttd, wspan->ttd) < 0 ? span->ttd : wspan->ttd;
+  return NSEC_NXDOMAIN;
+}
+
+static int nsec3_prove(struct nsec_zone *zone, char *name, int qtype, time_t *ttd)
+{
+  static char *wild = NULL;
+  unsigned char digest[64];
+  struct nsec_span *span, *nspan, *wspan;
+  char *ce, *next_closer;
+  int len;
+
+  if (!wild && !(wild = whine_malloc(MAXDNAME * 2)))
+    return 0;
+
+  if (!(len = nsec3_hash(zone, name, digest)) || len > (int)sizeof(digest))
+    return 0;
+
+  if ((span = nsec_find(zone, digest, len, 1)))
+    {
+      *ttd = span->ttd;
+      return nsec_nodata(span, qtype) ? NSEC_NODATA : 0;
+    }
+
+  /* Closest encloser proof, RFC 5155 7.2.1 */
+  for (next_closer = name, span = NULL; (ce = strchr(next_closer, '.')); next_closer = ce)
+    {
+      ce++;
+
+      if (!nsec_in_zone(zone->name, ce))
+	return 0;
+
+      if (!(len = nsec3_hash(zone, ce, digest)))
+	return 0;
+
+      if ((span = nsec_find(zone, digest, len, 1)))
+	break;
+    }
+
+  /* A closest encloser at a delegation or DNAME proves nothing below it */
+  if (!span || nsec_cut(span) || !(len = nsec3_hash(zone, next_closer, digest)) ||
+      !(nspan = nsec_find(zone, digest, len, 0)))
+    return 0;
+
+  sprintf(wild, "*.%s", ce);
+  if (!(len = nsec3_hash(zone, wild, digest)) ||
+      !(wspan = nsec_find(zone, digest, len, 0)))
+    return 0;
+
+  *ttd = difftime(nspan->ttd, wspan->ttd) < 0 ? nspan->ttd : wspan->ttd;
+  return NSEC_NXDOMAIN;
+}
+
+/* Called for queries not answered from the cache. If validated NSEC or NSEC3
+   records prove that the name or type doesn't exist, insert a negative
+   cache entry so that the query can be answered locally.
+   Returns 1 if an entry was inserted. */
+int dnssec_aggressive_nsec(time_t now, struct dns_header *header, size_t plen)
+{
+  static char *name = NULL;
+  struct nsec_zone *zone, *best = NULL;
+  unsigned char *p = (unsigned char *)(header+1);
+  int qtype, qclass, flags, rc;
+  time_t ttd;
+
+  if (!nsec_zones || ntohs(header->qdcount) != 1)
+    return 0;
+
+  if (!name && !(name = whine_malloc(MAXDNAME * 2)))
+    return 0;
+
+  if (!extract_name(header, plen, &p, name, 1, 4))
+    return 0;
+
+  GETSHORT(qtype, p);
+  GETSHORT(qclass, p);
+
+  /* Only types for which negative answers can be cached */
+  if (qclass != C_IN)
+    return 0;
+  else if (qtype == T_A)
+    flags = F_IPV4;
+  else if (qtype == T_AAAA)
+    flags = F_IPV6;
+  else if (qtype == T_SRV)
+    flags = F_SRV;
+  else
+    return 0;
+
+  /* Never override cached data or names sent to domain-specific servers. */
+  if (cache_find_by_name(NULL, name, now, flags | F_CNAME) ||
+      lookup_domain(name, F_DOMAINSRV, NULL, NULL))
+    return 0;
+
+  /* Use the closest enclosing zone we have data for */
+  for (zone = nsec_zones; zone; zone = zone->next)
+    if (nsec_in_zone(zone->name, name) && (!best || strlen(zone->name) > strlen(best->name)))
+      best = zone;
+
+  if (!best)
+    return 0;
+
+  nsec_zone_expire(best, now);
+
+  if (best->type == T_NSEC)
+    rc = nsec_prove(best, name, qtype, &ttd);
+  else
+    rc = nsec3_prove(best, name, qtype, &ttd);
+
+  if (!rc || difftime(ttd, now) <= 0)
+    return 0;
+
+  if (rc == NSEC_NXDOMAIN)
+    flags = F_NXDOMAIN;
+
+  /* nsec_zone_get() moves the zone to the front of the list */
+  nsec_zone_get(best->name, best->type, 0);
+  
+  cache_start_insert();
+  cache_insert(name, NULL, C_IN, now, (unsigned long)difftime(ttd, now), F_FORWARD | F_NEG | F_DNSSECOK | flags);
+  cache_end_insert();
+
+  daemon->metrics[METRIC_DNSSEC_AGGRESSIVE_NEG]++;
+
+  return 1;
+}
+
+/* Forget all spans, e.g. when the cache is cleared */
+void dnssec_aggressive_flush(void)
+{
+  struct nsec_zone *zone, *tmp;
+
+  for (zone = nsec_zones; zone; zone = tmp)
+    {
+      tmp = zone->next;
+      nsec_zone_free(zone);
+    }
+
+  nsec_zones = NULL;
+}
+/************************/
+
 /* Check signing status of name.
    returns:
    STAT_SECURE   zone is signed.
@@ -2126,6 +3145,11 @@ int dnssec_validate_reply(time_t now, struct dns_header *header, size_t plen, ch
 	    return STAT_BOGUS | DNSSEC_FAIL_NONSEC; /* signed zone, no NSECs */
 	  }
       }
+
+  /* Pi-hole modification */
+  if (STAT_ISEQUAL(secure, STAT_SECURE) && ntohs(header->nscount) != 0 && !async_job)
+    nsec_store(header, plen, now);
+  /************************/
   
   return secure;
 }
@@ -365,7 +365,12 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	      forward->forwardall = 1;
 	    }
 	  else
-	    start = master->last_server;
+	    {
+	      start = master->last_server;
+	      /************ Pi-hole modification ************/
+	      start = FTL_select_upstream(first, last, start);
+	      /**********************************************/
+	    }
 	}
     }
   else
@@ -941,7 +946,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
   daemon->log_display_id = forward->frec_src.log_id;
   
   /* We've had a reply already, which we're validating. Ignore this duplicate */
-  if (forward->blocking_query)
+  if (forward->blocking_query || (forward->flags & FREC_ASYNC)) /* Pi-hole modification */
     return;
   
   /* Truncated answer can't be validated.
@@ -961,6 +966,16 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
      will not be cached, so they'll be repeated. */
   if (!STAT_ISEQUAL(status, STAT_BOGUS) && !STAT_ISEQUAL(status, STAT_TRUNCATED) && !STAT_ISEQUAL(status, STAT_ABANDONED))
     {
+      /* Pi-hole modification */
+      /* Leave the signature checks to the worker threads and come back
+	 through dnssec_async_reply() when they are done. */
+      if (forward->flags & FREC_ASYNC_DONE)
+	forward->flags &= ~FREC_ASYNC_DONE;
+      else if (daemon->dnssec_workers > 0 &&
+	       dnssec_async_collect(forward, header, (size_t)plen, now, status))
+	return;
+      /************************/
+
       if (forward->flags & FREC_DNSKEY_QUERY)
 	status = dnssec_validate_by_ds(now, header, plen, daemon->namebuff, daemon->keyname, forward->class);
       else if (forward->flags & FREC_DS_QUERY)
@@ -1127,6 +1142,22 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 }
 #endif
 
+#ifdef HAVE_DNSSEC
+/* Pi-hole modification */
+/* Resume validation of a reply whose signature checks the DNSSEC worker
+   threads have finished. */
+void dnssec_async_reply(time_t now)
+{
+  struct frec *forward;
+  size_t plen;
+  int status;
+
+  if ((forward = dnssec_async_finish((struct dns_header *)daemon->packet, &plen, &status)))
+    dnssec_validate(forward, (struct dns_header *)daemon->packet, (ssize_t)plen, status, now);
+}
+/************************/
+#endif
+
 /* sets new last_server */
 void reply_query(int fd, time_t now)
 {
@@ -1872,7 +1903,7 @@ void receive_query(struct listener *listen, time_t now)
 #endif
   else
     {
-      int stale;
+      int stale, prefetch; /* Pi-hole modification: prefetch */
       int ad_reqd = do_bit;
       u16 hb3 = header->hb3, hb4 = header->hb4;
       int fd = listen->fd;
@@ -1894,22 +1925,22 @@ void receive_query(struct listener *listen, time_t now)
 	  if(n == 0)
 	    return;
 
+	  // Add EDNS0 option EDE if applicable
 	  if (have_pseudoheader)
-	  {
-	    u16 swap = htons(ede);
-	    if (ede != EDE_UNSET) // Add EDNS0 option EDE if applicable
-	      n = add_pseudoheader(header, n, ((unsigned char *) header) + udp_size,
-				   daemon->edns_pktsz, EDNS0_OPTION_EDE, (unsigned char *)&swap, 2, do_bit, 0);
-	    else
-	      n = add_pseudoheader(header, n, ((unsigned char *) header) + udp_size,
-				   daemon->edns_pktsz, 0, NULL, 0, do_bit, 0);
-	  }
+	    n = FTL_blocked_pseudoheader(header, n, ((unsigned char *) header) + udp_size, ede, do_bit);
 	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
 		    (char *)header, (size_t)n, &source_addr, &dst_addr, if_index);
 	  daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
 	  return;
 	}
       /**********************************************/
+
+#ifdef HAVE_DNSSEC
+      /* Pi-hole modification: answer names proven not to exist by cached
+	 NSEC/NSEC3 records locally (RFC 8198) */
+      if (option_bool(OPT_DNSSEC_VALID))
+	dnssec_aggressive_nsec(now, header, (size_t)n);
+#endif
       
       m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
 			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &stale);
@@ -1937,7 +1968,11 @@ void receive_query(struct listener *listen, time_t now)
 	    daemon->metrics[METRIC_DNS_STALE_ANSWERED]++;
 	}
       
-      if (m == 0 || stale)
+      /* Pi-hole modification */
+      prefetch = m != 0 && !stale && FTL_prefetch_due();
+      /************************/
+
+      if (m == 0 || stale || prefetch)
 	{
 	  if (m != 0)
 	    {
@@ -1958,6 +1993,13 @@ void receive_query(struct listener *listen, time_t now)
 	      /* We've already answered the client, so don't send it the answer 
 		 when it comes back. */
 	      fd = -1;
+
+	      /* Pi-hole modification: The answer served from cache was
+		 popular and is about to expire. Refresh it using a new log
+		 ID so FTL does not count it as a forwarded query */
+	      if (prefetch)
+		daemon->log_display_id = ++daemon->log_id;
+	      /************************/
 	    }
 	  
 	  if (forward_query(fd, &source_addr, &dst_addr, if_index,
@@ -2203,7 +2245,7 @@ unsigned char *tcp_request(int confd, time_t now,
   /**********************************************/
 
   if (!packet || getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1)
-    return packet;
+    goto done; /* Pi-hole modification */
 
 #ifdef HAVE_CONNTRACK
   /* Get connection mark of incoming query to set on outgoing connections. */
@@ -2247,7 +2289,7 @@ unsigned char *tcp_request(int confd, time_t now,
 	{
 	  prettyprint_addr(&peer_addr, daemon->addrbuff);
 	  my_syslog(LOG_WARNING, _("ignoring query from non-local network %s"), daemon->addrbuff);
-	  return packet;
+	  goto done; /* Pi-hole modification */
 	}
     }
 
@@ -2256,7 +2298,7 @@ unsigned char *tcp_request(int confd, time_t now,
       int ede = EDE_UNSET;
 
       if (query_count == TCP_MAX_QUERIES)
-	return packet;
+	goto done; /* Pi-hole modification */
 
       if (do_stale)
 	{
@@ -2279,7 +2321,7 @@ unsigned char *tcp_request(int confd, time_t now,
 	  if (!read_write(confd, &c1, 1, 1) || !read_write(confd, &c2, 1, 1) ||
 	      !(size = c1 << 8 | c2) ||
 	      !read_write(confd, payload, size, 1))
-	    return packet;
+	    goto done; /* Pi-hole modification */
 	  
 	  /* for stale-answer processing. */
 	  hb3 = header->hb3;
@@ -2407,16 +2449,9 @@ unsigned char *tcp_request(int confd, time_t now,
 	    m = FTL_make_answer(header, ((char *) header) + 65536, size, &ede);
 	    // The pseudoheader may contain important information such as EDNS0 version important for
 	    // some DNS resolvers (such as systemd-resolved) to work properly. We should not discard them.
+	    // Add EDNS0 option EDE if applicable
 	    if (have_pseudoheader && m > 0)
-	    {
-	      u16 swap = htons(ede);
-	      if (ede != -1) // Add EDNS0 option EDE if applicable
-		m = add_pseudoheader(header, m, ((unsigned char *) header) + 65536,
-				     daemon->edns_pktsz, EDNS0_OPTION_EDE, (unsigned char *)&swap, 2, do_bit, 0);
-	      else
-		m = add_pseudoheader(header, m, ((unsigned char *) header) + 65536,
-				     daemon->edns_pktsz, 0, NULL, 0, do_bit, 0);
-	    }
+	      m = FTL_blocked_pseudoheader(header, m, ((unsigned char *) header) + 65536, ede, do_bit);
 	  }
 	  else
 	  {
@@ -2425,9 +2460,16 @@ unsigned char *tcp_request(int confd, time_t now,
 	   if (do_stale)
 	     m = 0;
 	   else
-	     /* m > 0 if answered from cache */
-	     m = answer_request(header, ((char *) header) + 65536, (size_t)size, 
-				dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &stale);
+	     {
+#ifdef HAVE_DNSSEC
+	       /* Pi-hole modification */
+	       if (option_bool(OPT_DNSSEC_VALID))
+		 dnssec_aggressive_nsec(now, header, (size_t)size);
+#endif
+	       /* m > 0 if answered from cache */
+	       m = answer_request(header, ((char *) header) + 65536, (size_t)size, 
+				  dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &stale);
+	     }
 	   
 	  /* Do this by steam now we're not in the select() loop */
 	  check_log_writer(1); 
@@ -2461,7 +2503,12 @@ unsigned char *tcp_request(int confd, time_t now,
 		  if (option_bool(OPT_ORDER) || master->last_server == -1)
 		    start = first;
 		  else
-		    start = master->last_server;
+		    {
+		      start = master->last_server;
+		      /************ Pi-hole modification ************/
+		      start = FTL_select_upstream(first, last, start);
+		      /**********************************************/
+		    }
 		  
 		  size = add_edns0_config(header, size, ((unsigned char *) header) + 65536, &peer_addr, now, &cacheable);
 		  
@@ -2602,6 +2649,9 @@ unsigned char *tcp_request(int confd, time_t now,
 	}
     }
 
+  /* Pi-hole modification: confd is closed on all returns, pre-forked TCP
+     workers (--tcp-workers) don't exit after a connection */
+ done:
   /* If we ran once to get fresh data, confd is already closed. */
   if (!do_stale)
     {
@@ -2907,6 +2957,8 @@ static void free_frec(struct frec *f)
     }
   
 #ifdef HAVE_DNSSEC
+  f->async_job = NULL; /* Pi-hole modification */
+
   /* Anything we're waiting on is pointless now, too */
   if (f->blocking_query)
     {
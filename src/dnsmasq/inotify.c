@@ -304,13 +304,12 @@ int inotify_check(time_t now)
 		      {
 			if ((ah = dyndir_addhosts(dd, path)))
 			  {
-			    const unsigned int removed = cache_remove_uid(ah->index);
+			    /* Pi-hole modification: re-read modified files in place so
+			       that only names which actually changed are touched */
+			    const unsigned int removed = (in->mask & IN_DELETE) ?
+			      cache_remove_uid(ah->index) : reload_hostsfile(path, ah->index);
 			    if (removed > 0)
 			      my_syslog(LOG_INFO, _("inotify: flushed %u names read from %s"), removed, path);
-
-			    /* (Re-)load hostsfile only if this event isn't triggered by deletion */
-			    if (!(in->mask & IN_DELETE))
-			      read_hostsfile(path, ah->index, 0, NULL, 0);
 #ifdef HAVE_DHCP
 			    if (daemon->dhcp || daemon->doing_dhcp6) 
 			      {
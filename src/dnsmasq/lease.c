@@ -21,6 +21,206 @@
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
+/* Pi-hole modification */
+/* Hash indexes of the lease list by client-id, by hardware address and by
+   IPv4/IPv6 address. Every lease on the lease list is indexed by address and,
+   if known, by client-id and hardware address. The chains are unordered, the
+   lookups prefer the most recently allocated matching lease (highest seq)
+   which is the one a walk of the lease list would have found first. */
+#define LEASE_HASH_MIN 64
+static struct dhcp_lease **hash_clid = NULL, **hash_hw = NULL, **hash_addr = NULL;
+static unsigned int hash_size = 0, hash_count = 0;
+static u64 lease_seq = 0;
+
+/* Append-only lease journal. Changed and deleted leases are appended to
+   <leasefile>.journal instead of rewriting the whole lease file on every
+   change. Deleted leases are recorded with an expiry time in the past. The
+   journal is merged into the lease file (compaction) after start-up, when it
+   has more entries than there are leases or when its oldest entry is older
+   than LEASE_JOURNAL_INTERVAL seconds such that readers of the lease file see
+   changes with a bounded delay. */
+#define LEASE_JOURNAL_MIN 64
+#define LEASE_JOURNAL_INTERVAL 60
+static FILE *journal_stream = NULL;
+static unsigned int journal_entries = 0;
+static int journal_compact = 0;
+static time_t journal_since = 0;
+
+static unsigned int hash_bytes(const unsigned char *data, int len, unsigned int h)
+{
+  /* FNV-1a */
+  while (len-- > 0)
+    h = (h ^ *data++) * 16777619u;
+
+  return h;
+}
+
+static unsigned int clid_bucket(const unsigned char *clid, int clid_len)
+{
+  return hash_bytes(clid, clid_len, 2166136261u) & (hash_size - 1);
+}
+
+static unsigned int hw_bucket(const unsigned char *hwaddr, int hw_len, int hw_type)
+{
+  return hash_bytes(hwaddr, hw_len, 2166136261u ^ (unsigned int)hw_type) & (hash_size - 1);
+}
+
+static unsigned int addr4_bucket(struct in_addr addr)
+{
+  return hash_bytes((unsigned char *)&addr, INADDRSZ, 2166136261u) & (hash_size - 1);
+}
+
+#ifdef HAVE_DHCP6
+static unsigned int addr6_bucket(const struct in6_addr *addr)
+{
+  return hash_bytes((const unsigned char *)addr, IN6ADDRSZ, 2166136261u) & (hash_size - 1);
+}
+#endif
+
+static int lease_has_clid(const struct dhcp_lease *lease)
+{
+  return lease->clid && lease->clid_len != 0;
+}
+
+static int lease_has_hwaddr(const struct dhcp_lease *lease)
+{
+  return lease->hwaddr_len > 0 && lease->hwaddr_len <= DHCP_CHADDR_MAX;
+}
+
+static unsigned int lease_addr_bucket(const struct dhcp_lease *lease)
+{
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    return addr6_bucket(&lease->addr6);
+#endif
+  return addr4_bucket(lease->addr);
+}
+
+static void lease_hash_link(struct dhcp_lease *lease)
+{
+  unsigned int b;
+
+  if (lease_has_clid(lease))
+    {
+      b = clid_bucket(lease->clid, lease->clid_len);
+      lease->clid_next = hash_clid[b];
+      hash_clid[b] = lease;
+    }
+
+  if (lease_has_hwaddr(lease))
+    {
+      b = hw_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type);
+      lease->hw_next = hash_hw[b];
+      hash_hw[b] = lease;
+    }
+
+  b = lease_addr_bucket(lease);
+  lease->addr_next = hash_addr[b];
+  hash_addr[b] = lease;
+}
+
+/* Grow the hash tables, chains stay as they are if we run out of memory */
+static void lease_rehash(void)
+{
+  struct dhcp_lease **old_clid = hash_clid, **old_hw = hash_hw, **old_addr = hash_addr;
+  struct dhcp_lease **new_clid, **new_hw, **new_addr, *lease, *tmp;
+  unsigned int i, old_size = hash_size, new_size = hash_size ? 2 * hash_size : LEASE_HASH_MIN;
+  size_t len = new_size * sizeof(struct dhcp_lease *);
+
+  if (old_size == 0)
+    {
+      /* The first tables are required, we cannot do without them */
+      new_clid = safe_malloc(len);
+      new_hw = safe_malloc(len);
+      new_addr = safe_malloc(len);
+    }
+  else
+    {
+      new_clid = whine_malloc(len);
+      new_hw = whine_malloc(len);
+      new_addr = whine_malloc(len);
+      
+      if (!new_clid || !new_hw || !new_addr)
+	{
+	  free(new_clid);
+	  free(new_hw);
+	  free(new_addr);
+	  return;
+	}
+    }
+
+  memset(new_clid, 0, len);
+  memset(new_hw, 0, len);
+  memset(new_addr, 0, len);
+  hash_clid = new_clid;
+  hash_hw = new_hw;
+  hash_addr = new_addr;
+  hash_size = new_size;
+
+  /* All indexed leases are in the address table */
+  for (i = 0; i < old_size; i++)
+    for (lease = old_addr[i]; lease; lease = tmp)
+      {
+	tmp = lease->addr_next;
+	lease_hash_link(lease);
+      }
+
+  free(old_clid);
+  free(old_hw);
+  free(old_addr);
+}
+
+static void lease_index(struct dhcp_lease *lease)
+{
+  if (hash_count >= hash_size)
+    lease_rehash();
+
+  lease_hash_link(lease);
+  hash_count++;
+}
+
+static void lease_unindex(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (hash_size == 0)
+    return;
+
+  if (lease_has_clid(lease))
+    for (up = &hash_clid[clid_bucket(lease->clid, lease->clid_len)]; *up; up = &(*up)->clid_next)
+      if (*up == lease)
+	{
+	  *up = lease->clid_next;
+	  break;
+	}
+
+  if (lease_has_hwaddr(lease))
+    for (up = &hash_hw[hw_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type)]; *up; up = &(*up)->hw_next)
+      if (*up == lease)
+	{
+	  *up = lease->hw_next;
+	  break;
+	}
+
+  for (up = &hash_addr[lease_addr_bucket(lease)]; *up; up = &(*up)->addr_next)
+    if (*up == lease)
+      {
+	*up = lease->addr_next;
+	hash_count--;
+	break;
+      }
+
+  lease->clid_next = lease->hw_next = lease->addr_next = NULL;
+}
+
+/* The lease has to be written to the lease file */
+static void lease_dirty(struct dhcp_lease *lease)
+{
+  lease->flags |= LEASE_JOURNAL;
+  file_dirty = 1;
+}
+/************************/
+
 static int read_leases(time_t now, FILE *leasestream)
 {
   unsigned long ei;
@@ -69,7 +269,9 @@ static int read_leases(time_t now, FILE *leasestream)
 		
 	if (inet_pton(AF_INET, daemon->namebuff, &addr.addr4))
 	  {
-	    if ((lease = lease4_allocate(addr.addr4)))
+	    /* Pi-hole modification: the lease journal updates existing leases */
+	    if ((lease = lease_find_by_addr(addr.addr4)) ||
+		(lease = lease4_allocate(addr.addr4)))
 	      domain = get_domain(lease->addr);
 	    
 	    hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
@@ -89,7 +291,9 @@ static int read_leases(time_t now, FILE *leasestream)
 		s++;
 	      }
 	    
-	    if ((lease = lease6_allocate(&addr.addr6, lease_type)))
+	    /* Pi-hole modification: the lease journal updates existing leases */
+	    if ((lease = lease6_find_by_addr(&addr.addr6, 128, 0)) ||
+		(lease = lease6_allocate(&addr.addr6, lease_type)))
 	      {
 		lease_set_iaid(lease, strtoul(s, NULL, 10));
 		domain = get_domain6(&lease->addr6);
@@ -115,6 +319,9 @@ static int read_leases(time_t now, FILE *leasestream)
 	
 	if (strcmp(daemon->dhcp_buff, "*") !=  0)
 	  lease_set_hostname(lease, daemon->dhcp_buff, 0, domain, NULL);
+	/* Pi-hole modification: the journal may remove the hostname */
+	else if (lease->hostname)
+	  lease_set_hostname(lease, NULL, 0, NULL, NULL);
 
 	ei = atol(daemon->dhcp_buff3);
 
@@ -132,7 +339,7 @@ static int read_leases(time_t now, FILE *leasestream)
 	
 	/* set these correctly: the "old" events are generated later from
 	   the startup synthesised SIGHUP. */
-	lease->flags &= ~(LEASE_NEW | LEASE_CHANGED);
+	lease->flags &= ~(LEASE_NEW | LEASE_CHANGED | LEASE_JOURNAL); /* Pi-hole modification: LEASE_JOURNAL */
 	
 	*daemon->dhcp_buff3 = *daemon->dhcp_buff2 = '\0';
       }
@@ -187,6 +394,34 @@ void lease_init(time_t now)
       if (ferror(leasestream))
 	die(_("failed to read lease file %s: %s"), daemon->lease_file, EC_FILE);
     }
+
+  /* Pi-hole modification: replay the lease journal */
+#ifndef HAVE_BROKEN_RTC
+  if (daemon->lease_stream)
+    {
+      char *journal = safe_malloc(strlen(daemon->lease_file) + sizeof(".journal"));
+      
+      strcpy(journal, daemon->lease_file);
+      strcat(journal, ".journal");
+      
+      if (!(journal_stream = fopen(journal, "a+")))
+	my_syslog(MS_DHCP | LOG_WARNING, _("cannot open or create lease journal %s: %s"),
+		  journal, strerror(errno));
+      else
+	{
+	  rewind(journal_stream);
+	  
+	  if (!read_leases(now, journal_stream) || ferror(journal_stream))
+	    my_syslog(MS_DHCP | LOG_ERR, _("failed to parse lease journal %s cleanly"), journal);
+	  
+	  /* Merge it into the lease file as soon as possible */
+	  journal_compact = ftell(journal_stream) > 0;
+	}
+      
+      free(journal);
+    }
+#endif
+  /************************/
   
 #ifdef HAVE_SCRIPT
   if (!daemon->lease_stream)
@@ -238,23 +473,130 @@ void lease_update_from_configs(void)
       lease_set_hostname(lease, name, 1, get_domain(lease->addr), NULL); /* updates auth flag only */
 }
 
-static void ourprintf(int *errp, char *format, ...)
+/* Pi-hole modification: write to the given stream */
+static void ourprintf(FILE *stream, int *errp, char *format, ...)
 {
   va_list ap;
   
   va_start(ap, format);
-  if (!(*errp) && vfprintf(daemon->lease_stream, format, ap) < 0)
+  if (!(*errp) && vfprintf(stream, format, ap) < 0)
     *errp = errno;
   va_end(ap);
 }
 
+/* Pi-hole modification: write a single lease in lease file format, deleted
+   leases are written to the journal with an expiry time in the past */
+static void lease_write(FILE *stream, int *errp, struct dhcp_lease *lease, int deleted)
+{
+  int i;
+
+#ifdef HAVE_BROKEN_RTC
+  (void)deleted;
+  ourprintf(stream, errp, "%u ", lease->length);
+#else
+  ourprintf(stream, errp, "%lu ", deleted ? 1UL : (unsigned long)lease->expires);
+#endif
+
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    {
+      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
+      
+      ourprintf(stream, errp, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
+		lease->iaid, daemon->addrbuff);
+    }
+  else
+#endif
+    {
+      if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
+	ourprintf(stream, errp, "%.2x-", lease->hwaddr_type);
+      for (i = 0; i < lease->hwaddr_len; i++)
+	{
+	  ourprintf(stream, errp, "%.2x", lease->hwaddr[i]);
+	  if (i != lease->hwaddr_len - 1)
+	    ourprintf(stream, errp, ":");
+	}
+      
+      inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
+      
+      ourprintf(stream, errp, " %s ", daemon->addrbuff);
+    }
+
+  ourprintf(stream, errp, "%s ", lease->hostname ? lease->hostname : "*");
+  
+  if (lease->clid && lease->clid_len != 0)
+    {
+      for (i = 0; i < lease->clid_len - 1; i++)
+	ourprintf(stream, errp, "%.2x:", lease->clid[i]);
+      ourprintf(stream, errp, "%.2x\n", lease->clid[i]);
+    }
+  else
+    ourprintf(stream, errp, "*\n");	  
+}
+
+/* Pi-hole modification: Is it time to merge the journal into the lease file? */
+static int journal_due(time_t now)
+{
+  unsigned int count = (unsigned int)(daemon->dhcp_max - leases_left);
+
+  if (!journal_stream || journal_compact)
+    return 1;
+
+  if (journal_entries == 0)
+    return 0;
+
+  return (journal_entries >= LEASE_JOURNAL_MIN && journal_entries >= count) ||
+    difftime(now, journal_since) >= LEASE_JOURNAL_INTERVAL;
+}
+
+/* Pi-hole modification: Append changed leases to the journal */
+static int journal_append(time_t now)
+{
+  struct dhcp_lease *lease;
+  int err = 0;
+
+  for (lease = leases; lease; lease = lease->next)
+    {
+      if (!(lease->flags & LEASE_JOURNAL))
+	continue;
+      
+#ifdef HAVE_DHCP6
+      if ((lease->flags & (LEASE_TA | LEASE_NA)) && !daemon->duid)
+	continue;
+#endif
+      
+      lease_write(journal_stream, &err, lease, 0);
+      if (journal_entries++ == 0)
+	journal_since = now;
+    }
+
+  if (fflush(journal_stream) != 0 ||
+      fsync(fileno(journal_stream)) < 0)
+    err = errno;
+
+  if (err)
+    journal_compact = 1;
+  else
+    for (lease = leases; lease; lease = lease->next)
+      lease->flags &= ~LEASE_JOURNAL;
+
+  return err;
+}
+
 void lease_update_file(time_t now)
 {
   struct dhcp_lease *lease;
   time_t next_event;
   int i, err = 0;
 
-  if (file_dirty != 0 && daemon->lease_stream)
+  /* Pi-hole modification: append to the journal unless it is due to be
+     merged into the lease file */
+  if (file_dirty != 0 && daemon->lease_stream && !journal_due(now))
+    {
+      if (!(err = journal_append(now)))
+	file_dirty = 0;
+    }
+  else if ((file_dirty != 0 || (journal_stream && journal_due(now))) && daemon->lease_stream)
     {
       errno = 0;
       rewind(daemon->lease_stream);
@@ -263,49 +605,23 @@ void lease_update_file(time_t now)
       
       for (lease = leases; lease; lease = lease->next)
 	{
+	  lease->flags &= ~LEASE_JOURNAL; /* Pi-hole modification */
 
 #ifdef HAVE_DHCP6
 	  if (lease->flags & (LEASE_TA | LEASE_NA))
 	    continue;
 #endif
 
-#ifdef HAVE_BROKEN_RTC
-	  ourprintf(&err, "%u ", lease->length);
-#else
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-
-	  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
-	    ourprintf(&err, "%.2x-", lease->hwaddr_type);
-	  for (i = 0; i < lease->hwaddr_len; i++)
-	    {
-	      ourprintf(&err, "%.2x", lease->hwaddr[i]);
-	      if (i != lease->hwaddr_len - 1)
-		ourprintf(&err, ":");
-	    }
-	  
-	  inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
-
-	  ourprintf(&err, " %s ", daemon->addrbuff);
-	  ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	  	  
-	  if (lease->clid && lease->clid_len != 0)
-	    {
-	      for (i = 0; i < lease->clid_len - 1; i++)
-		ourprintf(&err, "%.2x:", lease->clid[i]);
-	      ourprintf(&err, "%.2x\n", lease->clid[i]);
-	    }
-	  else
-	    ourprintf(&err, "*\n");	  
+	  lease_write(daemon->lease_stream, &err, lease, 0); /* Pi-hole modification */
 	}
       
 #ifdef HAVE_DHCP6  
       if (daemon->duid)
 	{
-	  ourprintf(&err, "duid ");
+	  ourprintf(daemon->lease_stream, &err, "duid ");
 	  for (i = 0; i < daemon->duid_len - 1; i++)
-	    ourprintf(&err, "%.2x:", daemon->duid[i]);
-	  ourprintf(&err, "%.2x\n", daemon->duid[i]);
+	    ourprintf(daemon->lease_stream, &err, "%.2x:", daemon->duid[i]);
+	  ourprintf(daemon->lease_stream, &err, "%.2x\n", daemon->duid[i]);
 	  
 	  for (lease = leases; lease; lease = lease->next)
 	    {
@@ -313,26 +629,7 @@ void lease_update_file(time_t now)
 	      if (!(lease->flags & (LEASE_TA | LEASE_NA)))
 		continue;
 
-#ifdef HAVE_BROKEN_RTC
-	      ourprintf(&err, "%u ", lease->length);
-#else
-	      ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-    
-	      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
-	 
-	      ourprintf(&err, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
-			lease->iaid, daemon->addrbuff);
-	      ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	      
-	      if (lease->clid && lease->clid_len != 0)
-		{
-		  for (i = 0; i < lease->clid_len - 1; i++)
-		    ourprintf(&err, "%.2x:", lease->clid[i]);
-		  ourprintf(&err, "%.2x\n", lease->clid[i]);
-		}
-	      else
-		ourprintf(&err, "*\n");	  
+	      lease_write(daemon->lease_stream, &err, lease, 0); /* Pi-hole modification */
 	    }
 	}
 #endif      
@@ -343,6 +640,20 @@ void lease_update_file(time_t now)
       
       if (!err)
 	file_dirty = 0;
+
+      /* Pi-hole modification: the journal has been merged */
+      if (!err && journal_stream)
+	{
+	  if (fflush(journal_stream) != 0 ||
+	      ftruncate(fileno(journal_stream), 0) != 0)
+	    err = errno;
+	  else
+	    {
+	      journal_entries = 0;
+	      journal_compact = 0;
+	    }
+	}
+      /************************/
     }
   
   /* Set alarm for when the first lease expires. */
@@ -372,6 +683,16 @@ void lease_update_file(time_t now)
     if (lease->expires != 0 &&
 	(next_event == 0 || difftime(next_event, lease->expires) > 0.0))
       next_event = lease->expires;
+
+  /* Pi-hole modification: merge the journal into the lease file in time */
+  if (journal_entries != 0)
+    {
+      time_t event = journal_since + LEASE_JOURNAL_INTERVAL;
+      
+      if (next_event == 0 || difftime(next_event, event) > 0.0)
+	next_event = event;
+    }
+  /************************/
    
   if (err)
     {
@@ -486,6 +807,7 @@ void lease_make_duid(time_t now)
   if (!daemon->duid && daemon->doing_dhcp6)
     {
       file_dirty = 1;
+      journal_compact = 1; /* Pi-hole modification: the DUID isn't journaled */
       make_duid(now);
     }
 }
@@ -566,6 +888,22 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 
 	  daemon->metrics[lease->addr.s_addr ? METRIC_LEASES_PRUNED_4 : METRIC_LEASES_PRUNED_6]++;
 
+	  /* Pi-hole modification: deleted leases are recorded in the journal,
+	     expired ones too, so that the journal is merged into the lease
+	     file in time and they don't linger there */
+	  lease_unindex(lease);
+	  if (journal_stream && !journal_compact)
+	    {
+	      int err = 0;
+	      
+	      lease_write(journal_stream, &err, lease, 1);
+	      if (err)
+		journal_compact = 1;
+	      else if (journal_entries++ == 0)
+		journal_since = now;
+	    }
+	  /************************/
+
  	  *up = lease->next; /* unlink */
 	  
 	  /* Put on old_leases list 'till we
@@ -581,55 +919,70 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 } 
 	
   
+/* Pi-hole modification: lookups use the hash indexes */
 struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int hw_type,
 					unsigned char *clid, int clid_len)
 {
-  struct dhcp_lease *lease;
+  struct dhcp_lease *lease, *found = NULL;
 
-  if (clid)
-    for (lease = leases; lease; lease = lease->next)
-      {
+  if (hash_size == 0)
+    return NULL;
+
+  if (clid && clid_len != 0)
+    {
+      for (lease = hash_clid[clid_bucket(clid, clid_len)]; lease; lease = lease->clid_next)
+	{
 #ifdef HAVE_DHCP6
-	if (lease->flags & (LEASE_TA | LEASE_NA))
-	  continue;
+	  if (lease->flags & (LEASE_TA | LEASE_NA))
+	    continue;
 #endif
-	if (lease->clid && clid_len == lease->clid_len &&
-	    memcmp(clid, lease->clid, clid_len) == 0)
-	  return lease;
-      }
+	  if (clid_len == lease->clid_len &&
+	      memcmp(clid, lease->clid, clid_len) == 0 &&
+	      (!found || lease->seq > found->seq))
+	    found = lease;
+	}
+      
+      if (found)
+	return found;
+    }
   
-  for (lease = leases; lease; lease = lease->next)	
-    {
+  if (hw_len > 0 && hw_len <= DHCP_CHADDR_MAX)
+    for (lease = hash_hw[hw_bucket(hwaddr, hw_len, hw_type)]; lease; lease = lease->hw_next)
+      {
 #ifdef HAVE_DHCP6
-      if (lease->flags & (LEASE_TA | LEASE_NA))
-	continue;
+	if (lease->flags & (LEASE_TA | LEASE_NA))
+	  continue;
 #endif   
-      if ((!lease->clid || !clid) && 
-	  hw_len != 0 && 
-	  lease->hwaddr_len == hw_len &&
-	  lease->hwaddr_type == hw_type &&
-	  memcmp(hwaddr, lease->hwaddr, hw_len) == 0)
-	return lease;
-    }
+	if ((!lease->clid || !clid) && 
+	    lease->hwaddr_len == hw_len &&
+	    lease->hwaddr_type == hw_type &&
+	    memcmp(hwaddr, lease->hwaddr, hw_len) == 0 &&
+	    (!found || lease->seq > found->seq))
+	  found = lease;
+      }
 
-  return NULL;
+  return found;
 }
 
 struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
-  struct dhcp_lease *lease;
+  struct dhcp_lease *lease, *found = NULL;
 
-  for (lease = leases; lease; lease = lease->next)
+  if (hash_size == 0)
+    return NULL;
+
+  for (lease = hash_addr[addr4_bucket(addr)]; lease; lease = lease->addr_next)
     {
 #ifdef HAVE_DHCP6
       if (lease->flags & (LEASE_TA | LEASE_NA))
 	continue;
 #endif  
-      if (lease->addr.s_addr == addr.s_addr)
-	return lease;
+      if (lease->addr.s_addr == addr.s_addr &&
+	  (!found || lease->seq > found->seq))
+	found = lease;
     }
 
-  return NULL;
+  return found;
 }
 
 #ifdef HAVE_DHCP6
@@ -638,9 +991,13 @@ struct dhcp_lease *lease6_find(unsigned char *clid, int clid_len,
 			       int lease_type, unsigned int iaid,
 			       struct in6_addr *addr)
 {
-  struct dhcp_lease *lease;
+  struct dhcp_lease *lease, *found = NULL;
   
-  for (lease = leases; lease; lease = lease->next)
+  if (hash_size == 0)
+    return NULL;
+
+  /* Pi-hole modification: use the address index */
+  for (lease = hash_addr[addr6_bucket(addr)]; lease; lease = lease->addr_next)
     {
       if (!(lease->flags & lease_type) || lease->iaid != iaid)
 	continue;
@@ -652,10 +1009,11 @@ struct dhcp_lease *lease6_find(unsigned char *clid, int clid_len,
 	   memcmp(clid, lease->clid, clid_len) != 0))
 	continue;
       
-      return lease;
+      if (!found || lease->seq > found->seq)
+	found = lease;
     }
   
-  return NULL;
+  return found;
 }
 
 /* reset "USED flags */
@@ -672,7 +1030,37 @@ struct dhcp_lease *lease6_find_by_client(struct dhcp_lease *first, int lease_typ
 					 unsigned char *clid, int clid_len,
 					 unsigned int iaid)
 {
-  struct dhcp_lease *lease;
+  struct dhcp_lease *lease, *found = NULL;
+
+  /* Pi-hole modification: use the client-id index. Leases are enumerated in
+     the order of the lease list, i.e. by descending seq */
+  if (clid && clid_len != 0)
+    {
+      if (hash_size == 0)
+	return NULL;
+
+      for (lease = hash_clid[clid_bucket(clid, clid_len)]; lease; lease = lease->clid_next)
+	{
+	  if (lease->flags & LEASE_USED)
+	    continue;
+	  
+	  if (!(lease->flags & lease_type) || lease->iaid != iaid)
+	    continue;
+	  
+	  if (clid_len != lease->clid_len ||
+	      memcmp(clid, lease->clid, clid_len) != 0)
+	    continue;
+
+	  if (first && lease->seq >= first->seq)
+	    continue;
+	  
+	  if (!found || lease->seq > found->seq)
+	    found = lease;
+	}
+
+      return found;
+    }
+  /************************/
 
   if (!first)
     first = leases;
@@ -701,6 +1089,34 @@ struct dhcp_lease *lease6_find_by_addr(struct in6_addr *net, int prefix, u64 add
 {
   struct dhcp_lease *lease;
     
+  /* Pi-hole modification: With a prefix of at least 64 bits, the only
+     possible address is known and we can use the address index */
+  if (prefix >= 64)
+    {
+      struct dhcp_lease *found = NULL;
+      struct in6_addr addr6 = *net;
+      
+      if (hash_size == 0)
+	return NULL;
+      
+      if (prefix != 128)
+	setaddr6part(&addr6, addr);
+      
+      for (lease = hash_addr[addr6_bucket(&addr6)]; lease; lease = lease->addr_next)
+	{
+	  if (!(lease->flags & (LEASE_TA | LEASE_NA)))
+	    continue;
+	  
+	  if (is_same_net6(&lease->addr6, net, prefix) &&
+	      (prefix == 128 || addr6part(&lease->addr6) == addr) &&
+	      (!found || lease->seq > found->seq))
+	    found = lease;
+	}
+      
+      return found;
+    }
+  /************************/
+
   for (lease = leases; lease; lease = lease->next)
     {
       if (!(lease->flags & (LEASE_TA | LEASE_NA)))
@@ -776,7 +1192,10 @@ static struct dhcp_lease *lease_allocate(void)
   lease->next = leases;
   leases = lease;
   
-  file_dirty = 1;
+  /* Pi-hole modification */
+  lease->seq = ++lease_seq;
+  lease_dirty(lease);
+  /************************/
   leases_left--;
 
   return lease;
@@ -788,6 +1207,7 @@ struct dhcp_lease *lease4_allocate(struct in_addr addr)
   if (lease)
     {
       lease->addr = addr;
+      lease_index(lease); /* Pi-hole modification */
       daemon->metrics[METRIC_LEASES_ALLOCATED_4]++;
     }
   
@@ -804,6 +1224,7 @@ struct dhcp_lease *lease6_allocate(struct in6_addr *addrp, int lease_type)
       lease->addr6 = *addrp;
       lease->flags |= lease_type;
       lease->iaid = 0;
+      lease_index(lease); /* Pi-hole modification */
 
       daemon->metrics[METRIC_LEASES_ALLOCATED_6]++;
     }
@@ -837,7 +1258,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
       lease->expires = exp;
 #ifndef HAVE_BROKEN_RTC
       lease->flags |= LEASE_AUX_CHANGED | LEASE_EXP_CHANGED;
-      file_dirty = 1;
+      lease_dirty(lease); /* Pi-hole modification */
 #endif
     }
   
@@ -846,7 +1267,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
     {
       lease->length = len;
       lease->flags |= LEASE_AUX_CHANGED;
-      file_dirty = 1; 
+      lease_dirty(lease); /* Pi-hole modification */
     }
 #endif
 } 
@@ -858,6 +1279,7 @@ void lease_set_iaid(struct dhcp_lease *lease, unsigned int iaid)
     {
       lease->iaid = iaid;
       lease->flags |= LEASE_CHANGED;
+      lease_dirty(lease); /* Pi-hole modification */
     }
 }
 #endif
@@ -874,6 +1296,10 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
   (void)force;
   (void)now;
 
+  /* Pi-hole modification: the keys of the hash indexes may change */
+  lease_unindex(lease);
+  /************************/
+
   if (hw_len != lease->hwaddr_len ||
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
@@ -883,7 +1309,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       lease->hwaddr_len = hw_len;
       lease->hwaddr_type = hw_type;
       lease->flags |= LEASE_CHANGED;
-      file_dirty = 1; /* run script on change */
+      lease_dirty(lease); /* run script on change (Pi-hole modification) */
     }
 
   /* only update clid when one is available, stops packets
@@ -897,10 +1323,13 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       if (lease->clid_len != clid_len)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease); /* Pi-hole modification */
 	  free(lease->clid);
 	  if (!(lease->clid = whine_malloc(clid_len)))
-	    return;
+	    {
+	      lease_index(lease); /* Pi-hole modification */
+	      return;
+	    }
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	   
@@ -908,7 +1337,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       else if (memcmp(lease->clid, clid, clid_len) != 0)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease); /* Pi-hole modification */
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	
@@ -918,6 +1347,8 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       memcpy(lease->clid, clid, clid_len);
     }
   
+  lease_index(lease); /* Pi-hole modification */
+
 #ifdef HAVE_DHCP6
   if (change)
     slaac_add_addrs(lease, now, force);
@@ -1022,6 +1453,7 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
 	
 	  kill_name(lease_tmp);
 	  lease_tmp->flags |= LEASE_CHANGED; /* run script on change */
+	  lease_dirty(lease_tmp); /* Pi-hole modification */
 	  break;
 	}
     }
@@ -1035,7 +1467,7 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
   if (auth)
     lease->flags |= LEASE_AUTH_NAME;
   
-  file_dirty = 1;
+  lease_dirty(lease); /* Pi-hole modification */
   dns_dirty = 1; 
   lease->flags |= LEASE_CHANGED; /* run script on change */
 }
@@ -39,6 +39,9 @@ const char * metric_names[] = {
     "leases_pruned_4",
     "leases_allocated_6",
     "leases_pruned_6",
+    "dnssec_sig_cache_hits",
+    "dnssec_sig_cache_misses",
+    "dnssec_aggressive_negative",
 };
 
 const char* get_metric_name(int i) {
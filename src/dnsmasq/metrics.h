@@ -38,6 +38,9 @@ enum {
   METRIC_LEASES_PRUNED_4,
   METRIC_LEASES_ALLOCATED_6,
   METRIC_LEASES_PRUNED_6,
+  METRIC_DNSSEC_SIG_CACHE_HIT,
+  METRIC_DNSSEC_SIG_CACHE_MISS,
+  METRIC_DNSSEC_AGGRESSIVE_NEG,
   
   __METRIC_MAX,
 };
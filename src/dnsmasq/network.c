@@ -1566,6 +1566,9 @@ void check_servers(int no_loop_check)
   int port = 0, count;
   int locals = 0;
   
+  /* Pi-hole modification: pre-forked TCP workers know the old servers */
+  tcp_pool_retire();
+
 #ifdef HAVE_LOOP
   if (!no_loop_check)
     loop_send_probes();
@@ -190,6 +190,9 @@ struct myoption {
 #define LOPT_STALE_CACHE   377
 #define LOPT_NORR          378
 #define LOPT_NO_IDENT      379
+#define LOPT_DNSSEC_WORKERS 380 /* Pi-hole modification */
+#define LOPT_CACHE_FILE    381 /* Pi-hole modification */
+#define LOPT_TCP_WORKERS   382 /* Pi-hole modification */
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -380,6 +383,9 @@ static const struct myoption opts[] =
     { "fast-dns-retry", 2, 0, LOPT_FAST_RETRY },
     { "use-stale-cache", 2, 0 , LOPT_STALE_CACHE },
     { "no-ident", 0, 0, LOPT_NO_IDENT },
+    { "dnssec-workers", 1, 0, LOPT_DNSSEC_WORKERS }, /* Pi-hole modification */
+    { "cache-file", 1, 0, LOPT_CACHE_FILE }, /* Pi-hole modification */
+    { "tcp-workers", 1, 0, LOPT_TCP_WORKERS }, /* Pi-hole modification */
     { NULL, 0, 0, 0 }
   };
 
@@ -559,6 +565,7 @@ static struct {
   { LOPT_DNSSEC_CHECK, ARG_DUP, NULL, gettext_noop("Ensure answers without DNSSEC are in unsigned zones."), NULL },
   { LOPT_DNSSEC_TIME, OPT_DNSSEC_TIME, NULL, gettext_noop("Don't check DNSSEC signature timestamps until first cache-reload"), NULL },
   { LOPT_DNSSEC_STAMP, ARG_ONE, "<path>", gettext_noop("Timestamp file to verify system clock for DNSSEC"), NULL },
+  { LOPT_DNSSEC_WORKERS, ARG_ONE, "<integer>", gettext_noop("Number of threads checking DNSSEC signatures."), NULL }, /* Pi-hole modification */
   { LOPT_RA_PARAM, ARG_DUP, "<iface>,[mtu:<value>|<interface>|off,][<prio>,]<intval>[,<lifetime>]", gettext_noop("Set MTU, priority, resend-interval and router-lifetime"), NULL },
   { LOPT_QUIET_DHCP, OPT_QUIET_DHCP, NULL, gettext_noop("Do not log routine DHCP."), NULL },
   { LOPT_QUIET_DHCP6, OPT_QUIET_DHCP6, NULL, gettext_noop("Do not log routine DHCPv6."), NULL },
@@ -577,6 +584,8 @@ static struct {
   { LOPT_QUIET_TFTP, OPT_QUIET_TFTP, NULL, gettext_noop("Do not log routine TFTP."), NULL },
   { LOPT_NORR, OPT_NORR, NULL, gettext_noop("Suppress round-robin ordering of DNS records."), NULL },
   { LOPT_NO_IDENT, OPT_NO_IDENT, NULL, gettext_noop("Do not add CHAOS TXT records."), NULL },
+  { LOPT_CACHE_FILE, ARG_ONE, "<path>", gettext_noop("Save the DNS cache to this file and restore it at startup."), NULL }, /* Pi-hole modification */
+  { LOPT_TCP_WORKERS, ARG_ONE, "<integer>", gettext_noop("Number of pre-forked processes answering TCP queries."), NULL }, /* Pi-hole modification */
   { 0, 0, NULL, NULL, NULL }
 }; 
 
@@ -5182,11 +5191,35 @@ err:
 	break;
       }
 
+      /* Pi-hole modification */
+    case LOPT_CACHE_FILE: /* --cache-file */
+      daemon->cache_file = opt_string_alloc(arg);
+      break;
+      /************************/
+
+      /* Pi-hole modification */
+    case LOPT_TCP_WORKERS: /* --tcp-workers */
+      if (!atoi_check(arg, &daemon->tcp_workers))
+	ret_err(gen_err);
+      else if (daemon->tcp_workers > TCP_MAX_WORKERS)
+	daemon->tcp_workers = TCP_MAX_WORKERS;
+      break;
+      /************************/
+
 #ifdef HAVE_DNSSEC
     case LOPT_DNSSEC_STAMP: /* --dnssec-timestamp */
       daemon->timestamp_file = opt_string_alloc(arg); 
       break;
 
+      /* Pi-hole modification */
+    case LOPT_DNSSEC_WORKERS: /* --dnssec-workers */
+      if (!atoi_check(arg, &daemon->dnssec_workers))
+	ret_err(gen_err);
+      else if (daemon->dnssec_workers > DNSSEC_MAX_WORKERS)
+	daemon->dnssec_workers = DNSSEC_MAX_WORKERS;
+      break;
+      /************************/
+
     case LOPT_DNSSEC_CHECK: /* --dnssec-check-unsigned */
       if (arg)
 	{
@@ -1923,6 +1923,11 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 							crec_ttl(crecp, now), NULL, type, C_IN, 
 							type == T_A ? "4" : "6", &crecp->addr))
 				  anscount++;
+
+				/* Pi-hole modification */
+				if (!stale_flag)
+				  FTL_prefetch(name, crecp, now);
+				/************************/
 			      }
 			  }
 		      } while ((crecp = cache_find_by_name(crecp, name, now, flag)));
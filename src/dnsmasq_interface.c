@@ -46,12 +46,16 @@
 #include <stddef.h>
 // get_edestr()
 #include "api/api_helper.h"
-// logg_rate_limit_message()
-#include "database/message-table.h"
-// type struct sqlite3_stmt_vec
-#include "vector.h"
+// rate_limit_client()
+#include "ratelimit.h"
+// record_latency()
+#include "metrics.h"
+// select_upstream()
+#include "upstreams.h"
 // check_one_struct()
 #include "struct_size.h"
+// arena_strdup()
+#include "arena.h"
 
 // Private prototypes
 static void print_flags(const unsigned int flags);
@@ -74,6 +78,7 @@ static void check_pihole_PTR(char *domain);
 static void _query_set_dnssec(queriesData *query, const enum dnssec_status dnssec, const char *file, const int line);
 static char *get_ptrname(struct in_addr *addr);
 static const char *check_dnsmasq_name(const char *name);
+static void prefetch_count(const queriesData *query, const bool cached);
 
 // Static blocking metadata
 static bool adbit = false;
@@ -95,11 +100,27 @@ static struct {
 // Fork-private copy of the server data the most recent reply came from
 static union mysockaddr last_server = {{ 0 }};
 
+// Start times of the connections the TCP workers occupying the slots of the
+// TCP worker pool are busy with (main process only)
+static uint64_t tcp_worker_started[MAX_PROCS] = { 0 };
+
+// Set in pre-forked TCP workers which are handed one connection after another
+static bool tcp_pool_worker = false;
+
+// Fork-private prefetching state of the most recent query: the domain which
+// may be refreshed and whether a refresh is due after the cached answer has
+// been sent
+static int prefetch_domainID = -1;
+static bool prefetch_pending = false;
+
 unsigned char* pihole_privacylevel = &config.privacylevel;
 const char *flagnames[] = {"F_IMMORTAL ", "F_NAMEP ", "F_REVERSE ", "F_FORWARD ", "F_DHCP ", "F_NEG ", "F_HOSTS ", "F_IPV4 ", "F_IPV6 ", "F_BIGNAME ", "F_NXDOMAIN ", "F_CNAME ", "F_DNSKEY ", "F_CONFIG ", "F_DS ", "F_DNSSECOK ", "F_UPSTREAM ", "F_RRNAME ", "F_SERVER ", "F_QUERY ", "F_NOERR ", "F_AUTH ", "F_DNSSEC ", "F_KEYTAG ", "F_SECSTAT ", "F_NO_RR ", "F_IPSET ", "F_NOEXTRA ", "F_SERVFAIL", "F_RCODE", "F_SRV", "F_STALE" };
 
 void FTL_hook(unsigned int flags, const char *name, union all_addr *addr, char *arg, int id, unsigned short type, const char* file, const int line)
 {
+	// Release scratch memory of the previous event
+	arena_reset();
+
 	// Extract filename from path
 	const char *path = short_path(file);
 	if(config.debug & DEBUG_FLAGS)
@@ -169,6 +190,135 @@ void FTL_hook(unsigned int flags, const char *name, union all_addr *addr, char *
 		FTL_reply(flags, name, addr, arg, id, path, line);
 }
 
+// Pre-encoded answer records of blocked replies. Blocked replies to the same
+// type of query differ only in the question which is already in the packet
+// so the answer records are encoded once and then copied into every reply.
+// Templates are looked up by everything they encode (type, TTL and address),
+// changes of the blocking mode, the configured reply addresses or the
+// interface addresses are therefore picked up automatically
+#define BLOCKED_RR_TEMPLATES 8
+typedef struct {
+	unsigned short type;
+	unsigned long ttl;
+	union all_addr addr;
+	size_t len;
+	unsigned char rr[12 + IN6ADDRSZ];
+} blockedRR;
+static blockedRR blocked_rr[BLOCKED_RR_TEMPLATES] = {{ 0 }};
+static unsigned int blocked_rr_next = 0;
+
+// Pre-encoded EDNS(0) pseudoheader (without options) of blocked replies, one
+// for each state of the DO bit
+#define BLOCKED_OPT_LEN 11
+static unsigned char blocked_opt[2][BLOCKED_OPT_LEN] = {{ 0 }};
+static unsigned short blocked_opt_udpsz = 0;
+
+static const blockedRR *get_blocked_rr(const unsigned short type, const unsigned long ttl, const union all_addr *addr)
+{
+	const size_t addrlen = type == T_A ? INADDRSZ : IN6ADDRSZ;
+	for(unsigned int i = 0; i < BLOCKED_RR_TEMPLATES; i++)
+	{
+		const blockedRR *rr = &blocked_rr[i];
+		if(rr->len > 0 && rr->type == type && rr->ttl == ttl &&
+		   memcmp(&rr->addr, addr, addrlen) == 0)
+			return rr;
+	}
+
+	// Not known yet, encode a new template replacing the oldest one
+	blockedRR *rr = &blocked_rr[blocked_rr_next++ % BLOCKED_RR_TEMPLATES];
+	unsigned char *p = rr->rr;
+	rr->type = type;
+	rr->ttl = ttl;
+	memcpy(&rr->addr, addr, sizeof(rr->addr));
+
+	// The owner name is always a pointer to the question
+	PUTSHORT(sizeof(struct dns_header) | 0xc000, p);
+	PUTSHORT(type, p);
+	PUTSHORT(C_IN, p);
+	PUTLONG(ttl, p);
+	PUTSHORT(addrlen, p);
+	memcpy(p, addr, addrlen);
+	rr->len = (p - rr->rr) + addrlen;
+
+	if(config.debug & DEBUG_FLAGS)
+		logg("Encoded blocked reply template %u for type %s",
+		     (blocked_rr_next - 1) % BLOCKED_RR_TEMPLATES, type == T_A ? "A" : "AAAA");
+
+	return rr;
+}
+
+// Copy a pre-encoded answer record into the reply, returns false if the
+// record does not fit
+static bool add_blocked_rr(struct dns_header *header, char *limit, unsigned char **pp,
+                           const unsigned short type, const unsigned long ttl,
+                           const union all_addr *addr)
+{
+	const blockedRR *rr = get_blocked_rr(type, ttl, addr);
+	if(*pp + rr->len > (unsigned char *)limit)
+		return false;
+
+	memcpy(*pp, rr->rr, rr->len);
+	*pp += rr->len;
+	header->ancount = htons(ntohs(header->ancount) + 1);
+
+	return true;
+}
+
+// Append the EDNS(0) pseudoheader (and EDE, if set) to a reply created by
+// FTL_make_answer(). This is a copy of a pre-encoded record instead of
+// add_pseudoheader() which has to walk the entire packet first
+size_t FTL_blocked_pseudoheader(struct dns_header *header, const size_t plen, unsigned char *limit,
+                                const int ede, const int do_bit)
+{
+	const u16 swap = htons(ede);
+	// Fall back to the generic routine in case there is anything in the
+	// additional section already
+	if(ntohs(header->arcount) != 0)
+	{
+		if(ede != EDE_UNSET)
+			return add_pseudoheader(header, plen, limit, daemon->edns_pktsz,
+			                        EDNS0_OPTION_EDE, (unsigned char *)&swap, 2, do_bit, 0);
+		else
+			return add_pseudoheader(header, plen, limit, daemon->edns_pktsz,
+			                        0, NULL, 0, do_bit, 0);
+	}
+
+	// (Re-)encode the templates when the advertised packet size changed
+	if(blocked_opt_udpsz != daemon->edns_pktsz)
+	{
+		for(unsigned int i = 0; i < 2; i++)
+		{
+			unsigned char *p = blocked_opt[i];
+			*p++ = 0; // empty name
+			PUTSHORT(T_OPT, p);
+			PUTSHORT(daemon->edns_pktsz, p); // max packet length
+			PUTSHORT(0, p); // extended RCODE and version
+			PUTSHORT(i ? 0x8000 : 0, p); // DO flag
+			PUTSHORT(0, p); // RDLEN
+		}
+		blocked_opt_udpsz = daemon->edns_pktsz;
+	}
+
+	unsigned char *p = (unsigned char *)header + plen;
+	const size_t len = BLOCKED_OPT_LEN + (ede != EDE_UNSET ? 6 : 0);
+	if(p + len > limit)
+		return plen; // Too big
+
+	memcpy(p, blocked_opt[do_bit ? 1 : 0], BLOCKED_OPT_LEN);
+	if(ede != EDE_UNSET)
+	{
+		// Patch RDLEN and add the EDE option
+		p += BLOCKED_OPT_LEN - 2;
+		PUTSHORT(6, p);
+		PUTSHORT(EDNS0_OPTION_EDE, p);
+		PUTSHORT(2, p);
+		memcpy(p, &swap, 2);
+	}
+	header->arcount = htons(1);
+
+	return plen + len;
+}
+
 // This is inspired by make_local_answer()
 size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len, int *ede, const char *file, const int line)
 {
@@ -366,11 +516,11 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add A resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_A, C_IN, (char*)"4", &addr.addr4))
+		if(add_blocked_rr(header, limit, &p, T_A,
+		                  hostname ? daemon->local_ttl : config.block_ttl, &addr))
 			log_query(flags & ~F_IPV6, name, &addr, (char*)blockingreason, 0);
+		else
+			trunc = 1;
 	}
 
 	// Add AAAA answer record if requested
@@ -401,11 +551,11 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add AAAA resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_AAAA, C_IN, (char*)"6", &addr.addr6))
+		if(!trunc && add_blocked_rr(header, limit, &p, T_AAAA,
+		                            hostname ? daemon->local_ttl : config.block_ttl, &addr))
 			log_query(flags & ~F_IPV4, name, &addr, (char*)blockingreason, 0);
+		else
+			trunc = 1;
 	}
 
 	// Log empty replies
@@ -467,6 +617,14 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
                     const char* file, const int line)
 {
 	// Create new query in data structure
+	const uint64_t latency_start = metrics_now();
+
+	// Release scratch memory of the previous query
+	arena_reset();
+
+	// Reset prefetching state of the previous query
+	prefetch_domainID = -1;
+	prefetch_pending = false;
 
 	// Get timestamp
 	const time_t querytimestamp = time(NULL);
@@ -583,7 +741,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	}
 
 	// Convert domain to lower case
-	char *domainString = strdup(name);
+	char *domainString = arena_strdup(name);
 	strtolower(domainString);
 
 	// Get client IP address
@@ -619,7 +777,6 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	if(config.ignore_localhost &&
 	   (strcmp(clientIP, "127.0.0.1") == 0 || strcmp(clientIP, "::1") == 0))
 	{
-		free(domainString);
 		return false;
 	}
 
@@ -635,9 +792,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	if(client == NULL)
 	{
 		// Encountered memory error, skip query
-		// Free allocated memory
-		free(domainString);
 		// Release thread lock
+		record_latency(LATENCY_NEW_QUERY, latency_start);
 		unlock_shm();
 		return false;
 	}
@@ -647,31 +803,14 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	const char *interface = internal_query ? "-" : next_iface.name;
 
 	// Check rate-limit for this client
-	if(!internal_query && config.rate_limit.count > 0 &&
-	   (++client->rate_limit > config.rate_limit.count  || client->flags.rate_limited))
+	if(!internal_query && rate_limit_client(client, clientIP, querytimestamp))
 	{
-		if(!client->flags.rate_limited)
-		{
-			// Log the first rate-limited query for this client in
-			// this interval. We do not log the blocked domain for
-			// privacy reasons
-			logg_rate_limit_message(clientIP, client->rate_limit);
-			// Reset rate-limiting counter so we can count what
-			// comes within the adjacent interval
-			client->rate_limit = 0;
-		}
-
-		// Memorize this client needs rate-limiting
-		client->flags.rate_limited = true;
-
 		// Block this query
 		force_next_DNS_reply = REPLY_REFUSED;
 		blockingreason = "Rate-limiting";
 
-		// Free allocated memory
-		free(domainString);
-
 		// Do not further process this query, Pi-hole has never seen it
+		record_latency(LATENCY_NEW_QUERY, latency_start);
 		unlock_shm();
 		return true;
 	}
@@ -700,7 +839,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 			const char *types = querystr(arg, qtype);
 			logg("Notice: Skipping new query: %s (%i)", types, id);
 		}
-		free(domainString);
+		record_latency(LATENCY_NEW_QUERY, latency_start);
 		unlock_shm();
 		return false;
 	}
@@ -708,15 +847,19 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Go through already knows domains and see if it is one of them
 	const int domainID = findDomainID(domainString, true);
 
+	// Only the UDP path refreshes records after answering from cache (see
+	// FTL_prefetch_due()), TCP queries must not use up the budget
+	if(proto == UDP && (querytype == TYPE_A || querytype == TYPE_AAAA))
+		prefetch_domainID = domainID;
+
 	// Save everything
 	queriesData* query = getQuery(queryID, false);
 	if(query == NULL)
 	{
 		// Encountered memory error, skip query
 		logg("WARN: No memory available, skipping query analysis");
-		// Free allocated memory
-		free(domainString);
 		// Release thread lock
+		record_latency(LATENCY_NEW_QUERY, latency_start);
 		unlock_shm();
 		return false;
 	}
@@ -833,10 +976,14 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Check if this should be blocked only for active queries
 	// (skipped for internally generated ones, e.g., DNSSEC)
 	if(!internal_query)
+	{
+		const uint64_t check_start = metrics_now();
 		blockDomain = FTL_check_blocking(queryID, domainID, clientID);
+		record_latency(LATENCY_CHECK_BLOCKING, check_start);
+	}
 
-	// Free allocated memory
-	free(domainString);
+	// Record time spent analyzing this query
+	record_latency(LATENCY_NEW_QUERY, latency_start);
 
 	// Release thread lock
 	unlock_shm();
@@ -1105,7 +1252,9 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 		return false;
 
 	// Check domains against exact blacklist
+	uint64_t start = metrics_now();
 	enum db_result blacklist = in_blacklist(domain, dns_cache, client);
+	record_latency(LATENCY_BLACKLIST, start);
 	if(blacklist == FOUND)
 	{
 		// Set new status
@@ -1120,7 +1269,9 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 	}
 
 	// Check domains against gravity domains
+	start = metrics_now();
 	enum db_result gravity = in_gravity(domain, client);
+	record_latency(LATENCY_GRAVITY, start);
 	if(gravity == FOUND)
 	{
 		// Set new status
@@ -1174,7 +1325,10 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 
 	// Check domain against blacklist regex filters
 	// Skipped when the domain is whitelisted or blocked by exact blacklist or gravity
-	if(in_regex(domain, dns_cache, client-> id, REGEX_BLACKLIST))
+	start = metrics_now();
+	const bool regex_match = in_regex(domain, dns_cache, client-> id, REGEX_BLACKLIST);
+	record_latency(LATENCY_REGEX, start);
+	if(regex_match)
 	{
 		// Set new status
 		*new_status = QUERY_REGEX;
@@ -1422,15 +1576,21 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	// Make a local copy of the domain string. The string memory may get
 	// reorganized in the following. We cannot expect domainstr to remain
 	// valid for all time.
-	domainstr = strdup(domainstr);
+	domainstr = arena_strdup(domainstr);
 	const char *blockedDomain = domainstr;
 
 	// Check exact whitelist for match
+	uint64_t start = metrics_now();
 	query->flags.whitelisted = in_whitelist(domainstr, dns_cache, client) == FOUND;
+	record_latency(LATENCY_WHITELIST, start);
 
 	// If not found: Check regex whitelist for match
 	if(!query->flags.whitelisted)
+	{
+		start = metrics_now();
 		query->flags.whitelisted = in_regex(domainstr, dns_cache, client->id, REGEX_WHITELIST);
+		record_latency(LATENCY_REGEX, start);
+	}
 
 	// Check blacklist (exact + regex) and gravity for queried domain
 	unsigned char new_status = QUERY_UNKNOWN;
@@ -1488,13 +1648,15 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			     query->flags.whitelisted ? "whitelisted" : "not blocked");
 	}
 
-	free(domainstr);
 	return blockDomain;
 }
 
 
 bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file, const int line)
 {
+	// Release scratch memory of the previous event
+	arena_reset();
+
 	if(config.debug & DEBUG_QUERIES)
 		logg("FTL_CNAME called with: src = %s, dst = %s, id = %d", src, dst, id);
 
@@ -1546,7 +1708,7 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 
 	// child_domain = Intermediate domain in CNAME path
 	// This is the domain which was queried later in this chain
-	char *child_domain = strdup(dst);
+	char *child_domain = arena_strdup(dst);
 	// Convert to lowercase for matching
 	strtolower(child_domain);
 	const int child_domainID = findDomainID(child_domain, false);
@@ -1568,7 +1730,6 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 		if(parent_domain == NULL)
 		{
 			// Memory error, return
-			free(child_domain);
 			unlock_shm();
 			return false;
 		}
@@ -1618,7 +1779,6 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 		logg("Query %d: CNAME %s ---> %s", id, src, dst);
 
 	// Return result
-	free(child_domain);
 	unlock_shm();
 	return block;
 }
@@ -1663,7 +1823,7 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	}
 
 	// Convert upstreamIP to lower case
-	char *upstreamIP = strdup(dest);
+	char *upstreamIP = arena_strdup(dest);
 	strtolower(upstreamIP);
 
 	// Debug logging
@@ -1679,7 +1839,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	{
 		// This may happen e.g. if the original query was a PTR query or "pi.hole"
 		// as we ignore them altogether
-		free(upstreamIP);
 		unlock_shm();
 		return;
 	}
@@ -1688,7 +1847,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	queriesData* query = getQuery(queryID, true);
 	if(query == NULL)
 	{
-		free(upstreamIP);
 		unlock_shm();
 		return;
 	}
@@ -1716,7 +1874,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	//   (this is a special case further described below)
 	if(query->flags.complete && query->status != QUERY_CACHE)
 	{
-		free(upstreamIP);
 		unlock_shm();
 		return;
 	}
@@ -1756,6 +1913,7 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 		// Normal forwarded query (status is set below)
 		// Hereby, this query is now fully determined
 		query->flags.complete = true;
+		prefetch_count(query, false);
 	}
 
 	// Set query status to forwarded only after the
@@ -1764,9 +1922,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	// be negative
 	query_set_status(query, QUERY_FORWARDED);
 
-	// Release allocated memory
-	free(upstreamIP);
-
 	// Unlock shared memory
 	unlock_shm();
 }
@@ -2033,8 +2188,22 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 
 	// Save response time
 	// Skipped internally if already computed
+	const bool first_response = !query->flags.response_calculated;
 	set_response_time(query, response);
 
+	// Record round-trip time of the upstream server which sent the first
+	// reply (response times are stored in units of 100 microseconds)
+	if(!cached && first_response && query->upstreamID > -1)
+	{
+		upstreamsData *upstream = getUpstream(query->upstreamID, true);
+		if(upstream != NULL)
+		{
+			record_upstream_rtt(query->upstreamID, getstr(upstream->ippos), upstream->port,
+			                    (uint64_t)query->response * 100000u);
+			upstream_sample_rtt(upstream, 0.1f*query->response, query->timestamp);
+		}
+	}
+
 	// We only process the first reply further in here
 	// Check if reply type is still UNKNOWN
 	if(query->reply != REPLY_UNKNOWN)
@@ -2065,7 +2234,10 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	{
 		// Set status of this query only if this is not a blocked query
 		if(!is_blocked(query->status))
+		{
 			query_set_status(query, qs);
+			prefetch_count(query, !stale);
+		}
 
 		// Detect if returned IP indicates that this query was blocked
 		const enum query_status new_status = detect_blocked_IP(flags, addr, query, domain);
@@ -2943,12 +3115,152 @@ void getCacheInformation(const int sock)
 	// <valid> are cache entries with positive remaining TTL
 	// <expired> cache entries (to be removed when space is needed)
 	// <immortal> cache records never expire (e.g. from /etc/hosts)
+
+	// Prefetching counters (only shown when prefetching is enabled)
+	if(config.prefetch.percent > 0 && metrics != NULL)
+	{
+		const uint64_t *events = metrics->prefetch.events;
+		ssend(sock, "prefetch-sent: %llu\nprefetch-skipped: %llu\nprefetch-hits: %llu\nprefetch-misses: %llu\n",
+		      (unsigned long long)events[PREFETCH_SENT],
+		      (unsigned long long)events[PREFETCH_SKIPPED],
+		      (unsigned long long)events[PREFETCH_HIT],
+		      (unsigned long long)events[PREFETCH_MISS]);
+	}
+}
+
+// Get the ID of the upstream record of a dnsmasq server, a new record is
+// created if we have not seen this server before
+static int get_server_upstreamID(const struct server *serv)
+{
+	char dest[ADDRSTRLEN] = { 0 };
+	in_port_t port;
+	if(serv->addr.sa.sa_family == AF_INET)
+	{
+		inet_ntop(AF_INET, &serv->addr.in.sin_addr, dest, ADDRSTRLEN);
+		port = ntohs(serv->addr.in.sin_port);
+	}
+	else if(serv->addr.sa.sa_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &serv->addr.in6.sin6_addr, dest, ADDRSTRLEN);
+		port = ntohs(serv->addr.in6.sin6_port);
+	}
+	else
+		return -1;
+
+	strtolower(dest);
+	return findUpstreamID(dest, port);
+}
+
+// Count cache hits and misses of popular domains to judge how effective
+// prefetching is (SHM lock held)
+static void prefetch_count(const queriesData *query, const bool cached)
+{
+	if(config.prefetch.percent == 0 ||
+	   (query->type != TYPE_A && query->type != TYPE_AAAA))
+		return;
+
+	const domainsData *domain = getDomain(query->domainID, true);
+	if(domain == NULL || (unsigned int)domain->count < config.prefetch.min_queries)
+		return;
+
+	record_prefetch(cached ? PREFETCH_HIT : PREFETCH_MISS);
+}
+
+// Called by dnsmasq for every A/AAAA record served from cache. If a popular
+// domain is queried shortly before its record expires, we refresh it from
+// upstream in the background once the cached answer has been sent (see
+// FTL_prefetch_due())
+void FTL_prefetch(const char *name, struct crec *crecp, const time_t now)
+{
+	// Prefetching is disabled or this query has already been checked
+	if(config.prefetch.percent == 0 || prefetch_domainID < 0)
+		return;
+
+	// Only records received from upstream are refreshed. A TTL of zero
+	// means this record has already been prefetched
+	if(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL | F_NEG) ||
+	   crecp->ttl == 0 || crecp->ttd <= now)
+		return;
+
+	// Is this record in the last percent of its TTL?
+	if((uint64_t)(crecp->ttd - now) * 100u > (uint64_t)crecp->ttl * config.prefetch.percent)
+		return;
+
+	// Check only the first matching record of this query
+	const int domainID = prefetch_domainID;
+	prefetch_domainID = -1;
+
+	// Is this domain popular enough? Records reached by following a CNAME
+	// are skipped as they are not the queried domain
+	lock_shm();
+	const domainsData *domain = getDomain(domainID, true);
+	const bool popular = domain != NULL &&
+	                     (unsigned int)domain->count >= config.prefetch.min_queries &&
+	                     strcasecmp(getstr(domain->domainpos), name) == 0;
+	unlock_shm();
+	if(!popular)
+		return;
+
+	// Limit the number of refreshes per minute
+	static time_t budget_start = 0;
+	static unsigned int budget_used = 0;
+	if(now - budget_start >= 60)
+	{
+		budget_start = now;
+		budget_used = 0;
+	}
+	if(budget_used >= config.prefetch.budget)
+	{
+		record_prefetch(PREFETCH_SKIPPED);
+		return;
+	}
+	budget_used++;
+
+	// Do not refresh this record again
+	crecp->ttl = 0;
+	prefetch_pending = true;
+	record_prefetch(PREFETCH_SENT);
+
+	if(config.debug & DEBUG_QUERIES)
+		logg("Prefetching %s (expires in %lu seconds)", name, (unsigned long)(crecp->ttd - now));
+}
+
+// Should the query just answered from cache be sent upstream to refresh the
+// cache?
+bool FTL_prefetch_due(void)
+{
+	const bool due = prefetch_pending;
+	prefetch_pending = false;
+	return due;
+}
+
+// Called by dnsmasq before forwarding a query to the server it used most
+// recently for this domain (<current>). We may choose another server out of
+// the servers [first, last) responsible for this domain (see upstreams.c)
+int FTL_select_upstream(const int first, const int last, const int current)
+{
+	if(config.upstream_selection != UPSTREAM_SELECT_LATENCY || last - first < 2 ||
+	   current < first || current >= last)
+		return current;
+
+	lock_shm();
+	int upstreamIDs[last - first];
+	for(int i = first; i < last; i++)
+		upstreamIDs[i - first] = get_server_upstreamID(daemon->serverarray[i]);
+
+	const int selected = first + select_upstream(upstreamIDs, last - first, current - first, time(NULL));
+	unlock_shm();
+
+	return selected;
 }
 
 void FTL_forwarding_retried(const struct server *serv, const int oldID, const int newID, const bool dnssec)
 {
 	// Forwarding to upstream server failed
 
+	// Release scratch memory of the previous event
+	arena_reset();
+
 	if(oldID == newID)
 	{
 		if(config.debug & DEBUG_QUERIES)
@@ -2978,7 +3290,7 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 	}
 
 	// Convert upstream to lower case
-	char *upstreamIP = strdup(dest);
+	char *upstreamIP = arena_strdup(dest);
 	strtolower(upstreamIP);
 
 	// Get upstream ID
@@ -2995,9 +3307,12 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 	// Get upstream pointer
 	upstreamsData* upstream = getUpstream(upstreamID, true);
 
-	// Update counter
+	// Update counter and failure rate
 	if(upstream != NULL)
+	{
 		upstream->failed++;
+		upstream_sample_failure(upstream, time(NULL));
+	}
 
 	// Search for corresponding query identified by ID
 	// Retried DNSSEC queries are ignored, we have to flag themselves (newID)
@@ -3029,8 +3344,7 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 		}
 	}
 
-	// Clean up and unlock shared memory
-	free(upstreamIP);
+	// Unlock shared memory
 	unlock_shm();
 	return;
 }
@@ -3191,13 +3505,89 @@ void FTL_TCP_worker_created(const int confd)
 		return;
 	}
 
-	// Reopen gravity database handle in this fork as the main process's
-	// handle isn't valid here
+	// Pre-forked workers keep the connection they opened for earlier
+	// connections (see FTL_TCP_pool_worker_created())
+	if(tcp_pool_worker)
+		return;
+
+	// The main process's gravity database handle isn't valid here. The
+	// worker opens its own connection once it needs it (many TCP queries
+	// are answered from the cache without ever looking at gravity)
+	gravityDB_forked();
+}
+
+// Called once when a pre-forked TCP worker (--tcp-workers) is created. It
+// opens its own gravity database connection once it needs it and keeps it
+// for all the connections it is handed afterwards
+void FTL_TCP_pool_worker_created(void)
+{
 	if(config.debug != 0)
-		logg("Reopening Gravity database for this fork");
+		logg("TCP worker pre-forked");
+
+	tcp_pool_worker = true;
 	gravityDB_forked();
 }
 
+// Called in the main process after a TCP worker has been forked into this
+// slot of the TCP worker pool, either for a single connection or to be
+// handed connections later (pooled)
+void FTL_TCP_worker_forked(const int slot, const bool pooled)
+{
+	if(slot < 0 || slot >= MAX_PROCS)
+		return;
+
+	lock_shm();
+	record_tcp_worker_forked(MAX_PROCS);
+	if(!pooled)
+	{
+		tcp_worker_started[slot] = metrics_now();
+		record_tcp_worker_started(false);
+	}
+	unlock_shm();
+}
+
+// Called in the main process after a connection has been handed to the
+// pre-forked TCP worker in this slot
+void FTL_TCP_worker_dispatched(const int slot)
+{
+	if(slot < 0 || slot >= MAX_PROCS)
+		return;
+
+	lock_shm();
+	tcp_worker_started[slot] = metrics_now();
+	record_tcp_worker_started(true);
+	unlock_shm();
+}
+
+// Called in the main process once the TCP worker in this slot is done with
+// its connection, i.e., it terminated and all its data has been read or, if
+// pre-forked, it reported back for the next connection
+void FTL_TCP_worker_released(const int slot)
+{
+	if(slot < 0 || slot >= MAX_PROCS || tcp_worker_started[slot] == 0)
+		return;
+
+	lock_shm();
+	record_tcp_worker_finished(metrics_now() - tcp_worker_started[slot]);
+	unlock_shm();
+	tcp_worker_started[slot] = 0;
+}
+
+// Called by the main process whenever it checks for a free TCP worker slot
+// before waiting for new events. The SHM lock is only taken when the state
+// changes
+void FTL_TCP_pool_saturated(const bool saturated)
+{
+	static bool was_saturated = false;
+	if(saturated == was_saturated)
+		return;
+	was_saturated = saturated;
+
+	lock_shm();
+	record_tcp_pool_saturated(saturated);
+	unlock_shm();
+}
+
 bool FTL_unlink_DHCP_lease(const char *ipaddr)
 {
 	struct dhcp_lease *lease;
@@ -3400,19 +3790,18 @@ static void _query_set_dnssec(queriesData *query, const enum dnssec_status dnsse
 int check_struct_sizes(void)
 {
 	int result = 0;
-	result += check_one_struct("ConfigStruct", sizeof(ConfigStruct), 112, 104);
+	result += check_one_struct("ConfigStruct", sizeof(ConfigStruct), 136, 128);
 	result += check_one_struct("queriesData", sizeof(queriesData), 56, 44);
-	result += check_one_struct("upstreamsData", sizeof(upstreamsData), 616, 604);
-	result += check_one_struct("clientsData", sizeof(clientsData), 672, 648);
+	result += check_one_struct("upstreamsData", sizeof(upstreamsData), 632, 616);
+	result += check_one_struct("clientsData", sizeof(clientsData), 704, 668);
 	result += check_one_struct("domainsData", sizeof(domainsData), 24, 20);
 	result += check_one_struct("DNSCacheData", sizeof(DNSCacheData), 16, 16);
 	result += check_one_struct("ednsData", sizeof(ednsData), 76, 76);
 	result += check_one_struct("overTimeData", sizeof(overTimeData), 32, 24);
-	result += check_one_struct("regexData", sizeof(regexData), 64, 48);
+	result += check_one_struct("regexData", sizeof(regexData), 72, 52);
 	result += check_one_struct("SharedMemory", sizeof(SharedMemory), 24, 12);
 	result += check_one_struct("ShmSettings", sizeof(ShmSettings), 16, 16);
-	result += check_one_struct("countersStruct", sizeof(countersStruct), 248, 248);
-	result += check_one_struct("sqlite3_stmt_vec", sizeof(sqlite3_stmt_vec), 32, 16);
+	result += check_one_struct("countersStruct", sizeof(countersStruct), 252, 252);
 
 	if(result == 0)
 		printf("All okay\n");
@@ -29,14 +29,19 @@ bool _FTL_new_query(const unsigned int flags, const char *name, union mysockaddr
 #define FTL_header_analysis(header4, rcode, server, id) _FTL_header_analysis(header4, rcode, server, id, __FILE__, __LINE__)
 void _FTL_header_analysis(const unsigned char header4, const unsigned int rcode, const struct server *server, const int id, const char* file, const int line);
 
+int FTL_select_upstream(const int first, const int last, const int current);
 void FTL_forwarding_retried(const struct server *server, const int oldID, const int newID, const bool dnssec);
 
 #define FTL_make_answer(header, limit, len, ede) _FTL_make_answer(header, limit, len, ede, __FILE__, __LINE__)
 size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len, int *ede, const char* file, const int line);
+size_t FTL_blocked_pseudoheader(struct dns_header *header, const size_t plen, unsigned char *limit, const int ede, const int do_bit);
 
 #define FTL_CNAME(dst, src, id) _FTL_CNAME(dst, src, id, __FILE__, __LINE__)
 bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file, const int line);
 
+void FTL_prefetch(const char *name, struct crec *crecp, const time_t now);
+bool FTL_prefetch_due(void);
+
 unsigned int FTL_extract_question_flags(struct dns_header *header, const size_t qlen);
 void FTL_query_in_progress(const int id);
 void FTL_multiple_replies(const int id, int *firstID);
@@ -45,6 +50,11 @@ void FTL_dnsmasq_reload(void);
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw);
 void FTL_TCP_worker_created(const int confd);
 void FTL_TCP_worker_terminating(bool finished);
+void FTL_TCP_pool_worker_created(void);
+void FTL_TCP_worker_forked(const int slot, const bool pooled);
+void FTL_TCP_worker_dispatched(const int slot);
+void FTL_TCP_worker_released(const int slot);
+void FTL_TCP_pool_saturated(const bool saturated);
 
 bool FTL_unlink_DHCP_lease(const char *ipaddr);
 
@@ -90,6 +90,15 @@ enum regex_type {
 	REGEX_MAX
 } __attribute__ ((packed));
 
+enum regex_fast_type {
+	REGEX_FAST_NONE,
+	REGEX_FAST_EXACT,
+	REGEX_FAST_SUFFIX,
+	REGEX_FAST_PREFIX,
+	REGEX_FAST_ENDS,
+	REGEX_FAST_CONTAINS
+} __attribute__ ((packed));
+
 enum query_types {
 	TYPE_A = 1,
 	TYPE_AAAA,
@@ -173,6 +182,12 @@ enum refresh_hostnames {
 	REFRESH_NONE
 } __attribute__ ((packed));
 
+enum db_partitioning {
+	DB_PARTITION_NONE,
+	DB_PARTITION_DAY,
+	DB_PARTITION_WEEK
+} __attribute__ ((packed));
+
 enum db_result {
 	NOT_FOUND,
 	FOUND,
@@ -186,6 +201,19 @@ enum busy_reply {
 	BUSY_DROP
 } __attribute__ ((packed));
 
+enum upstream_selection {
+	UPSTREAM_SELECT_DNSMASQ,
+	UPSTREAM_SELECT_LATENCY
+} __attribute__ ((packed));
+
+enum prefetch_event {
+	PREFETCH_SENT,
+	PREFETCH_SKIPPED,
+	PREFETCH_HIT,
+	PREFETCH_MISS,
+	PREFETCH_EVENTS
+} __attribute__ ((packed));
+
 enum thread_types {
 	DB,
 	GC,
@@ -226,4 +254,17 @@ enum addinfo_type {
 	ADDINFO_REGEX_ID
 } __attribute__ ((packed));
 
+enum latency_stage {
+	LATENCY_NEW_QUERY,
+	LATENCY_CHECK_BLOCKING,
+	LATENCY_WHITELIST,
+	LATENCY_BLACKLIST,
+	LATENCY_GRAVITY,
+	LATENCY_REGEX,
+	LATENCY_SHM_LOCK_WAIT,
+	LATENCY_SHM_LOCK_HOLD,
+	LATENCY_UPSTREAM_RTT,
+	LATENCY_STAGES
+} __attribute__ ((packed));
+
 #endif // ENUMS_H
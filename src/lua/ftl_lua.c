@@ -17,6 +17,8 @@
 #include <readline/history.h>
 #include <wordexp.h>
 #include "scripts/scripts.h"
+// metrics_available()
+#include "../metrics.h"
 
 int run_lua_interpreter(const int argc, char **argv, bool dnsmasq_debug)
 {
@@ -88,8 +90,94 @@ static int pihole_ftl_version(lua_State *L) {
 	return 1;
 }
 
+// Push a latency histogram as table (all values in nanoseconds)
+static void push_latency_histogram(lua_State *L, const latencyHistogram *hist)
+{
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, hist->count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, hist->sum);
+	lua_setfield(L, -2, "sum");
+	lua_pushinteger(L, hist->max);
+	lua_setfield(L, -2, "max");
+	lua_pushinteger(L, get_latency_percentile(hist, 0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushinteger(L, get_latency_percentile(hist, 0.9));
+	lua_setfield(L, -2, "p90");
+	lua_pushinteger(L, get_latency_percentile(hist, 0.99));
+	lua_setfield(L, -2, "p99");
+	lua_pushinteger(L, get_latency_percentile(hist, 0.999));
+	lua_setfield(L, -2, "p999");
+}
+
+// pihole.latency()
+// Returns nil if FTL is not running
+static int pihole_latency(lua_State *L) {
+	if(!metrics_available())
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_createtable(L, 0, 3);
+
+	// Query processing stages
+	lua_createtable(L, 0, LATENCY_STAGES);
+	for(unsigned int i = 0; i < LATENCY_STAGES; i++)
+	{
+		push_latency_histogram(L, &metrics->stages[i]);
+		lua_setfield(L, -2, get_latency_stage_name(i));
+	}
+	lua_setfield(L, -2, "stages");
+
+	// Upstream round-trip times
+	lua_newtable(L);
+	for(unsigned int i = 0; i < MAX_UPSTREAM_METRICS; i++)
+	{
+		const upstreamMetrics *upstream = &metrics->upstreams[i];
+		if(upstream->name[0] == '\0')
+			continue;
+		push_latency_histogram(L, &upstream->rtt);
+		lua_setfield(L, -2, upstream->name);
+	}
+	lua_setfield(L, -2, "upstreams");
+
+	// SHM lock call sites
+	lua_newtable(L);
+	lua_Integer n = 0;
+	for(unsigned int i = 0; i < MAX_LOCK_SITES; i++)
+	{
+		const lockSite *site = &metrics->sites[i];
+		if(site->key == 0)
+			continue;
+
+		lua_createtable(L, 0, 8);
+		lua_pushstring(L, site->func);
+		lua_setfield(L, -2, "func");
+		lua_pushstring(L, site->file);
+		lua_setfield(L, -2, "file");
+		lua_pushinteger(L, site->line);
+		lua_setfield(L, -2, "line");
+		lua_pushinteger(L, site->count);
+		lua_setfield(L, -2, "count");
+		lua_pushinteger(L, site->wait_sum);
+		lua_setfield(L, -2, "wait_sum");
+		lua_pushinteger(L, site->wait_max);
+		lua_setfield(L, -2, "wait_max");
+		lua_pushinteger(L, site->hold_sum);
+		lua_setfield(L, -2, "hold_sum");
+		lua_pushinteger(L, site->hold_max);
+		lua_setfield(L, -2, "hold_max");
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_setfield(L, -2, "locks");
+
+	return 1;
+}
+
 static const luaL_Reg piholelib[] = {
 	{"ftl_version", pihole_ftl_version},
+	{"latency", pihole_latency},
 	{NULL, NULL}
 };
 
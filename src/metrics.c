@@ -0,0 +1,368 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Latency instrumentation routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "metrics.h"
+// PRIu64
+#include <inttypes.h>
+// short_path()
+#include "log.h"
+// attach_shmem_metrics()
+#include "shmem.h"
+
+// All metrics live in a dedicated shared memory object so they can also be
+// read by other processes (e.g., the embedded SQLite3 shell or the Lua
+// interpreter). All recording functions are only ever called while holding
+// the SHM lock, hence there is no need for atomic operations here. For the
+// same reason, the new_query stage only covers queries which got as far as
+// locking the SHM: queries FTL ignores before (e.g., AAAA queries when
+// AAAA_QUERY_ANALYSIS=no or queries from localhost when IGNORE_LOCALHOST=yes)
+// are not recorded.
+metricsData *metrics = NULL;
+
+static const char *const stage_names[LATENCY_STAGES] = {
+	"new_query", "check_blocking", "whitelist", "blacklist", "gravity",
+	"regex", "shm_lock_wait", "shm_lock_hold", "upstream_rtt"
+};
+
+const char * __attribute__ ((const)) get_latency_stage_name(const enum latency_stage stage)
+{
+	return stage < LATENCY_STAGES ? stage_names[stage] : "unknown";
+}
+
+// Get the bucket a value belongs to
+static unsigned int __attribute__ ((const)) latency_bucket(const uint64_t value)
+{
+	// Small values are stored exactly
+	if(value < LATENCY_SUB_BUCKETS)
+		return (unsigned int)value;
+
+	const int msb = 63 - __builtin_clzll(value);
+	if(msb >= LATENCY_MAX_EXP)
+		return LATENCY_BUCKETS - 1;
+
+	// The leading bits below the most significant one select the sub-bucket
+	const int shift = msb - LATENCY_SUB_BITS;
+	return (unsigned int)(shift + 1) * LATENCY_SUB_BUCKETS +
+	       (unsigned int)((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Get the largest value that is stored in this bucket
+uint64_t __attribute__ ((const)) latency_bucket_limit(const unsigned int bucket)
+{
+	if(bucket < LATENCY_SUB_BUCKETS)
+		return bucket;
+
+	const unsigned int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	const uint64_t sub = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_add(latencyHistogram *hist, const uint64_t value)
+{
+	hist->count++;
+	hist->sum += value;
+	if(value > hist->max)
+		hist->max = value;
+	hist->buckets[latency_bucket(value)]++;
+}
+
+uint64_t get_latency_percentile(const latencyHistogram *hist, const double quantile)
+{
+	if(hist->count == 0)
+		return 0;
+
+	const uint64_t rank = (uint64_t)(quantile * hist->count + 0.5);
+	uint64_t seen = 0;
+	for(unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= rank && seen > 0)
+		{
+			// Never report more than the largest value we have seen
+			const uint64_t limit = latency_bucket_limit(i);
+			return limit < hist->max ? limit : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+void init_metrics(void)
+{
+	memset(metrics, 0, sizeof(*metrics));
+	metrics->version = METRICS_VERSION;
+	metrics->lock.site = -1;
+}
+
+// Record time elapsed since <start> for this stage
+void record_latency(const enum latency_stage stage, const uint64_t start)
+{
+	if(metrics == NULL || stage >= LATENCY_STAGES)
+		return;
+
+	histogram_add(&metrics->stages[stage], metrics_now() - start);
+}
+
+// Find (or create) the statistics for this lock call site. We identify sites
+// by the address of their file name string and the line. This is stable in
+// the main process and all its forks (which are the only ones writing here)
+static int find_lock_site(const char *func, const int line, const char *file)
+{
+	const uintptr_t key = (uintptr_t)file;
+	unsigned int pos = (unsigned int)((key >> 4) ^ ((uintptr_t)line * 2654435761u)) % MAX_LOCK_SITES;
+	for(unsigned int i = 0; i < MAX_LOCK_SITES; i++)
+	{
+		lockSite *site = &metrics->sites[pos];
+		if(site->key == key && site->line == line)
+			return (int)pos;
+
+		if(site->key == 0)
+		{
+			// New call site
+			site->key = key;
+			site->line = line;
+			strncpy(site->func, func, sizeof(site->func) - 1);
+			strncpy(site->file, short_path(file), sizeof(site->file) - 1);
+			metrics->lock_sites++;
+			return (int)pos;
+		}
+
+		pos = (pos + 1) % MAX_LOCK_SITES;
+	}
+
+	// Table is full
+	return -1;
+}
+
+// Record time spent waiting for the SHM lock (we own the lock now)
+void record_lock_acquired(const char *func, const int line, const char *file, const uint64_t start)
+{
+	if(metrics == NULL)
+		return;
+
+	const uint64_t now = metrics_now();
+	const uint64_t wait = now - start;
+	histogram_add(&metrics->stages[LATENCY_SHM_LOCK_WAIT], wait);
+
+	metrics->lock.acquired = now;
+	metrics->lock.site = find_lock_site(func, line, file);
+	if(metrics->lock.site < 0)
+		return;
+
+	lockSite *site = &metrics->sites[metrics->lock.site];
+	site->count++;
+	site->wait_sum += wait;
+	if(wait > site->wait_max)
+		site->wait_max = wait;
+}
+
+// Record time the SHM lock was held (we still own the lock here)
+void record_lock_released(void)
+{
+	if(metrics == NULL || metrics->lock.acquired == 0)
+		return;
+
+	const uint64_t hold = metrics_now() - metrics->lock.acquired;
+	histogram_add(&metrics->stages[LATENCY_SHM_LOCK_HOLD], hold);
+	metrics->lock.acquired = 0;
+
+	if(metrics->lock.site < 0)
+		return;
+
+	lockSite *site = &metrics->sites[metrics->lock.site];
+	site->hold_sum += hold;
+	if(hold > site->hold_max)
+		site->hold_max = hold;
+}
+
+// Record round-trip time of an upstream server
+void record_upstream_rtt(const int upstreamID, const char *ip, const int port, const uint64_t rtt)
+{
+	if(metrics == NULL)
+		return;
+
+	histogram_add(&metrics->stages[LATENCY_UPSTREAM_RTT], rtt);
+
+	// Only the first upstreams get their individual histograms
+	if(upstreamID < 0 || upstreamID >= MAX_UPSTREAM_METRICS)
+		return;
+
+	upstreamMetrics *upstream = &metrics->upstreams[upstreamID];
+	if(upstream->name[0] == '\0')
+		snprintf(upstream->name, sizeof(upstream->name), "%s#%d", ip, port);
+	histogram_add(&upstream->rtt, rtt);
+}
+
+// A TCP worker has been forked
+void record_tcp_worker_forked(const unsigned int slots)
+{
+	if(metrics == NULL)
+		return;
+
+	metrics->tcp.slots = slots;
+	metrics->tcp.workers++;
+}
+
+// A TCP worker started handling a connection, pooled workers are handed
+// connections after they have been forked
+void record_tcp_worker_started(const bool pooled)
+{
+	if(metrics == NULL)
+		return;
+
+	if(pooled)
+		metrics->tcp.pooled++;
+	if(++metrics->tcp.busy > metrics->tcp.peak)
+		metrics->tcp.peak = metrics->tcp.busy;
+}
+
+// A TCP worker is done with its connection
+void record_tcp_worker_finished(const uint64_t lifetime)
+{
+	if(metrics == NULL)
+		return;
+
+	if(metrics->tcp.busy > 0)
+		metrics->tcp.busy--;
+	histogram_add(&metrics->tcp.lifetime, lifetime);
+}
+
+// Track periods during which all TCP worker slots are in use. New TCP
+// connections are not accepted (they wait in the kernel's backlog) while the
+// pool is saturated
+void record_tcp_pool_saturated(const bool saturated)
+{
+	if(metrics == NULL)
+		return;
+
+	if(saturated && metrics->tcp.saturated_since == 0)
+	{
+		metrics->tcp.saturated++;
+		metrics->tcp.saturated_since = metrics_now();
+	}
+	else if(!saturated && metrics->tcp.saturated_since != 0)
+	{
+		metrics->tcp.saturated_ns += metrics_now() - metrics->tcp.saturated_since;
+		metrics->tcp.saturated_since = 0;
+	}
+}
+
+// A TCP worker had to open the gravity database (SHM lock held)
+void record_tcp_worker_gravity(void)
+{
+	if(metrics == NULL)
+		return;
+
+	metrics->tcp.gravity_opened++;
+}
+
+// Total time the TCP worker pool was saturated (including an ongoing period)
+uint64_t get_tcp_saturated_ns(void)
+{
+	const uint64_t since = metrics->tcp.saturated_since;
+	return metrics->tcp.saturated_ns + (since > 0 ? metrics_now() - since : 0);
+}
+
+// Count prefetch events
+void record_prefetch(const enum prefetch_event event)
+{
+	if(metrics == NULL || event >= PREFETCH_EVENTS)
+		return;
+
+	metrics->prefetch.events[event]++;
+}
+
+// Check if metrics are available. Processes other than FTL itself try to
+// attach to the metrics of a running FTL instance
+bool metrics_available(void)
+{
+	if(metrics == NULL && !attach_shmem_metrics())
+		return false;
+
+	return metrics->version == METRICS_VERSION;
+}
+
+void json_histogram(FILE *fp, const latencyHistogram *hist)
+{
+	fprintf(fp, "{\"count\":%" PRIu64 ",\"sum_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64
+	        ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+	        ",\"p999_ns\":%" PRIu64 "}",
+	        hist->count, hist->sum, hist->max,
+	        get_latency_percentile(hist, 0.5), get_latency_percentile(hist, 0.9),
+	        get_latency_percentile(hist, 0.99), get_latency_percentile(hist, 0.999));
+}
+
+// Get all metrics formatted as JSON object, the returned string has to be
+// free'd by the caller
+char *get_metrics_json(void)
+{
+	if(!metrics_available())
+		return NULL;
+
+	char *buffer = NULL;
+	size_t size = 0;
+	FILE *fp = open_memstream(&buffer, &size);
+	if(fp == NULL)
+		return NULL;
+
+	fputs("{\"stages\":{", fp);
+	for(unsigned int i = 0; i < LATENCY_STAGES; i++)
+	{
+		fprintf(fp, "%s\"%s\":", i > 0 ? "," : "", get_latency_stage_name(i));
+		json_histogram(fp, &metrics->stages[i]);
+	}
+
+	fputs("},\"locks\":[", fp);
+	bool first = true;
+	for(unsigned int i = 0; i < MAX_LOCK_SITES; i++)
+	{
+		const lockSite *site = &metrics->sites[i];
+		if(site->key == 0)
+			continue;
+
+		fprintf(fp, "%s{\"func\":\"%s\",\"file\":\"%s\",\"line\":%d,\"count\":%" PRIu64
+		        ",\"wait_sum_ns\":%" PRIu64 ",\"wait_max_ns\":%" PRIu64
+		        ",\"hold_sum_ns\":%" PRIu64 ",\"hold_max_ns\":%" PRIu64 "}",
+		        first ? "" : ",", site->func, site->file, site->line, site->count,
+		        site->wait_sum, site->wait_max, site->hold_sum, site->hold_max);
+		first = false;
+	}
+
+	fputs("],\"upstreams\":{", fp);
+	first = true;
+	for(unsigned int i = 0; i < MAX_UPSTREAM_METRICS; i++)
+	{
+		const upstreamMetrics *upstream = &metrics->upstreams[i];
+		if(upstream->name[0] == '\0')
+			continue;
+
+		fprintf(fp, "%s\"%s\":", first ? "" : ",", upstream->name);
+		json_histogram(fp, &upstream->rtt);
+		first = false;
+	}
+
+	const tcpPoolMetrics *tcp = &metrics->tcp;
+	fprintf(fp, "},\"tcp\":{\"slots\":%u,\"busy\":%u,\"peak\":%u,\"workers\":%" PRIu64
+	        ",\"gravity_opened\":%" PRIu64 ",\"saturated\":%" PRIu64 ",\"saturated_ns\":%" PRIu64
+	        ",\"lifetime\":",
+	        tcp->slots, tcp->busy, tcp->peak, tcp->workers, tcp->gravity_opened,
+	        tcp->saturated, get_tcp_saturated_ns());
+	json_histogram(fp, &tcp->lifetime);
+
+	const prefetchMetrics *prefetch = &metrics->prefetch;
+	fprintf(fp, "},\"prefetch\":{\"sent\":%" PRIu64 ",\"skipped\":%" PRIu64
+	        ",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "}}",
+	        prefetch->events[PREFETCH_SENT], prefetch->events[PREFETCH_SKIPPED],
+	        prefetch->events[PREFETCH_HIT], prefetch->events[PREFETCH_MISS]);
+
+	fclose(fp);
+	return buffer;
+}
@@ -0,0 +1,125 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Latency instrumentation prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+// enum latency_stage
+#include "enums.h"
+
+// Histograms are log-linear (HDR-style): every power of two is split into
+// 2^LATENCY_SUB_BITS equally sized buckets which gives a relative error of at
+// most 12.5%. Values are recorded in nanoseconds, everything above
+// 2^LATENCY_MAX_EXP ns (about 69 seconds) ends up in the last bucket
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXP 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+#define MAX_LOCK_SITES 128
+#define MAX_UPSTREAM_METRICS 64
+#define METRICS_VERSION 4
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[LATENCY_BUCKETS];
+} latencyHistogram;
+
+typedef struct {
+	uintptr_t key;
+	int line;
+	char func[32];
+	char file[32];
+	uint64_t count;
+	uint64_t wait_sum;
+	uint64_t wait_max;
+	uint64_t hold_sum;
+	uint64_t hold_max;
+} lockSite;
+
+typedef struct {
+	char name[64];
+	latencyHistogram rtt;
+} upstreamMetrics;
+
+// TCP workers are forked by the main process which is the only one writing
+// here (except for gravity_opened which is written by the workers). Workers
+// are either forked for a single connection or pre-forked (--tcp-workers) and
+// handed one connection after another. The lifetime histogram covers the time
+// a worker was busy with a connection
+typedef struct {
+	unsigned int slots;
+	unsigned int busy;
+	unsigned int peak;
+	uint64_t workers;
+	uint64_t pooled;
+	uint64_t gravity_opened;
+	uint64_t saturated;
+	uint64_t saturated_ns;
+	uint64_t saturated_since;
+	latencyHistogram lifetime;
+} tcpPoolMetrics;
+
+// Cache prefetching: refreshes sent (or skipped because the budget was
+// exhausted) and cache hits/misses of popular domains
+typedef struct {
+	uint64_t events[PREFETCH_EVENTS];
+} prefetchMetrics;
+
+typedef struct {
+	int version;
+	unsigned int lock_sites;
+	struct {
+		int site;
+		uint64_t acquired;
+	} lock;
+	latencyHistogram stages[LATENCY_STAGES];
+	lockSite sites[MAX_LOCK_SITES];
+	upstreamMetrics upstreams[MAX_UPSTREAM_METRICS];
+	tcpPoolMetrics tcp;
+	prefetchMetrics prefetch;
+} metricsData;
+
+extern metricsData *metrics;
+
+// Monotonic timestamp in nanoseconds
+static inline uint64_t metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void init_metrics(void);
+void histogram_add(latencyHistogram *hist, const uint64_t value);
+uint64_t latency_bucket_limit(const unsigned int bucket) __attribute__ ((const));
+void record_latency(const enum latency_stage stage, const uint64_t start);
+void record_lock_acquired(const char *func, const int line, const char *file, const uint64_t start);
+void record_lock_released(void);
+void record_upstream_rtt(const int upstreamID, const char *ip, const int port, const uint64_t rtt);
+void record_tcp_worker_forked(const unsigned int slots);
+void record_tcp_worker_started(const bool pooled);
+void record_tcp_worker_finished(const uint64_t lifetime);
+void record_tcp_pool_saturated(const bool saturated);
+void record_tcp_worker_gravity(void);
+uint64_t get_tcp_saturated_ns(void);
+void record_prefetch(const enum prefetch_event event);
+uint64_t get_latency_percentile(const latencyHistogram *hist, const double quantile) __attribute__ ((pure));
+const char *get_latency_stage_name(const enum latency_stage stage) __attribute__ ((const));
+bool metrics_available(void);
+void json_histogram(FILE *fp, const latencyHistogram *hist);
+char *get_metrics_json(void);
+
+#endif //METRICS_H
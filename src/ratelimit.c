@@ -0,0 +1,99 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Rate-limiting routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "ratelimit.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+// logg_rate_limit_message()
+#include "database/message-table.h"
+
+// Every client has a token bucket holding up to config.rate_limit.count
+// tokens. The bucket is refilled continuously at a rate of count/interval
+// tokens per second. Refilling is done lazily whenever we see a query from
+// this client so there is no need to periodically reset anything.
+//
+// Each query takes one token. A client is rate-limited once its bucket is
+// empty. Refused queries still take a token (if available) so clients
+// continuing to query faster than allowed are never let through. The
+// limitation ends when the bucket has been refilled to half of its capacity.
+
+// Compute the current number of tokens without modifying the client
+float get_rate_limit_tokens(const clientsData *client, const time_t now)
+{
+	const float capacity = (float)config.rate_limit.count;
+
+	// The bucket of a client we have not seen before is full
+	if(client->rate_limit.refilled == 0)
+		return capacity;
+
+	float tokens = client->rate_limit.tokens;
+	if(now > client->rate_limit.refilled && config.rate_limit.interval > 0)
+		tokens += (float)(now - client->rate_limit.refilled) * capacity / config.rate_limit.interval;
+
+	return tokens < capacity ? tokens : capacity;
+}
+
+// Returns how many more seconds until the bucket has been refilled enough
+// to end rate-limiting (assuming the client stops querying)
+static time_t get_rate_limit_turnaround(const clientsData *client)
+{
+	const float missing = 0.5f*config.rate_limit.count - client->rate_limit.tokens;
+	const time_t turnaround = (time_t)(missing * config.rate_limit.interval / config.rate_limit.count);
+	return turnaround > 1 ? turnaround : 1;
+}
+
+// Check if this query should be refused due to rate-limiting
+bool rate_limit_client(clientsData *client, const char *clientIP, const time_t now)
+{
+	// Rate-limiting is disabled
+	if(config.rate_limit.count == 0 || config.rate_limit.interval == 0)
+		return false;
+
+	// Refill the bucket for the time that passed since the last query
+	client->rate_limit.tokens = get_rate_limit_tokens(client, now);
+	client->rate_limit.refilled = now;
+
+	// Check if rate-limiting ends for this client now
+	if(client->flags.rate_limited && client->rate_limit.tokens >= 0.5f*config.rate_limit.count)
+	{
+		logg("Ending rate-limitation of %s (%u queries refused in %ld second%s)",
+		     clientIP, client->rate_limit.refused, now - client->rate_limit.since,
+		     now - client->rate_limit.since == 1 ? "" : "s");
+		client->flags.rate_limited = false;
+		client->rate_limit.refused = 0;
+		client->rate_limit.since = 0;
+	}
+
+	// Take a token for this query
+	const bool available = client->rate_limit.tokens >= 1.0f;
+	if(available)
+		client->rate_limit.tokens -= 1.0f;
+
+	// Let this query pass
+	if(available && !client->flags.rate_limited)
+		return false;
+
+	if(!client->flags.rate_limited)
+	{
+		// Memorize this client needs rate-limiting
+		client->flags.rate_limited = true;
+		client->rate_limit.since = now;
+
+		// Log the first rate-limited query for this client. We do not
+		// log the blocked domain for privacy reasons
+		logg_rate_limit_message(clientIP, get_rate_limit_turnaround(client));
+	}
+
+	client->rate_limit.refused++;
+	return true;
+}
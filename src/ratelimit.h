@@ -0,0 +1,19 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Rate-limiting prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// type clientsData
+#include "datastructure.h"
+
+bool rate_limit_client(clientsData *client, const char *clientIP, const time_t now);
+float get_rate_limit_tokens(const clientsData *client, const time_t now) __attribute__ ((pure));
+
+#endif //RATELIMIT_H
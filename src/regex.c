@@ -10,6 +10,8 @@
 
 #include "FTL.h"
 #include "regex_r.h"
+// regex_fast_analyze()
+#include "regex_fast.h"
 #include "timers.h"
 #include "log.h"
 #include "config.h"
@@ -25,6 +27,9 @@
 #include "config.h"
 // cli_stuff()
 #include "args.h"
+// regex_test_batch()
+#include "database/sqlite3.h"
+#include <inttypes.h>
 
 // Safety-measure for future extensions
 #if TYPE_MAX > 30
@@ -39,6 +44,15 @@ static regexData   *cli_regex = NULL;
 static unsigned int num_regex[REGEX_MAX] = { 0 };
 unsigned int regex_change = 0;
 
+// Regex filters compiled by stage_regex_from_database() while the active ones
+// above keep being used. They replace them in swap_staged_regex()
+static regexData *staged_regex[REGEX_MAX] = { NULL };
+static unsigned int num_staged_regex[REGEX_MAX] = { 0 };
+static double staged_msec = 0.0;
+// Fast-path lookup structures of the active and staged regex (see regex_fast.c)
+static regexFastSet fastset[REGEX_MAX] = {{ 0 }};
+static regexFastSet staged_fastset[REGEX_MAX] = {{ 0 }};
+
 static inline regexData *get_regex_ptr(const enum regex_type regexid)
 {
 	switch (regexid)
@@ -55,31 +69,23 @@ static inline regexData *get_regex_ptr(const enum regex_type regexid)
 	}
 }
 
-static inline void free_regex_ptr(const enum regex_type regexid)
+static inline void set_regex_ptr(const enum regex_type regexid, regexData *regex)
 {
-	regexData **regex;
 	switch (regexid)
 	{
 		case REGEX_BLACKLIST:
-			regex = &black_regex;
+			black_regex = regex;
 			break;
 		case REGEX_WHITELIST:
-			regex = &white_regex;
+			white_regex = regex;
 			break;
 		case REGEX_CLI:
-			regex = &cli_regex;
+			cli_regex = regex;
 			break;
 		case REGEX_MAX: // Fall through
 		default: // This is not possible
 			return;
 	}
-
-	// Free pointer (if not already NULL)
-	if(*regex != NULL)
-	{
-		free(*regex);
-		*regex = NULL;
-	}
 }
 
 static __attribute__ ((pure)) regexData *get_regex_ptr_from_id(unsigned int regexID)
@@ -140,11 +146,8 @@ unsigned int __attribute__((pure)) get_num_regex(const enum regex_type regexid)
 #define FTL_REGEX_SEP ";"
 /* Compile regular expressions into data structures that can be used with
    regexec() to match against a string */
-static bool compile_regex(const char *regexin, const enum regex_type regexid, const int dbidx)
+static bool compile_regex(const char *regexin, regexData *regex, const enum regex_type regexid, const int dbidx)
 {
-	regexData *regex = get_regex_ptr(regexid);
-	int index = num_regex[regexid]++;
-
 	// Extract possible Pi-hole extensions
 	char rgxbuf[strlen(regexin) + 1u];
 	// Parse special FTL syntax if present
@@ -168,7 +171,7 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 			if(sscanf(part, "querytype=%63s", extra))
 			{
 				// Warn if specified more than one querytype option
-				if(regex[index].ext.query_type != 0)
+				if(regex->ext.query_type != 0)
 					logg_regex_warning(regextype[regexid],
 					                   "Overwriting previous querytype setting",
 					                   dbidx, regexin);
@@ -197,12 +200,12 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 						// Check for querytype
 						if(strcasecmp(token, querytypes[type]) == 0)
 						{
-							regex[index].ext.query_type ^= 1 << type;
+							regex->ext.query_type ^= 1 << type;
 							break;
 						}
 					}
 					// Check if we found a valid query type
-					if(regex[index].ext.query_type == 0)
+					if(regex->ext.query_type == 0)
 					{
 						logg_regex_warning(regextype[regexid],
 						                   "Unknown query type",
@@ -217,14 +220,14 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 
 				// Invert query types if requested
 				if(inverted)
-					regex[index].ext.query_type = ~regex[index].ext.query_type;
+					regex->ext.query_type = ~regex->ext.query_type;
 
-				if(regex[index].ext.query_type != 0 && config.debug & DEBUG_REGEX)
+				if(regex->ext.query_type != 0 && config.debug & DEBUG_REGEX)
 				{
 					logg("    Hint: This regex matches only specific query types:");
 					for(int i = TYPE_A; i < TYPE_MAX; i++)
 					{
-						if(regex[index].ext.query_type & (1 << i))
+						if(regex->ext.query_type & (1 << i))
 							logg("      - %s", querytypes[i]);
 					}
 				}
@@ -232,7 +235,7 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 			// option: ";invert"
 			else if(strcasecmp(part, "invert") == 0)
 			{
-				regex[index].ext.inverted = true;
+				regex->ext.inverted = true;
 
 				// Debug output
 				if(config.debug & DEBUG_REGEX)
@@ -248,41 +251,41 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 				if(strcasecmp(extra, "NODATA") == 0)
 				{
 					type = "NODATA";
-					regex[index].ext.reply = REPLY_NODATA;
+					regex->ext.reply = REPLY_NODATA;
 				}
 				else if(strcasecmp(extra, "NXDOMAIN") == 0)
 				{
 					type = "NXDOMAIN";
-					regex[index].ext.reply = REPLY_NXDOMAIN;
+					regex->ext.reply = REPLY_NXDOMAIN;
 				}
 				else if(strcasecmp(extra, "REFUSED") == 0)
 				{
 					type = "REFUSED";
-					regex[index].ext.reply = REPLY_REFUSED;
+					regex->ext.reply = REPLY_REFUSED;
 				}
 				else if(strcasecmp(extra, "IP") == 0)
 				{
 					type = "IP";
-					regex[index].ext.reply = REPLY_IP;
+					regex->ext.reply = REPLY_IP;
 				}
-				else if(inet_pton(AF_INET, extra, &regex[index].ext.addr4) == 1)
+				else if(inet_pton(AF_INET, extra, &regex->ext.addr4) == 1)
 				{
 					// Custom IPv4 target
 					type = extra;
-					regex[index].ext.reply = REPLY_IP;
-					regex[index].ext.custom_ip4 = true;
+					regex->ext.reply = REPLY_IP;
+					regex->ext.custom_ip4 = true;
 				}
-				else if(inet_pton(AF_INET6, extra, &regex[index].ext.addr6) == 1)
+				else if(inet_pton(AF_INET6, extra, &regex->ext.addr6) == 1)
 				{
 					// Custom IPv6 target
 					type = extra;
-					regex[index].ext.reply = REPLY_IP;
-					regex[index].ext.custom_ip6 = true;
+					regex->ext.reply = REPLY_IP;
+					regex->ext.custom_ip6 = true;
 				}
 				else if(strcasecmp(extra, "NONE") == 0)
 				{
 					type = "NONE";
-					regex[index].ext.reply = REPLY_NONE;
+					regex->ext.reply = REPLY_NONE;
 				}
 				else
 				{
@@ -292,7 +295,7 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 				}
 
 				// Debug output
-				if(config.debug & DEBUG_REGEX && regex[index].ext.reply != REPLY_UNKNOWN)
+				if(config.debug & DEBUG_REGEX && regex->ext.reply != REPLY_UNKNOWN)
 					logg("   This regex will result in a custom reply: %s", type);
 			}
 			else
@@ -313,22 +316,25 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 
 	// We use the extended RegEx flavor (ERE) and specify that matching should
 	// always be case INsensitive
-	const int errcode = regcomp(&regex[index].regex, rgxbuf, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	const int errcode = regcomp(&regex->regex, rgxbuf, REG_EXTENDED | REG_ICASE | REG_NOSUB);
 	if(errcode != 0)
 	{
 		// Get error string and log it
-		const size_t length = regerror(errcode, &regex[index].regex, NULL, 0);
+		const size_t length = regerror(errcode, &regex->regex, NULL, 0);
 		char *buffer = calloc(length, sizeof(char));
-		(void) regerror (errcode, &regex[index].regex, buffer, length);
+		(void) regerror (errcode, &regex->regex, buffer, length);
 		logg_regex_warning(regextype[regexid], buffer, dbidx, regexin);
 		free(buffer);
-		regex[index].available = false;
+		regex->available = false;
 		return false;
 	}
 
 	// Store compiled regex string in buffer
-	regex[index].string = strdup(regexin);
-	regex[index].available = true;
+	regex->string = strdup(regexin);
+	regex->available = true;
+
+	// Check if this regex can be matched without the regex engine
+	regex_fast_analyze(regex, rgxbuf);
 
 	return true;
 }
@@ -354,8 +360,12 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 		regex = get_regex_ptr(regexid);
 	}
 
-	// Loop over all configured regex filters of this type
-	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+	// Loop over all configured regex filters of this type which may match
+	// this domain
+	regexIterator it;
+	regex_fast_iter_init(&it, &fastset[regexid], regex, num_regex[regexid], input);
+	unsigned int index = 0;
+	while(regex_fast_iter_next(&it, &index))
 	{
 		// Only check regex which have been successfully compiled ...
 		if(!regex[index].available)
@@ -396,10 +406,14 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 		// Try to match the compiled regular expression against input
 		if(config.debug & DEBUG_REGEX)
 			logg("Executing: index = %d, preg = %p, str = \"%s\", pmatch = %p", index, &regex[index].regex, input, &match);
+		int retval;
+		if(regex[index].fast != REGEX_FAST_NONE)
+			retval = regex_fast_match(&regex[index], input) ? REG_OK : REG_NOMATCH;
+		else
 #ifdef USE_TRE_REGEX
-		int retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
+			retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
 #else
-		int retval = regexec(&regex[index].regex, input, 0, NULL, 0);
+			retval = regexec(&regex[index].regex, input, 0, NULL, 0);
 #endif
 		// regexec() returns REG_OK for a successful match or REG_NOMATCH for failure.
 		if ((retval == REG_OK && !regex[index].ext.inverted) ||
@@ -526,6 +540,42 @@ bool in_regex(const char *domain, DNSCacheData *dns_cache, const int clientID, c
 	return false;
 }
 
+// Free an array of compiled regex filters
+static void free_regex_list(regexData *regex, const unsigned int num)
+{
+	if(regex == NULL)
+		return;
+
+	// Loop over entries with this regex type
+	for(unsigned int index = 0; index < num; index++)
+	{
+		if(!regex[index].available)
+			continue;
+
+		regfree(&regex[index].regex);
+
+		// Also free buffered regex strings
+		if(regex[index].string != NULL)
+		{
+			free(regex[index].string);
+			regex[index].string = NULL;
+		}
+		if(regex[index].literal != NULL)
+		{
+			free(regex[index].literal);
+			regex[index].literal = NULL;
+		}
+	}
+
+	if(config.debug & DEBUG_DATABASE)
+	{
+		logg("Loop done, freeing regex pointer (%p)", regex);
+	}
+
+	// Free array with regex datastructure
+	free(regex);
+}
+
 static void free_regex(void)
 {
 	// Return early if we don't use any regex filters
@@ -566,29 +616,9 @@ static void free_regex(void)
 			     oldcount, regextype[regexid]);
 		}
 
-		// Loop over entries with this regex type
-		for(unsigned int index = 0; index < oldcount; index++)
-		{
-			if(!regex[index].available)
-				continue;
-
-			regfree(&regex[index].regex);
-
-			// Also free buffered regex strings
-			if(regex[index].string != NULL)
-			{
-				free(regex[index].string);
-				regex[index].string = NULL;
-			}
-		}
-
-		if(config.debug & DEBUG_DATABASE)
-		{
-			logg("Loop done, freeing regex pointer (%p)", regex);
-		}
-
-		// Free array with regex datastructure
-		free_regex_ptr(regexid);
+		free_regex_list(regex, oldcount);
+		regex_fast_free(&fastset[regexid]);
+		set_regex_ptr(regexid, NULL);
 	}
 }
 
@@ -617,7 +647,9 @@ void reload_per_client_regex(clientsData *client)
 		                                  "vw_regex_whitelist");
 }
 
-static void read_regex_table(const enum regex_type regexid)
+// Read and compile all regex filters of one type into a newly allocated array.
+// Returns the number of filters read
+static unsigned int read_regex_table(const enum regex_type regexid, regexData **regexp)
 {
 	// Get table ID
 	const enum gravity_tables tableID = (regexid == REGEX_BLACKLIST) ? REGEX_BLACKLIST_TABLE : REGEX_WHITELIST_TABLE;
@@ -626,38 +658,30 @@ static void read_regex_table(const enum regex_type regexid)
 		logg("Reading regex %s from database", regextype[regexid]);
 
 	// Get number of lines in the regex table
-	num_regex[regexid] = 0;
+	unsigned int num = 0;
+	*regexp = NULL;
 	int count = gravityDB_count(tableID);
 
 	if(count == 0)
 	{
-		return;
+		return 0;
 	}
 	else if(count < 0)
 	{
 		logg("WARN: Database query failed, assuming there are no %s regex entries", regextype[regexid]);
-		return;
+		return 0;
 	}
 
 	// Allocate memory for regex
-	regexData *regex = NULL;
-	if(regexid == REGEX_BLACKLIST)
-	{
-		black_regex = calloc(count, sizeof(regexData));
-		regex = black_regex;
-	}
-	else
-	{
-		white_regex = calloc(count, sizeof(regexData));
-		regex = white_regex;
-	}
+	regexData *regex = calloc(count, sizeof(regexData));
+	*regexp = regex;
 
 	// Connect to regex table
 	if(!gravityDB_getTable(tableID))
 	{
 		logg("read_regex_from_database(): Error getting %s regex table from database",
 		     regextype[regexid]);
-		return;
+		return 0;
 	}
 
 	// Walk database table
@@ -667,10 +691,10 @@ static void read_regex_table(const enum regex_type regexid)
 	{
 		// Avoid buffer overflow if database table changed
 		// since we counted its entries
-		if(num_regex[regexid] >= (unsigned int)count)
+		if(num >= (unsigned int)count)
 		{
 			logg("INFO: read_regex_table(%s) exiting early to avoid overflow (%d/%d).",
-			     regextype[regexid], num_regex[regexid], count);
+			     regextype[regexid], num, count);
 			break;
 		}
 
@@ -687,14 +711,11 @@ static void read_regex_table(const enum regex_type regexid)
 		if(config.debug & DEBUG_REGEX)
 		{
 			logg("Compiling %s regex %i (DB ID %i): %s",
-			     regextype[regexid], num_regex[regexid], rowid, domain);
+			     regextype[regexid], num, rowid, domain);
 		}
 
-		compile_regex(domain, regexid, rowid);
-		regex[num_regex[regexid]-1].database_id = rowid;
-
-		// Signal other forks that the regex data has changed and should be updated
-		regex_change = ++counters->regex_change;
+		compile_regex(domain, &regex[num], regexid, rowid);
+		regex[num++].database_id = rowid;
 	}
 
 	// Finalize statement and close gravity database handle
@@ -703,8 +724,28 @@ static void read_regex_table(const enum regex_type regexid)
 	if(config.debug & DEBUG_DATABASE)
 	{
 		logg("Read %i %s regex entries",
-		     num_regex[regexid],
-		     regextype[regexid]);
+		     num, regextype[regexid]);
+	}
+
+	return num;
+}
+
+// Loop over all clients and ensure we have enough space and load per-client
+// regex data, not all of the regex read and compiled will also be used by all
+// clients
+static void load_per_client_regex(void)
+{
+	if(config.debug & DEBUG_DATABASE)
+		logg("Loading per-client regex data");
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		// Get client pointer
+		clientsData *client = getClient(clientID, true);
+		// Skip invalid and alias-clients
+		if(client == NULL || client->flags.aliasclient)
+			continue;
+
+		reload_per_client_regex(client);
 	}
 }
 
@@ -719,31 +760,88 @@ void read_regex_from_database(void)
 	timer_start(REGEX_TIMER);
 
 	// Read and compile regex blacklist
-	read_regex_table(REGEX_BLACKLIST);
+	num_regex[REGEX_BLACKLIST] = read_regex_table(REGEX_BLACKLIST, &black_regex);
 
 	// Read and compile regex whitelist
-	read_regex_table(REGEX_WHITELIST);
+	num_regex[REGEX_WHITELIST] = read_regex_table(REGEX_WHITELIST, &white_regex);
 
-	// Loop over all clients and ensure we have enough space and load
-	// per-client regex data, not all of the regex read and compiled above
-	// will also be used by all clients
-	if(config.debug & DEBUG_DATABASE)
-		logg("Loading per-client regex data");
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	// Index regex which can be matched without the regex engine
+	regex_fast_build(&fastset[REGEX_BLACKLIST], black_regex, num_regex[REGEX_BLACKLIST]);
+	regex_fast_build(&fastset[REGEX_WHITELIST], white_regex, num_regex[REGEX_WHITELIST]);
+
+	// We are now up-to-date with the regex data of the main process
+	regex_change = counters->regex_change;
+
+	// Load per-client regex data
+	load_per_client_regex();
+
+	// Print message to FTL's log after reloading regex filters
+	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
+	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
+	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
+}
+
+// Free regex filters compiled for a reload which is not going to happen
+void discard_staged_regex(void)
+{
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_CLI; regexid++)
 	{
-		// Get client pointer
-		clientsData *client = getClient(clientID, true);
-		// Skip invalid and alias-clients
-		if(client == NULL || client->flags.aliasclient)
-			continue;
+		free_regex_list(staged_regex[regexid], num_staged_regex[regexid]);
+		regex_fast_free(&staged_fastset[regexid]);
+		staged_regex[regexid] = NULL;
+		num_staged_regex[regexid] = 0;
+	}
+}
 
-		reload_per_client_regex(client);
+// Read and compile regex filters from the staged gravity database connection
+// (see gravityDB_stage()). This is done by the database thread without holding
+// the SHM lock, the active filters are not touched
+void stage_regex_from_database(void)
+{
+	discard_staged_regex();
+
+	// Start timer for regex compilation analysis
+	timer_start(REGEX_TIMER);
+
+	// Read and compile regex black- and whitelist
+	num_staged_regex[REGEX_BLACKLIST] = read_regex_table(REGEX_BLACKLIST, &staged_regex[REGEX_BLACKLIST]);
+	num_staged_regex[REGEX_WHITELIST] = read_regex_table(REGEX_WHITELIST, &staged_regex[REGEX_WHITELIST]);
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_CLI; regexid++)
+		regex_fast_build(&staged_fastset[regexid], staged_regex[regexid], num_staged_regex[regexid]);
+
+	staged_msec = timer_elapsed_msec(REGEX_TIMER);
+}
+
+// Replace the active regex filters by the staged ones. Has to be called with
+// the SHM lock held after the staged gravity database connection has been
+// swapped in as the per-client regex data is read from it
+void swap_staged_regex(void)
+{
+	free_regex();
+
+	// Start timer for per-client regex analysis
+	timer_start(REGEX_TIMER);
+
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_CLI; regexid++)
+	{
+		set_regex_ptr(regexid, staged_regex[regexid]);
+		num_regex[regexid] = num_staged_regex[regexid];
+		fastset[regexid] = staged_fastset[regexid];
+		memset(&staged_fastset[regexid], 0, sizeof(staged_fastset[regexid]));
+		staged_regex[regexid] = NULL;
+		num_staged_regex[regexid] = 0;
 	}
 
+	// Signal other forks that the regex data has changed and should be updated
+	regex_change = ++counters->regex_change;
+
+	// Load per-client regex data
+	load_per_client_regex();
+
 	// Print message to FTL's log after reloading regex filters
 	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
 	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
-	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
+	     counters->clients, staged_msec + timer_elapsed_msec(REGEX_TIMER));
 }
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin)
@@ -768,8 +866,10 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 		logg("%s Loading regex filters from database...", cli_info());
 		timer_start(REGEX_TIMER);
 		log_ctrl(false, true); // Temporarily re-enable terminal output for error logging
-		read_regex_table(REGEX_BLACKLIST);
-		read_regex_table(REGEX_WHITELIST);
+		num_regex[REGEX_BLACKLIST] = read_regex_table(REGEX_BLACKLIST, &black_regex);
+		num_regex[REGEX_WHITELIST] = read_regex_table(REGEX_WHITELIST, &white_regex);
+		regex_fast_build(&fastset[REGEX_BLACKLIST], black_regex, num_regex[REGEX_BLACKLIST]);
+		regex_fast_build(&fastset[REGEX_WHITELIST], white_regex, num_regex[REGEX_WHITELIST]);
 		log_ctrl(false, !quiet); // Re-apply quiet option after compilation
 		logg("    Compiled %i black- and %i whitelist regex filters in %.3f msec\n",
 		     num_regex[REGEX_BLACKLIST],
@@ -795,11 +895,12 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 		// Compile CLI regex
 		logg("%s Compiling regex filter...", cli_info());
 		cli_regex = calloc(1, sizeof(regexData));
+		num_regex[REGEX_CLI] = 1;
 
 		// Compile CLI regex
 		timer_start(REGEX_TIMER);
 		log_ctrl(false, true); // Temporarily re-enable terminal output for error logging
-		if(!compile_regex(regexin, REGEX_CLI, -1))
+		if(!compile_regex(regexin, cli_regex, REGEX_CLI, -1))
 			return EXIT_FAILURE;
 		log_ctrl(false, !quiet); // Re-apply quiet option after compilation
 		logg("    Compiled regex filter in %.3f msec\n", timer_elapsed_msec(REGEX_TIMER));
@@ -817,6 +918,361 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 	return matchidx > -1 ? EXIT_SUCCESS : 2;
 }
 
+// Number of slowest regex filters listed in batch mode
+#define BATCH_SLOWEST 10
+
+typedef struct {
+	char *domain;
+	unsigned int count;
+} batchDomain;
+
+typedef struct {
+	const batchDomain *domains;
+	unsigned int num_domains;
+	unsigned int first;
+	unsigned int stride;
+	// Per-regex results (blacklist followed by whitelist)
+	uint64_t *hits;
+	uint64_t *queries;
+	uint64_t *nsec;
+	uint64_t blocked;
+	uint64_t whitelisted;
+} batchThread;
+
+typedef struct {
+	unsigned int idx;
+	uint64_t nsec;
+} batchOrder;
+
+static uint64_t batch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Read domains from a long-term database (all queried domains along with
+// how often they have been queried) or from a text file (one domain per line)
+static batchDomain *read_batch_domains(const char *path, unsigned int *num)
+{
+	batchDomain *domains = NULL;
+	unsigned int size = 0;
+	*num = 0;
+
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stmt = NULL;
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		logg("%s Cannot open %s: %s", cli_cross(), path, strerror(errno));
+		return NULL;
+	}
+
+	char magic[16] = { 0 };
+	const bool is_db = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, "SQLite format 3", 16) == 0;
+	if(is_db)
+	{
+		fclose(fp);
+		fp = NULL;
+		if(sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+		   sqlite3_prepare_v2(db, "SELECT domain,COUNT(*) FROM queries GROUP BY domain;", -1, &stmt, NULL) != SQLITE_OK)
+		{
+			logg("%s Cannot read queries from %s: %s", cli_cross(), path, sqlite3_errmsg(db));
+			sqlite3_close(db);
+			return NULL;
+		}
+	}
+	else
+		rewind(fp);
+
+	char *line = NULL;
+	size_t len = 0;
+	while(true)
+	{
+		const char *domain = NULL;
+		unsigned int count = 1;
+		if(is_db)
+		{
+			if(sqlite3_step(stmt) != SQLITE_ROW)
+				break;
+			domain = (const char*)sqlite3_column_text(stmt, 0);
+			count = (unsigned int)sqlite3_column_int(stmt, 1);
+		}
+		else
+		{
+			if(getline(&line, &len, fp) == -1)
+				break;
+			line[strcspn(line, " \t\r\n")] = '\0';
+			domain = line;
+		}
+		if(domain == NULL || domain[0] == '\0' || domain[0] == '#')
+			continue;
+
+		if(*num == size)
+		{
+			size = size > 0 ? 2*size : 4096;
+			batchDomain *new = realloc(domains, size*sizeof(batchDomain));
+			if(new == NULL)
+				break;
+			domains = new;
+		}
+		domains[*num].domain = strdup(domain);
+		strtolower(domains[*num].domain);
+		domains[*num].count = count;
+		(*num)++;
+	}
+
+	if(line != NULL)
+		free(line);
+	if(fp != NULL)
+		fclose(fp);
+	if(stmt != NULL)
+		sqlite3_finalize(stmt);
+	if(db != NULL)
+		sqlite3_close(db);
+
+	return domains;
+}
+
+// Check one regex against <input>, the fast-path is used as during normal
+// operation. Query type restrictions cannot be checked in batch mode
+static bool batch_match(const regexData *regex, const char *input)
+{
+	int retval;
+	if(regex->fast != REGEX_FAST_NONE)
+		retval = regex_fast_match(regex, input) ? REG_OK : REG_NOMATCH;
+	else
+	{
+#ifdef USE_TRE_REGEX
+		regmatch_t match[1] = {{ 0 }};
+		retval = tre_regexec(&regex->regex, input, 0, match, 0);
+#else
+		retval = regexec(&regex->regex, input, 0, NULL, 0);
+#endif
+	}
+
+	return (retval == REG_OK && !regex->ext.inverted) ||
+	       (retval == REG_NOMATCH && regex->ext.inverted);
+}
+
+// Match every domain of this thread against every single regex. Unlike
+// during normal operation, we do not stop at the first match as we want to
+// know the hits and costs of all regex
+static void *batch_thread(void *arg)
+{
+	batchThread *thread = arg;
+	const unsigned int num_black = num_regex[REGEX_BLACKLIST];
+	const unsigned int num_total = num_black + num_regex[REGEX_WHITELIST];
+	for(unsigned int d = thread->first; d < thread->num_domains; d += thread->stride)
+	{
+		const batchDomain *domain = &thread->domains[d];
+		bool black = false, white = false;
+		for(unsigned int i = 0; i < num_total; i++)
+		{
+			const regexData *regex = i < num_black ? &black_regex[i] : &white_regex[i - num_black];
+			if(!regex->available)
+				continue;
+
+			const uint64_t start = batch_now();
+			const bool match = batch_match(regex, domain->domain);
+			thread->nsec[i] += batch_now() - start;
+			if(!match)
+				continue;
+
+			thread->hits[i]++;
+			thread->queries[i] += domain->count;
+			if(i < num_black)
+				black = true;
+			else
+				white = true;
+		}
+
+		if(white)
+			thread->whitelisted += domain->count;
+		else if(black)
+			thread->blocked += domain->count;
+	}
+
+	return NULL;
+}
+
+static int batch_order_cmp(const void *a, const void *b)
+{
+	const batchOrder *x = a, *y = b;
+	return x->nsec < y->nsec ? 1 : x->nsec > y->nsec ? -1 : 0;
+}
+
+int regex_test_batch(const bool debug_mode, const char *path, unsigned int num_threads)
+{
+	int ret = EXIT_FAILURE;
+	unsigned int num_domains = 0, num_started = 0;
+	batchDomain *domains = NULL;
+	batchThread *threads = NULL;
+	pthread_t *tids = NULL;
+	batchOrder *order = NULL;
+
+	// Prepare counters and regex memories
+	counters = calloc(1, sizeof(countersStruct));
+	if(counters == NULL)
+		return EXIT_FAILURE;
+	// Disable terminal output during config config file parsing
+	log_ctrl(false, false);
+	// Process pihole-FTL.conf to get gravity.db
+	read_FTLconf();
+
+	// Disable all debugging output if not explicitly in debug mode (CLI argument "d")
+	if(!debug_mode)
+		config.debug = 0;
+	// Re-enable terminal output
+	log_ctrl(false, true);
+
+	// Read and compile regex lists from database
+	logg("%s Loading regex filters from database...", cli_info());
+	timer_start(REGEX_TIMER);
+	num_regex[REGEX_BLACKLIST] = read_regex_table(REGEX_BLACKLIST, &black_regex);
+	num_regex[REGEX_WHITELIST] = read_regex_table(REGEX_WHITELIST, &white_regex);
+	logg("    Compiled %i black- and %i whitelist regex filters in %.3f msec\n",
+	     num_regex[REGEX_BLACKLIST], num_regex[REGEX_WHITELIST],
+	     timer_elapsed_msec(REGEX_TIMER));
+
+	logg("%s Reading domains from %s...", cli_info(), path);
+	domains = read_batch_domains(path, &num_domains);
+	if(domains == NULL || num_domains == 0)
+	{
+		logg("    No domains found");
+		goto end_of_regex_test_batch;
+	}
+	uint64_t num_queries = 0;
+	for(unsigned int i = 0; i < num_domains; i++)
+		num_queries += domains[i].count;
+	logg("    Read %u domains (%" PRIu64 " queries)\n", num_domains, num_queries);
+
+	// Use all available cores unless told otherwise
+	if(num_threads == 0)
+	{
+		const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cores > 0 ? (unsigned int)cores : 1u;
+	}
+	if(num_threads > num_domains)
+		num_threads = num_domains;
+
+	const unsigned int num_total = num_regex[REGEX_BLACKLIST] + num_regex[REGEX_WHITELIST];
+	threads = calloc(num_threads, sizeof(batchThread));
+	tids = calloc(num_threads, sizeof(pthread_t));
+	if(threads == NULL || tids == NULL)
+		goto end_of_regex_test_batch;
+
+	logg("%s Matching domains using %u thread%s...", cli_info(), num_threads, num_threads == 1 ? "" : "s");
+	timer_start(REGEX_TIMER);
+	for(unsigned int t = 0; t < num_threads; t++)
+	{
+		threads[t].domains = domains;
+		threads[t].num_domains = num_domains;
+		threads[t].first = t;
+		threads[t].stride = num_threads;
+		threads[t].hits = calloc(num_total + 1, sizeof(uint64_t));
+		threads[t].queries = calloc(num_total + 1, sizeof(uint64_t));
+		threads[t].nsec = calloc(num_total + 1, sizeof(uint64_t));
+		if(threads[t].hits == NULL || threads[t].queries == NULL || threads[t].nsec == NULL ||
+		   pthread_create(&tids[t], NULL, batch_thread, &threads[t]) != 0)
+		{
+			logg("%s Cannot start thread: %s", cli_cross(), strerror(errno));
+			goto end_of_regex_test_batch;
+		}
+		num_started++;
+	}
+
+	// Collect results in the arrays of the first thread
+	uint64_t blocked = 0, whitelisted = 0;
+	for(unsigned int t = 0; t < num_threads; t++)
+	{
+		pthread_join(tids[t], NULL);
+		blocked += threads[t].blocked;
+		whitelisted += threads[t].whitelisted;
+		for(unsigned int i = 0; t > 0 && i < num_total; i++)
+		{
+			threads[0].hits[i] += threads[t].hits[i];
+			threads[0].queries[i] += threads[t].queries[i];
+			threads[0].nsec[i] += threads[t].nsec[i];
+		}
+	}
+	// All threads have been joined
+	num_started = 0;
+	logg("    Done in %.3f msec\n", timer_elapsed_msec(REGEX_TIMER));
+	logg("    Blocked: %" PRIu64 " queries (%.2f%%)", blocked, 100.0*blocked/num_queries);
+	logg("    Whitelisted: %" PRIu64 " queries (%.2f%%)\n", whitelisted, 100.0*whitelisted/num_queries);
+
+	// Sort by cumulative matching time
+	order = calloc(num_total + 1, sizeof(batchOrder));
+	if(order == NULL)
+		goto end_of_regex_test_batch;
+	for(unsigned int i = 0; i < num_total; i++)
+	{
+		order[i].idx = i;
+		order[i].nsec = threads[0].nsec[i];
+	}
+	qsort(order, num_total, sizeof(batchOrder), batch_order_cmp);
+
+	logg("%s Per-regex results (sorted by cumulative matching time):", cli_info());
+	logg("    %-9s %10s %12s %12s %9s  %s", "Type", "Hits", "Queries", "Time [ms]", "Avg [ns]", "Regex (DB ID)");
+	for(unsigned int j = 0; j < num_total; j++)
+	{
+		const unsigned int i = order[j].idx;
+		const bool black = i < num_regex[REGEX_BLACKLIST];
+		const regexData *regex = black ? &black_regex[i] : &white_regex[i - num_regex[REGEX_BLACKLIST]];
+		logg("    %-9s %10" PRIu64 " %12" PRIu64 " %12.3f %9.1f  %s (%i)%s",
+		     black ? "blacklist" : "whitelist", threads[0].hits[i], threads[0].queries[i],
+		     1e-6*threads[0].nsec[i], (double)threads[0].nsec[i]/num_domains,
+		     regex->string, regex->database_id, regex->available ? "" : " NOT AVAILABLE");
+	}
+
+	logg("\n%s Slowest regex filters (average time per domain):", cli_info());
+	for(unsigned int j = 0; j < num_total && j < BATCH_SLOWEST; j++)
+	{
+		const unsigned int i = order[j].idx;
+		const bool black = i < num_regex[REGEX_BLACKLIST];
+		const regexData *regex = black ? &black_regex[i] : &white_regex[i - num_regex[REGEX_BLACKLIST]];
+		logg("    %2u. %9.1f ns  %s%s%s (regex %s, DB ID %i)", j + 1,
+		     (double)threads[0].nsec[i]/num_domains, cli_bold(), regex->string,
+		     cli_normal(), black ? "blacklist" : "whitelist", regex->database_id);
+	}
+
+	ret = EXIT_SUCCESS;
+
+end_of_regex_test_batch:
+	// Wait for threads still working on the domains before freeing them
+	for(unsigned int t = 0; t < num_started; t++)
+		pthread_join(tids[t], NULL);
+	if(threads != NULL)
+	{
+		for(unsigned int t = 0; t < num_threads; t++)
+		{
+			if(threads[t].hits != NULL)
+				free(threads[t].hits);
+			if(threads[t].queries != NULL)
+				free(threads[t].queries);
+			if(threads[t].nsec != NULL)
+				free(threads[t].nsec);
+		}
+		free(threads);
+	}
+	if(domains != NULL)
+	{
+		for(unsigned int i = 0; i < num_domains; i++)
+			free(domains[i].domain);
+		free(domains);
+	}
+	if(tids != NULL)
+		free(tids);
+	if(order != NULL)
+		free(order);
+	free_regex();
+	free(counters);
+	counters = NULL;
+
+	return ret;
+}
+
 // Get internal ID of regex with this database ID
 static int __attribute__ ((pure)) regex_id_from_database_id(const int dbID)
 {
@@ -0,0 +1,468 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Regex fast-path routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "regex_fast.h"
+// logg()
+#include "log.h"
+// struct config
+#include "config.h"
+// USHRT_MAX
+#include <limits.h>
+
+// Most regex filters found in the wild are equivalent to plain string
+// comparisons. We recognize the following shapes (matching case-insensitive
+// just like the regex engine does, options like ;querytype= are not part of
+// the pattern here):
+//
+//   ^example\.com$               REGEX_FAST_EXACT     domain == literal
+//   (^|\.)example\.com$          REGEX_FAST_SUFFIX    domain == literal or
+//   (\.|^)example\.com$                               domain ends in .literal
+//   ^(.*\.)?example\.com$
+//   ^ads\.                       REGEX_FAST_PREFIX    domain starts with literal
+//   \.example\.com$              REGEX_FAST_ENDS      domain ends in literal
+//   doubleclick                  REGEX_FAST_CONTAINS  literal is in domain
+//
+// Such regex are collected in hash tables and tries so we only need to look at
+// those which actually match a domain instead of running all of them through
+// the regex engine. Inverted regex cannot be looked up this way, they (and all
+// other regex) are visited for every domain. The compiled regex are kept
+// as-is, so all other properties stay exactly the same
+
+// Characters which have to be escaped to be matched literally in an ERE
+#define ERE_SPECIAL ".[]()*+?{}|^$\\"
+
+static const char *const suffix_anchors[] = { "(^|\\.)", "(\\.|^)", "^(.*\\.)?" };
+
+// Try to interpret pattern as literal string, returns it unescaped and
+// lowercased or NULL if the pattern contains any regex operator
+static char *parse_literal(const char *pattern, const size_t len)
+{
+	char *literal = calloc(len + 1u, sizeof(char));
+	if(literal == NULL)
+		return NULL;
+
+	size_t n = 0;
+	for(size_t i = 0; i < len; i++)
+	{
+		char c = pattern[i];
+		if(c == '\\')
+		{
+			// Only escaped special characters are plain literals,
+			// everything else may be a TRE extension like \w
+			if(++i >= len || strchr(ERE_SPECIAL, pattern[i]) == NULL)
+				break;
+			c = pattern[i];
+		}
+		else if(strchr(ERE_SPECIAL, c) != NULL || c < '!' || c > '~')
+			break;
+
+		literal[n++] = (char)tolower(c);
+		if(i + 1 == len)
+		{
+			// Reached the end without hitting any operator
+			return literal;
+		}
+	}
+
+	free(literal);
+	return NULL;
+}
+
+static const char * __attribute__ ((const)) fast_type_str(const enum regex_fast_type type)
+{
+	switch(type)
+	{
+		case REGEX_FAST_EXACT:
+			return "exact";
+		case REGEX_FAST_SUFFIX:
+			return "domain suffix";
+		case REGEX_FAST_PREFIX:
+			return "prefix";
+		case REGEX_FAST_ENDS:
+			return "ending";
+		case REGEX_FAST_CONTAINS:
+			return "substring";
+		case REGEX_FAST_NONE:
+		default:
+			return "none";
+	}
+}
+
+// Check if this (successfully compiled) regex is equivalent to a plain string
+// comparison and remember the literal string if so
+void regex_fast_analyze(regexData *regex, const char *pattern)
+{
+	regex->fast = REGEX_FAST_NONE;
+	regex->literal = NULL;
+
+	const char *start = pattern;
+	size_t len = strlen(pattern);
+	enum regex_fast_type type = REGEX_FAST_CONTAINS;
+
+	// Leading anchors
+	for(unsigned int i = 0; i < sizeof(suffix_anchors)/sizeof(*suffix_anchors); i++)
+	{
+		const size_t anchor_len = strlen(suffix_anchors[i]);
+		if(strncmp(start, suffix_anchors[i], anchor_len) == 0)
+		{
+			type = REGEX_FAST_SUFFIX;
+			start += anchor_len;
+			len -= anchor_len;
+			break;
+		}
+	}
+	if(type == REGEX_FAST_CONTAINS && start[0] == '^')
+	{
+		type = REGEX_FAST_PREFIX;
+		start++;
+		len--;
+	}
+
+	// Trailing anchor (but not an escaped dollar sign)
+	const bool end_anchor = len > 0 && start[len-1] == '$' &&
+	                        (len < 2 || start[len-2] != '\\');
+	if(end_anchor)
+	{
+		len--;
+		if(type == REGEX_FAST_PREFIX)
+			type = REGEX_FAST_EXACT;
+		else if(type == REGEX_FAST_CONTAINS)
+			type = REGEX_FAST_ENDS;
+	}
+	else if(type == REGEX_FAST_SUFFIX)
+	{
+		// Suffix anchors are only meaningful at the end of the domain
+		return;
+	}
+
+	// Literal strings with more than 65535 characters do not appear in
+	// domain names anyway
+	if(len == 0 || len > USHRT_MAX)
+		return;
+
+	char *literal = parse_literal(start, len);
+	if(literal == NULL)
+		return;
+
+	regex->fast = type;
+	regex->literal = literal;
+	regex->literal_len = (unsigned short)strlen(literal);
+
+	if(config.debug & DEBUG_REGEX)
+		logg("   This regex is a plain %s match on \"%s\"", fast_type_str(type), literal);
+}
+
+// Match domain against the literal of a fast-path regex
+bool regex_fast_match(const regexData *regex, const char *input)
+{
+	const size_t len = strlen(input);
+	const size_t lit = regex->literal_len;
+	switch(regex->fast)
+	{
+		case REGEX_FAST_EXACT:
+			return len == lit && strcasecmp(input, regex->literal) == 0;
+		case REGEX_FAST_SUFFIX:
+			if(len == lit)
+				return strcasecmp(input, regex->literal) == 0;
+			return len > lit && input[len - lit - 1u] == '.' &&
+			       strcasecmp(input + len - lit, regex->literal) == 0;
+		case REGEX_FAST_PREFIX:
+			return strncasecmp(input, regex->literal, lit) == 0;
+		case REGEX_FAST_ENDS:
+			return len >= lit && strcasecmp(input + len - lit, regex->literal) == 0;
+		case REGEX_FAST_CONTAINS:
+			return strcasestr(input, regex->literal) != NULL;
+		case REGEX_FAST_NONE:
+		default:
+			return false;
+	}
+}
+
+// FNV-1a
+static uint32_t __attribute__ ((pure)) fast_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+	for(; *key != '\0'; key++)
+	{
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int trie_new_node(fastTrie *trie, const char c)
+{
+	if(trie->num_nodes >= trie->size_nodes)
+	{
+		const unsigned int size = trie->size_nodes > 0 ? 2*trie->size_nodes : 64;
+		fastTrieNode *nodes = realloc(trie->nodes, size*sizeof(fastTrieNode));
+		if(nodes == NULL)
+			return -1;
+		trie->nodes = nodes;
+		trie->size_nodes = size;
+	}
+
+	fastTrieNode *node = &trie->nodes[trie->num_nodes];
+	node->c = c;
+	node->child = -1;
+	node->sibling = -1;
+	node->first = -1;
+	return (int)trie->num_nodes++;
+}
+
+static bool trie_insert(fastTrie *trie, int *next, const char *literal, const size_t len,
+                        const bool reverse, const unsigned int index)
+{
+	// Root node
+	if(trie->num_nodes == 0 && trie_new_node(trie, '\0') < 0)
+		return false;
+
+	int node = 0;
+	for(size_t k = 0; k < len; k++)
+	{
+		const char c = reverse ? literal[len - 1u - k] : literal[k];
+		int child = trie->nodes[node].child;
+		while(child >= 0 && trie->nodes[child].c != c)
+			child = trie->nodes[child].sibling;
+
+		if(child < 0)
+		{
+			if((child = trie_new_node(trie, c)) < 0)
+				return false;
+			trie->nodes[child].sibling = trie->nodes[node].child;
+			trie->nodes[node].child = child;
+		}
+		node = child;
+	}
+
+	next[index] = trie->nodes[node].first;
+	trie->nodes[node].first = (int)index;
+	return true;
+}
+
+static void trie_free(fastTrie *trie)
+{
+	if(trie->nodes != NULL)
+		free(trie->nodes);
+	memset(trie, 0, sizeof(*trie));
+}
+
+void regex_fast_free(regexFastSet *set)
+{
+	if(set->slow != NULL)
+		free(set->slow);
+	if(set->hash != NULL)
+		free(set->hash);
+	if(set->next != NULL)
+		free(set->next);
+	if(set->contains != NULL)
+		free(set->contains);
+	trie_free(&set->prefix);
+	trie_free(&set->ends);
+	memset(set, 0, sizeof(*set));
+}
+
+// Build the lookup structures for an array of regex. If anything fails here,
+// the set is not used and all regex are checked one by one
+void regex_fast_build(regexFastSet *set, const regexData *regex, const unsigned int num)
+{
+	regex_fast_free(set);
+	if(num == 0)
+		return;
+
+	unsigned int hashed = 0;
+	for(unsigned int i = 0; i < num; i++)
+		if(regex[i].available && !regex[i].ext.inverted &&
+		   (regex[i].fast == REGEX_FAST_EXACT || regex[i].fast == REGEX_FAST_SUFFIX))
+			hashed++;
+
+	// Keep the load factor of the hash table below 50%
+	set->hash_size = 16;
+	while(set->hash_size < 2*hashed)
+		set->hash_size *= 2;
+
+	set->slow = calloc(num, sizeof(unsigned int));
+	set->contains = calloc(num, sizeof(unsigned int));
+	set->next = calloc(num, sizeof(int));
+	set->hash = calloc(set->hash_size, sizeof(fastHashEntry));
+	if(set->slow == NULL || set->contains == NULL || set->next == NULL || set->hash == NULL)
+	{
+		regex_fast_free(set);
+		return;
+	}
+
+	unsigned int fast = 0;
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const regexData *r = &regex[i];
+		bool okay = true;
+		if(!r->available || r->ext.inverted || r->fast == REGEX_FAST_NONE)
+		{
+			set->slow[set->num_slow++] = i;
+			continue;
+		}
+
+		switch(r->fast)
+		{
+			case REGEX_FAST_EXACT:
+			case REGEX_FAST_SUFFIX:
+			{
+				unsigned int pos = fast_hash(r->literal) & (set->hash_size - 1u);
+				while(set->hash[pos].literal != NULL)
+					pos = (pos + 1u) & (set->hash_size - 1u);
+				set->hash[pos].literal = r->literal;
+				set->hash[pos].index = i;
+				set->hash[pos].type = r->fast;
+				break;
+			}
+			case REGEX_FAST_PREFIX:
+				okay = trie_insert(&set->prefix, set->next, r->literal, r->literal_len, false, i);
+				break;
+			case REGEX_FAST_ENDS:
+				okay = trie_insert(&set->ends, set->next, r->literal, r->literal_len, true, i);
+				break;
+			case REGEX_FAST_CONTAINS:
+				set->contains[set->num_contains++] = i;
+				break;
+			case REGEX_FAST_NONE:
+			default:
+				break;
+		}
+
+		if(!okay)
+		{
+			regex_fast_free(set);
+			return;
+		}
+		fast++;
+	}
+
+	set->built = true;
+
+	if(config.debug & DEBUG_REGEX)
+		logg("Regex fast-path: %u of %u regex are plain string matches", fast, num);
+}
+
+static void add_candidate(regexIterator *it, const unsigned int index)
+{
+	if(it->num_candidates < MAX_FAST_CANDIDATES)
+		it->candidates[it->num_candidates] = index;
+	it->num_candidates++;
+}
+
+static void trie_candidates(regexIterator *it, const fastTrie *trie, const char *input,
+                            const size_t len, const bool reverse)
+{
+	if(trie->num_nodes == 0)
+		return;
+
+	int node = 0;
+	for(size_t k = 0; k < len; k++)
+	{
+		const char c = reverse ? input[len - 1u - k] : input[k];
+		int child = trie->nodes[node].child;
+		while(child >= 0 && trie->nodes[child].c != c)
+			child = trie->nodes[child].sibling;
+		if(child < 0)
+			return;
+
+		node = child;
+		for(int r = trie->nodes[node].first; r >= 0; r = it->set->next[r])
+			add_candidate(it, (unsigned int)r);
+	}
+}
+
+// Prepare iterating over all regex which may match this domain in the order of
+// their index. These are the fast-path regex actually matching and all others
+void regex_fast_iter_init(regexIterator *it, const regexFastSet *set, const regexData *regex,
+                          const unsigned int num, const char *input)
+{
+	memset(it, 0, sizeof(*it));
+	it->set = set;
+	it->num = num;
+	it->all = !set->built;
+	if(it->all)
+		return;
+
+	// Lookups are done on the lowercase domain
+	const size_t len = strlen(input);
+	char domain[len + 1u];
+	for(size_t i = 0; i <= len; i++)
+		domain[i] = (char)tolower(input[i]);
+
+	// Exact matches and domain suffixes: the domain and all its parents
+	for(const char *key = domain; key != NULL; key = strchr(key, '.'))
+	{
+		if(key != domain)
+			key++;
+
+		unsigned int pos = fast_hash(key) & (set->hash_size - 1u);
+		for(; set->hash[pos].literal != NULL; pos = (pos + 1u) & (set->hash_size - 1u))
+		{
+			const fastHashEntry *entry = &set->hash[pos];
+			if(strcmp(entry->literal, key) == 0 &&
+			   (entry->type == REGEX_FAST_SUFFIX || key == domain))
+				add_candidate(it, entry->index);
+		}
+	}
+
+	trie_candidates(it, &set->prefix, domain, len, false);
+	trie_candidates(it, &set->ends, domain, len, true);
+
+	for(unsigned int i = 0; i < set->num_contains; i++)
+	{
+		const unsigned int index = set->contains[i];
+		if(strstr(domain, regex[index].literal) != NULL)
+			add_candidate(it, index);
+	}
+
+	// Too many candidates, check everything
+	if(it->num_candidates > MAX_FAST_CANDIDATES)
+	{
+		it->all = true;
+		return;
+	}
+
+	// Sort candidates by index (there are only a few of them)
+	for(unsigned int i = 1; i < it->num_candidates; i++)
+	{
+		const unsigned int tmp = it->candidates[i];
+		unsigned int j = i;
+		for(; j > 0 && it->candidates[j-1] > tmp; j--)
+			it->candidates[j] = it->candidates[j-1];
+		it->candidates[j] = tmp;
+	}
+}
+
+// Get next regex to be checked, returns false when there are no more regex
+bool regex_fast_iter_next(regexIterator *it, unsigned int *index)
+{
+	if(it->all)
+	{
+		if(it->next >= it->num)
+			return false;
+		*index = it->next++;
+		return true;
+	}
+
+	// Merge regex needing the regex engine with the candidates (both are
+	// sorted). There are no duplicates between them
+	const regexFastSet *set = it->set;
+	if(it->s < set->num_slow &&
+	   (it->c >= it->num_candidates || set->slow[it->s] < it->candidates[it->c]))
+		*index = set->slow[it->s++];
+	else if(it->c < it->num_candidates)
+		*index = it->candidates[it->c++];
+	else
+		return false;
+
+	return true;
+}
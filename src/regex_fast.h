@@ -0,0 +1,77 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Regex fast-path prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef REGEX_FAST_H
+#define REGEX_FAST_H
+
+// regexData
+#include "regex_r.h"
+
+// Maximum number of fast-path candidates collected for a single domain. If
+// there are more, all regex are checked one by one
+#define MAX_FAST_CANDIDATES 32
+
+typedef struct {
+	const char *literal;
+	unsigned int index;
+	enum regex_fast_type type;
+} fastHashEntry;
+
+typedef struct {
+	char c;
+	int child;
+	int sibling;
+	int first;
+} fastTrieNode;
+
+typedef struct {
+	unsigned int num_nodes;
+	unsigned int size_nodes;
+	fastTrieNode *nodes;
+} fastTrie;
+
+// Lookup structures for all regex of one type
+typedef struct {
+	bool built;
+	// Regex which have to be checked for every domain (sorted)
+	unsigned int num_slow;
+	unsigned int *slow;
+	// Exact and domain-suffix matches (open addressing)
+	unsigned int hash_size;
+	fastHashEntry *hash;
+	// Prefix matches and matches at the end (reversed)
+	fastTrie prefix;
+	fastTrie ends;
+	// Chains of regex ending in the same trie node
+	int *next;
+	// Literals contained anywhere in the domain
+	unsigned int num_contains;
+	unsigned int *contains;
+} regexFastSet;
+
+typedef struct {
+	const regexFastSet *set;
+	unsigned int num;
+	bool all;
+	unsigned int next;
+	unsigned int s;
+	unsigned int c;
+	unsigned int num_candidates;
+	unsigned int candidates[MAX_FAST_CANDIDATES];
+} regexIterator;
+
+void regex_fast_analyze(regexData *regex, const char *pattern);
+bool regex_fast_match(const regexData *regex, const char *input) __attribute__ ((pure));
+void regex_fast_build(regexFastSet *set, const regexData *regex, const unsigned int num);
+void regex_fast_free(regexFastSet *set);
+void regex_fast_iter_init(regexIterator *it, const regexFastSet *set, const regexData *regex,
+                          const unsigned int num, const char *input);
+bool regex_fast_iter_next(regexIterator *it, unsigned int *index);
+
+#endif //REGEX_FAST_H
@@ -28,6 +28,9 @@ extern const char *regextype[];
 
 typedef struct {
 	bool available :1;
+	// Regex equivalent to a plain string comparison (see regex_fast.c)
+	enum regex_fast_type fast;
+	unsigned short literal_len;
 	struct {
 		bool inverted :1;
 		bool custom_ip4 :1;
@@ -39,6 +42,7 @@ typedef struct {
 	} ext;
 	int database_id;
 	char *string;
+	char *literal;
 	regex_t regex;
 } regexData;
 
@@ -47,8 +51,12 @@ bool in_regex(const char *domain, DNSCacheData *dns_cache, const int clientID, c
 void allocate_regex_client_enabled(clientsData *client, const int clientID);
 void reload_per_client_regex(clientsData *client);
 void read_regex_from_database(void);
+void stage_regex_from_database(void);
+void discard_staged_regex(void);
+void swap_staged_regex(void);
 bool regex_get_redirect(const int regexID, struct in_addr *addr4, struct in6_addr *addr6);
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin);
+int regex_test_batch(const bool debug_mode, const char *path, unsigned int num_threads);
 
 #endif //REGEX_H
@@ -30,9 +30,11 @@
 #include "database/message-table.h"
 // check_running_FTL()
 #include "procps.h"
+// record_lock_acquired()
+#include "metrics.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 14
+#define SHARED_MEMORY_VERSION 18
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHMEM_PATH "/dev/shm"
@@ -47,6 +49,7 @@
 #define SHARED_SETTINGS_NAME "FTL-settings"
 #define SHARED_DNS_CACHE "FTL-dns-cache"
 #define SHARED_PER_CLIENT_REGEX "FTL-per-client-regex"
+#define SHARED_METRICS_NAME "FTL-metrics"
 
 // Allocation step for FTL-strings bucket. This is somewhat special as we use
 // this as a general-purpose storage which should always be large enough. If,
@@ -70,6 +73,7 @@ static SharedMemory shm_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
 static SharedMemory shm_dns_cache = { 0 };
 static SharedMemory shm_per_client_regex = { 0 };
+static SharedMemory shm_metrics = { 0 };
 
 static SharedMemory *sharedMemories[] = { &shm_lock,
                                           &shm_strings,
@@ -81,7 +85,8 @@ static SharedMemory *sharedMemories[] = { &shm_lock,
                                           &shm_overTime,
                                           &shm_settings,
                                           &shm_dns_cache,
-                                          &shm_per_client_regex };
+                                          &shm_per_client_regex,
+                                          &shm_metrics };
 #define NUM_SHMEM (sizeof(sharedMemories)/sizeof(SharedMemory*))
 
 // Variable size array structs
@@ -108,6 +113,7 @@ static int pagesize;
 static unsigned int local_shm_counter = 0;
 static pid_t shmem_pid = 0;
 static size_t used_shmem = 0u;
+static const char *shmem_prefix = NULL;
 static size_t get_optimal_object_size(const size_t objsize, const size_t minsize);
 
 // Private prototypes
@@ -136,11 +142,11 @@ static int get_dev_shm_usage(char buffer[64])
 static void verify_shmem_pid(void)
 {
 	// Open shared memory settings object
-	const int settingsfd = shm_open(SHARED_SETTINGS_NAME, O_RDONLY, S_IRUSR | S_IWUSR);
+	const int settingsfd = shm_open(shm_settings.name, O_RDONLY, S_IRUSR | S_IWUSR);
 	if(settingsfd == -1)
 	{
 		logg("FATAL: verify_shmem_pid(): Failed to open shared memory object \"%s\": %s",
-			SHARED_SETTINGS_NAME, strerror(errno));
+			shm_settings.name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -148,7 +154,7 @@ static void verify_shmem_pid(void)
 	if(read(settingsfd, &shms, sizeof(shms)) != sizeof(shms))
 	{
 		logg("FATAL: verify_shmem_pid(): Failed to read %zu bytes from shared memory object \"%s\": %s",
-			sizeof(shms), SHARED_SETTINGS_NAME, strerror(errno));
+			sizeof(shms), shm_settings.name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -231,30 +237,21 @@ char *__attribute__ ((malloc)) str_escape(const char *input, unsigned int *N)
 
 bool strcmp_escaped(const char *a, const char *b)
 {
-	unsigned int Na, Nb;
-
 	// Input check
 	if(a == NULL || b == NULL)
 		return false;
 
-	// Escape both inputs
-	char *aa = str_escape(a, &Na);
-	char *bb = str_escape(b, &Nb);
-
-	// Check for memory errors
-	if(!aa || !bb)
+	// Compare case-insensitively as if both strings had been passed through
+	// str_escape(). This is done on the fly as it is called for every reply
+	for(;; a++, b++)
 	{
-		if(aa) free(aa);
-		if(bb) free(bb);
-		return false;
+		const int ca = *a == ' ' ? '~' : tolower((unsigned char)*a);
+		const int cb = *b == ' ' ? '~' : tolower((unsigned char)*b);
+		if(ca != cb)
+			return false;
+		if(ca == '\0')
+			return true;
 	}
-
-	const char result = strcasecmp(aa, bb) == 0;
-
-	free(aa);
-	free(bb);
-
-	return result;
 }
 
 
@@ -289,19 +286,22 @@ size_t addstr(const char *input)
 		len = avail_mem;
 	}
 
+	// Copy the C string pointed by input into the shared string buffer
+	char *str = &((char*)shm_strings.ptr)[shmSettings->next_str_pos];
+	strncpy(str, input, len);
+
+	// Replace any spaces by ~ in place (see str_escape()), this avoids
+	// duplicating every new string on the heap first
 	unsigned int N = 0;
-	char *str = str_escape(input, &N);
+	for(char *ix = str; (ix = memchr(ix, ' ', len - (ix - str))) != NULL; N++)
+		*ix++ = '~';
 
 	if(N > 0)
-		logg("INFO: FTL replaced %u invalid characters with ~ in the query \"%s\"", N, str);
+		logg("INFO: FTL replaced %u invalid characters with ~ in the query \"%.*s\"", N, (int)len, str);
 
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
-		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
-
-	// Copy the C string pointed by str into the shared string buffer
-	strncpy(&((char*)shm_strings.ptr)[shmSettings->next_str_pos], str, len);
-	free(str);
+		logg("Adding \"%.*s\" (len %zu) to buffer. next_str_pos is %u", (int)len, str, len, shmSettings->next_str_pos);
 
 	// Increment string length counter
 	shmSettings->next_str_pos += len;
@@ -380,6 +380,8 @@ void _lock_shm(const char *func, const int line, const char *file)
 	if(config.debug & DEBUG_LOCKS)
 		logg("Waiting for SHM lock in %s() (%s:%i)", func, file, line);
 
+	const uint64_t lock_start = metrics_now();
+
 	int result = pthread_mutex_lock(&shmLock->lock.outer);
 
 	if(result != 0)
@@ -431,6 +433,9 @@ void _lock_shm(const char *func, const int line, const char *file)
 		if(result != 0)
 			logg("Failed to make inner SHM lock consistent: %s", strerror(result));
 	}
+
+	// Record time spent waiting for the lock
+	record_lock_acquired(func, line, file, lock_start);
 }
 
 // Release SHM lock
@@ -442,6 +447,9 @@ void _unlock_shm(const char* func, const int line, const char * file)
 		     (long int)shmLock->owner.pid, (long int)shmLock->owner.tid);
 	}
 
+	// Record time the lock was held
+	record_lock_released();
+
 	// Unlock mutex
 	int result = pthread_mutex_unlock(&shmLock->lock.inner);
 	shmLock->owner.pid = 0;
@@ -482,6 +490,16 @@ bool init_shmem()
 	shmLock->lock.outer = create_mutex();
 	shmLock->lock.inner = create_mutex();
 
+	/****************************** shared metrics struct ******************************/
+	// Try to create shared memory object
+	shm_metrics = create_shm(SHARED_METRICS_NAME, sizeof(metricsData));
+	if(shm_metrics.ptr == NULL)
+		return false;
+
+	// set global pointer in metrics.c
+	metrics = (metricsData*)shm_metrics.ptr;
+	init_metrics();
+
 	/****************************** shared counters struct ******************************/
 	// Try to create shared memory object
 	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
@@ -584,6 +602,19 @@ bool init_shmem()
 	return true;
 }
 
+// Use a private set of shared memory objects. This has to be called before
+// init_shmem()
+void set_shmem_prefix(const char *prefix)
+{
+	shmem_prefix = prefix;
+}
+
+// Get the total size of all shared memory objects in bytes
+size_t get_shmem_usage(void)
+{
+	return used_shmem;
+}
+
 // CHOWN all shared memory objects to supplied user/group
 void chown_all_shmem(struct passwd *ent_pw)
 {
@@ -607,6 +638,31 @@ void destroy_shmem(void)
 		delete_shm(sharedMemories[i]);
 }
 
+// Attach to the metrics of a running FTL instance (read-only). This is used by
+// processes not owning the shared memory objects (e.g., the SQLite3 shell)
+bool attach_shmem_metrics(void)
+{
+	const int fd = shm_open(SHARED_METRICS_NAME, O_RDONLY, 0);
+	if(fd == -1)
+		return false;
+
+	// Check the object has the size we expect
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(metricsData))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *shm = mmap(NULL, sizeof(metricsData), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+		return false;
+
+	metrics = (metricsData*)shm;
+	return true;
+}
+
 /// Create shared memory
 ///
 /// \param name the name of the shared memory
@@ -624,6 +680,15 @@ static SharedMemory create_shm(const char *name, const size_t size)
 	if(config.check.shmem > 0 && percentage > config.check.shmem)
 		log_resource_shortage(-1.0, 0, percentage, -1, SHMEM_PATH, df);
 
+	// Objects of private instances (e.g., benchmarks) get a distinct name
+	// so they do not collide with those of a running FTL
+	if(shmem_prefix != NULL)
+	{
+		char *prefixed = NULL;
+		if(asprintf(&prefixed, "%s%s", shmem_prefix, name) > 0)
+			name = prefixed;
+	}
+
 	SharedMemory sharedMemory = {
 		.name = name,
 		.size = size,
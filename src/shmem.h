@@ -46,6 +46,7 @@ typedef struct {
 	int dns_cache_MAX;
 	int per_client_regex_MAX;
 	unsigned int regex_change;
+	unsigned int gravity_generation;
 	int querytype[TYPE_MAX-1];
 	int status[QUERY_STATUS_MAX];
 	int reply[QUERY_REPLY_MAX];
@@ -101,6 +102,9 @@ void _unlock_log(const char* func, const int line, const char * file);
 
 bool init_shmem(void);
 void destroy_shmem(void);
+bool attach_shmem_metrics(void);
+void set_shmem_prefix(const char *prefix);
+size_t get_shmem_usage(void) __attribute__ ((pure));
 size_t addstr(const char *str);
 #define getstr(pos) _getstr(pos, __FUNCTION__, __LINE__, __FILE__)
 const char *_getstr(const size_t pos, const char *func, const int line, const char *file);
@@ -114,7 +118,7 @@ char *str_escape(const char *input, unsigned int *N) __attribute__ ((malloc));
 /**
  * Compare two strings. Escape them if needed
  */
-bool strcmp_escaped(const char *a, const char *b);
+bool strcmp_escaped(const char *a, const char *b) __attribute__ ((pure));
 
 /**
  * Create a new overTime client shared memory block.
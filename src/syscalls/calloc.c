@@ -12,6 +12,9 @@
 //#include "syscalls.h" is implicitly done in FTL.h
 #include "../log.h"
 
+// Heap allocations done by this thread (see syscalls.h)
+__thread unsigned long FTLalloc_calls = 0;
+
 #undef calloc
 void* __attribute__((malloc)) __attribute__((alloc_size(1,2))) FTLcalloc(const size_t nmemb, const size_t size, const char *file, const char *func, const int line)
 {
@@ -21,6 +24,7 @@ void* __attribute__((malloc)) __attribute__((alloc_size(1,2))) FTLcalloc(const s
 	// either NULL, or a unique pointer value that can later be successfully
 	// passed to free().
 	void *ptr = NULL;
+	FTLalloc_calls++;
 	do
 	{
 		errno = 0;
@@ -25,6 +25,7 @@ void __attribute__((alloc_size(2))) *FTLrealloc(void *ptr_in, const size_t size,
 	// have been returned by an earlier call to malloc(), calloc() or realloc().
 	// If the area pointed to was moved, a free(ptr) is done implicitly.
 	void *ptr_out = NULL;
+	FTLalloc_calls++;
 	do
 	{
 		errno = 0;
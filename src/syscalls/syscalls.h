@@ -11,6 +11,9 @@
 #define SYSCALLS_H
 
 // Interrupt-safe memory routines
+// Number of heap allocations done through these routines by the calling
+// thread, used to verify the query path is allocation-free
+extern __thread unsigned long FTLalloc_calls;
 char *FTLstrdup(const char *src, const char *file, const char *func, const int line) __attribute__((malloc));
 void *FTLcalloc(size_t n, size_t size, const char *file, const char *func, const int line) __attribute__((malloc)) __attribute__((alloc_size(1,2)));
 void *FTLrealloc(void *ptr_in, size_t size, const char *file, const char *func, const int line) __attribute__((alloc_size(2)));
@@ -24,6 +24,7 @@ int FTLvasprintf(const char *file, const char *func, const int line, char **buff
 	}
 	// Print into dynamically allocated memory
 	int _errno, length = 0;
+	FTLalloc_calls++;
 	do
 	{
 		// The va_copy() macro copies the (previously initialized) variable
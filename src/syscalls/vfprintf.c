@@ -101,6 +101,10 @@ int FTLvfprintf(FILE *stream, const char *file, const char *func, const int line
 	// Print into dynamically allocated memory
 	char *buffer = NULL;
 	int _errno, length = 0;
+	// Formatting is not counted as a heap allocation: the only printing done
+	// on the query path is debug logging which would otherwise be reported
+	// by the allocation check of the scratch arena (see arena_reset())
+	const unsigned long alloc_calls = FTLalloc_calls;
 	do
 	{
 		// The va_copy() macro copies the (previously initialized) variable
@@ -123,6 +127,7 @@ int FTLvfprintf(FILE *stream, const char *file, const char *func, const int line
 	// Try again to allocate memory if this failed due to an interruption by
 	// an incoming signal
 	while(length < 0 && _errno == EINTR);
+	FTLalloc_calls = alloc_calls;
 
 	// Handle other errors than EINTR
 	if(length < 0 || buffer == NULL)
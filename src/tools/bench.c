@@ -0,0 +1,374 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline benchmark
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// Runs synthetic (or recorded) query streams through the very same hooks
+// dnsmasq calls for every query, without any sockets involved. Everything
+// happens in-process on a private set of shared memory objects so this can
+// safely be run alongside a live FTL instance.
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+
+#include "FTL.h"
+#include "bench.h"
+#include "log.h"
+#include "config.h"
+// init_shmem(), set_shmem_prefix()
+#include "shmem.h"
+// initOverTime()
+#include "overTime.h"
+// FTL_new_query(), FTL_hook()
+#include "dnsmasq_interface.h"
+// gravityDB_open()
+#include "database/gravity-db.h"
+// read_regex_from_database()
+#include "regex_r.h"
+// blockingstatus
+#include "setupVars.h"
+// startup
+#include "main.h"
+// histogram_add(), get_metrics_json()
+#include "metrics.h"
+#include "database/sqlite3.h"
+
+// Number of distinct gravity domains queried in synthetic mode
+#define BENCH_GRAVITY_POOL 1000
+// Number of distinct non-blocked domains queried in synthetic mode
+#define BENCH_ALLOWED_POOL 4000
+// Share of allowed queries answered from cache (percent)
+#define BENCH_CACHE_HITS 60
+// Share of synthetic queries asking for gravity domains (percent)
+#define BENCH_BLOCKED_SHARE 20
+
+typedef struct {
+	char *domain;
+	struct in_addr client;
+	unsigned short qtype;
+} benchQuery;
+
+// Deterministic xorshift PRNG so subsequent runs are comparable
+static uint32_t bench_rand(void)
+{
+	static uint32_t state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// Skewed pick from a pool of <size> entries: low indices are much more
+// popular than high ones (roughly like real-world domain popularity)
+static unsigned int bench_pick(const unsigned int size)
+{
+	const uint32_t rnd = bench_rand();
+	const double r = (double)rnd / UINT32_MAX;
+	const unsigned int idx = (unsigned int)(r*r*r * size);
+	return idx < size ? idx : size - 1;
+}
+
+static void bench_client(struct in_addr *addr, const unsigned int idx)
+{
+	addr->s_addr = htonl(0x0A000000u | ((idx / 254) << 8) | (idx % 254 + 1));
+}
+
+// Get the resident set size of this process in kilobytes
+static long get_rss_kb(void)
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if(fp == NULL)
+		return -1;
+
+	long pages = -1, rss = -1;
+	if(fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+		rss = -1;
+	fclose(fp);
+
+	return rss < 0 ? -1 : rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Read (up to <max>) gravity domains used as blocked part of the stream
+static unsigned int read_gravity_pool(const char *path, char **pool, const unsigned int max)
+{
+	sqlite3 *db = NULL;
+	if(sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		sqlite3_close(db);
+		return 0;
+	}
+
+	unsigned int num = 0;
+	sqlite3_stmt *stmt = NULL;
+	if(sqlite3_prepare_v2(db, "SELECT domain FROM gravity LIMIT ?;", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		sqlite3_bind_int(stmt, 1, (int)max);
+		while(num < max && sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+			if(domain != NULL && domain[0] != '\0')
+				pool[num++] = strdup(domain);
+		}
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+
+	return num;
+}
+
+// Generate a synthetic query stream
+static benchQuery *generate_queries(const char *gravity_db, const unsigned int num_queries,
+                                    const unsigned int num_clients)
+{
+	char *gravity[BENCH_GRAVITY_POOL] = { NULL };
+	const unsigned int num_gravity = read_gravity_pool(gravity_db, gravity, BENCH_GRAVITY_POOL);
+
+	char *allowed[BENCH_ALLOWED_POOL] = { NULL };
+	for(unsigned int i = 0; i < BENCH_ALLOWED_POOL; i++)
+		if(asprintf(&allowed[i], "host%u.bench%u.example.com", i, i % 97) < 0)
+			return NULL;
+
+	benchQuery *queries = calloc(num_queries, sizeof(benchQuery));
+	if(queries == NULL)
+		return NULL;
+
+	for(unsigned int i = 0; i < num_queries; i++)
+	{
+		const bool blocked = num_gravity > 0 && bench_rand() % 100 < BENCH_BLOCKED_SHARE;
+		const char *domain = blocked ? gravity[bench_pick(num_gravity)] : allowed[bench_pick(BENCH_ALLOWED_POOL)];
+		queries[i].domain = strdup(domain);
+		queries[i].qtype = bench_rand() % 10 < 7 ? T_A : T_AAAA;
+		bench_client(&queries[i].client, bench_pick(num_clients));
+	}
+
+	for(unsigned int i = 0; i < num_gravity; i++)
+		free(gravity[i]);
+	for(unsigned int i = 0; i < BENCH_ALLOWED_POOL; i++)
+		free(allowed[i]);
+
+	return queries;
+}
+
+// Read a recorded query stream. Every line has the format
+//   <domain> [<client IPv4> [<query type>]]
+// with query type being either A, AAAA or a numeric type. The file is
+// replayed as often as needed to reach <num_queries> queries
+static benchQuery *read_queries(const char *path, const unsigned int num_queries,
+                                const unsigned int num_clients)
+{
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		log_ctrl(false, true);
+		logg("Cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	unsigned int num = 0, size = 0;
+	benchQuery *recorded = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	while(getline(&line, &len, fp) != -1)
+	{
+		char domain[MAXDNAME] = { 0 }, client[INET_ADDRSTRLEN] = { 0 }, type[16] = { 0 };
+		const int fields = sscanf(line, "%1024s %15s %15s", domain, client, type);
+		if(fields < 1 || domain[0] == '#')
+			continue;
+
+		if(num == size)
+		{
+			size = size > 0 ? 2*size : 1024;
+			benchQuery *new = realloc(recorded, size*sizeof(benchQuery));
+			if(new == NULL)
+				break;
+			recorded = new;
+		}
+
+		benchQuery *query = &recorded[num];
+		query->domain = strdup(domain);
+		if(fields < 2 || inet_pton(AF_INET, client, &query->client) != 1)
+			bench_client(&query->client, bench_pick(num_clients));
+		if(fields < 3 || strcasecmp(type, "A") == 0)
+			query->qtype = T_A;
+		else if(strcasecmp(type, "AAAA") == 0)
+			query->qtype = T_AAAA;
+		else
+			query->qtype = (unsigned short)atoi(type);
+		num++;
+	}
+	free(line);
+	fclose(fp);
+
+	if(num == 0)
+	{
+		log_ctrl(false, true);
+		logg("No queries found in %s", path);
+		free(recorded);
+		return NULL;
+	}
+
+	benchQuery *queries = calloc(num_queries, sizeof(benchQuery));
+	if(queries == NULL)
+		return NULL;
+	for(unsigned int i = 0; i < num_queries; i++)
+	{
+		queries[i] = recorded[i % num];
+		queries[i].domain = strdup(recorded[i % num].domain);
+	}
+
+	for(unsigned int i = 0; i < num; i++)
+		free(recorded[i].domain);
+	free(recorded);
+
+	return queries;
+}
+
+// Run a single query through the pipeline: analysis (incl. blocking), then
+// either a cached reply or forwarding to one of two upstreams and their reply
+static bool bench_query(const benchQuery *bq, const int id)
+{
+	union mysockaddr client = {{ 0 }};
+	client.in.sin_family = AF_INET;
+	client.in.sin_port = htons(40000 + id % 20000);
+	client.in.sin_addr = bq->client;
+
+	if(_FTL_new_query(F_QUERY | F_FORWARD, bq->domain, &client, (char*)"query",
+	                  bq->qtype, id, UDP, __FILE__, __LINE__))
+		return true;
+
+	// The reply carries the address of the requested family
+	const unsigned int family = bq->qtype == T_AAAA ? F_IPV6 : F_IPV4;
+	union all_addr answer = {{ 0 }};
+	if(family == F_IPV6)
+		inet_pton(AF_INET6, "2001:db8::1", &answer.addr6);
+	else
+		inet_pton(AF_INET, "192.0.2.1", &answer.addr4);
+
+	if(bench_rand() % 100 < BENCH_CACHE_HITS)
+	{
+		FTL_hook(F_FORWARD | family, bq->domain, &answer, NULL, id, 0, __FILE__, __LINE__);
+		return false;
+	}
+
+	// FTL derives the upstream port from the sockaddr_in surrounding the
+	// address so this has to be a real one
+	struct sockaddr_in upstream = { 0 };
+	upstream.sin_family = AF_INET;
+	upstream.sin_port = htons(53);
+	upstream.sin_addr.s_addr = htonl(0xC6336401u + (id & 1)); // 198.51.100.1/2
+	FTL_hook(F_FORWARD | F_SERVER | F_IPV4, bq->domain, (void*)&upstream.sin_addr,
+	         NULL, id, 53, __FILE__, __LINE__);
+	FTL_hook(F_FORWARD | F_UPSTREAM | family, bq->domain, &answer, NULL, id, 0, __FILE__, __LINE__);
+
+	return false;
+}
+
+// Remove the private shared memory objects when interrupted
+static void bench_terminate(int signum)
+{
+	destroy_shmem();
+	_exit(128 + signum);
+}
+
+int run_bench(const char *gravity_db, const unsigned int num_queries,
+              const unsigned int num_clients, const char *query_file)
+{
+	// Process pihole-FTL.conf without printing anything. Only errors are
+	// printed as stdout is reserved for the results
+	log_ctrl(false, false);
+	read_FTLconf();
+
+	// Disable everything that would distort the results
+	config.debug = 0;
+	config.rate_limit.count = 0;
+	FTLfiles.gravity_db = strdup(gravity_db);
+
+	// Use a private set of shared memory objects
+	static char prefix[32];
+	snprintf(prefix, sizeof(prefix), "bench-%d-", (int)getpid());
+	set_shmem_prefix(prefix);
+
+	const long rss_start = get_rss_kb();
+	if(!init_shmem())
+	{
+		log_ctrl(false, true);
+		logg("Initialization of shared memory failed");
+		return EXIT_FAILURE;
+	}
+	initOverTime();
+	signal(SIGINT, bench_terminate);
+	signal(SIGTERM, bench_terminate);
+
+	// find_mac() asks the kernel via netlink about unknown clients
+	dnsmasq_daemon = calloc(1, sizeof(struct daemon));
+	daemon->port = NAMESERVER_PORT;
+	netlink_init();
+
+	// Load gravity and regex filters
+	blockingstatus = BLOCKING_ENABLED;
+	if(!gravityDB_open())
+	{
+		log_ctrl(false, true);
+		logg("Cannot open gravity database %s", gravity_db);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+	counters->gravity = gravityDB_count(GRAVITY_TABLE);
+	read_regex_from_database();
+	// Clients seen from now on get their groups loaded as usual
+	startup = false;
+
+	benchQuery *queries = query_file != NULL ?
+		read_queries(query_file, num_queries, num_clients) :
+		generate_queries(gravity_db, num_queries, num_clients);
+	if(queries == NULL)
+	{
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	const long rss_loaded = get_rss_kb();
+	const size_t shmem_loaded = get_shmem_usage();
+
+	latencyHistogram latency = { 0 };
+	unsigned int blocked = 0;
+	const uint64_t start = metrics_now();
+	for(unsigned int i = 0; i < num_queries; i++)
+	{
+		const uint64_t query_start = metrics_now();
+		if(bench_query(&queries[i], (int)i + 1))
+			blocked++;
+		histogram_add(&latency, metrics_now() - query_start);
+	}
+	const uint64_t elapsed = metrics_now() - start;
+
+	const long rss_end = get_rss_kb();
+
+	// Print results as JSON
+	printf("{\"queries\":%u,\"clients\":%d,\"domains\":%d,\"blocked\":%u,"
+	       "\"gravity\":%d,\"elapsed_ns\":%" PRIu64 ",\"qps\":%.1f,\"latency\":",
+	       num_queries, counters->clients, counters->domains, blocked,
+	       counters->gravity, elapsed, elapsed > 0 ? 1e9*num_queries/elapsed : 0.0);
+	json_histogram(stdout, &latency);
+	printf(",\"memory\":{\"rss_start_kb\":%ld,\"rss_loaded_kb\":%ld,\"rss_end_kb\":%ld,"
+	       "\"shmem_loaded_bytes\":%zu,\"shmem_end_bytes\":%zu}",
+	       rss_start, rss_loaded, rss_end, shmem_loaded, get_shmem_usage());
+	char *pipeline = get_metrics_json();
+	printf(",\"metrics\":%s}\n", pipeline != NULL ? pipeline : "null");
+	free(pipeline);
+
+	for(unsigned int i = 0; i < num_queries; i++)
+		free(queries[i].domain);
+	free(queries);
+
+	gravityDB_close();
+	destroy_shmem();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline benchmark prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+int run_bench(const char *gravity_db, const unsigned int num_queries,
+              const unsigned int num_clients, const char *query_file);
+
+#endif // BENCH_H
@@ -0,0 +1,721 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query replay load generator
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// Re-issues historical queries, either from the long-term database or from
+// a pcap file written by dnsmasq's packet dumper (--dumpfile), as real DNS
+// traffic. Queries are sent with their original timing, a scaled rate or as
+// fast as possible. Every original client is mapped onto one out of many
+// source addresses so client-side data structures are exercised
+// realistically.
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+
+#include "FTL.h"
+#include "replay.h"
+#include "log.h"
+// histogram_add(), json_histogram()
+#include "metrics.h"
+#include "database/sqlite3.h"
+#include <sys/epoll.h>
+
+// Number of distinct DNS IDs, this is also the upper limit for queries in
+// flight
+#define REPLAY_SLOTS 65536
+// Largest query we replay
+#define REPLAY_MAX_PACKET 4096
+// Number of events handled at once
+#define REPLAY_EVENTS 256
+// Interval for progress reports [ns]
+#define REPLAY_PROGRESS 5000000000ull
+
+// See dnsmasq/dump.c
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1
+#define PCAP_LINKTYPE_RAW 101
+
+typedef struct {
+	uint32_t magic_number;
+	uint16_t version_major;
+	uint16_t version_minor;
+	uint32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+} pcapHeader;
+
+typedef struct {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} pcapRecord;
+
+typedef struct {
+	double timestamp;
+	uint32_t client;
+	size_t len;
+	unsigned char packet[REPLAY_MAX_PACKET];
+} replayQuery;
+
+typedef struct {
+	FILE *pcap;
+	bool swapped;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	double from;
+	double until;
+} replaySource;
+
+typedef struct {
+	bool used;
+	int source;
+	int fd;
+	uint64_t sent;
+	// TCP only: length-prefixed query and reply progress
+	unsigned char *out;
+	size_t outlen;
+	size_t outpos;
+	unsigned char in[6];
+	size_t inlen;
+	size_t need;
+} replaySlot;
+
+static struct {
+	uint64_t sent;
+	uint64_t answered;
+	uint64_t lost;
+	uint64_t failed;
+	uint64_t mismatched;
+	uint64_t malformed;
+	uint64_t rcodes[16];
+	latencyHistogram latency;
+} stats = { 0 };
+
+static replaySlot *slots = NULL;
+static unsigned int inflight = 0u;
+
+// FTL's query types as stored in the database (see enum query_types)
+static const unsigned short db_qtypes[TYPE_MAX] = {
+	0, T_A, T_AAAA, T_ANY, T_SRV, T_SOA, T_PTR, T_TXT, T_NAPTR, T_MX,
+	T_DS, T_RRSIG, T_DNSKEY, T_NS, 0, 64, 65 };
+
+static uint32_t __attribute__ ((pure)) hash_client(const unsigned char *data, const size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+static uint32_t pcap32(const replaySource *src, const uint32_t value)
+{
+	return src->swapped ? __builtin_bswap32(value) : value;
+}
+
+static bool open_source(replaySource *src, const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL)
+	{
+		logg("Cannot open %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	pcapHeader header = { 0 };
+	if(fread(&header, sizeof(header), 1, fp) == 1 &&
+	   (header.magic_number == PCAP_MAGIC || header.magic_number == PCAP_MAGIC_SWAPPED))
+	{
+		src->pcap = fp;
+		src->swapped = header.magic_number == PCAP_MAGIC_SWAPPED;
+		if(pcap32(src, header.network) != PCAP_LINKTYPE_RAW)
+		{
+			logg("%s: Unsupported link type %u (expected raw IP as written by dnsmasq)",
+			     path, pcap32(src, header.network));
+			return false;
+		}
+		return true;
+	}
+	fclose(fp);
+
+	// Not a pcap file, try to open it as long-term database
+	if(sqlite3_open_v2(path, &src->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+	   sqlite3_prepare_v2(src->db, "SELECT timestamp,type,domain,client FROM queries "
+	                               "WHERE timestamp >= ?1 AND timestamp < ?2 "
+	                               "ORDER BY timestamp;", -1, &src->stmt, NULL) != SQLITE_OK)
+	{
+		logg("%s is neither a pcap file nor a long-term database: %s",
+		     path, sqlite3_errmsg(src->db));
+		return false;
+	}
+	sqlite3_bind_double(src->stmt, 1, src->from);
+	sqlite3_bind_double(src->stmt, 2, src->until);
+
+	return true;
+}
+
+// Build a query packet for <domain>
+static size_t build_query(unsigned char *packet, const char *domain, const unsigned short qtype)
+{
+	struct dns_header *header = (struct dns_header *)(void*)packet;
+	memset(header, 0, sizeof(*header));
+	header->hb3 = HB3_RD;
+	header->qdcount = htons(1);
+
+	unsigned char *p = packet + sizeof(*header);
+	const unsigned char *end = packet + REPLAY_MAX_PACKET - 5;
+	const char *label = domain;
+	while(*label != '\0')
+	{
+		const char *dot = strchr(label, '.');
+		const size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+		if(len == 0 || len > 63 || p + len + 1 >= end)
+			return 0;
+		*p++ = (unsigned char)len;
+		memcpy(p, label, len);
+		p += len;
+		label += len;
+		if(*label == '.')
+			label++;
+	}
+	*p++ = 0;
+	PUTSHORT(qtype, p);
+	PUTSHORT(C_IN, p);
+
+	return (size_t)(p - packet);
+}
+
+static bool next_db_query(replaySource *src, replayQuery *query)
+{
+	while(sqlite3_step(src->stmt) == SQLITE_ROW)
+	{
+		const int type = sqlite3_column_int(src->stmt, 1);
+		const char *domain = (const char*)sqlite3_column_text(src->stmt, 2);
+		const char *client = (const char*)sqlite3_column_text(src->stmt, 3);
+		if(domain == NULL || client == NULL)
+			continue;
+
+		// Skip queries generated by FTL itself (e.g. for DNSSEC validation)
+		// and those hidden by the privacy level
+		if(strcmp(client, "::") == 0 || strcmp(domain, "hidden") == 0)
+			continue;
+
+		unsigned short qtype = 0;
+		if(type > 100)
+			qtype = (unsigned short)(type - 100);
+		else if(type > 0 && type < TYPE_MAX)
+			qtype = db_qtypes[type];
+		if(qtype == 0)
+			continue;
+
+		query->len = build_query(query->packet, domain, qtype);
+		if(query->len == 0)
+			continue;
+
+		query->timestamp = sqlite3_column_double(src->stmt, 0);
+		query->client = hash_client((const unsigned char*)client, strlen(client));
+		return true;
+	}
+
+	return false;
+}
+
+static bool next_pcap_query(replaySource *src, replayQuery *query)
+{
+	pcapRecord record;
+	unsigned char packet[REPLAY_MAX_PACKET + 64];
+	while(fread(&record, sizeof(record), 1, src->pcap) == 1)
+	{
+		const size_t len = pcap32(src, record.incl_len);
+		if(len > sizeof(packet))
+		{
+			if(fseek(src->pcap, (long)len, SEEK_CUR) != 0)
+				return false;
+			continue;
+		}
+		if(fread(packet, len, 1, src->pcap) != 1)
+			return false;
+
+		// dnsmasq dumps raw IPv4 or IPv6 packets without extension headers
+		size_t offset = 0;
+		const unsigned char *addr = NULL;
+		size_t addrlen = 0;
+		if(len > 20 && (packet[0] >> 4) == 4 && packet[9] == IPPROTO_UDP)
+		{
+			offset = (packet[0] & 0x0f) * 4u;
+			addr = &packet[12];
+			addrlen = 4;
+		}
+		else if(len > 40 && (packet[0] >> 4) == 6 && packet[6] == IPPROTO_UDP)
+		{
+			offset = 40;
+			addr = &packet[8];
+			addrlen = 16;
+		}
+		else
+			continue;
+
+		// Skip the UDP header, only queries (QR bit clear) are replayed
+		offset += 8;
+		if(len < offset + sizeof(struct dns_header))
+			continue;
+		const struct dns_header *header = (const struct dns_header *)(void*)&packet[offset];
+		if(header->hb3 & HB3_QR)
+			continue;
+
+		query->timestamp = pcap32(src, record.ts_sec) + 1e-6 * pcap32(src, record.ts_usec);
+		if(query->timestamp < src->from || query->timestamp >= src->until)
+			continue;
+
+		// The read buffer leaves room for the IP and UDP headers, the DNS
+		// payload itself still has to fit into the query
+		if(len - offset > sizeof(query->packet))
+		{
+			stats.malformed++;
+			continue;
+		}
+
+		query->len = len - offset;
+		memcpy(query->packet, header, query->len);
+		query->client = hash_client(addr, addrlen);
+		return true;
+	}
+
+	return false;
+}
+
+static bool next_query(replaySource *src, replayQuery *query)
+{
+	return src->pcap != NULL ? next_pcap_query(src, query) : next_db_query(src, query);
+}
+
+static void close_source(replaySource *src)
+{
+	if(src->pcap != NULL)
+		fclose(src->pcap);
+	if(src->stmt != NULL)
+		sqlite3_finalize(src->stmt);
+	if(src->db != NULL)
+		sqlite3_close(src->db);
+}
+
+// Bind to a distinct address in 127.1.0.0/16 for every source when talking to
+// a local server so every source is a distinct client to FTL
+static void bind_source(const int fd, const union mysockaddr *server, const unsigned int source)
+{
+	if(server->sa.sa_family != AF_INET || (ntohl(server->in.sin_addr.s_addr) >> 24) != 127)
+		return;
+
+	struct sockaddr_in local = { 0 };
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(0x7F010000u + source + 1);
+	if(bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0)
+		logg("Cannot bind to %s: %s", inet_ntoa(local.sin_addr), strerror(errno));
+}
+
+static int *create_sources(const union mysockaddr *server, const unsigned int num, const int epfd)
+{
+	int *fds = calloc(num, sizeof(int));
+	if(fds == NULL)
+		return NULL;
+
+	for(unsigned int i = 0; i < num; i++)
+	{
+		fds[i] = socket(server->sa.sa_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		if(fds[i] < 0)
+		{
+			logg("Cannot create socket: %s", strerror(errno));
+			return NULL;
+		}
+		bind_source(fds[i], server, i);
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = i };
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+	}
+
+	return fds;
+}
+
+static void release_slot(const unsigned int id, const int epfd)
+{
+	replaySlot *slot = &slots[id];
+	if(slot->out != NULL)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, slot->fd, NULL);
+		close(slot->fd);
+		free(slot->out);
+		slot->out = NULL;
+	}
+	slot->used = false;
+	inflight--;
+}
+
+static void answered(const unsigned int id, const unsigned char *reply, const int epfd)
+{
+	const struct dns_header *header = (const struct dns_header *)(const void*)reply;
+	stats.answered++;
+	stats.rcodes[header->hb4 & 0x0f]++;
+	histogram_add(&stats.latency, metrics_now() - slots[id].sent);
+	release_slot(id, epfd);
+}
+
+// Send a query using a fresh TCP connection. The query is written as soon
+// as the connection is established
+static bool send_tcp(const union mysockaddr *server, replaySlot *slot, const unsigned int id,
+                     const replayQuery *query, const int epfd)
+{
+	const socklen_t addrlen = server->sa.sa_family == AF_INET ?
+		sizeof(server->in) : sizeof(server->in6);
+	slot->fd = socket(server->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(slot->fd < 0)
+		return false;
+	bind_source(slot->fd, server, slot->source);
+
+	slot->out = malloc(query->len + 2);
+	if(slot->out == NULL)
+	{
+		close(slot->fd);
+		return false;
+	}
+	slot->out[0] = (unsigned char)(query->len >> 8);
+	slot->out[1] = (unsigned char)(query->len & 0xff);
+	memcpy(slot->out + 2, query->packet, query->len);
+	slot->outlen = query->len + 2;
+	slot->outpos = 0;
+	slot->inlen = 0;
+	slot->need = 2;
+
+	if(connect(slot->fd, &server->sa, addrlen) != 0 && errno != EINPROGRESS)
+	{
+		close(slot->fd);
+		free(slot->out);
+		slot->out = NULL;
+		return false;
+	}
+
+	struct epoll_event ev = { .events = EPOLLOUT | EPOLLIN, .data.u64 = (1ull << 32) | id };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, slot->fd, &ev);
+	return true;
+}
+
+static void handle_tcp(const unsigned int id, const uint32_t events, const int epfd)
+{
+	replaySlot *slot = &slots[id];
+	if(!slot->used || slot->out == NULL)
+		return;
+
+	if(events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))
+	{
+		stats.failed++;
+		release_slot(id, epfd);
+		return;
+	}
+
+	if(events & EPOLLOUT && slot->outpos < slot->outlen)
+	{
+		const ssize_t ret = write(slot->fd, slot->out + slot->outpos, slot->outlen - slot->outpos);
+		if(ret < 0 && errno != EAGAIN)
+		{
+			stats.failed++;
+			release_slot(id, epfd);
+			return;
+		}
+		if(ret > 0)
+			slot->outpos += ret;
+		if(slot->outpos == slot->outlen)
+		{
+			struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (1ull << 32) | id };
+			epoll_ctl(epfd, EPOLL_CTL_MOD, slot->fd, &ev);
+		}
+	}
+
+	if(!(events & EPOLLIN))
+		return;
+
+	// Read the length prefix and the DNS header, the rest is discarded
+	unsigned char buffer[REPLAY_MAX_PACKET];
+	ssize_t ret = -1;
+	while(slot->need > 0 && (ret = read(slot->fd, buffer, MIN(slot->need, sizeof(buffer)))) > 0)
+	{
+		for(ssize_t i = 0; i < ret && slot->inlen < sizeof(slot->in); i++)
+			slot->in[slot->inlen++] = buffer[i];
+		slot->need -= ret;
+		if(slot->need == 0 && slot->inlen == 2)
+			slot->need = ((size_t)slot->in[0] << 8 | slot->in[1]);
+	}
+
+	if(slot->need == 0 && slot->inlen == sizeof(slot->in))
+		answered(id, slot->in + 2, epfd);
+	else if(slot->need == 0 || ret == 0 || (ret < 0 && errno != EAGAIN))
+	{
+		stats.failed++;
+		release_slot(id, epfd);
+	}
+}
+
+static void handle_udp(const int fd, const int source, const int epfd)
+{
+	unsigned char buffer[REPLAY_MAX_PACKET];
+	ssize_t len;
+	while((len = read(fd, buffer, sizeof(buffer))) >= (ssize_t)sizeof(struct dns_header))
+	{
+		const struct dns_header *header = (const struct dns_header *)(void*)buffer;
+		const unsigned int id = ntohs(header->id);
+		if(!slots[id].used || slots[id].source != source)
+		{
+			// Late reply to a query we already counted as lost
+			stats.mismatched++;
+			continue;
+		}
+		answered(id, buffer, epfd);
+	}
+}
+
+static bool parse_target(const char *arg, union mysockaddr *server)
+{
+	char ip[INET6_ADDRSTRLEN] = { 0 };
+	unsigned int port = 53;
+	const char *hash = strchr(arg, '#');
+	const size_t len = hash != NULL ? (size_t)(hash - arg) : strlen(arg);
+	if(len >= sizeof(ip) || (hash != NULL && (sscanf(hash + 1, "%u", &port) != 1 || port > 65535)))
+		return false;
+	memcpy(ip, arg, len);
+
+	memset(server, 0, sizeof(*server));
+	if(inet_pton(AF_INET, ip, &server->in.sin_addr) == 1)
+	{
+		server->in.sin_family = AF_INET;
+		server->in.sin_port = htons(port);
+		return true;
+	}
+	if(inet_pton(AF_INET6, ip, &server->in6.sin6_addr) == 1)
+	{
+		server->in6.sin6_family = AF_INET6;
+		server->in6.sin6_port = htons(port);
+		return true;
+	}
+
+	return false;
+}
+
+static void print_results(const uint64_t elapsed)
+{
+	printf("{\"sent\":%" PRIu64 ",\"answered\":%" PRIu64 ",\"lost\":%" PRIu64
+	       ",\"failed\":%" PRIu64 ",\"late\":%" PRIu64 ",\"malformed\":%" PRIu64 ",\"elapsed_ns\":%" PRIu64
+	       ",\"qps\":%.1f,\"loss\":%.5f,\"rcodes\":{\"noerror\":%" PRIu64
+	       ",\"servfail\":%" PRIu64 ",\"nxdomain\":%" PRIu64 ",\"refused\":%" PRIu64
+	       "},\"latency\":",
+	       stats.sent, stats.answered, stats.lost, stats.failed, stats.mismatched, stats.malformed, elapsed,
+	       elapsed > 0 ? 1e9*stats.answered/elapsed : 0.0,
+	       stats.sent > 0 ? (double)(stats.lost + stats.failed)/stats.sent : 0.0,
+	       stats.rcodes[NOERROR], stats.rcodes[SERVFAIL], stats.rcodes[NXDOMAIN],
+	       stats.rcodes[REFUSED]);
+	json_histogram(stdout, &stats.latency);
+
+	// Non-empty buckets as [<upper limit in ns>, <count>]
+	printf(",\"histogram\":[");
+	bool first = true;
+	for(unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		if(stats.latency.buckets[i] == 0)
+			continue;
+		printf("%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",",
+		       latency_bucket_limit(i), stats.latency.buckets[i]);
+		first = false;
+	}
+	printf("]}\n");
+}
+
+static void usage(void)
+{
+	printf("Usage: pihole-FTL replay <file> [options]\n\n");
+	printf("<file> is either a long-term database or a pcap file written by --dumpfile\n");
+	printf("(use --dumpmask=0x0001 to record only queries received from clients)\n\n");
+	printf("Options:\n");
+	printf("  -s <ip>[#<port>]  Server to send the queries to (default 127.0.0.1#53)\n");
+	printf("  -r <factor>|max   Replay speed: 1 = original timing (default),\n");
+	printf("                    2 = twice as fast, max = as fast as possible\n");
+	printf("  -c <n>            Number of source addresses (default 256)\n");
+	printf("  -m <n>            Maximum number of queries in flight (default 1000)\n");
+	printf("  -n <n>            Stop after <n> queries\n");
+	printf("  -f <time>         Replay only queries newer than <time> (UNIX timestamp)\n");
+	printf("  -u <time>         Replay only queries older than <time> (UNIX timestamp)\n");
+	printf("  -w <msec>         Time after which a query is considered lost (default 2000)\n");
+	printf("  -t                Use TCP instead of UDP\n");
+}
+
+int run_replay(int argc, char *argv[])
+{
+	// Errors go to stdout in front of the (missing) results
+	log_ctrl(false, true);
+
+	if(argc < 3)
+	{
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	union mysockaddr server;
+	parse_target("127.0.0.1", &server);
+	double speed = 1.0;
+	unsigned int num_sources = 256, max_inflight = 1000;
+	uint64_t max_queries = UINT64_MAX, timeout = 2000;
+	bool tcp = false;
+	replaySource src = { .from = 0.0, .until = 1e18 };
+	for(int i = 3; i < argc; i++)
+	{
+		const bool value = i + 1 < argc;
+		bool ok = true;
+		if(strcmp(argv[i], "-t") == 0)
+			tcp = true;
+		else if(strcmp(argv[i], "-s") == 0 && value)
+			ok = parse_target(argv[++i], &server);
+		else if(strcmp(argv[i], "-r") == 0 && value)
+		{
+			i++;
+			speed = strcmp(argv[i], "max") == 0 ? 0.0 : atof(argv[i]);
+			ok = strcmp(argv[i], "max") == 0 || speed > 0.0;
+		}
+		else if(strcmp(argv[i], "-c") == 0 && value)
+			ok = sscanf(argv[++i], "%u", &num_sources) == 1 && num_sources > 0 && num_sources < 65535;
+		else if(strcmp(argv[i], "-m") == 0 && value)
+			ok = sscanf(argv[++i], "%u", &max_inflight) == 1 && max_inflight > 0 && max_inflight < REPLAY_SLOTS;
+		else if(strcmp(argv[i], "-n") == 0 && value)
+			ok = sscanf(argv[++i], "%" SCNu64, &max_queries) == 1;
+		else if(strcmp(argv[i], "-f") == 0 && value)
+			ok = sscanf(argv[++i], "%lf", &src.from) == 1;
+		else if(strcmp(argv[i], "-u") == 0 && value)
+			ok = sscanf(argv[++i], "%lf", &src.until) == 1;
+		else if(strcmp(argv[i], "-w") == 0 && value)
+			ok = sscanf(argv[++i], "%" SCNu64, &timeout) == 1 && timeout > 0;
+		else
+			ok = false;
+
+		if(!ok)
+		{
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	timeout *= 1000000u;
+
+	if(!open_source(&src, argv[2]))
+	{
+		close_source(&src);
+		return EXIT_FAILURE;
+	}
+
+	const int epfd = epoll_create1(0);
+	slots = calloc(REPLAY_SLOTS, sizeof(replaySlot));
+	int *sources = tcp ? NULL : create_sources(&server, num_sources, epfd);
+	if(epfd < 0 || slots == NULL || (!tcp && sources == NULL))
+	{
+		close_source(&src);
+		return EXIT_FAILURE;
+	}
+
+	const socklen_t addrlen = server.sa.sa_family == AF_INET ? sizeof(server.in) : sizeof(server.in6);
+	replayQuery *query = calloc(1, sizeof(replayQuery));
+	bool pending = query != NULL && next_query(&src, query);
+	const double first = pending ? query->timestamp : 0.0;
+	unsigned int next_id = 0u, oldest = 0u;
+	const uint64_t start = metrics_now();
+	uint64_t progress = start + REPLAY_PROGRESS;
+	struct epoll_event events[REPLAY_EVENTS];
+
+	while(pending || inflight > 0)
+	{
+		uint64_t now = metrics_now();
+
+		// Send all queries which are due
+		while(pending && inflight < max_inflight && !slots[next_id].used)
+		{
+			const uint64_t due = speed > 0.0 ? start + (uint64_t)(1e9*(query->timestamp - first)/speed) : now;
+			if(due > now)
+				break;
+
+			replaySlot *slot = &slots[next_id];
+			slot->source = query->client % num_sources;
+			struct dns_header *header = (struct dns_header *)(void*)query->packet;
+			header->id = htons(next_id);
+			bool sent;
+			if(tcp)
+				sent = send_tcp(&server, slot, next_id, query, epfd);
+			else
+				sent = sendto(sources[slot->source], query->packet, query->len, 0,
+				              &server.sa, addrlen) == (ssize_t)query->len;
+
+			stats.sent++;
+			if(sent)
+			{
+				slot->used = true;
+				slot->sent = now;
+				inflight++;
+				next_id = (next_id + 1) % REPLAY_SLOTS;
+			}
+			else
+				stats.failed++;
+
+			pending = stats.sent < max_queries && next_query(&src, query);
+		}
+
+		// Wait for replies (at most until the next query is due)
+		int wait = 10;
+		if(pending && speed > 0.0 && inflight < max_inflight)
+		{
+			const uint64_t due = start + (uint64_t)(1e9*(query->timestamp - first)/speed);
+			wait = due > now ? (int)MIN((due - now) / 1000000u, 10u) : 0;
+		}
+		const int num = epoll_wait(epfd, events, REPLAY_EVENTS, wait);
+		for(int i = 0; i < num; i++)
+		{
+			if(events[i].data.u64 >> 32)
+				handle_tcp((unsigned int)(events[i].data.u64 & 0xffffffff), events[i].events, epfd);
+			else
+				handle_udp(sources[events[i].data.u64], (int)events[i].data.u64, epfd);
+		}
+
+		// Queries are sent in order of their IDs so the oldest ones are
+		// found at the tail of the ring
+		now = metrics_now();
+		while(oldest != next_id && (!slots[oldest].used || now - slots[oldest].sent > timeout))
+		{
+			if(slots[oldest].used)
+			{
+				stats.lost++;
+				release_slot(oldest, epfd);
+			}
+			oldest = (oldest + 1) % REPLAY_SLOTS;
+		}
+
+		if(now > progress)
+		{
+			fprintf(stderr, "Sent %" PRIu64 ", answered %" PRIu64 ", lost %" PRIu64 ", %u in flight\n",
+			        stats.sent, stats.answered, stats.lost, inflight);
+			progress = now + REPLAY_PROGRESS;
+		}
+	}
+
+	print_results(metrics_now() - start);
+
+	if(sources != NULL)
+	{
+		for(unsigned int i = 0; i < num_sources; i++)
+			close(sources[i]);
+		free(sources);
+	}
+	free(query);
+	free(slots);
+	close(epfd);
+	close_source(&src);
+
+	return EXIT_SUCCESS;
+}
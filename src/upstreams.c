@@ -0,0 +1,125 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Upstream server selection routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "upstreams.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+// getstr()
+#include "shmem.h"
+
+// We keep exponentially weighted moving averages of the round-trip time and
+// the failure rate (queries which had to be retried) of all upstream servers.
+// The score of a server is the expected time it takes to get a reply: its
+// average round-trip time plus the time a client waits before retrying,
+// weighted with the probability that this is going to be necessary. Lower is
+// better.
+//
+// When UPSTREAM_SELECTION=LATENCY, queries dnsmasq would send to the server
+// which replied first most recently are sent to the best-scoring server
+// instead. To avoid flapping between servers of similar quality, we only
+// switch when the new server is significantly better. Servers we did not
+// hear from for some time are probed with a single query so their scores
+// can recover after a period of bad performance. dnsmasq itself still sends
+// every 50th query (and at least one every 20 seconds) to all servers.
+
+// Weight of a new sample
+#define UPSTREAM_EWMA_WEIGHT 0.2f
+// Assumed time [ms] until a client retries a query which has not been answered
+#define UPSTREAM_FAILURE_COST 2000.0f
+// Only switch to another server if its score is at least 20% better
+#define UPSTREAM_HYSTERESIS 0.8f
+// Probe servers we have not checked for this long [s]
+#define UPSTREAM_PROBE_INTERVAL 30
+
+// A reply has been received from this server after <rtt> milliseconds
+void upstream_sample_rtt(upstreamsData *upstream, const float rtt, const time_t now)
+{
+	if(upstream->ewma.rtt <= 0.0f)
+		upstream->ewma.rtt = rtt;
+	else
+		upstream->ewma.rtt += UPSTREAM_EWMA_WEIGHT * (rtt - upstream->ewma.rtt);
+
+	upstream->ewma.failures *= 1.0f - UPSTREAM_EWMA_WEIGHT;
+	upstream->ewma.checked = now;
+}
+
+// A query sent to this server had to be retried
+void upstream_sample_failure(upstreamsData *upstream, const time_t now)
+{
+	upstream->ewma.failures += UPSTREAM_EWMA_WEIGHT * (1.0f - upstream->ewma.failures);
+	upstream->ewma.checked = now;
+}
+
+// Expected time [ms] to get a reply from this server
+float get_upstream_score(const upstreamsData *upstream)
+{
+	return upstream->ewma.rtt + upstream->ewma.failures * UPSTREAM_FAILURE_COST;
+}
+
+// Choose one of the given upstream servers for the next query. <current> is
+// the index of the server dnsmasq would use, the index of the chosen server is
+// returned. Upstream IDs may be -1 for servers we do not know
+int select_upstream(const int *upstreamIDs, const int num, const int current, const time_t now)
+{
+	int best = -1;
+	float best_score = 0.0f;
+	float current_score = -1.0f;
+	for(int i = 0; i < num; i++)
+	{
+		if(upstreamIDs[i] < 0)
+			continue;
+
+		upstreamsData *upstream = getUpstream(upstreamIDs[i], true);
+		if(upstream == NULL)
+			continue;
+
+		// Probe servers we have not heard from for some time (or not at
+		// all). Marking the server as checked makes sure we send only a
+		// single probe per interval, even if it never replies
+		if(i != current && now - upstream->ewma.checked >= UPSTREAM_PROBE_INTERVAL)
+		{
+			if(config.debug & DEBUG_QUERIES)
+				logg("Probing upstream server %s#%u", getstr(upstream->ippos), upstream->port);
+			upstream->ewma.checked = now;
+			return i;
+		}
+
+		// Skip servers without measurements
+		if(upstream->ewma.rtt <= 0.0f)
+			continue;
+
+		const float score = get_upstream_score(upstream);
+		if(i == current)
+			current_score = score;
+		if(best < 0 || score < best_score)
+		{
+			best = i;
+			best_score = score;
+		}
+	}
+
+	// Keep the current server unless another one is significantly better
+	if(best < 0 || best == current ||
+	   (current_score >= 0.0f && best_score > UPSTREAM_HYSTERESIS * current_score))
+		return current;
+
+	if(config.debug & DEBUG_QUERIES)
+	{
+		const upstreamsData *upstream = getUpstream(upstreamIDs[best], true);
+		if(upstream != NULL)
+			logg("Selecting upstream server %s#%u (score %.1f ms, was %.1f ms)",
+			     getstr(upstream->ippos), upstream->port, best_score, current_score);
+	}
+
+	return best;
+}
@@ -0,0 +1,21 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Upstream server selection prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef UPSTREAMS_H
+#define UPSTREAMS_H
+
+// type upstreamsData
+#include "datastructure.h"
+
+void upstream_sample_rtt(upstreamsData *upstream, const float rtt, const time_t now);
+void upstream_sample_failure(upstreamsData *upstream, const time_t now);
+float get_upstream_score(const upstreamsData *upstream) __attribute__ ((pure));
+int select_upstream(const int *upstreamIDs, const int num, const int current, const time_t now);
+
+#endif //UPSTREAMS_H
@@ -119,6 +119,23 @@ pdnsutil add-record arpa. 2.1.168.192.in-addr PTR a.ftl.
 pdnsutil add-record arpa. 1.0.c.1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.e.f.ip6 PTR ftl.
 pdnsutil add-record arpa. 2.0.c.1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.e.f.ip6 PTR aaaa.ftl.
 
+# Create a signed zone with a signed delegation to a child zone. FTL uses
+# validated NSEC records of the parent to synthesise negative answers, but
+# must never do so for names below the zone cut
+pdnsutil create-zone dnssec.test ns1.ftl
+pdnsutil secure-zone dnssec.test
+pdnsutil add-record dnssec.test. zzz A 192.168.4.1
+pdnsutil create-zone sub.dnssec.test ns1.ftl
+pdnsutil secure-zone sub.dnssec.test
+pdnsutil add-record sub.dnssec.test. www A 192.168.4.2
+pdnsutil add-record dnssec.test. sub NS ns1.ftl.
+pdnsutil export-zone-ds sub.dnssec.test | awk '{for(i=1;i<NF;i++) if($i=="DS"){print $(i+1), $(i+2), $(i+3), $(i+4); break}}' | while read -r ds; do
+  pdnsutil add-record dnssec.test. sub DS "${ds}"
+done
+
+# Trust the signed zone in FTL
+pdnsutil export-zone-ds dnssec.test | awk '{for(i=1;i<NF;i++) if($i=="DS" && $(i+3)=="2"){printf "trust-anchor=dnssec.test,%s,%s,%s,%s\n", $(i+1), $(i+2), $(i+3), $(i+4); exit}}' >> /etc/dnsmasq.conf
+
 # Calculates the ‘ordername’ and ‘auth’ fields for all zones so they comply with
 # DNSSEC settings. Can be used to fix up migrated data. Can always safely be
 # run, it does no harm.
@@ -127,6 +144,8 @@ pdnsutil rectify-all-zones
 # Do final checking
 pdnsutil check-zone ftl
 pdnsutil check-zone arpa
+pdnsutil check-zone dnssec.test
+pdnsutil check-zone sub.dnssec.test
 
 pdnsutil list-all-zones
 
@@ -558,11 +558,34 @@
   [[ ${lines[1]} == "-3 27.78 blocked blocked" ]]
   [[ ${lines[2]} == "-2 22.22 cached cached" ]]
   [[ ${lines[3]} == "-1 0.00 other other" ]]
-  [[ ${lines[4]} == "0 46.30 127.0.0.1#5555 127.0.0.1#5555" ]]
-  [[ ${lines[5]} == "1 3.70 127.0.0.1#5554 127.0.0.1#5554" ]]
+  # Upstream servers are followed by their average RTT [ms], failure rate [%]
+  # and score
+  [[ ${lines[4]} =~ ^"0 46.30 127.0.0.1#5555 127.0.0.1#5555 "[0-9]+\.[0-9]" "[0-9]+\.[0-9]" "[0-9]+\.[0-9]$ ]]
+  [[ ${lines[5]} =~ ^"1 3.70 127.0.0.1#5554 127.0.0.1#5554 "[0-9]+\.[0-9]" "[0-9]+\.[0-9]" "[0-9]+\.[0-9]$ ]]
   [[ ${lines[6]} == "" ]]
 }
 
+@test "Latency metrics reported correctly" {
+  run bash -c 'echo ">latency >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  # <type> <name> <count> <average> <p50> <p90> <p99> <p99.9> <max>
+  [[ ${lines[1]} =~ ^"stage new_query "[1-9][0-9]*( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[2]} =~ ^"stage check_blocking "[1-9][0-9]*( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[3]} =~ ^"stage whitelist "[0-9]+( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[4]} =~ ^"stage blacklist "[0-9]+( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[5]} =~ ^"stage gravity "[0-9]+( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[6]} =~ ^"stage regex "[0-9]+( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[7]} =~ ^"stage shm_lock_wait "[1-9][0-9]*( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[8]} =~ ^"stage shm_lock_hold "[1-9][0-9]*( [0-9]+\.[0-9]){6}$ ]]
+  [[ ${lines[9]} =~ ^"stage upstream_rtt "[1-9][0-9]*( [0-9]+\.[0-9]){6}$ ]]
+  [[ "${lines[@]}" =~ "upstream 127.0.0.1#5555 "[1-9][0-9]*( [0-9]+\.[0-9]){6} ]]
+  # lock <function> <file>:<line> <count> <wait avg> <wait max> <hold avg> <hold max>
+  [[ "${lines[@]}" =~ "lock _FTL_new_query src/dnsmasq_interface.c:"[0-9]+" "[1-9][0-9]*( [0-9]+\.[0-9]){4} ]]
+  # tcp <slots> <busy> <peak> <workers> <gravity> <saturated> <saturated [s]> <pooled>
+  # The TCP queries above were handled by the pre-forked workers (tcp-workers=2)
+  [[ "${lines[@]}" =~ "tcp 60 "[0-9]+" "[1-9][0-9]*" "[1-9][0-9]*" "[0-9]+" "[0-9]+" "[0-9]+\.[0-9]{3}" "[1-9][0-9]* ]]
+}
+
 @test "Query Types reported correctly" {
   run bash -c 'echo ">querytypes >quit" | nc -v 127.0.0.1 4711'
   printf "%s\n" "${lines[@]}"
@@ -671,7 +694,7 @@
   [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"network\" (id INTEGER PRIMARY KEY NOT NULL, hwaddr TEXT UNIQUE NOT NULL, interface TEXT NOT NULL, firstSeen INTEGER NOT NULL, lastQuery INTEGER NOT NULL, numQueries INTEGER NOT NULL, macVendor TEXT, aliasclient_id INTEGER);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"network_addresses\" (network_id INTEGER NOT NULL, ip TEXT UNIQUE NOT NULL, lastSeen INTEGER NOT NULL DEFAULT (cast(strftime('%s', 'now') as int)), name TEXT, nameUpdated INTEGER, FOREIGN KEY(network_id) REFERENCES network(id));"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE aliasclient (id INTEGER PRIMARY KEY NOT NULL, name TEXT NOT NULL, comment TEXT);"* ]]
-  [[ "${lines[@]}" == *"INSERT INTO ftl VALUES(0,12);"* ]] # Expecting FTL database version 12
+  [[ "${lines[@]}" == *"INSERT INTO ftl VALUES(0,14);"* ]] # Expecting FTL database version 14
   # vvv This has been added in version 10 vvv
   [[ "${lines[@]}" == *"CREATE VIEW queries AS SELECT id, timestamp, type, status, CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info, reply_type, reply_time, dnssec FROM query_storage q;"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE domain_by_id (id INTEGER PRIMARY KEY, domain TEXT NOT NULL);"* ]]
@@ -682,6 +705,11 @@
   # vvv This has been added in version 11 vvv
   [[ "${lines[@]}" == *"CREATE TABLE addinfo_by_id (id INTEGER PRIMARY KEY, type INTEGER NOT NULL, content NOT NULL);"* ]]
   [[ "${lines[@]}" == *"CREATE UNIQUE INDEX addinfo_by_id_idx ON addinfo_by_id(type,content);"* ]]
+  # vvv This has been added in version 13 vvv
+  [[ "${lines[@]}" == *"CREATE TABLE query_partitions (name TEXT PRIMARY KEY, start INTEGER NOT NULL, end INTEGER NOT NULL);"* ]]
+  # vvv This has been added in version 14 vvv
+  [[ "${lines[@]}" == *"CREATE TABLE query_rollup_hourly (timestamp INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER NOT NULL, status INTEGER NOT NULL, type INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, domain, client, forward, status, type)) WITHOUT ROWID;"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE query_rollup_daily (timestamp INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER NOT NULL, status INTEGER NOT NULL, type INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, domain, client, forward, status, type)) WITHOUT ROWID;"* ]]
 }
 
 @test "Ownership, permissions and type of pihole-FTL.db correct" {
@@ -1133,6 +1161,23 @@
   [[ "${lines[@]}" == *"status: NOERROR"* ]]
 }
 
+@test "Regex Test 54: Batch mode \"-f\" matches a list of domains against the database regex" {
+  printf "regex1.ftl\nregex5.ftl\nregex2.ftl\n# comment\na.ftl\nregex-A\n" > /tmp/regex-batch.txt
+  run bash -c './pihole-FTL regex-test -f /tmp/regex-batch.txt 2'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  [[ "${lines[@]}" == *"Read 5 domains (5 queries)"* ]]
+  [[ "${lines[@]}" == *"Matching domains using 2 threads..."* ]]
+  [[ "${lines[@]}" == *"Blocked: 3 queries (60.00%)"* ]]
+  [[ "${lines[@]}" == *"Whitelisted: 1 queries (20.00%)"* ]]
+  [[ "${lines[@]}" =~ "blacklist"\ +"3"\ +"3"\ [^\(]*"regex[0-9].ftl (6)" ]]
+  [[ "${lines[@]}" =~ "whitelist"\ +"1"\ +"1"\ [^\(]*"regex2 (3)" ]]
+  run bash -c './pihole-FTL regex-test -f /tmp/regex-batch-missing.txt'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 1 ]]
+  [[ "${lines[@]}" == *"No domains found"* ]]
+}
+
 # x86_64-musl is built on busybox which has a slightly different
 # variant of ls displaying three, instead of one, spaces between the
 # user and group names.
@@ -1380,6 +1425,114 @@
   rm abc.lua
 }
 
+@test "Benchmark mode replays a query file and reports the results as JSON" {
+  printf "gravity.ftl 127.0.0.5 A\nwhitelisted.ftl 127.0.0.6 AAAA\n# Comments are skipped\nftl\n" > /tmp/bench.txt
+  run bash -c './pihole-FTL bench /etc/pihole/gravity.db 30 2 /tmp/bench.txt'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  # The line without a client is assigned one of the generated clients
+  [[ ${lines[0]} =~ ^"{\"queries\":30,\"clients\":3,\"domains\":3,\"blocked\":"[0-9]+",\"gravity\":"[0-9]+",\"elapsed_ns\":"[0-9]+",\"qps\":"[0-9]+\.[0-9]",\"latency\":{\"count\":30," ]]
+  [[ ${lines[0]} == *",\"memory\":{\"rss_start_kb\":"*",\"metrics\":"*"}" ]]
+  run bash -c './pihole-FTL bench /etc/pihole/gravity.db 0'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 1 ]]
+  [[ ${lines[0]} == "Incorrect usage of pihole-FTL bench subcommand" ]]
+  run bash -c './pihole-FTL bench /etc/pihole/gravity.db 30 2 /tmp/bench-missing.txt'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 1 ]]
+  [[ ${lines[0]} == "Cannot open /tmp/bench-missing.txt: No such file or directory" ]]
+}
+
+@test "Replay mode sends the queries of a packet capture to FTL" {
+  # pcap file with link type raw IP as written by --dumpfile. It contains two
+  # A queries for replay.ftl, a query whose DNS payload exceeds the largest
+  # query replayed (counted as malformed) and a record exceeding the read
+  # buffer (skipped)
+  query='\x45\x00\x00\x38\x00\x00\x00\x00\x40\x11\x00\x00\x7f\x00\x00\x01\x7f\x00\x00\x01\x30\x39\x00\x35\x00\x24\x00\x00\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x06replay\x03ftl\x00\x00\x01\x00\x01'
+  {
+    printf '\xd4\xc3\xb2\xa1\x02\x00\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xff\x00\x00\x65\x00\x00\x00'
+    printf '\x00\x00\x00\x60\x00\x00\x00\x00\x38\x00\x00\x00\x38\x00\x00\x00'"${query}"
+    printf '\x00\x00\x00\x60\x00\x00\x00\x00\x36\x10\x00\x00\x36\x10\x00\x00\x45\x00\x10\x36\x00\x00\x00\x00\x40\x11\x00\x00\x7f\x00\x00\x01\x7f\x00\x00\x01'
+    head -c 4130 /dev/zero
+    printf '\x00\x00\x00\x60\x00\x00\x00\x00\x88\x13\x00\x00\x88\x13\x00\x00'
+    head -c 5000 /dev/zero
+    printf '\x00\x00\x00\x60\x00\x00\x00\x01\x38\x00\x00\x00\x38\x00\x00\x00'"${query}"
+  } > /tmp/replay.pcap
+  run bash -c './pihole-FTL replay /tmp/replay.pcap -s 127.0.0.1#53 -r max -c 1'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  [[ ${lines[0]} == "{\"sent\":2,\"answered\":2,\"lost\":0,\"failed\":0,\"late\":0,\"malformed\":1,"* ]]
+  # The queries are sent from the first replay source address
+  run bash -c 'echo ">getallqueries >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" =~ " A replay.ftl 127.1.0.1 ".*" A replay.ftl 127.1.0.1 " ]]
+}
+
+@test "UPSTREAM_SELECTION=LATENCY measures all servers of a domain" {
+  # dnsmasq sends the first query to both servers of latency.ftl and all
+  # further ones to the server which replied first. FTL probes the other
+  # server as it has not been measured so far
+  run bash -c "dig A a.latency.ftl @127.0.0.1"
+  run bash -c "dig A b.latency.ftl @127.0.0.1"
+  run bash -c "dig A c.latency.ftl @127.0.0.1"
+  run bash -c 'echo ">forward-dest >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" =~ " 127.0.0.2#5554 127.0.0.2#5554 "[0-9]+\.[0-9]" "[0-9]+\.[0-9]" "[0-9]+\.[0-9] ]]
+  [[ "${lines[@]}" =~ " 127.0.0.3#5554 127.0.0.3#5554 "[0-9]+\.[0-9]" "[0-9]+\.[0-9]" "[0-9]+\.[0-9] ]]
+  # Both servers have a measured round-trip time (and hence score)
+  [[ ! "${lines[@]}" =~ " 127.0.0.2#5554 127.0.0.2#5554 0.0 0.0 0.0" ]]
+  [[ ! "${lines[@]}" =~ " 127.0.0.3#5554 127.0.0.3#5554 0.0 0.0 0.0" ]]
+}
+
+@test "DNSSEC: Names covered by a cached NSEC are answered locally" {
+  # Caches the validated NSEC dnssec.test -> sub.dnssec.test of the apex
+  run bash -c "dig A aaa.dnssec.test @127.0.0.1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"status: NXDOMAIN"* ]]
+  # The same NSEC proves that bbb.dnssec.test does not exist either
+  run bash -c "dig A bbb.dnssec.test @127.0.0.1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"status: NXDOMAIN"* ]]
+  run bash -c 'grep -c "forwarded bbb.dnssec.test" /var/log/pihole/pihole.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+  run bash -c 'grep -c "cached bbb.dnssec.test is NXDOMAIN" /var/log/pihole/pihole.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+}
+
+@test "DNSSEC: No negative answers synthesised below a signed delegation" {
+  # Caches the validated NSEC sub.dnssec.test -> zzz.dnssec.test of the parent
+  run bash -c "dig A suba.dnssec.test @127.0.0.1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"status: NXDOMAIN"* ]]
+  # The NSEC covers www.sub.dnssec.test, but the name is in the child zone
+  run bash -c "dig A www.sub.dnssec.test @127.0.0.1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"status: NOERROR"* ]]
+  run bash -c "dig A www.sub.dnssec.test +short @127.0.0.1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[0]}" == "192.168.4.2" ]]
+}
+
+@test "Rate-limiting refuses queries of a client exceeding RATE_LIMIT" {
+  # Use a separate client so the other tests are not affected, 1500 queries
+  # exceed the default limit of 1000 queries per 60 seconds
+  for i in {1..1500}; do echo "a.ftl"; done > /tmp/ratelimit.batch
+  run bash -c "dig -b 127.0.0.9 @127.0.0.1 +tries=1 +time=1 +short -f /tmp/ratelimit.batch"
+  run bash -c "dig A a.ftl -b 127.0.0.9 @127.0.0.1 +tries=1 +time=1"
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"status: REFUSED"* ]]
+  # Queries of other clients are still answered
+  run bash -c "dig A a.ftl @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "192.168.1.1" ]]
+  run bash -c 'echo ">rate-limit >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  # <IP> <name> <tokens> <capacity> <limited> <refused> <since>
+  [[ "${lines[@]}" =~ "127.0.0.9 "[^[:space:]]*" "-?[0-9]+\.[0-9]{2}" 1000 1 "[1-9][0-9]*" "[1-9][0-9]* ]]
+}
+
 @test "Pi-hole PTR generation check" {
   run bash -c "bash test/hostnames.sh | tee ptr.log"
   printf "%s\n" "${lines[@]}"